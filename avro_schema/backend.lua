@@ -1,6 +1,7 @@
 local ffi            = require('ffi')
 local bit            = require('bit')
 local digest         = require('digest')
+local msgpack        = require('msgpack')
 local rt             = require('avro_schema.runtime')
 local ffi_new        = ffi.new
 local ffi_string     = ffi.string
@@ -8,7 +9,8 @@ local ffi_sizeof     = ffi.sizeof
 local format, rep    = string.format, string.rep
 local byte, max      = string.byte, math.max
 local insert, remove = table.insert, table.remove
-local concat         = table.concat
+local concat, sort   = table.concat, table.sort
+local clock          = os.clock
 local band, rshift   = bit.band, bit.rshift
 
 local rt_C           = ffi.load(rt.C_path)
@@ -19,6 +21,16 @@ local random_bytes   = digest.base64_decode([[
 X1CntcveBDc4inHKyWfyXw5iCjg1f3TmeX88pZ2Galb9tXpTt1uBO0pZrkU5NW1/4Ki9g8fAwElq
 B3dRsBscsg==]])
 
+-- The largest enum looked up with schema_rt_search* rather than phf,
+-- by SIMD level and hash width: a table that fits in a vector is
+-- searched as fast as phf is evaluated, a longer one is slower
+-- (bench/search.c). The phf_threshold option overrides.
+local phf_thresholds = {
+    [0] = { [8] = 8,  [16] = 8,  [32] = 8 },
+    [1] = { [8] = 16, [16] = 8,  [32] = 4 },
+    [2] = { [8] = 32, [16] = 16, [32] = 8 }
+}
+
 local sched_variables_helper
 sched_variables_helper = function(block, n, varmap, reusequeue)
     for i = 1, #block do
@@ -109,6 +121,16 @@ local function varref(ipv, ipo, map)
     end
 end
 
+-- Raise an error: call is rt_err_*(...). With lazy_errors the call
+-- records the error (yields true if there is one) and the function
+-- returns -1.
+local function err_stmt(il, call)
+    if il.lazy_errors then
+        return format('if %s then return -1 end', call)
+    end
+    return call
+end
+
 local emit_instruction_tab = {
     ----------------------- T
     [opcode.PUTNULC    ] =  1,
@@ -120,6 +142,7 @@ local emit_instruction_tab = {
     [opcode.PUTSTRC    ] = 18,
     [opcode.PUTBINC    ] = 19,
     [opcode.PUTXC      ] = 20,
+    [opcode.PUTRAW     ] = 21,
     ------------------------- T, tofield, fromfield
     [opcode.PUTINT     ] = {  4, 'ival',  'ival' },
     [opcode.PUTLONG    ] = {  4, 'ival',  'ival' },
@@ -168,8 +191,20 @@ local emit_compute_hash_func_tab = {
 }
 
 local function emit_compute_hash_func(func, pos, res)
-    if func == 0 then
+    if type(func) == 'table' then
+        -- string phf, see create_string_hash()
+        insert(res, format([[
+t = rt_C.phf_hash_string_band_raw%d(r.b2-%d, r.b1-r.v[%s].xoff, r.v[%s].xlen, %d, %d, %d)]],
+                      func.bits, func.cpos, pos, pos,
+                      func.seed, func.r, func.m))
+        return
+    elseif func == 0 then
         assert(false)
+    elseif rshift(func, 24) == 0x10 then
+        insert(res, format([[
+t = rt_C.eval_crc32c_func(%d, r.b1-r.v[%s].xoff, r.v[%s].xlen)]],
+                      band(func, 0xffffff), pos, pos))
+        return
     elseif band(func, 0xf0000000) ~= 0 then
         insert(res, format([[
 t = rt_C.eval_fnv1a_func(%d, r.b1-r.v[%s].xoff, r.v[%s].xlen)]],
@@ -206,6 +241,9 @@ local function emit_instruction(il, o, res, varmap)
                             ', '..varref(o.ripv, 0, varmap),
                             il.get_extra(o), varref(o.ipv, o.ipo, varmap),
                             epilog))
+        if il.lazy_errors then
+            insert(res, 'if v0 < 0 then return -1 end')
+        end
     elseif o.op == opcode.MOVE      then
         insert(res, format('%s = %s',
                             varref(o.ripv, 0,     varmap),
@@ -269,6 +307,23 @@ r.ot[%s] = %d; r.ov[%s].xlen = %d; r.ov[%s].xoff = %d]],
         insert(res, format('r.ot[%s] = %d; r.ov[%s].%s = r.v[%s].%s',
                             pos, opt[1], pos, opt[2],
                             varref(o.ipv, o.ipo, varmap), opt[3]))
+    elseif o.op == opcode.PUTRAW    then
+        -- parser records byte ranges only when asked to
+        il.uses_raw = true
+        local pos = varref(0, o.offset, varmap)
+        insert(res, format('r.ot[%s] = %d; r.ov[%s].uval = r.rv[%s].uval',
+                            pos, tab[o.op], pos,
+                            varref(o.ipv, o.ipo, varmap)))
+    elseif o.op == opcode.CHECKITEMS then
+        insert(res, err_stmt(il, format('rt_check_items(r, %s, 0x%x)',
+                                        varref(o.ipv, o.ipo, varmap), o.k)))
+    elseif o.op == opcode.PUTITEMS  then
+        insert(res, format('v0 = rt_put_items(r, %s, %s, 0x%x)',
+                            varref(o.ipv, o.ipo, varmap),
+                            varref(0, o.offset, varmap), o.k))
+        if il.lazy_errors then
+            insert(res, 'if v0 < 0 then return -1 end')
+        end
     -----------------------------------------------------------
     elseif o.op == opcode.PUTENUMI2S then
         il.emit_putenumi2s(o, res, varmap)
@@ -278,36 +333,42 @@ r.ot[%s] = %d; r.ov[%s].xlen = %d; r.ov[%s].xoff = %d]],
     -----------------------------------------------------------
     elseif o.op == opcode.ISBOOL or o.op == opcode.ISNULORMAP   then
         local pos = varref(o.ipv, o.ipo, varmap)
-        insert(res, format([[
-if r.b2[r.t[%s]-%d] == 0 then rt_err_type(r, %s, 0x%x) end]],
+        insert(res, format('if r.b2[r.t[%s]-%d] == 0 then %s end',
                             pos,
                             il.cpool_add(tab[o.op]),
-                            pos, o.op))
+                            err_stmt(il, format('rt_err_type(r, %s, 0x%x)',
+                                                pos, o.op))))
     elseif o.op == opcode.ISINT     then
         local pos = varref(o.ipv, o.ipo, varmap)
         insert(res, format([[
-if r.t[%s] ~= 4 or r.v[%s].uval+0x80000000 > 0xffffffff then rt_err_type(r, %s, 0x%x) end]],
-                            pos, pos, pos, opcode.ISINT))
+if r.t[%s] ~= 4 or r.v[%s].uval+0x80000000 > 0xffffffff then %s end]],
+                            pos, pos,
+                            err_stmt(il, format('rt_err_type(r, %s, 0x%x)',
+                                                pos, opcode.ISINT))))
     elseif o.op == opcode.ISFLOAT or o.op == opcode.ISDOUBLE then
         local pos = varref(o.ipv, o.ipo, varmap)
-        insert(res, format([[
-if r.b2[r.t[%s]-%d] == 0 then rt_err_type(r, %s, 0x%x) end]],
+        insert(res, format('if r.b2[r.t[%s]-%d] == 0 then %s end',
                             pos,
                             il.cpool_add('\0\0\0\0\0\0\1\1\0\0\0\0\0'),
-                            pos, o.op))
+                            err_stmt(il, format('rt_err_type(r, %s, 0x%x)',
+                                                pos, o.op))))
     elseif o.op >= opcode.ISLONG and o.op <= opcode.ISNUL then
         local pos, t = varref(o.ipv, o.ipo, varmap), tab[o.op]
-        insert(res, format('if r.t[%s] ~= %d then rt_err_type(r, %s, 0x%x) end',
-                            pos, t, pos, o.op))
+        insert(res, format('if r.t[%s] ~= %d then %s end',
+                            pos, t,
+                            err_stmt(il, format('rt_err_type(r, %s, 0x%x)',
+                                                pos, o.op))))
     elseif o.op == opcode.LENIS     then
         local pos = varref(o.ipv, o.ipo, varmap)
-        insert(res, format([[
-if r.v[%s].xlen ~= %d then rt_err_length(r, %s, %d) end]],
-                            pos, o.len, pos, o.len))
+        insert(res, format('if r.v[%s].xlen ~= %d then %s end',
+                            pos, o.len,
+                            err_stmt(il, format('rt_err_length(r, %s, %d)',
+                                                pos, o.len))))
     elseif o.op == opcode.ISNOTSET  then
         local pos = varref(o.ipv, o.ipo, varmap)
-        insert(res, format('if %s ~= 0 then rt_err_duplicate(r, %s) end',
-                            pos, pos))
+        insert(res, format('if %s ~= 0 then %s end', pos,
+                            err_stmt(il, format('rt_err_duplicate(r, %s)',
+                                                pos))))
     -----------------------------------------------------------
     elseif o.op == opcode.CHECKOBUF then
         local expr
@@ -323,20 +384,32 @@ if r.v[%s].xlen ~= %d then rt_err_length(r, %s, %d) end]],
                             expr, expr))
     -----------------------------------------------------------
     elseif o.op == opcode.ERRVALUEV then
-        insert(res, format('rt_err_value(r, %s, 1)',
-                           varref(o.ipv, o.ipo, varmap)))
+        insert(res, err_stmt(il, format('rt_err_value(r, %s, 1)',
+                                        varref(o.ipv, o.ipo, varmap))))
     -----------------------------------------------------------
     elseif o.op == opcode.ISSET     then
-        insert(res, format('if %s == 0 then rt_err_missing(r, %s, "%s") end',
-                            varref(o.ripv, 0, varmap),
-                            varref(o.ipv, o.ipo, varmap),
-                            il.get_extra(o)))
+        local pos, name = varref(o.ipv, o.ipo, varmap), il.get_extra(o)
+        local call
+        if il.lazy_errors then
+            -- the key is recorded as a cpool offset, same as in vm.c
+            call = format('rt_err_missing(r, %s, %d, %d)',
+                          pos, il.cpool_add(name), #name)
+        else
+            call = format('rt_err_missing(r, %s, "%s")', pos, name)
+        end
+        insert(res, format('if %s == 0 then %s end',
+                            varref(o.ripv, 0, varmap), err_stmt(il, call)))
     -----------------------------------------------------------
     elseif o.op == opcode.ERROR then
         local str = il.get_extra(o)
         local pos = il.cpool_add(str)
-        insert(res, format('error(cpool:sub(#cpool - %d, #cpool - %d))',
-                           pos - 1, pos - #str))
+        if il.lazy_errors then
+            insert(res, err_stmt(il, format('rt_err_message(r, %d, %d)',
+                                            pos, #str)))
+        else
+            insert(res, format('error(cpool:sub(#cpool - %d, #cpool - %d))',
+                               pos - 1, pos - #str))
+        end
     -----------------------------------------------------------
     elseif not (o.op == opcode.ENDVAR) then
     -----------------------------------------------------------
@@ -384,57 +457,48 @@ local function emit_intswitch_block(ctx, block, cc, res)
         emit_nested_block(ctx, branch, cc, res)
     end
     insert(res, 'else')
-    insert(res, format('rt_err_value(r, %s)', pos))
+    insert(res, err_stmt(ctx.il, format('rt_err_value(r, %s)', pos)))
     insert(res, 'end')
 end
 
-local function create_strswitch_hash_func(il, block)
-    if not il.enable_fast_strings then return 0 end
-    local strings = ffi_new('const char *[?]', #block - 1)
-    for i = 2, #block do
-        local branch = block[i]
-        local branch_head = branch[1]
-        assert(branch_head.op == opcode.SBRANCH)
-        local str = il.get_extra(branch_head)
-        strings[i - 2] = str
-    end
-    return rt_C.create_hash_func(#block - 1, strings,
-                                 random_bytes, #random_bytes)
-end
-
+-- The key is checked against the one that followed the previous key
+-- last time (schema_rt_guess_key), the hash is computed only if it
+-- isn't that one; either way t is the branch number.
 local function emit_strswitch_block(ctx, block, cc, res)
     local il     = ctx.il
     local varmap = ctx.varmap
     local head   = block[1]
-    local func   = create_strswitch_hash_func(il, block)
+    local func   = il.strswitch_hash_func(block)
     local pos    = varref(head.ipv, head.ipo, varmap)
+    local n      = #block - 1
+    local keys   = il.strswitch_keys(block) / 4
+    local hints  = il.lua_hints_alloc(n)
+    insert(res, format([[
+t = rt_C.schema_rt_guess_key(r.b2, r.b2_32-%d, hints+%d, r.b1-r.v[%s].xoff, r.v[%s].xlen)
+if t < 0 then]], keys, hints, pos, pos))
     if func ~= 0 then
         emit_compute_hash_func(func, pos, res)
+        insert(res, format('t = rt_C.schema_rt_search32(r.b2_32-%d, t, %d)',
+                           il.strswitch_hashes(block, func) / 4, n))
+        insert(res, format([[
+if rt_C.schema_rt_key_eq(r.b2-(r.b2_32-%d)[t*2+1], r.b1-r.v[%s].xoff, (r.b2_32-%d)[t*2], r.v[%s].xlen) ~= 0 then]],
+                           keys, pos, keys, pos))
     else
-        insert(res, format('t = ffi_string(r.b1-r.v[%s].xoff, r.v[%s].xlen)',
-                           pos, pos))
+        insert(res, format([[
+t = rt_C.schema_rt_strsearch(r.b2, r.b2_32-%d, %d, r.b1-r.v[%s].xoff, r.v[%s].xlen)
+if t < 0 then]], il.strswitch_table(block) / 4, n, pos, pos))
     end
+    insert(res, err_stmt(il, format('rt_err_value(r, %s)', pos)))
+    insert(res, 'end')
+    insert(res, format('rt_C.schema_rt_learn_key(hints+%d, t)', hints))
+    insert(res, 'end')
     for i = 2, #block do
         local branch = block[i]
-        local branch_head = branch[1]
-        assert(branch_head.op == opcode.SBRANCH)
-        local str = il.get_extra(branch_head)
-        local if_or_elseif = i == 2 and 'if' or 'elseif'
-        if func ~= 0 then
-            insert(res, format('%s t == %d then', if_or_elseif,
-                                rt_C.eval_hash_func(func, str, #str)))
-            insert(res, format([[
-if rt_C.schema_rt_key_eq(r.b2-%d, r.b1-r.v[%s].xoff, %d, r.v[%s].xlen) ~= 0 then]],
-                               il.cpool_add(str), pos, #str, pos))
-            insert(res, format('rt_err_value(r, %s)\nend', pos))
-        else
-            insert(res, format('%s t == %q then',
-                               if_or_elseif, str))
-        end
+        assert(branch[1].op == opcode.SBRANCH)
+        insert(res, format('%s t == %d then', i == 2 and 'if' or 'elseif',
+                           i - 2))
         emit_nested_block(ctx, branch, cc, res)
     end
-    insert(res, 'else')
-    insert(res, format('rt_err_value(r, %s)', pos))
     insert(res, 'end')
 end
 
@@ -707,6 +771,190 @@ local function emit_func(il, func, res, opts)
     end
     insert(res, 'end')
 end
+------------------------------------------------------------------------
+-- Hash cache
+--
+-- Perfect hash functions and compacted phf displacement maps, keyed by
+-- content (the keys and whatever else the result depends on) and shared
+-- by compile() calls: an enum used in many schemas is hashed once.
+-- Entries hold no cpool offsets, each compilation adds g to its cpool.
+-- Entries loaded with hash_cache_load() are checked on the first use.
+
+-- bump when create_hash_func or phf change the results
+local HASH_CACHE_VERSION = 1
+
+local hash_cache = {}
+local hash_cache_unchecked = {}
+local hash_stats = { hits = 0, misses = 0, entries = 0, time = 0 }
+
+-- Cached build(), a miss if check (if any) fails.
+local function hash_cache_get(key, build, check)
+    local res = hash_cache[key]
+    if res ~= nil and hash_cache_unchecked[key] then
+        hash_cache_unchecked[key] = nil
+        if not check(res) then
+            res = nil
+        end
+    end
+    if res ~= nil then
+        hash_stats.hits = hash_stats.hits + 1
+        return res
+    end
+    local start = clock()
+    res = build()
+    hash_stats.time = hash_stats.time + clock() - start
+    hash_stats.misses = hash_stats.misses + 1
+    if hash_cache[key] == nil then
+        hash_stats.entries = hash_stats.entries + 1
+    end
+    hash_cache[key] = res
+    return res
+end
+
+-- Compile-time stats: hash cache hits and misses, entries, and the time
+-- spent building hash functions and phf (seconds of CPU time).
+local function compile_stats()
+    return { hash_hits = hash_stats.hits, hash_misses = hash_stats.misses,
+             hash_entries = hash_stats.entries, hash_time = hash_stats.time }
+end
+
+-- The cache contents, to be restored with hash_cache_load(), e.g. in the
+-- next run of the program.
+local function hash_cache_dump()
+    return msgpack.encode({ HASH_CACHE_VERSION, hash_cache })
+end
+
+local function is_phf_entry(v)
+    local r, m = v.r, v.m
+    return (v.bits == 8 or v.bits == 16 or v.bits == 32) and
+           type(v.g) == 'string' and type(v.seed) == 'number' and
+           type(r) == 'number' and r >= 1 and band(r, r - 1) == 0 and
+           type(m) == 'number' and m >= 1 and band(m, m - 1) == 0 and
+           #v.g == r * v.bits / 8
+end
+
+-- Add entries from hash_cache_dump() data. False and the error if the
+-- data is malformed or made by another version.
+local function hash_cache_load(data)
+    local ok, t = pcall(msgpack.decode, data)
+    if not ok or type(t) ~= 'table' or type(t[2]) ~= 'table' then
+        return false, 'hash cache: malformed data'
+    end
+    if t[1] ~= HASH_CACHE_VERSION then
+        return false, 'hash cache: version mismatch'
+    end
+    for k, v in pairs(t[2]) do
+        if type(k) ~= 'string' or
+           not (type(v) == 'number' or type(v) == 'table' and
+                is_phf_entry(v)) then
+            return false, 'hash cache: malformed data'
+        end
+    end
+    for k, v in pairs(t[2]) do
+        if hash_cache[k] == nil then
+            hash_stats.entries = hash_stats.entries + 1
+            hash_cache[k] = v
+            hash_cache_unchecked[k] = true
+        end
+    end
+    return true
+end
+
+local function hash_cache_clear()
+    hash_cache, hash_cache_unchecked = {}, {}
+    hash_stats.entries = 0
+end
+
+-- A perfect hash of n strings, s[0..n-1], see create_string_hash()
+-- (no cpos).
+local function eval_string_hash(func, str)
+    if type(func) == 'number' then
+        return rt_C.eval_hash_func(func, str, #str)
+    end
+    return rt_C['phf_hash_string_band_raw'..func.bits](
+        func.g, str, #str, func.seed, func.r, func.m)
+end
+
+local function is_perfect_string_hash(func, s, n)
+    local seen = {}
+    for i = 0, n-1 do
+        local h = eval_string_hash(func, s[i])
+        if seen[h] then return false end
+        seen[h] = true
+    end
+    return true
+end
+
+local function build_string_hash(s, n, fast_strings)
+    local _s = ffi_new('const char * [?]', n)
+    for i = 0, n-1 do
+        _s[i] = s[i]
+    end
+    local func = fast_strings and
+                 rt_C.create_hash_func(n, _s, random_bytes,
+                                       #random_bytes) or 0
+    if func ~= 0 then
+        return func
+    end
+    local k = ffi_new('struct schema_rt_phf_string[?]', n)
+    for i = 0, n-1 do
+        k[i].p, k[i].n = _s[i], #s[i]
+    end
+    local phf = ffi.gc(ffi_new('struct schema_rt_phf'), rt_C.phf_destroy)
+    local res = rt_C.phf_init_string(phf, k, n, 4, 90, 0, 1)
+    if res ~= 0 then error('internal error: phf: '..res) end
+    rt_C.phf_compact(phf)
+    local g_width = byte('#\1#\2#\4', phf.g_op) -- 2:int8 4:int16 6:int32
+    return { bits = g_width*8, g = ffi_string(phf.g, phf.r*(g_width)),
+             seed = 0, r = tonumber(phf.r), m = tonumber(phf.m) }
+end
+
+-- The key has the strings in order, the result depends on it. With
+-- fast strings, create_hash_func may pick CRC32C if the CPU has it.
+local function cached_string_hash(s, n, fast_strings)
+    local key = { fast_strings and
+                  (rt_C.schema_rt_get_simd() > 0 and 'S' or 's') or 'p' }
+    for i = 0, n-1 do
+        insert(key, #s[i]..':'..s[i])
+    end
+    return hash_cache_get(concat(key, ','), function()
+        return build_string_hash(s, n, fast_strings)
+    end, function(func)
+        return is_perfect_string_hash(func, s, n)
+    end)
+end
+
+-- A phf mapping n int32 hashes, h[0..n-1], to 0..m-1: { bits, g, seed,
+-- r, m }, evaluated with phf_hash_uint32_band_raw*.
+local function build_uint32_phf(h, n, seed)
+    local phf = ffi.gc(ffi_new('struct schema_rt_phf'), rt_C.phf_destroy)
+    local res = rt_C.phf_init_uint32(phf, h, n, 4, 90, seed, 1)
+    if res ~= 0 then error('internal error: phf: '..res) end
+    rt_C.phf_compact(phf)
+    local g_width = byte('#\1#\2#\4', phf.g_op) -- 2:int8 4:int16 6:int32
+    return { bits = g_width*8, g = ffi_string(phf.g, phf.r*(g_width)),
+             seed = seed, r = tonumber(phf.r), m = tonumber(phf.m) }
+end
+
+local function eval_uint32_phf(phf, h)
+    return rt_C['phf_hash_uint32_band_raw'..phf.bits](
+        phf.g, h, phf.seed, phf.r, phf.m)
+end
+
+local function cached_uint32_phf(h, n, seed)
+    return hash_cache_get(format('u%d,', seed)..ffi_string(h, 4*n),
+                          function() return build_uint32_phf(h, n, seed) end,
+                          function(phf)
+        local seen = {}
+        for i = 0, n-1 do
+            local x = eval_uint32_phf(phf, h[i])
+            if seen[x] then return false end
+            seen[x] = true
+        end
+        return true
+    end)
+end
+
 ------------------------------------------------------------------------
 
 local function install_backend(il, opts)
@@ -734,26 +982,32 @@ local function install_backend(il, opts)
     end
 
     -- store a uint array in cpool; pick the smallest type to fit the values
-    -- return an expression (string) to access the array in runtime
-    local function cpool_add_uint_array(t, len)
+    -- (unless item_bits is given)
+    -- return the offset (bytes) and the item size (bits)
+    local function cpool_add_uint_array(t, len, item_bits)
         local v_max = 0
         for i = 0,len-1 do
             local v = t[i] or 0
             v_max = max(v, v_max)
         end
-        local item_bits = v_max < 0x100 and 8 or
-                          v_max < 0x10000 and 16 or 32
+        item_bits = item_bits or v_max < 0x100 and 8 or
+                    v_max < 0x10000 and 16 or 32
         local array_type = format('uint%d_t [?]', item_bits)
         local buf = ffi_new(array_type, len)
         for i = 0,len-1 do
             buf[i] = t[i] or 0
         end
         cpool_align(4)
-        local cpos = cpool_add_raw(ffi_string(buf, ffi_sizeof(array_type, len)))
+        return cpool_add_raw(ffi_string(buf, ffi_sizeof(array_type, len))),
+               item_bits
+    end
+
+    -- an expression (string) to access a uint array in runtime
+    local function uint_array_ref(cpos, item_bits)
         if item_bits == 8 then
-            return format('r.b2-%d', cpos), 8
+            return format('r.b2-%d', cpos)
         else
-            return format('r.b2_%d-%d', item_bits, cpos/(item_bits/8)), item_bits
+            return format('r.b2_%d-%d', item_bits, cpos/(item_bits/8))
         end
     end
 
@@ -773,14 +1027,13 @@ local function install_backend(il, opts)
         return concat(cpoo, '', cmin, cmax)
     end
 
-    -- PUTENUMI2S handling
-    -- We assume that several I2S-es may share the same translation table,
-    -- hence the caching.
+    -- PUTENUMI2S translation table: (len, offset) pairs, an empty
+    -- string marks a gap. We assume that several I2S-es may share the
+    -- same translation table, hence the caching.
     local i2s_cache = {}
-    function il.emit_putenumi2s(o, res, varmap)
-        local tab  = il.get_extra(o)
-        local emit = i2s_cache[tab]
-        if not emit then
+    function il.enumi2s_table(tab)
+        local info = i2s_cache[tab]
+        if not info then
             local n, is_sparse, data = #tab, false, {}
             for i = 1, n do
                 local str = tab[i]
@@ -788,28 +1041,49 @@ local function install_backend(il, opts)
                 data[i*2 - 2] = #str
                 data[i*2 - 1] = il.cpool_add(str)
             end
-            local cdata = cpool_add_uint_array(data, n*2)
-            emit = function(o, res, varmap)
-                local pos = varref(o.ipv, o.ipo, varmap)
-                insert(res, format([[
-if r.v[%s].uval >= %d then rt_err_value(r, %s) end]],
-                                   pos, n, pos))
-                if is_sparse then
-                    insert(res, format([[
-if (%s)[r.v[%s].ival*2] == 0 then rt_err_value(r, %s, true) end]],
-                                       cdata, pos, pos))
-                end
-                local output = varref(0, o.offset, varmap)
-                insert(res, format([[
+            local cpos, bits = cpool_add_uint_array(data, n*2)
+            info = { cpos = cpos, bits = bits, n = n, is_sparse = is_sparse }
+            i2s_cache[tab] = info
+        end
+        return info
+    end
+
+    function il.emit_putenumi2s(o, res, varmap)
+        local info  = il.enumi2s_table(il.get_extra(o))
+        local cdata = uint_array_ref(info.cpos, info.bits)
+        local pos = varref(o.ipv, o.ipo, varmap)
+        insert(res, format('if r.v[%s].uval >= %d then %s end',
+                           pos, info.n,
+                           err_stmt(il, format('rt_err_value(r, %s)', pos))))
+        if info.is_sparse then
+            insert(res, format('if (%s)[r.v[%s].ival*2] == 0 then %s end',
+                               cdata, pos,
+                               err_stmt(il, format('rt_err_value(r, %s, true)',
+                                                   pos))))
+        end
+        local output = varref(0, o.offset, varmap)
+        insert(res, format([[
 r.ot[%s] = 18; r.ov[%s].xlen = (%s)[r.v[%s].ival*2];
 r.ov[%s].xoff = (%s)[r.v[%s].ival*2+1];]],
-                                   output, output, cdata, pos,
-                                   output, cdata, pos))
-            end
-            i2s_cache[tab] = emit
+                           output, output, cdata, pos,
+                           output, cdata, pos))
+    end
+
+    -- A perfect hash of n strings, s[0..n-1]: a func made by
+    -- create_hash_func (a number), or a string phf if there is none
+    -- (huge sets) or if fast strings are disabled, a table:
+    -- { bits, cpos, seed, r, m } and g, the displacement map also
+    -- stored in cpool at cpos.
+    local function create_string_hash(s, n)
+        local func = cached_string_hash(s, n, il.enable_fast_strings)
+        if type(func) == 'number' then
+            return func
         end
-        emit(o, res, varmap)
+        cpool_align(4)
+        return { bits = func.bits, cpos = cpool_add_raw(func.g), g = func.g,
+                 seed = func.seed, r = func.r, m = func.m }
     end
+    il.eval_string_hash = eval_string_hash
 
     -- Compute data tables for PUTENUMS2I
     --
@@ -820,6 +1094,7 @@ r.ov[%s].xoff = (%s)[r.v[%s].ival*2+1];]],
     -- it into 0..m range (m is typically 1.1x the total number of entries).
     -- Finally, we add aux_table of m*3 elements filled with the triples:
     --   str_len, str_offset, v.
+    -- If hash_func is a string phf, it makes the index in 0..m itself.
     local function putenums2i_prepare(tab)
         local seed = 0
         local s = {}
@@ -829,90 +1104,206 @@ r.ov[%s].xoff = (%s)[r.v[%s].ival*2+1];]],
         for k, v in pairs(tab) do
             is_sparse = is_sparse or v == -1
             v_max = max(v, v_max)
-            s[n] = k
+            s[n + 1] = k
             n = n + 1
         end
-        local hash_func = 0
-        if il.enable_fast_strings then
-            local _s = ffi_new('const char * [?]', n)
-            for i = 0, n-1 do
-                _s[i] = s[i]
-            end
-            hash_func = rt_C.create_hash_func(n, _s, random_bytes,
-                                              #random_bytes)
-        end
-        assert(hash_func ~= 0) -- fixme
-        -- only use phf if enum is large
-        local phf = n > il.phf_threshold and
-                    ffi.gc(ffi_new('struct schema_rt_phf'),
-                           rt_C.phf_destroy)
-        local h = ffi_new('int32_t[?]', n)
+        -- same symbols, same order: a hash cache hit
+        sort(s)
         for i = 0, n-1 do
-            h[i] = rt_C.eval_hash_func(hash_func, s[i], #s[i])
+            s[i] = s[i + 1]
         end
-        local eval_phf_func, m
-        if phf then
-            local res = rt_C.phf_init_uint32(phf, h, n, 4, 90, seed, 1)
-            if res ~= 0 then error('internal error: phf: '..res) end
-            rt_C.phf_compact(phf)
-            local g_width = byte('#\1#\2#\4', phf.g_op) -- 2:int8 4:int16 6:int32
-            cpool_align(4)
-            local g_offset = cpool_add_raw(ffi_string(phf.g, phf.r*(g_width)))
-            local r
-            r, m = tonumber(phf.r), tonumber(phf.m)
-            eval_phf_func = format([[
-t = rt_C.phf_hash_uint32_band_raw%d(r.b2-%d, t, %d, %d, %d)]],
-                                   g_width*8, g_offset, seed, r, m)
+        s[n] = nil
+        local hash_func = create_string_hash(s, n)
+        local info = { hash_func = hash_func, v_max = is_sparse and v_max }
+        local index = {}
+        local m
+        if type(hash_func) == 'table' then
+            m = hash_func.m
+            for i = 0, n-1 do
+                index[i] = eval_string_hash(hash_func, s[i])
+            end
         else
-            local tab, tab_bits = cpool_add_uint_array(h, n)
-            m, eval_phf_func = n, format('t = rt_C.schema_rt_search%d(%s, t, %d)',
-                                         tab_bits, tab, n)
+            local h, h_max = ffi_new('int32_t[?]', n), 0
+            for i = 0, n-1 do
+                h[i] = rt_C.eval_hash_func(hash_func, s[i], #s[i])
+                h_max = max(h_max, h[i] % 0x100000000)
+            end
+            -- only use phf if enum is large
+            local bits = h_max < 0x100 and 8 or
+                         h_max < 0x10000 and 16 or 32
+            local phf = n > (il.phf_threshold or
+                             phf_thresholds[rt_C.schema_rt_get_simd()][bits])
+                        and cached_uint32_phf(h, n, seed)
+            if phf then
+                cpool_align(4)
+                m = phf.m
+                info.phf = { bits = phf.bits, cpos = cpool_add_raw(phf.g),
+                             seed = phf.seed, r = phf.r, m = m }
+            else
+                -- hashes are unsigned
+                local hu = {}
+                for i = 0, n-1 do
+                    hu[i] = h[i] % 0x100000000
+                end
+                local cpos = cpool_add_uint_array(hu, n)
+                m = n
+                info.search = { bits = bits, cpos = cpos, n = n }
+            end
+            for i = 0, n-1 do
+                index[i] = phf and eval_uint32_phf(phf, h[i]) or i
+            end
         end
         local aux_table = {}
         for i = 0, n-1 do
             local str = s[i]
             local v   = tab[str]
-            local index = phf and rt_C.phf_hash_uint32(phf, h[i]) or i
-            aux_table[index*3    ] = #str
-            aux_table[index*3 + 1] = il.cpool_add(str)
-            aux_table[index*3 + 2] = v == -1 and v_max + 1 or v
+            aux_table[index[i]*3    ] = #str
+            aux_table[index[i]*3 + 1] = il.cpool_add(str)
+            aux_table[index[i]*3 + 2] = v == -1 and v_max + 1 or v
         end
-        return hash_func, eval_phf_func, is_sparse and v_max,
-               cpool_add_uint_array(aux_table, m*3)
+        info.aux_cpos, info.aux_bits = cpool_add_uint_array(aux_table, m*3)
+        return info
     end
 
-    -- PUTENUMS2I handling
+    -- PUTENUMS2I data tables.
     -- We assume that several S2I-s may share the same translation table,
     -- hence the cache.
     local s2i_cache = {}
+    function il.enums2i_table(tab)
+        local info = s2i_cache[tab]
+        if not info then
+            info = putenums2i_prepare(tab)
+            s2i_cache[tab] = info
+        end
+        return info
+    end
+
     function il.emit_putenums2i(o, res, varmap)
-        local tab  = il.get_extra(o)
-        local emit = s2i_cache[tab]
-        if not emit then
-            local hash_func, eval_phf_func, v_max, aux_table =
-                putenums2i_prepare(tab)
-            emit = function(o, res, varmap)
-                local pos = varref(o.ipv, o.ipo, varmap)
-                emit_compute_hash_func(hash_func, pos, res)
-                insert(res, eval_phf_func)
-                insert(res, format([[
+        local info = il.enums2i_table(il.get_extra(o))
+        local aux_table = uint_array_ref(info.aux_cpos, info.aux_bits)
+        local pos = varref(o.ipv, o.ipo, varmap)
+        emit_compute_hash_func(info.hash_func, pos, res)
+        local phf, search = info.phf, info.search
+        if phf then
+            insert(res, format([[
+t = rt_C.phf_hash_uint32_band_raw%d(r.b2-%d, t, %d, %d, %d)]],
+                               phf.bits, phf.cpos, phf.seed, phf.r, phf.m))
+        elseif search then
+            insert(res, format('t = rt_C.schema_rt_search%d(%s, t, %d)',
+                               search.bits,
+                               uint_array_ref(search.cpos, search.bits),
+                               search.n))
+        end
+        insert(res, format([[
 if rt_C.schema_rt_key_eq(r.b2-(%s)[t*3+1], r.b1-r.v[%s].xoff, (%s)[t*3], r.v[%s].xlen) ~= 0 then
-    rt_err_value(r, %s)
-end]], aux_table, pos, aux_table, pos, pos))
-                if v_max then
-                    insert(res, format([[
+    %s
+end]], aux_table, pos, aux_table, pos,
+       err_stmt(il, format('rt_err_value(r, %s)', pos))))
+        if info.v_max then
+            insert(res, format([[
 if (%s)[t*3+2] > %d then
-    rt_err_value(r, %s, true)
-end]], aux_table, v_max, pos))
-                end
-                local output = varref(0, o.offset, varmap)
-                insert(res, format([[
+    %s
+end]], aux_table, info.v_max,
+       err_stmt(il, format('rt_err_value(r, %s, true)', pos))))
+        end
+        local output = varref(0, o.offset, varmap)
+        insert(res, format([[
 r.ot[%s] = 4; r.ov[%s].ival = (%s)[t*3+2];]],
-                                   output, output, aux_table))
-            end
-            s2i_cache[tab] = emit
+                           output, output, aux_table))
+    end
+
+    local function strswitch_strings(block)
+        local strings = {}
+        for i = 2, #block do
+            local branch = block[i]
+            local branch_head = branch[1]
+            assert(branch_head.op == opcode.SBRANCH)
+            strings[i - 2] = il.get_extra(branch_head)
         end
-        emit(o, res, varmap)
+        return strings
+    end
+
+    -- STRSWITCH hash func (0 - use strswitch_table, a table - string phf)
+    function il.strswitch_hash_func(block)
+        if not il.enable_fast_strings then return 0 end
+        return create_string_hash(strswitch_strings(block), #block - 1)
+    end
+
+    -- STRSWITCH with no hash func: cpos of the schema_rt_strsearch table,
+    -- (length, cpos, branch) triples ordered by length, then contents;
+    -- branches are numbered from 0.
+    function il.strswitch_table(block)
+        local strings = strswitch_strings(block)
+        local n = #block - 1
+        local order = {}
+        for i = 1, n do
+            order[i] = i - 1
+        end
+        sort(order, function(a, b)
+            local x, y = strings[a], strings[b]
+            if #x ~= #y then return #x < #y end
+            return x < y
+        end)
+        local tab = {}
+        for i = 1, n do
+            local str = strings[order[i]]
+            tab[i*3 - 3] = #str
+            tab[i*3 - 2] = il.cpool_add(str)
+            tab[i*3 - 1] = order[i]
+        end
+        return (cpool_add_uint_array(tab, n*3, 32))
+    end
+
+    -- STRSWITCH keys by branch for schema_rt_guess_key: cpos of
+    -- (length, cpos) pairs.
+    function il.strswitch_keys(block)
+        local strings = strswitch_strings(block)
+        local tab = {}
+        for i = 0, #block - 2 do
+            tab[i*2]     = #strings[i]
+            tab[i*2 + 1] = il.cpool_add(strings[i])
+        end
+        return (cpool_add_uint_array(tab, (#block - 1)*2, 32))
+    end
+
+    -- STRSWITCH hashes by branch (string phf values or unsigned hashes)
+    -- for schema_rt_search32: cpos.
+    function il.strswitch_hashes(block, func)
+        local strings = strswitch_strings(block)
+        local tab = {}
+        for i = 0, #block - 2 do
+            tab[i] = eval_string_hash(func, strings[i]) % 0x100000000
+        end
+        return (cpool_add_uint_array(tab, #block - 1, 32))
+    end
+
+    -- Initial hints of a STRSWITCH with n branches, see
+    -- schema_rt_guess_key: the last branch was taken, branches follow
+    -- in the schema order.
+    function il.strswitch_hints(n)
+        local hints = { [0] = n - 1 }
+        for i = 1, n do
+            hints[i] = i % n
+        end
+        return hints
+    end
+
+    -- Hints of the Lua engine are in one array made at load time from
+    -- cpool (hints_get_data). Returns the offset.
+    local lua_hints, lua_nhints = {}, 0
+    function il.lua_hints_alloc(n)
+        local offset = lua_nhints
+        local hints = il.strswitch_hints(n)
+        for i = 0, n do
+            lua_hints[offset + i] = hints[i]
+        end
+        lua_nhints = lua_nhints + n + 1
+        return offset
+    end
+
+    function il.hints_get_data()
+        if lua_nhints == 0 then return 0, 0 end
+        return (cpool_add_uint_array(lua_hints, lua_nhints, 32)), lua_nhints
     end
 
     function il.emit_lua_func(func, res, opts)
@@ -921,11 +1312,16 @@ r.ot[%s] = 4; r.ov[%s].ival = (%s)[t*3+2];]],
 
     il.enable_loop_peeling = (opts.enable_loop_peeling ~= false)
     il.enable_fast_strings = (opts.enable_fast_strings ~= false)
-    il.phf_threshold       = (opts.phf_threshold or 8)
+    il.phf_threshold       = opts.phf_threshold
+    il.lazy_errors         = (opts.lazy_errors == true)
 
     return il
 end
 
 return {
-    install = install_backend
+    install          = install_backend,
+    compile_stats    = compile_stats,
+    hash_cache_dump  = hash_cache_dump,
+    hash_cache_load  = hash_cache_load,
+    hash_cache_clear = hash_cache_clear
 }
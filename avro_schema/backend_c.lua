@@ -0,0 +1,611 @@
+local ffi            = require('ffi')
+local rt             = require('avro_schema.runtime')
+local backend_vm     = require('avro_schema.backend_vm')
+local ffi_new        = ffi.new
+local format, rep    = string.format, string.rep
+local insert, concat = table.insert, table.concat
+
+local opcode = ffi_new('struct schema_il_Opcode')
+
+-- Native code: the optimized IL translated to C, built with the system
+-- C compiler and loaded as a shared object.
+--
+-- A function operates on the State and reports errors in a VmError,
+-- same as the IL interpreter (runtime/vm.c). The object is linked
+-- with the runtime library, helpers (hashing, buf_grow) come from there.
+-- Symbols are hidden, except for schema_native_run().
+--
+-- Note: this file is processed with il_filt.sh, hence a certain
+-- C keyword never appears here.
+
+local prelude = [[
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+struct Value {
+    union {
+        void          *p;
+        int64_t        ival;
+        uint64_t       uval;
+        double         dval;
+        struct {
+            uint32_t   xlen;
+            uint32_t   xoff;
+        };
+    };
+};
+
+/* The leading fields of State (runtime/pipeline.h). */
+struct State {
+    size_t             t_capacity;
+    size_t             ot_capacity;
+    size_t             res_capacity;
+    size_t             res_size;
+    uint8_t           *res;
+    const uint8_t     *b1;
+    const uint8_t     *b2;
+    uint8_t           *t;
+    struct Value      *v;
+    uint8_t           *ot;
+    struct Value      *ov;
+    int32_t            k;
+    int32_t            raw;
+    size_t             rv_capacity;
+    struct Value      *rv;
+};
+
+typedef char state_layout_check[
+    offsetof(struct State, rv) == %d ? 1 : -1];
+
+struct VmError {
+    int32_t            kind;
+    int32_t            arg;
+    uint32_t           str;
+    uint32_t           len;
+    int64_t            pos;
+};
+
+uint32_t eval_hash_func(uint32_t func, const char *str, size_t len);
+uint32_t phf_hash_uint32_band_raw8(const uint8_t *g, uint32_t k,
+                                   uint32_t seed, size_t r, size_t m);
+uint32_t phf_hash_uint32_band_raw16(const uint16_t *g, uint32_t k,
+                                    uint32_t seed, size_t r, size_t m);
+uint32_t phf_hash_uint32_band_raw32(const uint32_t *g, uint32_t k,
+                                    uint32_t seed, size_t r, size_t m);
+uint32_t phf_hash_string_band_raw8(const uint8_t *g, const void *p, size_t n,
+                                   uint32_t seed, size_t r, size_t m);
+uint32_t phf_hash_string_band_raw16(const uint16_t *g, const void *p, size_t n,
+                                    uint32_t seed, size_t r, size_t m);
+uint32_t phf_hash_string_band_raw32(const uint32_t *g, const void *p, size_t n,
+                                    uint32_t seed, size_t r, size_t m);
+int schema_rt_key_eq(const char *key, const char *str,
+                     size_t klen, size_t len);
+uint32_t schema_rt_search8(const uint8_t *tab, uint32_t k, size_t n);
+uint32_t schema_rt_search16(const uint16_t *tab, uint32_t k, size_t n);
+uint32_t schema_rt_search32(const uint32_t *tab, uint32_t k, size_t n);
+int32_t schema_rt_strsearch(const uint8_t *b2, const uint32_t *tab, uint32_t n,
+                            const char *str, size_t len);
+int schema_rt_buf_grow(struct State *state, size_t min_capacity);
+int schema_rt_check_items(struct State *state, int64_t pos, uint32_t kind,
+                          struct VmError *err);
+int64_t schema_rt_put_items(struct State *state, int64_t pos, int64_t opos,
+                            uint32_t kind, struct VmError *err);
+
+/* VmError kinds, see runtime/vm.c */
+#define ERR(k_, a_, p_) \
+    do { err->kind = (k_); err->arg = (a_); err->pos = (p_); \
+         return -1; } while (0)
+#define ERR_STR(k_, s_, l_) \
+    do { err->str = (s_); err->len = (l_); ERR((k_), 0, 0); } while (0)
+
+int hash_str(uint32_t func, const char *str, uint32_t len,
+             uint32_t *hash)
+{
+    uint32_t family = func >> 24;
+    if ((func & 0xf0000000) == 0 && (family & 3) != 0 &&
+        len <= (0xff & (func >> (8 * (3 - (family & 3))))))
+        return -1;
+    *hash = eval_hash_func(func, str, len);
+    return 0;
+}
+
+/* Record keys in the order seen before, see schema_rt_guess_key().
+ * Hints are shared by the runs on all states, a race spoils a guess. */
+#define HINT_LOAD(x)     __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define HINT_STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+int32_t guess_key(const uint8_t *b2, const uint32_t *keys, uint32_t *hints,
+                  const char *str, uint32_t len)
+{
+    uint32_t g = HINT_LOAD(hints[1 + HINT_LOAD(hints[0])]);
+    if (keys[2 * g] != len || memcmp(b2 - keys[2 * g + 1], str, len) != 0)
+        return -1;
+    HINT_STORE(hints[0], g);
+    return (int32_t)g;
+}
+
+void learn_key(uint32_t *hints, uint32_t b)
+{
+    HINT_STORE(hints[1 + HINT_LOAD(hints[0])], b);
+    HINT_STORE(hints[0], b);
+}
+]]
+
+local emit_put_tab = {
+    ------------------------- T, tofield, fromfield
+    [opcode.PUTINT     ] = {  4, 'ival',  'ival' },
+    [opcode.PUTLONG    ] = {  4, 'ival',  'ival' },
+    [opcode.PUTFLOAT   ] = {  6, 'dval',  'dval' },
+    [opcode.PUTDOUBLE  ] = {  7, 'dval',  'dval' },
+    [opcode.PUTSTR     ] = {  8, 'uval',  'uval' },
+    [opcode.PUTBIN     ] = {  9, 'uval',  'uval' },
+    [opcode.PUTARRAY   ] = { 11, 'xlen',  'xlen' },
+    [opcode.PUTMAP     ] = { 12, 'xlen',  'xlen' },
+    [opcode.PUTINT2LONG] = {  4, 'ival',  'ival' },
+    [opcode.PUTINT2FLT ] = {  6, 'dval',  'ival' },
+    [opcode.PUTINT2DBL ] = {  7, 'dval',  'ival' },
+    [opcode.PUTLONG2FLT] = {  6, 'dval',  'ival' },
+    [opcode.PUTLONG2DBL] = {  7, 'dval',  'ival' },
+    [opcode.PUTFLT2DBL ] = {  7, 'dval',  'dval' },
+    [opcode.PUTSTR2BIN ] = {  9, 'uval',  'uval' },
+    [opcode.PUTBIN2STR ] = {  8, 'uval',  'uval' }
+}
+
+local emit_check_tab = {
+    [opcode.ISBOOL     ] = 'r->t[%s] == 2 || r->t[%s] == 3',
+    [opcode.ISLONG     ] = 'r->t[%s] == 4',
+    [opcode.ISSTR      ] = 'r->t[%s] == 8',
+    [opcode.ISBIN      ] = 'r->t[%s] == 9',
+    [opcode.ISARRAY    ] = 'r->t[%s] == 11',
+    [opcode.ISMAP      ] = 'r->t[%s] == 12',
+    [opcode.ISNUL      ] = 'r->t[%s] == 1',
+    [opcode.ISNULORMAP ] = 'r->t[%s] == 1 || r->t[%s] == 12'
+}
+
+-- variable [ + offset]
+local function varref(ctx, ipv, ipo)
+    ctx.vars[ipv] = true
+    if ipo == 0 then
+        return format('v%d', ipv)
+    else
+        return format('(v%d%+d)', ipv, ipo)
+    end
+end
+
+local function uint_array(cpos, bits)
+    return format('((const uint%d_t *)(r->b2-%d))', bits, cpos)
+end
+
+-- a string phf lookup, see create_string_hash() in backend.lua
+local function phf_string(func, str, len)
+    return format('phf_hash_string_band_raw%d(%s, %s, %s, %d, %d, %d)',
+                  func.bits, uint_array(func.cpos, func.bits), str, len,
+                  func.seed, func.r, func.m)
+end
+
+local function double_const(d)
+    if d ~= d then return '(0.0/0.0)' end
+    if d == math.huge then return '(1.0/0.0)' end
+    if d == -math.huge then return '(-1.0/0.0)' end
+    return format('%.17g', d)
+end
+
+local function line(ctx, str, ...)
+    insert(ctx.res, rep('    ', ctx.depth) .. format(str, ...))
+end
+
+local function emit_instruction(ctx, o)
+    local il = ctx.il
+    local op = o.op
+    if     op == opcode.CALLFUNC then
+        line(ctx, '{')
+        line(ctx, '    int64_t p = %s;', varref(ctx, o.ipv, o.ipo))
+        if o.k ~= 0 then line(ctx, '    r->k += %d;', o.k) end
+        line(ctx, '    if (f%d(r, err, &v0, &p) != 0) return -1;',
+             il.get_extra(o))
+        if o.k ~= 0 then line(ctx, '    r->k -= %d;', o.k) end
+        if o.ripv ~= opcode.NILREG then
+            line(ctx, '    %s = p;', varref(ctx, o.ripv, 0))
+        end
+        line(ctx, '}')
+    elseif op == opcode.MOVE then
+        if o.ripv ~= opcode.NILREG then
+            line(ctx, '%s = %s;', varref(ctx, o.ripv, 0),
+                 varref(ctx, o.ipv, o.ipo))
+        end
+    elseif op == opcode.SKIP then
+        local pos = varref(ctx, o.ipv, o.ipo)
+        line(ctx, '%s = %s+r->v[%s].xoff;', varref(ctx, o.ripv, 0), pos, pos)
+    elseif op == opcode.PSKIP then
+        local pos = varref(ctx, o.ipv, o.ipo)
+        line(ctx, '%s = r->t[%s] == 11 || r->t[%s] == 12 ? %s+r->v[%s].xoff : %s+1;',
+             varref(ctx, o.ripv, 0), pos, pos, pos, pos, pos)
+    -----------------------------------------------------------
+    elseif op == opcode.PUTBOOLC then
+        line(ctx, 'r->ot[v0+%d] = %d;', o.offset, o.ci == 0 and 2 or 3)
+    elseif op == opcode.PUTINTC then
+        line(ctx, 'r->ot[v0+%d] = 4; r->ov[v0+%d].ival = %d;',
+             o.offset, o.offset, o.ci)
+    elseif op == opcode.PUTINTKC then
+        line(ctx, 'r->ot[v0+%d] = 4; r->ov[v0+%d].ival = r->k + %d;',
+             o.offset, o.offset, o.ci)
+    elseif op == opcode.PUTARRAYC or op == opcode.PUTMAPC then
+        line(ctx, 'r->ot[v0+%d] = %d; r->ov[v0+%d].xlen = %d;',
+             o.offset, op == opcode.PUTARRAYC and 11 or 12, o.offset, o.ci)
+    elseif op == opcode.PUTLONGC then
+        line(ctx, 'r->ot[v0+%d] = 4; r->ov[v0+%d].ival = (int64_t)%sULL;',
+             o.offset, o.offset,
+             tostring(ffi.cast('uint64_t', o.cl)):sub(1, -4))
+    elseif op == opcode.PUTFLOATC or op == opcode.PUTDOUBLEC then
+        line(ctx, 'r->ot[v0+%d] = %d; r->ov[v0+%d].dval = %s;',
+             o.offset, op == opcode.PUTFLOATC and 6 or 7, o.offset,
+             double_const(o.cd))
+    elseif op == opcode.PUTNULC or op == opcode.PUTDUMMYC then
+        line(ctx, 'r->ot[v0+%d] = %d;', o.offset,
+             op == opcode.PUTNULC and 1 or 17)
+    elseif op == opcode.PUTSTRC or op == opcode.PUTBINC or
+           op == opcode.PUTXC then
+        local str = il.get_extra(o)
+        line(ctx, 'r->ot[v0+%d] = %d; r->ov[v0+%d].xlen = %d; r->ov[v0+%d].xoff = %d;',
+             o.offset, op == opcode.PUTSTRC and 18 or
+                       op == opcode.PUTBINC and 19 or 20,
+             o.offset, #str, o.offset, il.cpool_add(str))
+    -----------------------------------------------------------
+    elseif op == opcode.PUTBOOL then
+        line(ctx, 'r->ot[v0+%d] = r->t[%s];', o.offset,
+             varref(ctx, o.ipv, o.ipo))
+    elseif op >= opcode.PUTINT and op <= opcode.PUTBIN2STR then
+        local opt = emit_put_tab[op]
+        line(ctx, 'r->ot[v0+%d] = %d; r->ov[v0+%d].%s = r->v[%s].%s;',
+             o.offset, opt[1], o.offset, opt[2],
+             varref(ctx, o.ipv, o.ipo), opt[3])
+    elseif op == opcode.PUTRAW then
+        -- parser records byte ranges only when asked to
+        il.uses_raw = true
+        line(ctx, 'r->ot[v0+%d] = 21; r->ov[v0+%d].uval = r->rv[%s].uval;',
+             o.offset, o.offset, varref(ctx, o.ipv, o.ipo))
+    -----------------------------------------------------------
+    elseif op == opcode.PUTENUMI2S then
+        local info = il.enumi2s_table(il.get_extra(o))
+        local tab = uint_array(info.cpos, info.bits)
+        local pos = varref(ctx, o.ipv, o.ipo)
+        line(ctx, 'if (r->v[%s].uval >= %d) ERR(5, 0, %s);',
+             pos, info.n, pos)
+        if info.is_sparse then
+            line(ctx, 'if (%s[r->v[%s].uval*2] == 0) ERR(5, 1, %s);',
+                 tab, pos, pos)
+        end
+        line(ctx, 'r->ot[v0+%d] = 18;', o.offset)
+        line(ctx, 'r->ov[v0+%d].xlen = %s[r->v[%s].uval*2];',
+             o.offset, tab, pos)
+        line(ctx, 'r->ov[v0+%d].xoff = %s[r->v[%s].uval*2+1];',
+             o.offset, tab, pos)
+    elseif op == opcode.PUTENUMS2I then
+        local info = il.enums2i_table(il.get_extra(o))
+        local aux = uint_array(info.aux_cpos, info.aux_bits)
+        local pos = varref(ctx, o.ipv, o.ipo)
+        local phf, search = info.phf, info.search
+        line(ctx, '{')
+        line(ctx, '    const char *s = (const char *)r->b1-r->v[%s].xoff;', pos)
+        line(ctx, '    uint32_t h, i;')
+        if type(info.hash_func) == 'table' then
+            line(ctx, '    (void)h;')
+            line(ctx, '    i = %s;', phf_string(info.hash_func, 's',
+                                           format('r->v[%s].xlen', pos)))
+        else
+            line(ctx, '    if (hash_str(%d, s, r->v[%s].xlen, &h) != 0) ERR(5, 0, %s);',
+                 info.hash_func, pos, pos)
+        end
+        if type(info.hash_func) == 'table' then
+            -- the string phf makes the index
+        elseif phf then
+            line(ctx, '    i = phf_hash_uint32_band_raw%d(%s, h, %d, %d, %d);',
+                 phf.bits, uint_array(phf.cpos, phf.bits), phf.seed,
+                 phf.r, phf.m)
+        else
+            line(ctx, '    i = schema_rt_search%d(%s, h, %d);', search.bits,
+                 uint_array(search.cpos, search.bits), search.n)
+        end
+        line(ctx, '    if (schema_rt_key_eq((const char *)r->b2-%s[i*3+1], s, %s[i*3], r->v[%s].xlen) != 0)',
+             aux, aux, pos)
+        line(ctx, '        ERR(5, 0, %s);', pos)
+        if info.v_max then
+            line(ctx, '    if (%s[i*3+2] > %d) ERR(5, 1, %s);',
+                 aux, info.v_max, pos)
+        end
+        line(ctx, '    r->ot[v0+%d] = 4; r->ov[v0+%d].ival = %s[i*3+2];',
+             o.offset, o.offset, aux)
+        line(ctx, '}')
+    -----------------------------------------------------------
+    elseif op == opcode.ISINT then
+        local pos = varref(ctx, o.ipv, o.ipo)
+        line(ctx, 'if (r->t[%s] != 4 || r->v[%s].uval+0x80000000 > 0xffffffff) ERR(1, %d, %s);',
+             pos, pos, op, pos)
+    elseif op == opcode.ISFLOAT or op == opcode.ISDOUBLE then
+        local pos = varref(ctx, o.ipv, o.ipo)
+        -- promote, as err_type() in runtime.lua does
+        line(ctx, 'if (r->t[%s] == 4) {', pos)
+        line(ctx, '    r->t[%s] = 7; r->v[%s].dval = r->v[%s].ival;',
+             pos, pos, pos)
+        line(ctx, '} else if (r->t[%s] != 6 && r->t[%s] != 7) ERR(1, %d, %s);',
+             pos, pos, op, pos)
+    elseif op >= opcode.ISBOOL and op <= opcode.ISNULORMAP then
+        local pos = varref(ctx, o.ipv, o.ipo)
+        line(ctx, 'if (!(%s)) ERR(1, %d, %s);',
+             format(emit_check_tab[op], pos, pos), op, pos)
+    elseif op == opcode.LENIS then
+        local pos = varref(ctx, o.ipv, o.ipo)
+        line(ctx, 'if (r->v[%s].xlen != %d) ERR(2, %d, %s);',
+             pos, o.len, o.len, pos)
+    elseif op == opcode.ISSET then
+        local name = il.get_extra(o)
+        line(ctx, 'if (%s == 0) { err->str = %d; err->len = %d; ERR(3, 0, %s); }',
+             varref(ctx, o.ripv, 0), il.cpool_add(name), #name,
+             varref(ctx, o.ipv, o.ipo))
+    elseif op == opcode.ISNOTSET then
+        local pos = varref(ctx, o.ipv, 0)
+        line(ctx, 'if (%s != 0) ERR(4, 0, %s);', pos, pos)
+    elseif op == opcode.BEGINVAR then
+        line(ctx, '%s = 0;', varref(ctx, o.ipv, 0))
+    -----------------------------------------------------------
+    elseif op == opcode.CHECKOBUF then
+        local size
+        if o.ipv == opcode.NILREG then
+            size = format('v0+%d', o.offset)
+        else
+            size = format('v0+%d+(int64_t)r->v[%s].xlen*%d', o.offset,
+                          varref(ctx, o.ipv, o.ipo), o.scale)
+        end
+        line(ctx, 'if ((size_t)(%s) > r->ot_capacity &&', size)
+        line(ctx, '    schema_rt_buf_grow(r, %s) != 0) ERR(7, 0, 0);', size)
+    elseif op == opcode.ERRVALUEV then
+        local pos = varref(ctx, o.ipv, o.ipo)
+        line(ctx, 'ERR(5, 1, %s);', pos)
+    elseif op == opcode.ERROR then
+        local str = il.get_extra(o)
+        line(ctx, 'ERR_STR(6, %d, %d);', il.cpool_add(str), #str)
+    elseif op == opcode.CHECKITEMS then
+        line(ctx, 'if (schema_rt_check_items(r, %s, %d, err) != 0) return -1;',
+             varref(ctx, o.ipv, o.ipo), o.k)
+    elseif op == opcode.PUTITEMS then
+        line(ctx, 'v0 = schema_rt_put_items(r, %s, v0+%d, %d, err);',
+             varref(ctx, o.ipv, o.ipo), o.offset, o.k)
+        line(ctx, 'if (v0 < 0) return -1;')
+    elseif op ~= opcode.ENDVAR then
+        assert(false)
+    end
+end
+
+local emit_block
+
+local function emit_nested_block(ctx, block)
+    local il   = ctx.il
+    local head = block[1]
+    local op   = head.op
+    if op == opcode.IFSET or op == opcode.IFNUL then
+        local branch1, branch2 = block[2], block[3]
+        local cond
+        if op == opcode.IFNUL then
+            cond = format('r->t[%s] %s 1', varref(ctx, head.ipv, head.ipo),
+                          branch1[1].ci == 0 and '!=' or '==')
+        else
+            cond = format('%s %s 0', varref(ctx, head.ipv, head.ipo),
+                          branch1[1].ci == 0 and '==' or '!=')
+        end
+        line(ctx, 'if (%s) {', cond)
+        emit_block(ctx, branch1)
+        if branch2 then
+            line(ctx, '} else {')
+            emit_block(ctx, branch2)
+        end
+        line(ctx, '}')
+    elseif op == opcode.INTSWITCH then
+        local pos = varref(ctx, head.ipv, head.ipo)
+        line(ctx, 'switch (r->v[%s].ival) {', pos)
+        for i = 2, #block do
+            local branch = block[i]
+            assert(branch[1].op == opcode.IBRANCH)
+            line(ctx, 'case %d: {', branch[1].ci)
+            emit_block(ctx, branch)
+            line(ctx, '    break;')
+            line(ctx, '}')
+        end
+        line(ctx, 'default:')
+        line(ctx, '    ERR(5, 0, %s);', pos)
+        line(ctx, '}')
+    elseif op == opcode.STRSWITCH then
+        -- b: the branch, guessed or found by the hash
+        local func  = il.strswitch_hash_func(block)
+        local pos   = varref(ctx, head.ipv, head.ipo)
+        local n     = #block - 1
+        local keys  = uint_array(il.strswitch_keys(block), 32)
+        local hints = format('hints%d', #il.c_protos)
+        insert(il.c_protos, format('uint32_t %s[] = { %s };', hints,
+                                   concat(il.strswitch_hints(n), ', ', 0, n)))
+        line(ctx, '{')
+        ctx.depth = ctx.depth + 1
+        line(ctx, 'const char *s = (const char *)r->b1-r->v[%s].xoff;', pos)
+        line(ctx, 'uint32_t len = r->v[%s].xlen;', pos)
+        line(ctx, 'int32_t b = guess_key(r->b2, %s, %s, s, len);', keys, hints)
+        line(ctx, 'if (b < 0) {')
+        if func ~= 0 then
+            if type(func) == 'table' then
+                line(ctx, '    switch (%s) {', phf_string(func, 's', 'len'))
+            else
+                line(ctx, '    uint32_t h;')
+                line(ctx, '    if (hash_str(%d, s, len, &h) != 0) ERR(5, 0, %s);',
+                     func, pos)
+                line(ctx, '    switch (h) {')
+            end
+            for i = 2, #block do
+                local str = il.get_extra(block[i][1])
+                line(ctx, '    case %dU: b = %d; break;',
+                     il.eval_string_hash(func, str) % 0x100000000, i - 2)
+            end
+            line(ctx, '    default: ERR(5, 0, %s);', pos)
+            line(ctx, '    }')
+            line(ctx, '    if (schema_rt_key_eq((const char *)r->b2-%s[2*b+1], s, %s[2*b], len) != 0)',
+                 keys, keys)
+            line(ctx, '        ERR(5, 0, %s);', pos)
+        else
+            line(ctx, '    b = schema_rt_strsearch(r->b2, %s, %d, s, len);',
+                 uint_array(il.strswitch_table(block), 32), n)
+            line(ctx, '    if (b < 0) ERR(5, 0, %s);', pos)
+        end
+        line(ctx, '    learn_key(%s, b);', hints)
+        line(ctx, '}')
+        line(ctx, 'switch (b) {')
+        for i = 2, #block do
+            local branch = block[i]
+            assert(branch[1].op == opcode.SBRANCH)
+            line(ctx, 'case %d: {', i - 2)
+            emit_block(ctx, branch)
+            line(ctx, '    break;')
+            line(ctx, '}')
+        end
+        line(ctx, '}')
+        ctx.depth = ctx.depth - 1
+        line(ctx, '}')
+    elseif op == opcode.OBJFOREACH then
+        local pos  = varref(ctx, head.ipv, head.ipo)
+        local iter = varref(ctx, head.ripv, 0)
+        line(ctx, '{')
+        line(ctx, '    int64_t end = %s+r->v[%s].xoff;', pos, pos)
+        line(ctx, '    for (%s = %s+1; %s < end; %s += %d) {',
+             iter, pos, iter, iter, head.step)
+        ctx.depth = ctx.depth + 1
+        emit_block(ctx, block)
+        ctx.depth = ctx.depth - 1
+        line(ctx, '    }')
+        line(ctx, '}')
+    else
+        assert(false)
+    end
+end
+
+emit_block = function(ctx, block)
+    ctx.depth = ctx.depth + 1
+    for i = 2, #block do
+        local o = block[i]
+        if type(o) == 'cdata' then
+            emit_instruction(ctx, o)
+        else
+            emit_nested_block(ctx, o)
+        end
+    end
+    ctx.depth = ctx.depth - 1
+end
+
+-- int f<name>(r, err, &v0, &param)
+local function emit_c_func(il, func, cname)
+    local head = func[1]
+    local ctx = { il = il, res = {}, vars = {}, depth = 0 }
+    emit_block(ctx, func)
+    local res = il.c_code
+    insert(il.c_protos, format(
+        'int %s(struct State *r, struct VmError *err, int64_t *pv0, int64_t *pv%d);',
+        cname, head.ipv))
+    insert(res, format(
+        'int %s(struct State *r, struct VmError *err, int64_t *pv0, int64_t *pv%d)',
+        cname, head.ipv))
+    insert(res, '{')
+    insert(res, format('    int64_t v0 = *pv0, v%d = *pv%d;', head.ipv, head.ipv))
+    local vars = {}
+    for vid in pairs(ctx.vars) do
+        if vid ~= 0 and vid ~= head.ipv then insert(vars, vid) end
+    end
+    table.sort(vars)
+    for _, vid in ipairs(vars) do
+        insert(res, format('    int64_t v%d = 0;', vid))
+    end
+    insert(res, concat(ctx.res, '\n'))
+    insert(res, format('    *pv0 = v0; *pv%d = v%d;', head.ipv, head.ipv))
+    insert(res, '    return 0;')
+    insert(res, '}')
+end
+
+local function emit_func(il, func, res, opts)
+    if not opts then
+        emit_c_func(il, func, format('f%d', func[1].name))
+        return
+    end
+    -- top-level functions are entry points of schema_native_run()
+    local entry = #il.c_entries + 1
+    local cname = format('entry%d', entry)
+    insert(il.c_entries, cname)
+    emit_c_func(il, func, cname)
+    backend_vm.emit_wrapper(il, res, opts,
+                            format('rt_native_run(r, program, %d)', entry))
+end
+
+local cc = os.getenv('CC') or 'cc'
+
+-- Build the code, return the library (an FFI namespace).
+local function c_link(il)
+    local res = { format(prelude, ffi.offsetof('struct schema_rt_State', 'rv')) }
+    for _, proto in ipairs(il.c_protos) do insert(res, proto) end
+    for _, code in ipairs(il.c_code) do insert(res, code) end
+    insert(res, [[
+__attribute__((visibility("default")))
+ptrdiff_t schema_native_run(struct State *r, int entry, struct VmError *err)
+{
+    int64_t v0 = 0, v1 = 0;
+    int rc = -1;
+    switch (entry) {]])
+    for i, cname in ipairs(il.c_entries) do
+        insert(res, format('    case %d: rc = %s(r, err, &v0, &v1); break;',
+                           i, cname))
+    end
+    insert(res, [[
+    default: err->kind = 8; err->pos = 0;
+    }
+    return rc == 0 ? v0 : -1;
+}]])
+    local src = concat(res, '\n')
+    if il.dump_c then
+        local file = io.open(il.dump_c, 'w+')
+        file:write(src)
+        file:close()
+    end
+    local path = os.tmpname()
+    local file = io.open(path .. '.c', 'w')
+    file:write(src)
+    file:close()
+    local pipe = io.popen(format(
+        '%s -O2 -std=gnu99 -fPIC -shared -fvisibility=hidden -o %s.so %s.c %s 2>&1',
+        cc, path, path, rt.C_path))
+    local output = pipe:read('*a')
+    pipe:close()
+    local ok, lib = pcall(ffi.load, path .. '.so')
+    os.remove(path .. '.c')
+    os.remove(path .. '.so')
+    os.remove(path)
+    if not ok then
+        error(format('Native code build failed: %s', output), 0)
+    end
+    return lib
+end
+
+-- Installed on top of the Lua backend (shares the constant pool and
+-- the data tables of enums).
+local function install_backend(il, opts)
+    il.c_protos  = {}
+    il.c_code    = {}
+    il.c_entries = {}
+    il.dump_c    = opts.dump_c
+
+    function il.emit_lua_func(func, res, opts)
+        return emit_func(il, func, res, opts)
+    end
+
+    function il.c_link()
+        return c_link(il)
+    end
+
+    return il
+end
+
+return {
+    install = install_backend
+}
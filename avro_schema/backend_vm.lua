@@ -0,0 +1,355 @@
+local ffi            = require('ffi')
+local ffi_new        = ffi.new
+local format         = string.format
+local insert         = table.insert
+
+require('avro_schema.runtime') -- struct schema_rt_VmInsn
+
+local opcode = ffi_new('struct schema_il_Opcode')
+
+-- Lowering IL into the bytecode of the IL interpreter (runtime/vm.c).
+--
+-- Instructions mirror IL opcodes, the layout is the same. IL variables
+-- become registers (0 - the output position, 1 - the function param)
+-- and nested blocks become jumps, using a few VM-only opcodes.
+-- Operands not fitting in a single instruction follow it in VMEXT
+-- words. Must be kept in sync with runtime/vm.c.
+
+local VMJUMP   = 0x01
+local VMLOOP   = 0x02
+local VMNEXT   = 0x03
+local VMRETURN = 0x04
+local VMEXT    = 0x05
+
+local NILREG   = opcode.NILREG
+
+local function reg(ctx, vid)
+    if vid == NILREG then return NILREG end
+    local r = ctx.regmap[vid]
+    if not r then
+        r = ctx.nregs
+        ctx.regmap[vid] = r
+        ctx.nregs = r + 1
+    end
+    return r
+end
+
+-- hidden register (not an IL variable)
+local function reg_new(ctx)
+    local r = ctx.nregs
+    ctx.nregs = r + 1
+    return r
+end
+
+-- append an instruction, return its pc
+local function emit(ctx, insn)
+    local code = ctx.code
+    insert(code, insn)
+    return #code - 1
+end
+
+local function pc_next(ctx)
+    return #ctx.code
+end
+
+local function lower_instruction(ctx, o)
+    local il = ctx.il
+    local op = o.op
+    if     op == opcode.CALLFUNC then
+        emit(ctx, { op = op, a = reg(ctx, o.ripv), k = o.k,
+                    ipv = reg(ctx, o.ipv), ipo = o.ipo })
+        -- callee pc is resolved by vm_link
+        local ext = { op = VMEXT, a = 0 }
+        emit(ctx, ext)
+        insert(ctx.calls, { ext, il.get_extra(o) })
+    elseif op == opcode.MOVE then
+        if o.ripv ~= NILREG then
+            emit(ctx, { op = op, a = reg(ctx, o.ripv),
+                        ipv = reg(ctx, o.ipv), ipo = o.ipo })
+        end
+    elseif op == opcode.SKIP or op == opcode.PSKIP then
+        emit(ctx, { op = op, a = reg(ctx, o.ripv),
+                    ipv = reg(ctx, o.ipv), ipo = o.ipo })
+    elseif op == opcode.PUTBOOLC or op == opcode.PUTINTC or
+           op == opcode.PUTINTKC or op == opcode.PUTARRAYC or
+           op == opcode.PUTMAPC then
+        emit(ctx, { op = op, a = o.offset, ci = o.ci })
+    elseif op == opcode.PUTLONGC then
+        emit(ctx, { op = op, a = o.offset, cl = o.cl })
+    elseif op == opcode.PUTFLOATC or op == opcode.PUTDOUBLEC then
+        emit(ctx, { op = op, a = o.offset, cd = o.cd })
+    elseif op == opcode.PUTNULC or op == opcode.PUTDUMMYC then
+        emit(ctx, { op = op, a = o.offset })
+    elseif op == opcode.PUTSTRC or op == opcode.PUTBINC or
+           op == opcode.PUTXC then
+        local str = il.get_extra(o)
+        emit(ctx, { op = op, a = o.offset,
+                    ipv = #str, ipo = il.cpool_add(str) })
+    elseif (op >= opcode.PUTBOOL and op <= opcode.PUTBIN2STR) or
+           op == opcode.PUTRAW then
+        if op == opcode.PUTRAW then
+            -- parser records byte ranges only when asked to
+            il.uses_raw = true
+        end
+        emit(ctx, { op = op, a = o.offset,
+                    ipv = reg(ctx, o.ipv), ipo = o.ipo })
+    elseif op == opcode.PUTENUMI2S then
+        local info = il.enumi2s_table(il.get_extra(o))
+        emit(ctx, { op = op, a = o.offset,
+                    ipv = reg(ctx, o.ipv), ipo = o.ipo })
+        emit(ctx, { op = VMEXT, a = info.cpos, k = info.bits,
+                    ipv = info.n, ipo = info.is_sparse and 1 or 0 })
+    elseif op == opcode.PUTENUMS2I then
+        local info = il.enums2i_table(il.get_extra(o))
+        local phf, search = info.phf, info.search
+        local sphf = type(info.hash_func) == 'table' and info.hash_func
+        emit(ctx, { op = op, a = o.offset,
+                    ipv = reg(ctx, o.ipv), ipo = o.ipo })
+        emit(ctx, { op = VMEXT, a = (phf or sphf) and (phf or sphf).seed or 0,
+                    k = sphf and 2 or phf and 1 or 0,
+                    ci = sphf and 0 or info.hash_func })
+        if sphf then
+            emit(ctx, { op = VMEXT, a = sphf.cpos, k = sphf.bits,
+                        ipv = sphf.r, ipo = sphf.m })
+        elseif phf then
+            emit(ctx, { op = VMEXT, a = phf.cpos, k = phf.bits,
+                        ipv = phf.r, ipo = phf.m })
+        else
+            emit(ctx, { op = VMEXT, a = search.cpos, k = search.bits,
+                        ipv = search.n, ipo = 0 })
+        end
+        emit(ctx, { op = VMEXT, a = info.aux_cpos, k = info.aux_bits,
+                    ci = info.v_max or -1 })
+    elseif (op >= opcode.ISBOOL and op <= opcode.ISNULORMAP) or
+           op == opcode.ERRVALUEV then
+        emit(ctx, { op = op, ipv = reg(ctx, o.ipv), ipo = o.ipo })
+    elseif op == opcode.LENIS then
+        emit(ctx, { op = op, a = o.len,
+                    ipv = reg(ctx, o.ipv), ipo = o.ipo })
+    elseif op == opcode.ISSET then
+        local name = il.get_extra(o)
+        emit(ctx, { op = op, a = reg(ctx, o.ripv),
+                    ipv = reg(ctx, o.ipv), ipo = o.ipo })
+        emit(ctx, { op = VMEXT, ipv = #name, ipo = il.cpool_add(name) })
+    elseif op == opcode.ISNOTSET or op == opcode.BEGINVAR then
+        emit(ctx, { op = op, ipv = reg(ctx, o.ipv), ipo = 0 })
+    elseif op == opcode.CHECKOBUF then
+        emit(ctx, { op = op, a = o.offset, k = o.scale,
+                    ipv = reg(ctx, o.ipv), ipo = o.ipo })
+    elseif op == opcode.ERROR then
+        local str = il.get_extra(o)
+        emit(ctx, { op = op, ipv = #str, ipo = il.cpool_add(str) })
+    elseif op == opcode.CHECKITEMS or op == opcode.PUTITEMS then
+        emit(ctx, { op = op, a = op == opcode.PUTITEMS and o.offset or 0,
+                    k = o.k, ipv = reg(ctx, o.ipv), ipo = o.ipo })
+    elseif op ~= opcode.ENDVAR then
+        assert(false)
+    end
+end
+
+local lower_block
+
+local function lower_branches(ctx, block, heads)
+    local jumps = {}
+    for i = 2, #block do
+        heads[i - 1].a = pc_next(ctx)
+        lower_block(ctx, block[i])
+        if i ~= #block then
+            insert(jumps, emit(ctx, { op = VMJUMP }))
+        end
+    end
+    local done = pc_next(ctx)
+    for _, pc in ipairs(jumps) do
+        ctx.code[pc + 1].a = done
+    end
+end
+
+local function lower_nested_block(ctx, block)
+    local il   = ctx.il
+    local head = block[1]
+    local op   = head.op
+    if op == opcode.IFSET or op == opcode.IFNUL then
+        local branch1, branch2 = block[2], block[3]
+        local insn = { op = op, k = branch1[1].ci ~= 0 and 1 or 0,
+                       ipv = reg(ctx, head.ipv), ipo = head.ipo }
+        emit(ctx, insn)
+        lower_block(ctx, branch1)
+        if branch2 then
+            local jump = { op = VMJUMP }
+            emit(ctx, jump)
+            insn.a = pc_next(ctx)
+            lower_block(ctx, branch2)
+            jump.a = pc_next(ctx)
+        else
+            insn.a = pc_next(ctx)
+        end
+    elseif op == opcode.INTSWITCH then
+        local heads = {}
+        emit(ctx, { op = op, k = #block - 1,
+                    ipv = reg(ctx, head.ipv), ipo = head.ipo })
+        for i = 2, #block do
+            local branch_head = block[i][1]
+            assert(branch_head.op == opcode.IBRANCH)
+            local ext = { op = VMEXT, ci = branch_head.ci }
+            emit(ctx, ext)
+            insert(heads, ext)
+        end
+        lower_branches(ctx, block, heads)
+    elseif op == opcode.STRSWITCH then
+        local heads = {}
+        local func = il.strswitch_hash_func(block)
+        -- hints live in a fields, see IlStrSwitch in vm.c
+        local hints = il.strswitch_hints(#block - 1)
+        emit(ctx, { op = op, k = #block - 1, a = hints[0],
+                    ipv = reg(ctx, head.ipv), ipo = head.ipo })
+        if type(func) == 'table' then
+            -- string phf, the seed is 0
+            assert(func.seed == 0)
+            emit(ctx, { op = VMEXT, a = func.cpos, k = func.bits,
+                        ipv = func.r, ipo = func.m })
+        elseif func ~= 0 then
+            emit(ctx, { op = VMEXT, ci = func })
+        else
+            emit(ctx, { op = VMEXT, a = il.strswitch_table(block), ci = 0 })
+        end
+        for i = 2, #block do
+            local branch_head = block[i][1]
+            assert(branch_head.op == opcode.SBRANCH)
+            local str = il.get_extra(branch_head)
+            local ext = { op = VMEXT, ipv = #str, ipo = il.cpool_add(str) }
+            emit(ctx, ext)
+            emit(ctx, { op = VMEXT, a = hints[i - 1], ci = func ~= 0 and
+                        il.eval_string_hash(func, str) or 0 })
+            insert(heads, ext)
+        end
+        lower_branches(ctx, block, heads)
+    elseif op == opcode.OBJFOREACH then
+        local iter, last = reg(ctx, head.ripv), reg_new(ctx)
+        emit(ctx, { op = op, a = iter, k = last,
+                    ipv = reg(ctx, head.ipv), ipo = head.ipo })
+        local loop = { op = VMLOOP, ipv = iter, ipo = last }
+        local looppc = emit(ctx, loop)
+        lower_block(ctx, block)
+        emit(ctx, { op = VMNEXT, a = looppc, ipv = iter, ipo = head.step })
+        loop.a = pc_next(ctx)
+    else
+        assert(false)
+    end
+end
+
+lower_block = function(ctx, block)
+    for i = 2, #block do
+        local o = block[i]
+        if type(o) == 'cdata' then
+            lower_instruction(ctx, o)
+        else
+            lower_nested_block(ctx, o)
+        end
+    end
+end
+
+local function lower_func(il, func)
+    local head = func[1]
+    local ctx = {
+        il = il,
+        code = il.vm_code,
+        calls = il.vm_calls,
+        regmap = { [0] = 0, [head.ipv] = 1 },
+        nregs = 2
+    }
+    local decl = { op = opcode.DECLFUNC, ipv = 1 }
+    local entry = emit(ctx, decl)
+    lower_block(ctx, func)
+    emit(ctx, { op = VMRETURN })
+    -- OBJFOREACH keeps a register number in k
+    assert(ctx.nregs < 0x10000, 'too many variables')
+    decl.k = ctx.nregs
+    return entry
+end
+
+local locals_tab = {
+    [0] = 'local x%d',
+    'local x%d, x%d',
+    'local x%d, x%d, x%d'
+}
+
+-- A top-level function is a Lua wrapper running the compiled code
+-- (opts are the same as in backend.lua), call yields v0 (-1 is an
+-- error, with lazy_errors).
+local function emit_wrapper(il, res, opts, call)
+    local nlocals = opts.nlocals_min or 0
+    insert(res, opts.func_decl)
+    insert(res, opts.func_locals)
+    for i = 1, nlocals, 4 do
+        insert(res, format(locals_tab[nlocals - i] or
+                           'local x%d, x%d, x%d, x%d',
+                           i, i+1, i+2, i+3))
+    end
+    insert(res, opts.conversion_init)
+    insert(res, format('v0 = %s', call))
+    if il.lazy_errors then
+        insert(res, 'if v0 < 0 then return -1 end')
+    end
+    insert(res, opts.conversion_complete)
+    insert(res, opts.func_return)
+    insert(res, 'end')
+end
+
+-- Helper functions are lowered only, CALLFUNC refers to them by name.
+local function emit_func(il, func, res, opts)
+    local entry = lower_func(il, func)
+    if not opts then
+        il.vm_funcs[func[1].name] = entry
+        return
+    end
+    emit_wrapper(il, res, opts, format('rt_vm_run(r, program, %d)', entry))
+end
+
+-- Resolve calls, return the program (cdata)
+local function vm_link(il)
+    local code = il.vm_code
+    for _, call in ipairs(il.vm_calls) do
+        call[1].a = assert(il.vm_funcs[call[2]])
+    end
+    local prog = ffi_new('struct schema_rt_VmInsn[?]', #code)
+    for i, insn in ipairs(code) do
+        local dst = prog[i - 1]
+        dst.op = insn.op
+        dst.k  = insn.k or 0
+        dst.a  = insn.a or 0
+        if insn.cl then
+            dst.cl = insn.cl
+        elseif insn.cd then
+            dst.cd = insn.cd
+        elseif insn.ci then
+            dst.ci = insn.ci
+        else
+            dst.ipv = insn.ipv or 0
+            dst.ipo = insn.ipo or 0
+        end
+    end
+    return prog
+end
+
+-- Installed on top of the Lua backend (shares the constant pool and
+-- the data tables of enums).
+local function install_backend(il)
+    il.vm_code  = {}
+    il.vm_calls = {}
+    il.vm_funcs = {}
+
+    function il.emit_lua_func(func, res, opts)
+        return emit_func(il, func, res, opts)
+    end
+
+    function il.vm_link()
+        return vm_link(il)
+    end
+
+    return il
+end
+
+return {
+    install      = install_backend,
+    emit_wrapper = emit_wrapper
+}
@@ -25,6 +25,7 @@ json.cfg{encode_use_tostring = true}
 local front      = require('avro_schema.frontend')
 local insert     = table.insert
 local find       = string.find
+local format     = string.format
 local abs        = math.abs
 
 local get_union_tag_map   = front.get_union_tag_map
@@ -258,6 +259,8 @@ end
 -----------------------------------------------------------------------
 -- basic codegen
 
+local do_append_code
+
 local function append_objforeach(il, code, ipv, ipo)
     local loop_var = il.id()
     local loop_body = { il.objforeach(loop_var, ipv, ipo) }
@@ -316,8 +319,75 @@ local function do_append_nullable_type(il, mode, code, ipv, ipo)
     return code
 end
 
+-- Arrays and maps of these (possibly nullable) items are the same
+-- in the source and in the target, hence passed through unchanged.
+-- Not FLT: a double value is narrowed; not DBL: an integer or a
+-- float32 value is promoted.
+local raw_passthrough_types = {
+    NUL = true, BOOL = true, INT = true, LONG = true,
+    BIN = true, STR  = true
+}
+
+local function is_raw_passthrough(ir)
+    if type(ir) == 'string' then
+        return raw_passthrough_types[ir] or false
+    end
+    local ir_type = ir.type
+    if ir_type == 'ARRAY' or ir_type == 'MAP' then
+        return is_raw_passthrough(ir.nested)
+    end
+    return ir_type == nil and raw_passthrough_types[ir[1]] or false
+end
+
+-- Items of an array / map, if primitive: ir2ilfuncs entry and the
+-- nullable flag. Such items are handled by a single CHECKITEMS /
+-- PUTITEMS (a loop in C) instead of an OBJFOREACH.
+local function primitive_items(ir)
+    local item, nullable = ir.nested, false
+    if type(item) == 'table' then
+        if item.type then return nil end
+        item, nullable = item[1], item.nullable
+    end
+    return ir2ilfuncs[item], nullable
+end
+
+local append_raw_check_items
+
+-- Passed through data is still validated: check the item at ipv+ipo
+-- and move ipv past it.
+local function append_raw_check(il, code, ir, ipv, ipo)
+    local ir_type = type(ir) == 'table' and ir.type
+    if ir_type ~= 'ARRAY' and ir_type ~= 'MAP' then
+        return do_append_code(il, 'cn', code, ir, ipv, ipo)
+    end
+    if ir.nullable then
+        code = do_append_nullable_type(il, 'n', code, ipv, ipo)
+    end
+    insert(code, ir_type == 'ARRAY' and il.isarray(ipv, ipo) or
+                                        il.ismap(ipv, ipo))
+    append_raw_check_items(il, code, ir, ipv, ipo)
+    insert(code, il.skip(ipv, ipv, ipo))
+end
+
+-- Check items of the array / map at ipv+ipo.
+append_raw_check_items = function(il, code, ir, ipv, ipo)
+    local items, nullable = primitive_items(ir)
+    if items then
+        insert(code, il.checkitems(ipv, ipo, items.is, nullable,
+                                   ir.type == 'MAP'))
+        return
+    end
+    local loop_var, loop_body = append_objforeach(il, code, ipv, ipo)
+    if ir.type == 'MAP' then
+        insert(loop_body, il.isstr(loop_var, 0))
+        append_raw_check(il, loop_body, ir.nested, loop_var, 1)
+    else
+        append_raw_check(il, loop_body, ir.nested, loop_var, 0)
+    end
+end
+
 -- See new_codegen() below for il:append_code() / __FUNC__ / __CALL__ info.
-local function do_append_code(il, mode, code, ir, ipv, ipo, is_flatten)
+do_append_code = function(il, mode, code, ir, ipv, ipo, is_flatten)
     if ir.nullable then
         code = do_append_nullable_type(il, mode, code, ipv, ipo)
     end
@@ -355,28 +425,56 @@ local function do_append_code(il, mode, code, ir, ipv, ipo, is_flatten)
         if find(mode, 'n') then insert(code, il.move(ipv, ipv, ipo + 1)) end
     elseif ir_type == 'ARRAY' then
         if find(mode, 'c') then insert(code, il.isarray(ipv, ipo)) end
-        if find(mode, 'x') then
+        if find(mode, 'x') and is_raw_passthrough(ir) then
+            extend(code,
+                   il.checkobuf(1),
+                   il.putraw(0, ipv, ipo),
+                   il.move(0, 0, 1))
+            append_raw_check_items(il, code, ir, ipv, ipo)
+        elseif find(mode, 'x') then
             extend(code,
                    il.checkobuf(1),
                    il.putarray(0, ipv, ipo),
                    il.move(0, 0, 1))
-            local loop_var, loop_body = append_objforeach(il, code,
-                ipv, ipo)
-            il:append_code('cxn', loop_body,
-                unwrap_nullable_record(ir.nested, is_flatten), loop_var, 0)
+            local items, nullable = primitive_items(ir)
+            if items then
+                extend(code,
+                       il.checkobuf(0, ipv, ipo, 1),
+                       il.putitems(0, ipv, ipo, items.put, nullable))
+            else
+                local loop_var, loop_body = append_objforeach(il, code,
+                    ipv, ipo)
+                il:append_code('cxn', loop_body,
+                    unwrap_nullable_record(ir.nested, is_flatten),
+                    loop_var, 0)
+            end
         end
         if find(mode, 'n') then
             insert(code, il.skip(ipv, ipv, ipo))
         end
     elseif ir_type == 'MAP' then
         if find(mode, 'c') then insert(code, il.ismap(ipv, ipo)) end
-        if find(mode, 'x') then
+        if find(mode, 'x') and is_raw_passthrough(ir) then
+            extend(code,
+                   il.checkobuf(1),
+                   il.putraw(0, ipv, ipo),
+                   il.move(0, 0, 1))
+            append_raw_check_items(il, code, ir, ipv, ipo)
+        elseif find(mode, 'x') then
             extend(code, il.checkobuf(1),
                    il.putmap(0, ipv, ipo), il.move(0, 0, 1))
-            local loop_var, loop_body = append_objforeach(il, code, ipv, ipo)
-            extend(loop_body, il.isstr(loop_var, 0), il.checkobuf(1),
-                   il.putstr(0, loop_var, 0), il.move(0, 0, 1))
-            il:append_code('cxn', loop_body, ir.nested, loop_var, 1)
+            local items, nullable = primitive_items(ir)
+            if items then
+                extend(code,
+                       il.checkobuf(0, ipv, ipo, 2),
+                       il.putitems(0, ipv, ipo, items.put, nullable, true))
+            else
+                local loop_var, loop_body = append_objforeach(il, code,
+                    ipv, ipo)
+                extend(loop_body, il.isstr(loop_var, 0), il.checkobuf(1),
+                       il.putstr(0, loop_var, 0), il.move(0, 0, 1))
+                il:append_code('cxn', loop_body, ir.nested, loop_var, 1)
+            end
         end
         if find(mode, 'n') then insert(code, il.skip(ipv, ipv, ipo)) end
     elseif ir_type == '__CALL__' then
@@ -1075,7 +1173,148 @@ local function emit_code(il, ir, service_fields, alpha_nullable_record_xflatten)
            to and abs(schema_width(to)) or 1
 end
 
+-----------------------------------------------------------------------
+-- fused transcoder plan
+
+-- See enum FuseOp in runtime/pipeline.c.
+local fuse_leaf_ops = {
+    null   = 1, boolean = 2, int    = 3, long  = 4,
+    float  = 5, double  = 6, string = 7, bytes = 8
+}
+local fuse_record_op = 9
+local fuse_width_max = 256 -- FUSE_WIDTH_MAX
+
+--
+-- A record of records and scalars has a fixed layout, hence
+-- flatten and unflatten can convert msgpack to msgpack in a single
+-- pass (schema_rt_fuse_flatten and friends). The plan is a list of
+-- nodes, {op, n, arg, name}:
+-- * the first node is the top level record;
+-- * fields of a record are in consecutive nodes, starting with arg
+--   (0-based), n is the number of fields;
+-- * a scalar field has arg set to the position in a flattened tuple.
+--
+-- Returns nil unless the schema qualifies.
+--
+local function emit_fuse_plan(schema)
+    if type(schema) ~= 'table' or not is_record(schema) or
+       schema.nullable then
+        return nil
+    end
+    local width = schema_width(schema)
+    if width <= 0 or width > fuse_width_max then
+        return nil
+    end
+    local plan, pos = { { op = fuse_record_op } }, 0
+    local function emit_fields(node, s)
+        local fields = s.fields
+        local base = #plan
+        node.n, node.arg = #fields, base
+        for i, field in ipairs(fields) do
+            if field.hidden then return false end
+            plan[base + i] = { name = field.name }
+        end
+        for i, field in ipairs(fields) do
+            local field_node, field_type = plan[base + i], field.type
+            local t = field_type
+            if type(t) == 'table' then
+                t = not field_type.nullable and field_type.type
+            end
+            if t == 'record' then
+                field_node.op = fuse_record_op
+                if not emit_fields(field_node, field_type) then
+                    return false
+                end
+            elseif fuse_leaf_ops[t] then
+                field_node.op, field_node.arg = fuse_leaf_ops[t], pos
+                pos = pos + 1
+            else
+                return false
+            end
+        end
+        return true
+    end
+    if not emit_fields(plan[1], schema) then
+        return nil
+    end
+    assert(pos == width)
+    return plan, width
+end
+
+-----------------------------------------------------------------------
+-- Avro binary plan
+
+-- See enum AvroOp in runtime/avro.c.
+local avro_ops = {
+    null   = 1,  boolean = 2,  int    = 3,  long   = 4,  float = 5,
+    double = 6,  bytes   = 7,  string = 8,  fixed  = 9,  enum  = 10,
+    array  = 11, map     = 12, record = 13, union  = 14
+}
+
+--
+-- Avro binary isn't self-describing, the decoder and the encoder
+-- (schema_rt_parse_avro, schema_rt_unparse_avro) walk the plan.
+-- The plan is a list of nodes, {op, nullable, n, arg, name, type}, the
+-- first one is the root:
+-- * array, map: arg is the item type node (0-based);
+-- * fixed: n is the size;
+-- * enum, record, union: n entries starting with arg; an entry has
+--   the name (a symbol, a field name or a branch tag), fields and
+--   branches also have the type node.
+--
+local function emit_avro_plan(schema)
+    local plan, type_nodes = {}, {}
+    local emit_type
+    emit_type = function(s)
+        if type_nodes[s] then return type_nodes[s] end
+        local t = type(s) == 'string' and s or s.type or 'union'
+        local op = avro_ops[t]
+        if not op then
+            error(format('Avro binary: %s not supported', t:upper()), 0)
+        end
+        local id, node = #plan, { op = op }
+        plan[id + 1] = node
+        if type(s) == 'table' then
+            -- named types may be recursive
+            type_nodes[s] = id
+            node.nullable = s.nullable
+        end
+        if t == 'array' then
+            node.arg = emit_type(s.items)
+        elseif t == 'map' then
+            node.arg = emit_type(s.values)
+        elseif t == 'fixed' then
+            node.n = s.size
+        elseif t == 'enum' or t == 'record' or t == 'union' then
+            local entries = t == 'enum' and s.symbols or
+                            t == 'record' and s.fields or s
+            local base = #plan
+            node.n, node.arg = #entries, base
+            for i = 1, #entries do
+                plan[base + i] = {}
+            end
+            for i, e in ipairs(entries) do
+                local entry = plan[base + i]
+                if t == 'enum' then
+                    entry.name = e
+                elseif t == 'record' then
+                    entry.name, entry.type = e.name, emit_type(e.type)
+                else
+                    entry.name = type(e) == 'string' and e or
+                                 e.name or e.type
+                    entry.type = emit_type(e)
+                end
+            end
+        end
+        return id
+    end
+    emit_type(schema)
+    return plan
+end
+
 -----------------------------------------------------------------------
 return {
-    emit_code = emit_code
+    emit_code      = emit_code,
+    emit_fuse_plan = emit_fuse_plan,
+    emit_avro_plan = emit_avro_plan
 }
@@ -1,4 +1,5 @@
 local ffi            = require('ffi')
+local bit            = require('bit')
 local json           = require('json').new()
 local msgpack        = require('msgpack')
 local json_encode    = json and json.encode
@@ -8,6 +9,7 @@ local format, rep    = string.format, string.rep
 local insert, remove = table.insert, table.remove
 local concat         = table.concat
 local max            = math.max
+local band, bor      = bit.band, bit.bor
 
 json.cfg{encode_use_tostring = true}
 
@@ -116,6 +118,17 @@ if not loaded then
 
         static const int ERROR   = 0xfe;
 
+        static const int PUTRAW      = 0xff;
+
+        // items of an array or a map of primitives in a single op,
+        // k: the item's ISxxx (CHECKITEMS) or PUTxxx (PUTITEMS) opcode
+        //    | ITEMSNULLABLE | ITEMSMAP
+        static const int CHECKITEMS  = 0xbe;
+        static const int PUTITEMS    = 0xbf; // moves $0 past the items
+
+        static const int ITEMSNULLABLE = 0x100;
+        static const int ITEMSMAP      = 0x200;
+
         static const unsigned NILREG  = 0xffffffff;
     };
 
@@ -166,7 +179,8 @@ local op2str = {
     [opcode.ISSET      ] = 'ISSET      ',   [opcode.ISNOTSET   ] = 'ISNOTSET   ',
     [opcode.BEGINVAR   ] = 'BEGINVAR   ',   [opcode.ENDVAR     ] = 'ENDVAR     ',
     [opcode.CHECKOBUF  ] = 'CHECKOBUF  ',   [opcode.ERRVALUEV  ] = 'ERRVALUEV  ',
-    [opcode.ERROR      ] = 'ERROR      ',
+    [opcode.ERROR      ] = 'ERROR      ',   [opcode.PUTRAW     ] = 'PUTRAW     ',
+    [opcode.CHECKITEMS ] = 'CHECKITEMS ',   [opcode.PUTITEMS   ] = 'PUTITEMS   ',
 }
 
 local function opcode_new(op)
@@ -216,6 +230,29 @@ local function opcode_ctor_offset_ci(op)
     end
 end
 
+-- CHECKITEMS / PUTITEMS item opcodes, by the il method name
+local items_op = {
+    isnul       = opcode.ISNUL,       isbool      = opcode.ISBOOL,
+    isint       = opcode.ISINT,       islong      = opcode.ISLONG,
+    isfloat     = opcode.ISFLOAT,     isdouble    = opcode.ISDOUBLE,
+    isstr       = opcode.ISSTR,       isbin       = opcode.ISBIN,
+    putnulc     = opcode.PUTNULC,     putbool     = opcode.PUTBOOL,
+    putint      = opcode.PUTINT,      putlong     = opcode.PUTLONG,
+    putfloat    = opcode.PUTFLOAT,    putdouble   = opcode.PUTDOUBLE,
+    putstr      = opcode.PUTSTR,      putbin      = opcode.PUTBIN,
+    putint2long = opcode.PUTINT2LONG, putint2flt  = opcode.PUTINT2FLT,
+    putint2dbl  = opcode.PUTINT2DBL,  putlong2flt = opcode.PUTLONG2FLT,
+    putlong2dbl = opcode.PUTLONG2DBL, putflt2dbl  = opcode.PUTFLT2DBL,
+    putstr2bin  = opcode.PUTSTR2BIN,  putbin2str  = opcode.PUTBIN2STR
+}
+
+local function items_kind(item, nullable, map)
+    local k = assert(items_op[item])
+    if nullable then k = bor(k, opcode.ITEMSNULLABLE) end
+    if map then k = bor(k, opcode.ITEMSMAP) end
+    return k
+end
+
 local il_methods = {
     declfunc = function(name, ipv)
         local o = opcode_new(opcode.DECLFUNC)
@@ -287,6 +324,7 @@ local il_methods = {
     putflt2dbl  = opcode_ctor_offset_ipv_ipo(opcode.PUTFLT2DBL),
     putstr2bin  = opcode_ctor_offset_ipv_ipo(opcode.PUTSTR2BIN),
     putbin2str  = opcode_ctor_offset_ipv_ipo(opcode.PUTBIN2STR),
+    putraw      = opcode_ctor_offset_ipv_ipo(opcode.PUTRAW),
     ----------------------------------------------------------------
     isbool      = opcode_ctor_ipv_ipo(opcode.ISBOOL),
     isint       = opcode_ctor_ipv_ipo(opcode.ISINT),
@@ -316,7 +354,20 @@ local il_methods = {
         o.ipo = ipo or 0; o.scale = scale or 1
         return o
     end,
-    errvaluev  = opcode_ctor_ipv_ipo(opcode.ERRVALUEV)
+    errvaluev  = opcode_ctor_ipv_ipo(opcode.ERRVALUEV),
+    ----------------------------------------------------------------
+    -- item is the name of the item's check / put method, ex: 'islong'
+    checkitems = function(ipv, ipo, item, nullable, map)
+        local o = opcode_new(opcode.CHECKITEMS)
+        o.ipv = ipv; o.ipo = ipo; o.k = items_kind(item, nullable, map)
+        return o
+    end,
+    putitems = function(offset, ipv, ipo, item, nullable, map)
+        local o = opcode_new(opcode.PUTITEMS)
+        o.offset = offset; o.ipv = ipv; o.ipo = ipo
+        o.k = items_kind(item, nullable, map)
+        return o
+    end
     ----------------------------------------------------------------
     -- callfunc, sbranch, putstrc, putbinc, putxc and isset
     -- are instance methods
@@ -351,6 +402,14 @@ local function cvis(o, extra, decode)
     return format('#%p', o)
 end
 
+-- visualize CHECKITEMS / PUTITEMS kind
+local function kvis(k)
+    local res = op2str[band(k, 0xff)]:gsub(' +$', '')
+    if band(k, opcode.ITEMSNULLABLE) ~= 0 then res = res .. '|NULLABLE' end
+    if band(k, opcode.ITEMSMAP) ~= 0 then res = res .. '|MAP' end
+    return res
+end
+
 -- visualize opcode
 local function opcode_vis(o, extra)
     local opname = op2str[o.op]
@@ -392,7 +451,8 @@ local function opcode_vis(o, extra)
         return format('%s [%s],\t%s', opname, rvis(0, o.offset), cvis(o, extra))
     elseif o.op == opcode.PUTXC then
         return format('%s [%s],\t%s', opname, rvis(0, o.offset), cvis(o, extra, msgpack_decode))
-    elseif o.op >= opcode.PUTBOOL and o.op <= opcode.PUTBIN2STR then
+    elseif o.op >= opcode.PUTBOOL and o.op <= opcode.PUTBIN2STR or
+           o.op == opcode.PUTRAW then
         return format('%s [%s],\t[%s]', opname, rvis(0, o.offset), rvis(o.ipv, o.ipo))
     elseif o.op == opcode.PUTENUMI2S or o.op == opcode.PUTENUMS2I then
         return format('%s [%s],\t[%s],\t%s', opname,
@@ -401,6 +461,10 @@ local function opcode_vis(o, extra)
         return format('%s [%s],\t%d', opname, rvis(o.ipv, o.ipo), o.len)
     elseif o.op == opcode.CHECKOBUF then
         return format('%s %s,\t[%s],\t%d', opname, rvis(0, o.offset), rvis(o.ipv, o.ipo), o.scale)
+    elseif o.op == opcode.CHECKITEMS then
+        return format('%s [%s],\t%s', opname, rvis(o.ipv, o.ipo), kvis(o.k))
+    elseif o.op == opcode.PUTITEMS then
+        return format('%s [%s],\t[%s],\t%s', opname, rvis(0, o.offset), rvis(o.ipv, o.ipo), kvis(o.k))
     else
         return format('<opcode: %d>', o.op)
     end
@@ -532,7 +596,9 @@ local function vexecute(il, scope, o, res)
     if (o.op == opcode.CALLFUNC or
         o.op >= opcode.IFNUL and o.op <= opcode.PSKIP or
         o.op >= opcode.PUTBOOL and o.op <= opcode.ISSET or
-        o.op == opcode.CHECKOBUF or o.op == opcode.ERRVALUEV) and
+        o.op == opcode.CHECKOBUF or o.op == opcode.ERRVALUEV or
+        o.op == opcode.PUTRAW or o.op == opcode.CHECKITEMS or
+        o.op == opcode.PUTITEMS) and
        o.ipv ~= opcode.NILREG then
 
         local vinfo = vlookup(scope, o.ipv)
@@ -540,7 +606,8 @@ local function vexecute(il, scope, o, res)
     end
     local fixoffset = 0
     if o.op >= opcode.PUTBOOLC and o.op <= opcode.PUTENUMS2I or
-       o.op == opcode.CHECKOBUF then
+       o.op == opcode.CHECKOBUF or o.op == opcode.PUTRAW or
+       o.op == opcode.PUTITEMS then
 
         local vinfo = vlookup(scope, 0)
         fixoffset = vinfo.inc
@@ -564,6 +631,12 @@ local function vexecute(il, scope, o, res)
         vinfo.gen = il.id()
         vinfo.inc = 0
     end
+    -- PUTITEMS moves $0 past the items (the count isn't known)
+    if o.op == opcode.PUTITEMS then
+        local new_v0info = vcreate(scope, 0)
+        new_v0info.gen = il.id()
+        new_v0info.inc = 0
+    end
     -- adjust $0 after func call
     if o.op == opcode.CALLFUNC then
         local new_v0info = vcreate(scope, 0)
@@ -1,10 +1,14 @@
+local json        = require('json')
 local digest      = require('digest')
 local front       = require('avro_schema.frontend')
 local c           = require('avro_schema.compiler')
 local il          = require('avro_schema.il')
 local backend_lua = require('avro_schema.backend')
+local backend_vm  = require('avro_schema.backend_vm')
+local backend_c   = require('avro_schema.backend_c')
 local rt          = require('avro_schema.runtime')
 local fingerprint = require('avro_schema.fingerprint')
+local ocf         = require('avro_schema.ocf')
 local utils       = require('avro_schema.utils')
 
 local format, find, sub = string.format, string.find, string.sub
@@ -15,11 +19,29 @@ local f_create_schema     = front.create_schema
 local f_validate_data     = front.validate_data
 local f_create_ir         = front.create_ir
 local c_emit_code         = c.emit_code
+local c_emit_fuse_plan    = c.emit_fuse_plan
+local c_emit_avro_plan    = c.emit_avro_plan
 local il_create           = il.il_create
 local rt_msgpack_encode   = rt.msgpack_encode
 local rt_lua_encode       = rt.lua_encode
 local rt_universal_decode = rt.universal_decode
+local rt_batch_msgpack    = rt.batch_msgpack
+local rt_batch_lua        = rt.batch_lua
+local rt_enable_raw       = rt.enable_raw
+local rt_new_state        = rt.new_state
+local rt_is_state         = rt.is_state
+local rt_fuse_load        = rt.fuse_load
+local rt_fuse_flatten     = rt.fuse_flatten
+local rt_fuse_unflatten   = rt.fuse_unflatten
+local rt_avro_load        = rt.avro_load
+local rt_avro_decoder     = rt.avro_decoder
+local rt_json_decode      = rt.json_decode
+local rt_json_encode      = rt.json_encode
+local rt_avro_encoder     = rt.avro_encoder
+local rt_error_message   = rt.error_message
 local install_lua_backend = backend_lua.install
+local install_vm_backend  = backend_vm.install
+local install_c_backend   = backend_c.install
 
 -- We give away a handle but we never expose schema data.
 -- {schema=schema, options=options}
@@ -270,6 +292,12 @@ end
 local expand_lua_template
 local function gen_lua_code(args, il, il_code, service_fields)
     install_lua_backend(il, args)
+    local engine = args.engine or 'lua'
+    if engine == 'vm' then
+        install_vm_backend(il)
+    elseif engine == 'c' then
+        install_c_backend(il, args)
+    end
     expand_lua_template = expand_lua_template or compile_template([=[
 -- v2.1
 local ffi        = require('ffi')
@@ -282,31 +310,62 @@ local lshift     = bit.lshift
 local ffi_cast   = ffi.cast
 local ffi_string = ffi.string
 local rt_C       = ffi.load(rt.C_path)
-local rt_regs          = rt.regs
 local rt_buf_grow      = rt.buf_grow
-local rt_err_type      = rt.err_type
-local rt_err_length    = rt.err_length
-local rt_err_missing   = rt.err_missing
-local rt_err_duplicate = rt.err_duplicate
-local rt_err_value     = rt.err_value
+local rt_err           = ${lazy_errors} and rt.lazy_errors or rt
+local rt_err_type      = rt_err.err_type
+local rt_err_length    = rt_err.err_length
+local rt_err_missing   = rt_err.err_missing
+local rt_err_duplicate = rt_err.err_duplicate
+local rt_err_value     = rt_err.err_value
+local rt_err_message   = rt_err.err_message
+local rt_check_items   = rt_err.check_items
+local rt_put_items     = rt_err.put_items
+local rt_vm_run        = rt_err.vm_run
+local rt_native_run    = rt_err.native_run
+local program          = ... -- bytecode or native code (engine ~= 'lua')
 local cpool      = digest.base64_decode([[
 ${cpool_data}
 ]])
+-- string switch hints (schema_rt_guess_key), initially in cpool
+local hints      = ffi.new('uint32_t[?]', ${nhints})
+ffi.copy(hints, ffi_cast('const uint8_t *', cpool) + #cpool - ${hints_cpos},
+         ${nhints} * 4)
 ${outter_protos}
 ${outter_decls}
-local function linker(decode_proc, encode_proc)
+local function linker(regs, decode_proc, encode_proc, batch_msgpack, batch_lua)
     decode_proc = decode_proc or rt.msgpack_decode
     encode_proc = encode_proc or rt.msgpack_encode
+    local protect = ${lazy_errors} and rt.lazy_pcall(regs) or pcall
 ${inner_decls}
     return {
         flatten  = function(data${extra_params})
-            return pcall(flatten, data${extra_params})
+            return protect(flatten, data${extra_params})
         end,
-        unflatten  = function(data)
-            return pcall(unflatten, data)
+        unflatten  = function(data, dest)
+            return protect(unflatten, data, dest)
         end,
         xflatten  = function(data)
-            return pcall(xflatten, data)
+            return protect(xflatten, data)
+        end,
+        flatten_batch = batch_lua and function(items, extras)
+            return batch_lua(regs, flatten, items, extras)
+        end,
+        unflatten_batch = batch_lua and function(items)
+            return batch_lua(regs, unflatten, items, nil,
+                             ${unflatten_service})
+        end,
+        xflatten_batch = batch_lua and function(items)
+            return batch_lua(regs, xflatten, items)
+        end,
+        flatten_msgpack_batch = batch_msgpack and function(items, extras)
+            return batch_msgpack(regs, flatten, items, extras)
+        end,
+        unflatten_msgpack_batch = batch_msgpack and function(items)
+            return batch_msgpack(regs, unflatten, items, nil,
+                                 ${unflatten_service})
+        end,
+        xflatten_msgpack_batch = batch_msgpack and function(items)
+            return batch_msgpack(regs, xflatten, items)
         end
     }
 end
@@ -325,7 +384,7 @@ return linker
         func_decl = format('local function flatten(data%s)', param_list(n)),
         func_locals = 'local r, v0, v1, msgpack_data',
         conversion_init = [[
-        r = rt_regs; v1 = 0; v0 = 0
+        r = regs; v1 = 0; v0 = 0; r.err.kind = 0
         msgpack_data = decode_proc(r, data)
         r.b2 = ffi_cast("const uint8_t *", cpool) + #cpool]],
         conversion_complete = concat(f_complete, '\n'),
@@ -334,14 +393,14 @@ return linker
 
     -- unflatten
     local u_complete = gen_fetch_service_fields(service_fields)
-    insert(u_complete, 'v0 = encode_proc(r, v0)')
+    insert(u_complete, 'v0 = encode_proc(r, v0, dest)')
 
     il.emit_lua_func(il_code[2], inner_decls, {
-        func_decl = 'local function unflatten(data)',
+        func_decl = 'local function unflatten(data, dest)',
         func_locals = 'local r, v0, v1, msgpack_data',
         nlocals_min = n,
         conversion_init = [[
-r = rt_regs; v0 = 0; v1 = 0
+r = regs; v0 = 0; v1 = 0; r.err.kind = 0
 msgpack_data = decode_proc(r, data)
 r.b2 = ffi_cast("const uint8_t *", cpool) + #cpool]],
         conversion_complete = concat(u_complete, '\n'),
@@ -354,7 +413,7 @@ r.b2 = ffi_cast("const uint8_t *", cpool) + #cpool]],
         func_decl = 'local function xflatten(data)',
         func_locals = 'local r, v0, v1, msgpack_data',
         conversion_init = format([[
-r = rt_regs
+r = regs; r.err.kind = 0
 msgpack_data = decode_proc(r, data)
 r.b2 = ffi_cast("const uint8_t *", cpool) + #cpool
 r.k = %d; v0 = 0; v1 = 0]], n + 1),
@@ -367,17 +426,25 @@ v0 = encode_proc(r, v0)]],
     -- helper functions (if any)
     for i = 4, #il_code do
         local func = il_code[i]
-        insert(outter_protos, format('local f%d', func[1].name))
+        if engine == 'lua' then
+            insert(outter_protos, format('local f%d', func[1].name))
+        end
         il.emit_lua_func(func, outter_decls)
     end
 
+    local hints_cpos, nhints = il.hints_get_data()
     return expand_lua_template({
+        hints_cpos = hints_cpos,
+        nhints = nhints,
         cpool_data = base64_encode(il.cpool_get_data()),
         extra_params = param_list(n),
+        unflatten_service = n == 0 and 'nil' or '{}',
+        lazy_errors = tostring(args.lazy_errors == true),
         outter_protos = outter_protos,
         outter_decls = outter_decls,
         inner_decls = inner_decls
-    })
+    }), engine == 'vm' and il.vm_link() or
+        engine == 'c' and il.c_link() or nil
 end
 
 local function validate_service_fields(sfs)
@@ -393,6 +460,15 @@ local function validate_service_fields(sfs)
     end
 end
 
+-- Avro binary plan (nil and the error if not supported).
+local function load_avro_plan(schema)
+    local ok, plan = pcall(c_emit_avro_plan, schema)
+    if not ok then
+        return nil, plan
+    end
+    return rt_avro_load(plan)
+end
+
 local get_names, get_types
 -- compile(schema)
 -- compile(schema1, schema2)
@@ -417,6 +493,11 @@ local function compile(...)
         error('service_fields: Expecting a table', 0)
     end
     validate_service_fields(service_fields)
+    local engine = args.engine
+    if engine ~= nil and engine ~= 'lua' and engine ~= 'vm' and
+       engine ~= 'c' then
+        error('engine: Expecting "lua", "vm" or "c"', 0)
+    end
     local list = {}
     local handler_schema_to
     for i = 1, n do
@@ -450,6 +531,9 @@ local function compile(...)
             file:close()
         end
         local lua_code, lua_args = gen_lua_code(args, il, il_code, service_fields)
+        if il.uses_raw then
+            rt_enable_raw()
+        end
         local dump_src = args.dump_src
         if dump_src then
             local file = io.open(dump_src, 'w+')
@@ -459,22 +543,103 @@ local function compile(...)
         local module, err     = loadstring(lua_code, '@<schema-jit>')
         if not module then error(err, 0) end
         local linker          = module(lua_args)
-        local process_msgpack = linker(rt_universal_decode, rt_msgpack_encode)
-        local process_lua     = linker(rt_universal_decode, rt_lua_encode)
-        return true, {
-            flatten           = process_lua.flatten,
-            unflatten         = process_lua.unflatten,
-            xflatten          = process_lua.xflatten,
-            flatten_msgpack   = process_msgpack.flatten,
-            unflatten_msgpack = process_msgpack.unflatten,
-            xflatten_msgpack  = process_msgpack.xflatten,
-            get_names         = function ()
-                return get_names(handler_schema_to, service_fields)
-            end,
-            get_types         = function ()
-                return get_types(handler_schema_to, service_fields)
+        -- fixed layout schemas are converted msgpack to msgpack directly
+        local fuse_plan
+        if not debug and args.fuse ~= false and #list == 1 and
+           #service_fields == 0 then
+            local plan, width = c_emit_fuse_plan(list[1])
+            fuse_plan = plan and rt_fuse_load(plan, width)
+        end
+        -- Avro binary: flatten input and unflatten output
+        local avro_from, avro_from_err = load_avro_plan(list[1])
+        local avro_to, avro_to_err = load_avro_plan(list[#list])
+        local link
+        link = function(regs)
+            -- batch routines share the code (and JIT traces) with
+            -- the _msgpack ones
+            local process_msgpack = linker(regs, rt_universal_decode,
+                                           rt_msgpack_encode,
+                                           rt_batch_msgpack, rt_batch_lua)
+            local process_lua     = linker(regs, rt_universal_decode,
+                                           rt_lua_encode)
+            local flatten_msgpack   = process_msgpack.flatten
+            local unflatten_msgpack = process_msgpack.unflatten
+            if fuse_plan then
+                flatten_msgpack   = rt_fuse_flatten(regs, fuse_plan,
+                                                    flatten_msgpack)
+                unflatten_msgpack = rt_fuse_unflatten(regs, fuse_plan,
+                                                      unflatten_msgpack)
+            end
+            local flatten_avro = function()
+                return false, avro_from_err
+            end
+            local unflatten_avro = function()
+                return false, avro_to_err
+            end
+            local flatten_avro_batch   = flatten_avro
+            local unflatten_avro_batch = unflatten_avro
+            if avro_from then
+                local process_avro = linker(regs, rt_avro_decoder(avro_from),
+                                            rt_msgpack_encode,
+                                            rt_batch_msgpack)
+                flatten_avro       = process_avro.flatten
+                flatten_avro_batch = process_avro.flatten_msgpack_batch
+            end
+            local process_json = linker(regs, rt_json_decode,
+                                        rt_msgpack_encode)
+            local process_json_out = linker(regs, rt_universal_decode,
+                                            rt_json_encode)
+            if avro_to then
+                local process_avro = linker(regs, rt_universal_decode,
+                                            rt_avro_encoder(avro_to),
+                                            rt_batch_msgpack)
+                unflatten_avro       = process_avro.unflatten
+                unflatten_avro_batch = process_avro.unflatten_msgpack_batch
             end
-        }
+            return {
+                flatten           = process_lua.flatten,
+                unflatten         = process_lua.unflatten,
+                xflatten          = process_lua.xflatten,
+                flatten_msgpack   = flatten_msgpack,
+                unflatten_msgpack = unflatten_msgpack,
+                xflatten_msgpack  = process_msgpack.xflatten,
+                flatten_avro      = flatten_avro,
+                unflatten_avro    = unflatten_avro,
+                flatten_json      = process_json.flatten,
+                xflatten_json     = process_json.xflatten,
+                unflatten_json    = process_json_out.unflatten,
+                flatten_avro_batch   = flatten_avro_batch,
+                unflatten_avro_batch = unflatten_avro_batch,
+                flatten_batch     = process_msgpack.flatten_batch,
+                unflatten_batch   = process_msgpack.unflatten_batch,
+                xflatten_batch    = process_msgpack.xflatten_batch,
+                flatten_msgpack_batch   = process_msgpack.flatten_msgpack_batch,
+                unflatten_msgpack_batch = process_msgpack.unflatten_msgpack_batch,
+                xflatten_msgpack_batch  = process_msgpack.xflatten_msgpack_batch,
+                -- lazy_errors: the message of the last failed call
+                -- (valid until the next call on the state)
+                error_message     = function ()
+                    return rt_error_message(regs)
+                end,
+                get_names         = function ()
+                    return get_names(handler_schema_to, service_fields)
+                end,
+                get_types         = function ()
+                    return get_types(handler_schema_to, service_fields)
+                end,
+                -- same methods, running on the given state (a new one
+                -- if omitted)
+                bind              = function (state)
+                    if state == nil then
+                        state = rt_new_state()
+                    elseif not rt_is_state(state) then
+                        error('Expecting a state', 0)
+                    end
+                    return link(state)
+                end
+            }
+        end
+        return true, link(rt.regs)
     end
 end
 
@@ -521,14 +686,77 @@ local function get_fingerprint(schema_h, hash, size)
                                        size, schema.options)
 end
 
+-----------------------------------------------------------------------
+-- object container files
+
+-- compile() arguments: schemas and the options, except ours
+local function compile_args(options, ours, ...)
+    local args = { ... }
+    for k, v in pairs(options) do
+        if type(k) ~= 'number' and not ours[k] then
+            args[k] = v
+        end
+    end
+    return args
+end
+
+local ocf_reader_options = { schema = true }
+local ocf_writer_options = {
+    codec = true, level = true, block_size = true, sync = true,
+    metadata = true
+}
+
+-- ok, reader = ocf_reader(source, {schema = schema, <compile options>})
+-- source is a function(n) or a file (source:read(n)); the data is
+-- converted to schema (the writer's schema if omitted)
+local function ocf_reader(source, options)
+    options = options or {}
+    local ok, reader = pcall(ocf.new_reader, source)
+    if not ok then return false, reader end
+    local raw_schema
+    ok, raw_schema = pcall(json.decode, reader.metadata['avro.schema'])
+    if not ok then return false, raw_schema end
+    local schema
+    ok, schema = create(raw_schema)
+    if not ok then return false, schema end
+    local methods
+    ok, methods = compile(compile_args(options, ocf_reader_options, schema,
+                                       options.schema))
+    if not ok then return false, methods end
+    reader.schema, reader.methods = schema, methods
+    return true, reader
+end
+
+-- ok, writer = ocf_writer(schema, sink, {codec = 'deflate',
+--                         block_size = 65536, <compile options>, ...})
+-- sink is a function(s) or a file (sink:write(s))
+local function ocf_writer(schema, sink, options)
+    options = options or {}
+    local ok, methods = compile(compile_args(options, ocf_writer_options,
+                                             schema))
+    if not ok then return false, methods end
+    local schema_json = json.encode(export(schema))
+    return pcall(ocf.new_writer, methods, schema_json, sink, options)
+end
+
 return {
-    are_compatible = are_compatible,
-    create         = create,
-    compile        = compile,
-    get_names      = get_names,
-    get_types      = get_types,
-    is             = is_schema,
-    validate       = validate,
-    export         = export,
-    fingerprint    = get_fingerprint,
+    are_compatible   = are_compatible,
+    create           = create,
+    compile          = compile,
+    get_names        = get_names,
+    get_types        = get_types,
+    is               = is_schema,
+    validate         = validate,
+    export           = export,
+    fingerprint      = get_fingerprint,
+    msgpack_stream   = rt.msgpack_stream,
+    buffer_policy    = rt.buf_policy,
+    buffer_stats     = rt.buf_stats,
+    new_state        = rt.new_state,
+    ocf_reader       = ocf_reader,
+    ocf_writer       = ocf_writer,
+    compile_stats    = backend_lua.compile_stats,
+    hash_cache_dump  = backend_lua.hash_cache_dump,
+    hash_cache_load  = backend_lua.hash_cache_load,
+    hash_cache_clear = backend_lua.hash_cache_clear,
 }
@@ -0,0 +1,356 @@
+-- Avro object container files: a header (magic, metadata, sync marker)
+-- and blocks of records, optionally compressed. Blocks are read and
+-- written one at a time, hence the memory use is bounded by the block
+-- size regardless of the file size.
+local ffi        = require('ffi')
+local digest     = require('digest')
+local msgpacklib = require('msgpack')
+local rt         = require('avro_schema.runtime')
+
+local format, sub, byte, char = string.format, string.sub, string.byte,
+                                string.char
+local insert, concat = table.insert, table.concat
+local max, floor = math.max, math.floor
+
+local ffi_cast, ffi_string = ffi.cast, ffi.string
+local rt_avro_cursor = rt.avro_cursor
+local rt_ocf_codec = rt.ocf_codec
+local msgpacklib_decode = msgpacklib.decode
+
+local MAGIC      = 'Obj\1'
+local SYNC_SIZE  = 16
+local CHUNK_SIZE = 65536
+
+local codecs = { null = true, deflate = true }
+
+-----------------------------------------------------------------------
+-- Avro long (zigzag varint); counts and sizes only, i.e. below 2^53
+
+local function encode_long(v)
+    local u = v >= 0 and 2 * v or -2 * v - 1
+    local res = {}
+    while u > 127 do
+        local b = u % 128
+        insert(res, char(b + 128))
+        u = (u - b) / 128
+    end
+    insert(res, char(u))
+    return concat(res)
+end
+
+local function encode_bytes(s)
+    return encode_long(#s) .. s
+end
+
+-----------------------------------------------------------------------
+-- reader
+
+local reader_methods = {}
+local reader_mt = { __index = reader_methods }
+
+-- Buffer at least n bytes; false if the input ends earlier.
+local function fill(reader, n)
+    local buf, pos = reader.buf, reader.pos
+    local avail = #buf - pos + 1
+    if avail >= n then return true end
+    local chunks = { sub(buf, pos) }
+    while avail < n do
+        local chunk, err = reader.input(max(n - avail, CHUNK_SIZE))
+        if chunk == nil and err ~= nil then
+            error(tostring(err), 0)
+        end
+        if chunk == nil or chunk == '' then break end
+        insert(chunks, chunk)
+        avail = avail + #chunk
+    end
+    reader.buf, reader.pos = concat(chunks), 1
+    return avail >= n
+end
+
+local function read_long(reader)
+    fill(reader, 10)
+    local buf, pos = reader.buf, reader.pos
+    local u, scale = 0, 1
+    while true do
+        local b = byte(buf, pos)
+        if b == nil then
+            error('Truncated data', 0)
+        end
+        pos = pos + 1
+        u = u + (b % 128) * scale
+        if b < 128 then break end
+        scale = scale * 128
+        if scale > 2^56 then
+            error('Invalid data', 0)
+        end
+    end
+    reader.pos = pos
+    return u % 2 == 0 and u / 2 or -(u + 1) / 2
+end
+
+local function read_bytes(reader, n)
+    if n < 0 then
+        error('Invalid data', 0)
+    end
+    if not fill(reader, n) then
+        error('Truncated data', 0)
+    end
+    local pos = reader.pos
+    reader.pos = pos + n
+    return sub(reader.buf, pos, pos + n - 1)
+end
+
+local function read_header(reader)
+    if not fill(reader, #MAGIC) or read_bytes(reader, #MAGIC) ~= MAGIC then
+        error('Not an Avro object container file', 0)
+    end
+    local metadata = {}
+    while true do
+        local count = read_long(reader)
+        if count == 0 then break end
+        if count < 0 then
+            count = -count
+            read_long(reader) -- block size
+        end
+        for _ = 1, count do
+            local key = read_bytes(reader, read_long(reader))
+            metadata[key] = read_bytes(reader, read_long(reader))
+        end
+    end
+    reader.sync = read_bytes(reader, SYNC_SIZE)
+    local codec = metadata['avro.codec'] or 'null'
+    if not codecs[codec] then
+        error(format('Unsupported codec: %s', codec), 0)
+    end
+    if codec == 'deflate' then
+        reader.codec = rt_ocf_codec(false)
+    end
+    if not metadata['avro.schema'] then
+        error('Schema missing', 0)
+    end
+    reader.metadata = metadata
+end
+
+-- Records count and the data of the next block, nil at the end.
+local function read_block(reader)
+    if not fill(reader, 1) then return nil end
+    local count = read_long(reader)
+    local size = read_long(reader)
+    if count < 0 or size < 0 then
+        error('Invalid data', 0)
+    end
+    local data = read_bytes(reader, size)
+    if read_bytes(reader, SYNC_SIZE) ~= reader.sync then
+        error('Sync marker mismatch', 0)
+    end
+    -- the consumed data is dropped on the next fill
+    return count, data
+end
+
+-- ok, data, offsets, errors (as with flatten_msgpack_batch);
+-- data is nil at the end of the file
+function reader_methods.read_msgpack(reader)
+    local ok, count, block = pcall(read_block, reader)
+    if not ok then return false, count end
+    if not count then return true, nil end
+    local data, size = block, #block
+    if reader.codec then
+        data, size = reader.codec:run(block)
+        if not data then return false, size end
+    end
+    -- every item is the cursor, records are back to back
+    local cursor, items = rt_avro_cursor(data, size), reader.items
+    for i = count + 1, reader.nitems do
+        items[i] = nil
+    end
+    for i = 1, count do
+        items[i] = cursor
+    end
+    reader.nitems = count
+    reader.block = block -- keep alive
+    local res, offsets, errors
+    ok, res, offsets, errors = reader.methods.flatten_avro_batch(items)
+    reader.block = nil
+    if not ok then return false, res end
+    if cursor.failed ~= 0 or cursor.pos ~= size then
+        -- record boundaries are lost, so is the block
+        for i = 1, count do
+            if errors[i] then return false, errors[i] end
+        end
+        return false, 'Invalid data'
+    end
+    return true, res, offsets, errors
+end
+
+-- ok, tuples, errors (as with flatten_batch);
+-- tuples is nil at the end of the file
+function reader_methods.read(reader)
+    local ok, data, offsets, errors = reader:read_msgpack()
+    if not ok or data == nil then return ok, data end
+    local tuples, buf = {}, ffi_cast('const char *', data)
+    for i = 1, #offsets - 1 do
+        if not errors[i] then
+            tuples[i] = msgpacklib_decode(buf + offsets[i],
+                                          offsets[i + 1] - offsets[i])
+        end
+    end
+    return true, tuples, errors
+end
+
+-- Read the header; methods are attached later (see init.lua), once
+-- the writer's schema is known.
+local function new_reader(source)
+    local input
+    if type(source) == 'function' then
+        input = source
+    elseif source ~= nil and type(source.read) == 'function' then
+        input = function(n) return source:read(n) end
+    else
+        error('Expecting a function or a file', 0)
+    end
+    local reader = setmetatable({
+        input = input, buf = '', pos = 1, items = {}, nitems = 0
+    }, reader_mt)
+    read_header(reader)
+    return reader
+end
+
+-----------------------------------------------------------------------
+-- writer
+
+local writer_methods = {}
+local writer_mt = { __index = writer_methods }
+
+local function emit(writer, s)
+    local res, err = writer.output(s)
+    if res == false or (res == nil and err ~= nil) then
+        error(tostring(err or 'Write failed'), 0)
+    end
+end
+
+local function flush_block(writer)
+    if writer.count == 0 then return end
+    local data = concat(writer.pending)
+    if writer.codec then
+        local buf, size = writer.codec:run(data)
+        if not buf then
+            error(size, 0)
+        end
+        data = ffi_string(buf, size)
+    end
+    emit(writer, concat({
+        encode_long(writer.count), encode_long(#data), data, writer.sync
+    }))
+    writer.pending, writer.size, writer.count = {}, 0, 0
+end
+
+-- Append the records of a batch, a block is written once it reaches
+-- block_size.
+local function append(writer, data, offsets, errors)
+    local start = 0
+    for i = 1, #offsets - 1 do
+        if not errors[i] then
+            local finish = offsets[i + 1]
+            writer.count = writer.count + 1
+            if writer.size + finish - start >= writer.block_size then
+                insert(writer.pending, sub(data, start + 1, finish))
+                flush_block(writer)
+                start = finish
+            end
+        end
+    end
+    if start < #data then
+        insert(writer.pending, sub(data, start + 1))
+        writer.size = writer.size + #data - start
+    end
+end
+
+-- ok, errors (as with unflatten_batch)
+function writer_methods.write(writer, tuples)
+    if writer.closed then
+        return false, 'Writer closed'
+    end
+    local ok, data, offsets, errors =
+        writer.methods.unflatten_avro_batch(tuples)
+    if not ok then return false, data end
+    local err
+    ok, err = pcall(append, writer, data, offsets, errors)
+    if not ok then return false, err end
+    return true, errors
+end
+
+-- Write the pending records as a block.
+function writer_methods.flush(writer)
+    if writer.closed then
+        return false, 'Writer closed'
+    end
+    local ok, err = pcall(flush_block, writer)
+    if not ok then return false, err end
+    return true
+end
+
+-- Flush; the sink is left open.
+function writer_methods.close(writer)
+    local ok, err = writer:flush()
+    writer.closed = true
+    return ok, err
+end
+
+-- options: codec, level, block_size, sync, metadata
+local function new_writer(methods, schema_json, sink, options)
+    local output
+    if type(sink) == 'function' then
+        output = sink
+    elseif sink ~= nil and type(sink.write) == 'function' then
+        output = function(s) return sink:write(s) end
+    else
+        error('Expecting a function or a file', 0)
+    end
+    local codec = options.codec or 'deflate'
+    if not codecs[codec] then
+        error(format('codec: Unsupported codec: %s', codec), 0)
+    end
+    local level = options.level
+    if level ~= nil and (type(level) ~= 'number' or level < -1 or
+                         level > 9) then
+        error('level: Expecting a number between -1 and 9', 0)
+    end
+    local block_size = options.block_size or CHUNK_SIZE
+    if type(block_size) ~= 'number' or block_size < 1 then
+        error('block_size: Expecting a positive number', 0)
+    end
+    local sync = options.sync or digest.urandom(SYNC_SIZE)
+    if type(sync) ~= 'string' or #sync ~= SYNC_SIZE then
+        error(format('sync: Expecting a string of %d bytes', SYNC_SIZE), 0)
+    end
+    local header = { MAGIC }
+    local metadata = { 'avro.schema', schema_json, 'avro.codec', codec }
+    for k, v in pairs(options.metadata or {}) do
+        if type(k) ~= 'string' or type(v) ~= 'string' then
+            error('metadata: Expecting strings', 0)
+        end
+        if sub(k, 1, 5) == 'avro.' then
+            error(format('metadata: Reserved key: %s', k), 0)
+        end
+        insert(metadata, k)
+        insert(metadata, v)
+    end
+    insert(header, encode_long(#metadata / 2))
+    for _, s in ipairs(metadata) do
+        insert(header, encode_bytes(s))
+    end
+    insert(header, encode_long(0))
+    insert(header, sync)
+    local writer = setmetatable({
+        output = output, methods = methods, sync = sync,
+        block_size = floor(block_size), pending = {}, size = 0, count = 0,
+        codec = codec == 'deflate' and rt_ocf_codec(true, level)
+    }, writer_mt)
+    emit(writer, concat(header))
+    return writer
+end
+
+return {
+    new_reader = new_reader,
+    new_writer = new_writer
+}
@@ -12,8 +12,8 @@ local ffi_new = ffi.new
 local msgpacklib_encode = msgpacklib and msgpacklib.encode
 local msgpacklib_decode = msgpacklib and msgpacklib.decode
 
-local loaded, regs = pcall(ffi_new, 'struct schema_rt_State')
-if not loaded then
+local regs
+if not pcall(ffi.typeof, 'struct schema_rt_State') then
     -- pipeline -----------------------------------------------------------
     ffi.cdef[[
     struct schema_rt_Value {
@@ -29,6 +29,22 @@ if not loaded then
         };
     };
 
+    struct schema_rt_BufStats {
+        size_t                    used;
+        size_t                    peak;
+        uint32_t                  grows;
+        uint32_t                  shrinks;
+        uint32_t                  idle;
+    };
+
+    struct schema_rt_VmError {
+        int32_t                   kind;
+        int32_t                   arg;
+        uint32_t                  str;
+        uint32_t                  len;
+        int64_t                   pos;
+    };
+
     struct schema_rt_State {
         size_t                    t_capacity;
         size_t                    ot_capacity;
@@ -46,6 +62,21 @@ if not loaded then
         uint8_t                  *ot;
         struct schema_rt_Value   *ov;
         int32_t                   k;
+        int32_t                   raw;
+        size_t                    rv_capacity;
+        struct schema_rt_Value   *rv;
+        struct schema_rt_BufStats stats[6];
+        int32_t                   batch_mode;
+        struct {
+            uint8_t              *buf;
+            size_t                size;
+            size_t                capacity;
+        }                         batch;
+        size_t                    vm_capacity;
+        int64_t                  *vm_stack;
+        size_t                    xbuf_capacity;
+        uint8_t                  *xbuf;
+        struct schema_rt_VmError  err;
     };
 
     int
@@ -53,10 +84,19 @@ if not loaded then
                   const uint8_t          *msgpack_in,
                   size_t                  msgpack_size);
 
+    int
+    parse_json(struct schema_rt_State *state,
+               const uint8_t          *json_in,
+               size_t                  json_size);
+
     int
     unparse_msgpack(struct schema_rt_State *state,
                     size_t                  nitems);
 
+    int
+    unparse_json(struct schema_rt_State *state,
+                 size_t                  nitems);
+
     int
     schema_rt_buf_grow(struct schema_rt_State *state,
                        size_t                  min_capacity);
@@ -67,8 +107,198 @@ if not loaded then
     void schema_rt_xflatten_done(struct schema_rt_State *state,
                                  size_t len);
 
+    int schema_rt_set_simd(int level);
+
+    int schema_rt_get_simd(void);
+
+    size_t schema_rt_set_unparse_exact_min(size_t n);
+
+    void schema_rt_buf_policy(size_t high_water, size_t baseline,
+                              uint32_t decay);
+
+    size_t schema_rt_buf_size(const struct schema_rt_State *state, int buf);
+
+    void schema_rt_state_destroy(struct schema_rt_State *state);
+
+    struct schema_rt_ParseCtx {
+        size_t                    nitems;
+        size_t                    depth;
+        uint32_t                  todo;
+        uint32_t                  patch;
+        const uint8_t            *mi;
+    };
+
+    struct schema_rt_Stream {
+        struct schema_rt_State   *state;
+        uint8_t                  *buf;
+        size_t                    size;
+        size_t                    capacity;
+        size_t                    pos;
+        struct schema_rt_ParseCtx ctx;
+        int                       status;
+    };
+
+    int
+    schema_rt_stream_init(struct schema_rt_Stream *s);
+
+    int
+    schema_rt_stream_feed(struct schema_rt_Stream *s,
+                          const uint8_t           *chunk,
+                          size_t                   len);
+
+    void
+    schema_rt_stream_reset(struct schema_rt_Stream *s);
+
+    void
+    schema_rt_stream_destroy(struct schema_rt_Stream *s);
+
+    int
+    schema_rt_batch_append(struct schema_rt_State *state,
+                           size_t                  nitems);
+
 ]]
 
+    -- vm -----------------------------------------------------------------
+    ffi.cdef[[
+    struct schema_rt_VmInsn {
+        uint16_t                  op;
+        uint16_t                  k;
+        uint32_t                  a;
+        union {
+            struct {
+                uint32_t          ipv;
+                int32_t           ipo;
+            };
+            int32_t               ci;
+            int64_t               cl;
+            double                cd;
+        };
+    };
+
+    ptrdiff_t
+    schema_rt_vm_run(struct schema_rt_State         *state,
+                     const struct schema_rt_VmInsn  *code,
+                     uint32_t                        entry,
+                     struct schema_rt_VmError       *err);
+
+    int
+    schema_rt_check_items(struct schema_rt_State        *state,
+                          int64_t                        pos,
+                          uint32_t                       kind,
+                          struct schema_rt_VmError      *err);
+
+    int64_t
+    schema_rt_put_items(struct schema_rt_State          *state,
+                        int64_t                          pos,
+                        int64_t                          opos,
+                        uint32_t                         kind,
+                        struct schema_rt_VmError        *err);
+
+    /* native code (backend_c.lua), each object has its own */
+    ptrdiff_t
+    schema_native_run(struct schema_rt_State        *state,
+                      int                            entry,
+                      struct schema_rt_VmError      *err);
+    ]]
+
+    -- fused transcoder ---------------------------------------------------
+    ffi.cdef[[
+    struct schema_rt_FuseNode {
+        uint16_t                  op;
+        uint16_t                  n;
+        uint32_t                  arg;
+        uint32_t                  key;
+        uint32_t                  klen;
+    };
+
+    struct schema_rt_FusePlan {
+        const struct schema_rt_FuseNode *node;
+        const uint8_t            *bank;
+        uint32_t                  width;
+        uint32_t                  keys;
+    };
+
+    int
+    schema_rt_fuse_flatten(struct schema_rt_State          *state,
+                           const struct schema_rt_FusePlan *plan,
+                           const uint8_t                   *msgpack_in,
+                           size_t                           msgpack_size);
+
+    int
+    schema_rt_fuse_unflatten(struct schema_rt_State          *state,
+                             const struct schema_rt_FusePlan *plan,
+                             const uint8_t                   *msgpack_in,
+                             size_t                           msgpack_size);
+    ]]
+
+    -- Avro binary --------------------------------------------------------
+    ffi.cdef[[
+    struct schema_rt_AvroNode {
+        uint16_t                  op;
+        uint16_t                  nullable;
+        uint32_t                  n;
+        uint32_t                  arg;
+        uint32_t                  key;
+        uint32_t                  klen;
+        uint32_t                  type;
+    };
+
+    struct schema_rt_AvroPlan {
+        const struct schema_rt_AvroNode *node;
+        const uint8_t            *bank;
+    };
+
+    int
+    schema_rt_parse_avro(struct schema_rt_State          *state,
+                         const struct schema_rt_AvroPlan *plan,
+                         const uint8_t                   *avro_in,
+                         size_t                           avro_size);
+
+    int
+    schema_rt_unparse_avro(struct schema_rt_State          *state,
+                           const struct schema_rt_AvroPlan *plan,
+                           size_t                           nitems);
+
+    struct schema_rt_AvroCursor {
+        const uint8_t            *data;
+        size_t                    size;
+        size_t                    pos;
+        int                       failed;
+    };
+
+    int
+    schema_rt_parse_avro_next(struct schema_rt_State          *state,
+                              const struct schema_rt_AvroPlan *plan,
+                              struct schema_rt_AvroCursor     *cursor);
+
+    int
+    schema_rt_batch_append_avro(struct schema_rt_State          *state,
+                                const struct schema_rt_AvroPlan *plan,
+                                size_t                           nitems);
+    ]]
+
+    -- object container files ---------------------------------------------
+    ffi.cdef[[
+    struct schema_rt_OcfCodec {
+        void                     *zs;
+        int                       deflate;
+        uint8_t                  *buf;
+        size_t                    size;
+        size_t                    capacity;
+    };
+
+    int
+    schema_rt_ocf_init(struct schema_rt_OcfCodec *codec,
+                       int compress, int level);
+
+    void
+    schema_rt_ocf_destroy(struct schema_rt_OcfCodec *codec);
+
+    int
+    schema_rt_ocf_run(struct schema_rt_OcfCodec *codec,
+                      const uint8_t *in, size_t size);
+    ]]
+
     -- hash ---------------------------------------------------------------
     ffi.cdef[[
     int32_t
@@ -80,6 +310,9 @@ if not loaded then
 
     int32_t
     eval_fnv1a_func(int32_t seed, const unsigned char *str, size_t len);
+
+    int32_t
+    eval_crc32c_func(int32_t seed, const unsigned char *str, size_t len);
     ]]
 
     -- misc ---------------------------------------------------------------
@@ -95,6 +328,17 @@ if not loaded then
 
     int32_t
     schema_rt_search32(const void *tab, int32_t k, size_t n);
+
+    int32_t
+    schema_rt_strsearch(const void *b2, const void *tab, uint32_t n,
+                        const char *str, size_t len);
+
+    int32_t
+    schema_rt_guess_key(const void *b2, const void *keys, uint32_t *hints,
+                        const char *str, size_t len);
+
+    void
+    schema_rt_learn_key(uint32_t *hints, uint32_t b);
     ]]
 
     -- phf ----------------------------------------------------------------
@@ -136,15 +380,41 @@ if not loaded then
 
     int32_t
     phf_hash_uint32_band_raw32(const void *g, int32_t k, int32_t seed, size_t r, size_t m);
+
+    struct schema_rt_phf_string {
+        const void               *p;
+        size_t                    n;
+    };
+
+    int
+    phf_init_string(struct schema_rt_phf *phf,
+                    const struct schema_rt_phf_string *k,
+                    size_t n,
+                    size_t lambda,
+                    size_t alpha,
+                    int32_t seed,
+                    bool nodiv);
+
+    int32_t
+    phf_hash_string_band_raw8(const void *g, const void *p, size_t n, int32_t seed, size_t r, size_t m);
+
+    int32_t
+    phf_hash_string_band_raw16(const void *g, const void *p, size_t n, int32_t seed, size_t r, size_t m);
+
+    int32_t
+    phf_hash_string_band_raw32(const void *g, const void *p, size_t n, int32_t seed, size_t r, size_t m);
     ]]
 
-    regs = ffi_new('struct schema_rt_State')
 end
 
 local rt_C_path = package.search('avro_schema_rt_c') or
         package.searchpath('avro_schema_rt_c', package.cpath) or
         error('Failed to load avro_schema_rt_c.so, check LUA_CPATH.')
 local rt_C = ffi.load(rt_C_path)
+-- Lua C API part of the library (table.c)
+local rt_lua = package.loadlib(rt_C_path, 'luaopen_avro_schema_rt_c')()
+local rt_parse_table = rt_lua.parse_table
+local rt_unparse_table = rt_lua.unparse_table
 
 local function buf_grow(r, min_capacity)
     if rt_C.schema_rt_buf_grow(r, min_capacity) ~= 0 then
@@ -152,8 +422,88 @@ local function buf_grow(r, min_capacity)
     end
 end
 
--- Buf has space for at least 128 items.
-buf_grow(regs, 128)
+-- Pick parse_msgpack / unparse_msgpack code path: 0 - scalar,
+-- 1 - SSE4.2, 2 - AVX2, nil - the best one supported by CPU.
+-- Returns the effective level.
+local function set_simd(level)
+    return rt_C.schema_rt_set_simd(level or -1)
+end
+
+-- Encode outputs of at least n items in exact-size mode: compute the
+-- output size first, then encode with no buffer checks (nil - never).
+-- Returns the previous value.
+local function set_unparse_exact_min(n)
+    local prev = rt_C.schema_rt_set_unparse_exact_min(n or -1)
+    return prev ~= -1ULL and tonumber(prev) or nil
+end
+
+-- Buffers larger than high_water bytes, or larger than baseline bytes
+-- for decay conversions in a row, shrink back to the baseline.
+-- No opts - keep the memory (the default).
+local function buf_policy(opts)
+    opts = opts or {}
+    rt_C.schema_rt_buf_policy(opts.high_water or -1, opts.baseline or 0,
+                              opts.decay or 0)
+end
+
+local buf_names = {
+    [0] = 'tv', [1] = 'ot', [2] = 'res', [3] = 'xbuf', [4] = 'batch',
+    [5] = 'vm'
+}
+
+-- Capacity and peak usage (bytes), growth and shrink counts per buffer.
+local function buf_stats(r)
+    r = r or regs
+    local res = {}
+    for i = 0, #buf_names do
+        local stats = r.stats[i]
+        res[buf_names[i]] = {
+            capacity = tonumber(rt_C.schema_rt_buf_size(r, i)),
+            peak     = tonumber(stats.peak),
+            grows    = stats.grows,
+            shrinks  = stats.shrinks
+        }
+    end
+    return res
+end
+
+-- All states, raw is enabled in each one.
+local states = setmetatable({}, { __mode = 'k' })
+local raw_enabled = 0
+
+-- Make the parser record byte ranges of arrays and maps (needed by
+-- the code passing them through unchanged). Once enabled, stays on.
+local function enable_raw()
+    raw_enabled = 1
+    for r in pairs(states) do
+        r.raw = 1
+    end
+end
+
+-- Not rt_C.schema_rt_state_destroy directly: the finalizer keeps
+-- the library loaded (a state may outlive the module if reloaded).
+local function state_destroy(r)
+    rt_C.schema_rt_state_destroy(r)
+end
+
+-- A state holds the buffers of a conversion in progress. Conversions
+-- with distinct states don't interfere (a state per fiber or a state
+-- per thread), the buffers are released when the state is collected.
+local function new_state()
+    local r = ffi.gc(ffi_new('struct schema_rt_State'), state_destroy)
+    r.raw = raw_enabled
+    -- Buf has space for at least 128 items.
+    buf_grow(r, 128)
+    states[r] = true
+    return r
+end
+
+local function is_state(r)
+    return ffi.istype('struct schema_rt_State', r)
+end
+
+-- The default state, shared by methods not bound to a state.
+regs = new_state()
 
 local function msgpack_decode(r, s)
     if rt_C.parse_msgpack(r, s, #s) ~= 0 then
@@ -162,15 +512,111 @@ local function msgpack_decode(r, s)
     return s
 end
 
+-- JSON text straight to t/v, no Lua object in between
+local function json_decode(r, s)
+    if type(s) ~= 'string' then
+        error('Expecting a string', 0)
+    end
+    if rt_C.parse_json(r, s, #s) ~= 0 then
+        error(ffi_string(r.res, r.res_size), 0)
+    end
+    return s
+end
+
 local function msgpack_encode(r, n)
+    if r.batch_mode ~= 0 then
+        -- results of all items in a batch are collected in r.batch
+        if rt_C.schema_rt_batch_append(r, n) ~= 0 then
+            error(ffi_string(r.res, r.res_size), 0)
+        end
+        return
+    end
     if rt_C.unparse_msgpack(r, n) ~= 0 then
         error(ffi.string(r.res, r.res_size), 0)
     end
     return ffi_string(r.res, r.res_size)
 end
 
+-- JSON text straight from ot/ov, no Lua object in between
+local function json_encode(r, n)
+    if rt_C.unparse_json(r, n) ~= 0 then
+        error(ffi_string(r.res, r.res_size), 0)
+    end
+    return ffi_string(r.res, r.res_size)
+end
+
+--
+-- msgpack_stream - resumable parser, the document is fed in chunks
+--
+
+local stream_methods = {}
+local stream_mt = { __index = stream_methods }
+
+-- Returns true once the document is complete, false if more data is
+-- needed, nil and the error message on failure.
+function stream_methods.feed(stream, chunk)
+    chunk = chunk or ''
+    local s = stream.s
+    stream.adopted = false
+    if s.status ~= 0 or s.ctx.nitems == 0 then
+        -- a new document starts, sync it with the states
+        s.state.raw = raw_enabled
+    end
+    local rc = rt_C.schema_rt_stream_feed(s, chunk, #chunk)
+    if rc < 0 then
+        return nil, ffi_string(s.state.res, s.state.res_size)
+    end
+    return rc == 0
+end
+
+-- Discard the document and the buffered data.
+function stream_methods.reset(stream)
+    stream.adopted = false
+    rt_C.schema_rt_stream_reset(stream.s)
+end
+
+local function msgpack_stream()
+    local s = ffi_new('struct schema_rt_Stream')
+    if rt_C.schema_rt_stream_init(s) ~= 0 then
+        error('Out of memory', 0)
+    end
+    ffi.gc(s, rt_C.schema_rt_stream_destroy)
+    return setmetatable({ s = s, adopted = false }, stream_mt)
+end
+
+-- Hand the parsed document over to r (swap t/v buffers, no copying).
+local function stream_adopt(r, stream)
+    local s = stream.s
+    if s.status ~= 1 or stream.adopted then
+        error('Incomplete data', 0)
+    end
+    local st = s.state
+    if st.raw < r.raw then
+        -- raw was enabled in the middle of the document
+        error('Incomplete data: the document predates the schema', 0)
+    end
+    r.t, st.t = st.t, r.t
+    r.v, st.v = st.v, r.v
+    r.t_capacity, st.t_capacity = st.t_capacity, r.t_capacity
+    r.rv, st.rv = st.rv, r.rv
+    r.rv_capacity, st.rv_capacity = st.rv_capacity, r.rv_capacity
+    r.b1 = st.b1
+    stream.adopted = true
+end
+
 local function universal_decode(r, s)
     if type(s) ~= 'string' then
+        if getmetatable(s) == stream_mt then
+            stream_adopt(r, s)
+            return s
+        end
+        -- walk the object in C, unless it has anything the walker
+        -- doesn't handle; the result is the same either way
+        local ok, err = rt_parse_table(r, s, msgpacklib.NULL)
+        if ok then return s end
+        if err ~= nil then
+            error(err, 0)
+        end
         s = msgpacklib_encode(s)
     end
     if rt_C.parse_msgpack(r, s, #s) ~= 0 then
@@ -179,11 +625,256 @@ local function universal_decode(r, s)
     return s
 end
 
-local function lua_encode(r, n)
+--
+-- batch conversions
+--
+
+
+-- Convert items starting with i, offsets[i + 1] is the end
+-- of i-th result; runs in a protected call.
+local function batch_run(r, proc, items, extras, offsets, errors, i,
+                         service)
+    local batch, err = r.batch, r.err
+    for i = i, #items do
+        if service then
+            service[i] = { select(2, proc(items[i])) }
+        elseif extras then
+            proc(items[i], unpack(extras[i]))
+        else
+            proc(items[i])
+        end
+        -- lazy_errors: failed, the error code is recorded
+        if err.kind ~= 0 then
+            errors[i] = err.kind
+            if service then service[i] = nil end
+        end
+        offsets[i + 1] = tonumber(batch.size)
+    end
+end
+
+-- Returns offsets (n + 1 entries, 0-based) into the batch buffer and
+-- errors (sparse, indexed by item number). A failed item is recorded
+-- and the conversion resumes with the next item.
+local function batch_convert(r, proc, items, extras, service)
+    if type(items) ~= 'table' then
+        error('Expecting a table', 0)
+    end
+    r.batch.size = 0
+    r.batch_mode = 1
+    local offsets, errors = { 0 }, {}
+    local i, n = 1, #items
+    while i <= n do
+        local ok, err = pcall(batch_run, r, proc, items, extras,
+                              offsets, errors, i, service)
+        if ok then break end
+        i = #offsets
+        errors[i] = err
+        i = i + 1
+        offsets[i] = tonumber(r.batch.size)
+    end
+    r.batch_mode = 0
+    return offsets, errors
+end
+
+-- ok, data, offsets, errors [, service]
+-- i-th result is data:sub(offsets[i] + 1, offsets[i + 1])
+local function batch_msgpack(r, proc, items, extras, service)
+    local ok, offsets, errors = pcall(batch_convert, r, proc, items,
+                                      extras, service)
+    if not ok then return false, offsets end
+    return true, ffi_string(r.batch.buf, r.batch.size), offsets, errors,
+           service
+end
+
+-- ok, results, errors [, service]
+local function batch_lua(r, proc, items, extras, service)
+    local ok, offsets, errors = pcall(batch_convert, r, proc, items,
+                                      extras, service)
+    if not ok then return false, offsets end
+    local results, buf = {}, r.batch.buf
+    for i = 1, #items do
+        if not errors[i] then
+            results[i] = msgpacklib_decode(buf + offsets[i],
+                                           offsets[i + 1] - offsets[i])
+        end
+    end
+    return true, results, errors, service
+end
+
+-- metatables msgpack.decode sets on arrays and maps (if any)
+local msgpack_array_mt = msgpacklib and
+                         getmetatable(msgpacklib_decode('\144'))
+local msgpack_map_mt   = msgpacklib and
+                         getmetatable(msgpacklib_decode('\128'))
+
+-- Make the Lua object straight from ot/ov; a table result is stored
+-- in dest if given (the elements are set, other keys are left as is).
+local function lua_encode(r, n, dest)
+    if dest ~= nil and type(dest) ~= 'table' then
+        error('Expecting a table', 0)
+    end
+    local ok, res = rt_unparse_table(r, n, dest, msgpacklib.NULL,
+                                     msgpack_array_mt, msgpack_map_mt)
+    if ok then return res end
+    -- something table.c doesn't handle, e.g. a 64 bit integer
     if rt_C.unparse_msgpack(r, n) ~= 0 then
         error(ffi.string(r.res, r.res_size), 0)
     end
-    return msgpacklib_decode(ffi_string(r.res, r.res_size))
+    res = msgpacklib_decode(ffi_string(r.res, r.res_size))
+    if dest ~= nil and type(res) == 'table' then
+        for k, v in pairs(res) do
+            dest[k] = v
+        end
+        return dest
+    end
+    return res
+end
+
+--
+-- fused transcoder
+--
+
+-- Load a plan made by emit_fuse_plan (compiler.lua).
+local function fuse_load(plan, width)
+    local nodes = ffi_new('struct schema_rt_FuseNode[?]', #plan)
+    local bank, size, keys = {}, 0, 0
+    for i, node in ipairs(plan) do
+        local n, name = nodes[i - 1], node.name
+        n.op, n.n, n.arg = node.op, node.n or 0, node.arg or 0
+        if node.n then
+            keys = keys + 5 -- map header
+        end
+        if name then
+            n.key, n.klen = size, #name
+            insert(bank, name)
+            size = size + #name
+            keys = keys + 5 + #name
+        end
+    end
+    bank = concat(bank)
+    local res = ffi_new('struct schema_rt_FusePlan')
+    res.node, res.bank, res.width, res.keys = nodes, bank, width, keys
+    -- res doesn't keep nodes and bank alive
+    return { res, nodes, bank }
+end
+
+local function fuse_wrap(r, plan, transcode, proc)
+    return function(data, ...)
+        -- as in the generated code, see lazy_errors
+        r.err.kind = 0
+        if type(data) == 'string' and
+           transcode(r, plan[1], data, #data) == 0 then
+            return true, ffi_string(r.res, r.res_size)
+        end
+        return proc(data, ...)
+    end
+end
+
+-- flatten_msgpack / unflatten_msgpack converting msgpack to msgpack
+-- directly; proc (the generated code) runs if the transcoder bails
+-- out, e.g. to report an error.
+local function fuse_flatten(r, plan, proc)
+    return fuse_wrap(r, plan, rt_C.schema_rt_fuse_flatten, proc)
+end
+
+local function fuse_unflatten(r, plan, proc)
+    return fuse_wrap(r, plan, rt_C.schema_rt_fuse_unflatten, proc)
+end
+
+--
+-- Avro binary
+--
+
+-- Load a plan made by emit_avro_plan (compiler.lua).
+local function avro_load(plan)
+    local nodes = ffi_new('struct schema_rt_AvroNode[?]', #plan)
+    local bank, size = {}, 0
+    for i, node in ipairs(plan) do
+        local n, name = nodes[i - 1], node.name
+        n.op, n.nullable = node.op or 0, node.nullable and 1 or 0
+        n.n, n.arg, n.type = node.n or 0, node.arg or 0, node.type or 0
+        if name then
+            n.key, n.klen = size, #name
+            insert(bank, name)
+            size = size + #name
+        end
+    end
+    bank = concat(bank)
+    local res = ffi_new('struct schema_rt_AvroPlan')
+    res.node, res.bank = nodes, bank
+    -- res doesn't keep nodes and bank alive
+    return { res, nodes, bank }
+end
+
+local avro_cursor_t = ffi.typeof('struct schema_rt_AvroCursor')
+
+-- decode_proc / encode_proc for the generated code (see linker);
+-- the decoder also takes a cursor (records back to back, see ocf.lua)
+local function avro_decoder(plan)
+    return function(r, s)
+        if type(s) ~= 'string' then
+            if not ffi.istype(avro_cursor_t, s) then
+                error('Expecting a string', 0)
+            end
+            if rt_C.schema_rt_parse_avro_next(r, plan[1], s) ~= 0 then
+                error(ffi_string(r.res, r.res_size), 0)
+            end
+            return s
+        end
+        if rt_C.schema_rt_parse_avro(r, plan[1], s, #s) ~= 0 then
+            error(ffi_string(r.res, r.res_size), 0)
+        end
+        return s
+    end
+end
+
+local function avro_encoder(plan)
+    return function(r, n)
+        if r.batch_mode ~= 0 then
+            if rt_C.schema_rt_batch_append_avro(r, plan[1], n) ~= 0 then
+                error(ffi_string(r.res, r.res_size), 0)
+            end
+            return
+        end
+        if rt_C.schema_rt_unparse_avro(r, plan[1], n) ~= 0 then
+            error(ffi_string(r.res, r.res_size), 0)
+        end
+        return ffi_string(r.res, r.res_size)
+    end
+end
+
+local function avro_cursor(data, size)
+    return avro_cursor_t(data, size, 0, 0)
+end
+
+--
+-- Object container file block codecs
+--
+
+local ocf_codec_errors = { [-1] = 'Invalid data', [-2] = 'Out of memory' }
+
+local ocf_codec_methods = {}
+local ocf_codec_mt = { __index = ocf_codec_methods }
+
+-- Compress or decompress a block; returns a pointer and the size
+-- (valid till the next call), or nil and the error message.
+function ocf_codec_methods.run(codec, data, size)
+    local c = codec.c
+    local rc = rt_C.schema_rt_ocf_run(c, data, size or #data)
+    if rc ~= 0 then
+        return nil, ocf_codec_errors[rc]
+    end
+    return c.buf, tonumber(c.size)
+end
+
+local function ocf_codec(compress, level)
+    local c = ffi_new('struct schema_rt_OcfCodec')
+    local rc = rt_C.schema_rt_ocf_init(c, compress and 1 or 0, level or -1)
+    if rc ~= 0 then
+        error(ocf_codec_errors[rc], 0)
+    end
+    ffi.gc(c, rt_C.schema_rt_ocf_destroy)
+    return setmetatable({ c = c }, ocf_codec_mt)
 end
 
 --
@@ -272,13 +963,20 @@ local etype2typename = {
     [0xf4] = 'MAP',  [0xf5] = 'NIL', [0xf6] = 'NIL or MAP'
 }
 
-local function err_type(r, pos, etype)
+local function promote(r, pos, etype)
     -- T==4(LONG) and (etype==0xee(ISFLOAT) or etype==0xef(ISDOUBLE))
     -- due to T range (1..12) and etype-s coding (236 + (0..9))
     -- this check is robust
     if r.t[pos] * band(etype, 0xfe) == 0x3b8 then
         r.t[pos] = 7 + band(etype, 1) -- long 2 float / double
         r.v[pos].dval = r.v[pos].ival
+        return true
+    end
+    return false
+end
+
+local function err_type(r, pos, etype)
+    if promote(r, pos, etype) then
         return
     end
     local location, iskerror = extract_location(r, pos)
@@ -335,6 +1033,145 @@ local function err_value(r, pos, ver_error)
     error(format('%sBad value: %s%s', location, val, tag), 0)
 end
 
+-- Errors of the IL interpreter and of the native code are recorded in
+-- r.err, and rendered the same way as the errors of the generated Lua
+-- code.
+local function raise(r, kind)
+    local err = r.err
+    local pos = tonumber(err.pos)
+    if kind == 1 then
+        err_type(r, pos, err.arg)
+    elseif kind == 2 then
+        err_length(r, pos, err.arg)
+    elseif kind == 3 then
+        err_missing(r, pos, ffi_string(r.b2 - err.str, err.len))
+    elseif kind == 4 then
+        err_duplicate(r, pos)
+    elseif kind == 5 then
+        err_value(r, pos, err.arg ~= 0)
+    elseif kind == 6 then
+        error(ffi_string(r.b2 - err.str, err.len), 0)
+    elseif kind == 7 then
+        error('Out of memory', 0)
+    end
+    error('internal error: bad VM code', 0)
+end
+
+local function vm_raise(r)
+    local kind = r.err.kind
+    r.err.kind = 0 -- raised, not pending (see error_message)
+    raise(r, kind)
+end
+
+local function vm_run(r, code, entry)
+    local v0 = rt_C.schema_rt_vm_run(r, code, entry, r.err)
+    if v0 < 0 then
+        vm_raise(r)
+    end
+    return tonumber(v0)
+end
+
+-- CHECKITEMS / PUTITEMS of the generated Lua code
+local function check_items(r, pos, kind)
+    if rt_C.schema_rt_check_items(r, pos, kind, r.err) ~= 0 then
+        vm_raise(r)
+    end
+end
+
+local function put_items(r, pos, opos, kind)
+    local v0 = rt_C.schema_rt_put_items(r, pos, opos, kind, r.err)
+    if v0 < 0 then
+        vm_raise(r)
+    end
+    return tonumber(v0)
+end
+
+local function native_run(r, lib, entry)
+    local v0 = lib.schema_native_run(r, entry, r.err)
+    if v0 < 0 then
+        vm_raise(r)
+    end
+    return tonumber(v0)
+end
+
+--
+-- lazy_errors: the generated code records an error in r.err and
+-- returns -1 instead of raising it. The message is rendered on request
+-- (error_message), the input is kept alive till then.
+--
+
+local lazy_anchors = setmetatable({}, { __mode = 'k' })
+
+local function lazy_fail(r, kind, pos, arg, str, len)
+    local err = r.err
+    err.kind, err.pos, err.arg = kind, pos, arg or 0
+    err.str, err.len = str or 0, len or 0
+    return true
+end
+
+-- Same as the err_* functions and the friends above, true / -1 is
+-- an error.
+local lazy_errors = {
+    err_type = function(r, pos, etype)
+        return not promote(r, pos, etype) and lazy_fail(r, 1, pos, etype)
+    end,
+    err_length = function(r, pos, elength)
+        return lazy_fail(r, 2, pos, elength)
+    end,
+    -- the key is in cpool
+    err_missing = function(r, pos, str, len)
+        return lazy_fail(r, 3, pos, 0, str, len)
+    end,
+    err_duplicate = function(r, pos)
+        return lazy_fail(r, 4, pos)
+    end,
+    err_value = function(r, pos, ver_error)
+        return lazy_fail(r, 5, pos, ver_error and 1 or 0)
+    end,
+    -- the message is in cpool
+    err_message = function(r, str, len)
+        return lazy_fail(r, 6, 0, 0, str, len)
+    end,
+    check_items = function(r, pos, kind)
+        return rt_C.schema_rt_check_items(r, pos, kind, r.err) ~= 0
+    end,
+    put_items = function(r, pos, opos, kind)
+        return tonumber(rt_C.schema_rt_put_items(r, pos, opos, kind, r.err))
+    end,
+    vm_run = function(r, code, entry)
+        return tonumber(rt_C.schema_rt_vm_run(r, code, entry, r.err))
+    end,
+    native_run = function(r, lib, entry)
+        return tonumber(lib.schema_native_run(r, entry, r.err))
+    end
+}
+
+local function lazy_result(r, data, ok, ...)
+    if ok and r.err.kind ~= 0 then
+        lazy_anchors[r] = data
+        return false, r.err.kind
+    end
+    return ok, ...
+end
+
+-- Replaces pcall in the methods: false, error code if the generated
+-- code failed.
+local function lazy_pcall(r)
+    return function(proc, data, ...)
+        return lazy_result(r, data, pcall(proc, data, ...))
+    end
+end
+
+-- The message of the last failed call (lazy_errors), nil if none.
+local function error_message(r)
+    local kind = r.err.kind
+    if kind == 0 then
+        return nil
+    end
+    local _, message = pcall(raise, r, kind)
+    return message
+end
+
 return {
     -- don't expose C library (unsafe),
     -- but let module user to load it herself (if she can)
@@ -343,13 +1180,40 @@ return {
     vis_msgpack      = vis_msgpack,
     regs             = regs,
     buf_grow         = buf_grow,
+    set_simd         = set_simd,
+    set_unparse_exact_min = set_unparse_exact_min,
+    enable_raw       = enable_raw,
+    new_state        = new_state,
+    is_state         = is_state,
+    buf_policy       = buf_policy,
+    buf_stats        = buf_stats,
+    msgpack_stream   = msgpack_stream,
     msgpack_encode   = msgpack_encode,
     msgpack_decode   = msgpack_decode,
+    json_decode      = json_decode,
+    json_encode      = json_encode,
     lua_encode       = lua_encode,
+    batch_msgpack    = batch_msgpack,
+    batch_lua        = batch_lua,
     universal_decode = universal_decode,
     err_type         = err_type,
     err_length       = err_length,
     err_missing      = err_missing,
     err_duplicate    = err_duplicate,
-    err_value        = err_value
+    err_value        = err_value,
+    vm_run           = vm_run,
+    check_items      = check_items,
+    put_items        = put_items,
+    native_run       = native_run,
+    lazy_errors      = lazy_errors,
+    lazy_pcall       = lazy_pcall,
+    error_message    = error_message,
+    fuse_load        = fuse_load,
+    fuse_flatten     = fuse_flatten,
+    fuse_unflatten   = fuse_unflatten,
+    avro_load        = avro_load,
+    avro_decoder     = avro_decoder,
+    avro_encoder     = avro_encoder,
+    avro_cursor      = avro_cursor,
+    ocf_codec        = ocf_codec
 }
@@ -0,0 +1,195 @@
+/*
+ * parse_msgpack benchmark: scalar vs. SIMD code path.
+ *
+ * Usage: bench_parse_msgpack [iterations]
+ *
+ * Inputs are synthetic: a string-heavy document (records with
+ * string fields of various length) and a number-heavy one (records
+ * with small-integer arrays, a few larger numbers and doubles).
+ * Every path is checked to produce exactly the same t/v output.
+ */
+#define _POSIX_C_SOURCE 199309L /* clock_gettime */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../runtime/pipeline.h"
+
+int parse_msgpack(struct State *state, const uint8_t *mi, size_t ms);
+int schema_rt_set_simd(int level);
+
+struct buf {
+    uint8_t *p;
+    size_t   size;
+    size_t   capacity;
+};
+
+static uint8_t *buf_reserve(struct buf *b, size_t n)
+{
+    if (b->size + n > b->capacity) {
+        b->capacity = (b->size + n) * 2;
+        b->p = realloc(b->p, b->capacity);
+        if (b->p == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return b->p + b->size;
+}
+
+static void put_u8(struct buf *b, uint8_t x)
+{
+    *buf_reserve(b, 1) = x;
+    b->size++;
+}
+
+static void put_be(struct buf *b, uint8_t tag, uint64_t x, int len)
+{
+    uint8_t *p = buf_reserve(b, len + 1);
+    p[0] = tag;
+    for (int i = 0; i < len; i++)
+        p[1 + i] = (uint8_t)(x >> (8 * (len - 1 - i)));
+    b->size += len + 1;
+}
+
+static void put_array(struct buf *b, uint32_t n)
+{
+    if (n <= 15) put_u8(b, 0x90 + n); else put_be(b, 0xdd, n, 4);
+}
+
+static void put_map(struct buf *b, uint32_t n)
+{
+    if (n <= 15) put_u8(b, 0x80 + n); else put_be(b, 0xdf, n, 4);
+}
+
+static void put_int(struct buf *b, int64_t x)
+{
+    if (x >= -32 && x <= 127) put_u8(b, (uint8_t)x);
+    else if (x >= 0 && x <= UINT16_MAX) put_be(b, 0xcd, x, 2);
+    else put_be(b, 0xd3, (uint64_t)x, 8);
+}
+
+static void put_double(struct buf *b, double x)
+{
+    struct unaligned_storage u;
+    u.f64 = x;
+    put_be(b, 0xcb, u.u64, 8);
+}
+
+static void put_str(struct buf *b, const char *s, uint32_t len)
+{
+    if (len <= 31) put_u8(b, 0xa0 + len);
+    else if (len <= UINT8_MAX) put_be(b, 0xd9, len, 1);
+    else put_be(b, 0xda, len, 2);
+    memcpy(buf_reserve(b, len), s, len);
+    b->size += len;
+}
+
+static void gen_strings(struct buf *b, int nrecords)
+{
+    static char text[512];
+    memset(text, 'x', sizeof(text));
+    put_array(b, nrecords);
+    for (int i = 0; i < nrecords; i++) {
+        put_map(b, 4);
+        put_str(b, "name", 4); put_str(b, text, 5 + i % 20);
+        put_str(b, "email", 5); put_str(b, text, 20 + i % 30);
+        put_str(b, "comment", 7); put_str(b, text, 100 + i % 300);
+        put_str(b, "tags", 4);
+        put_array(b, 4);
+        for (int j = 0; j < 4; j++)
+            put_str(b, text, 3 + (i + j) % 8);
+    }
+}
+
+static void gen_numbers(struct buf *b, int nrecords)
+{
+    put_array(b, nrecords);
+    for (int i = 0; i < nrecords; i++) {
+        put_map(b, 3);
+        put_str(b, "id", 2); put_int(b, i);
+        put_str(b, "samples", 7);
+        put_array(b, 64);
+        for (int j = 0; j < 64; j++)
+            put_int(b, (i * 31 + j * 7) % 150 - 32 + (j % 29 == 0) * 1000);
+        put_str(b, "stats", 5);
+        put_array(b, 3);
+        put_double(b, i * 0.5); put_double(b, 1.0 / (i + 1)); put_int(b, -i);
+    }
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int same_output(const struct State *a, const struct State *b)
+{
+    if (a->res_size != b->res_size ||
+        memcmp(a->t, b->t, a->res_size) != 0)
+        return 0;
+    for (size_t i = 0; i < a->res_size; i++) {
+        /* Nil/False/True leave value unused */
+        if (a->t[i] <= TrueValue)
+            continue;
+        if (a->v[i].uval != b->v[i].uval)
+            return 0;
+    }
+    return 1;
+}
+
+static void bench(const char *name, const struct buf *b, int iterations)
+{
+    static const char *level_names[] = { "scalar", "sse4.2", "avx2" };
+    struct State ref, state;
+    memset(&ref, 0, sizeof(ref));
+
+    schema_rt_set_simd(0);
+    if (parse_msgpack(&ref, b->p, b->size) != 0) {
+        fprintf(stderr, "%s: parse failed\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    for (int level = 0; level <= 2; level++) {
+        if (schema_rt_set_simd(level) != level)
+            continue;
+        memset(&state, 0, sizeof(state));
+        if (parse_msgpack(&state, b->p, b->size) != 0 ||
+            !same_output(&ref, &state)) {
+            fprintf(stderr, "%s/%s: output mismatch\n",
+                    name, level_names[level]);
+            exit(EXIT_FAILURE);
+        }
+        double start = now();
+        for (int i = 0; i < iterations; i++)
+            parse_msgpack(&state, b->p, b->size);
+        double elapsed = now() - start;
+        printf("%-8s %-7s %8.1f MB/s %8.2f Mitems/s\n", name,
+               level_names[level],
+               b->size * (double)iterations / elapsed / 1e6,
+               state.res_size * (double)iterations / elapsed / 1e6);
+        free(state.t); free(state.v); free(state.ot); free(state.ov);
+        free(state.res);
+    }
+    free(ref.t); free(ref.v); free(ref.ot); free(ref.ov); free(ref.res);
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 200;
+    struct buf strings = { NULL, 0, 0 }, numbers = { NULL, 0, 0 };
+
+    gen_strings(&strings, 10000);
+    gen_numbers(&numbers, 10000);
+
+    bench("strings", &strings, iterations);
+    bench("numbers", &numbers, iterations);
+
+    free(strings.p);
+    free(numbers.p);
+    return 0;
+}
@@ -0,0 +1,135 @@
+/*
+ * Perfect hash construction benchmark: create_hash_func vs. the string
+ * PHF (phf_init_string) on wide record field names, up to 100k keys.
+ *
+ * Usage: bench_phf [lookups]
+ *
+ * Reports the build time and the lookup time of both; create_hash_func
+ * must be perfect on every key set it returns a function for.
+ */
+#define _POSIX_C_SOURCE 199309L /* clock_gettime */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../lib/phf/phf.h"
+
+uint32_t create_hash_func(int n, const char *strings[],
+                          const char *random, size_t size_random);
+uint32_t eval_hash_func(uint32_t func, const char *str, size_t len);
+phf_hash_t phf_hash_string_band_raw8(const void *g, const void *p, size_t n,
+                                     uint32_t seed, size_t r, size_t m);
+phf_hash_t phf_hash_string_band_raw16(const void *g, const void *p, size_t n,
+                                      uint32_t seed, size_t r, size_t m);
+phf_hash_t phf_hash_string_band_raw32(const void *g, const void *p, size_t n,
+                                      uint32_t seed, size_t r, size_t m);
+
+#define NMAX 100000
+
+static char         keys[NMAX][48];
+static const char  *ptrs[NMAX];
+static size_t       lens[NMAX];
+static phf_string_t strs[NMAX];
+static uint32_t     hashes[NMAX];
+static uint32_t     sink;
+
+static const char random_data[] =
+    "\x5a\x13\x77\x21\x90\xab\xcd\xef\x01\x23\x45\x67\x89\xab\xcd\xef";
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int is_perfect(uint32_t func, size_t n)
+{
+    for (size_t k = 0; k < n; k++)
+        hashes[k] = eval_hash_func(func, ptrs[k], lens[k]);
+    qsort(hashes, n, sizeof(hashes[0]), cmp_u32);
+    for (size_t k = 1; k < n; k++)
+        if (hashes[k] == hashes[k - 1])
+            return 0;
+    return 1;
+}
+
+static uint32_t phf_lookup(const struct phf *phf, size_t k)
+{
+    switch (phf->g_op) {
+    case PHF_G_UINT8_BAND_R:
+        return phf_hash_string_band_raw8(phf->g, ptrs[k], lens[k],
+                                         phf->seed, phf->r, phf->m);
+    case PHF_G_UINT16_BAND_R:
+        return phf_hash_string_band_raw16(phf->g, ptrs[k], lens[k],
+                                          phf->seed, phf->r, phf->m);
+    default:
+        return phf_hash_string_band_raw32(phf->g, ptrs[k], lens[k],
+                                          phf->seed, phf->r, phf->m);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t sizes[] = { 100, 1000, 10000, 100000 };
+    long lookups = argc > 1 ? atol(argv[1]) : 10000000;
+
+    for (size_t k = 0; k < NMAX; k++) {
+        lens[k] = (size_t)snprintf(keys[k], sizeof(keys[k]),
+                                   "customer_shipping_address_line_%zu", k);
+        ptrs[k] = keys[k];
+        strs[k].p = keys[k];
+        strs[k].n = lens[k];
+    }
+
+    printf("%8s %12s %12s %12s %12s\n", "n", "func ms", "func ns",
+           "phf ms", "phf ns");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t     n = sizes[s];
+        struct phf phf;
+        double     start, t_func, t_phf, l_func, l_phf;
+
+        start = now();
+        uint32_t func = create_hash_func((int)n, ptrs, random_data,
+                                         sizeof(random_data) - 1);
+        t_func = (now() - start) * 1e3;
+        if (func == 0 || !is_perfect(func, n)) {
+            fprintf(stderr, "%zu: create_hash_func failed\n", n);
+            return EXIT_FAILURE;
+        }
+
+        start = now();
+        if (phf_init_string(&phf, strs, n, 4, 90, 0, 1)) {
+            fprintf(stderr, "%zu: phf_init_string failed\n", n);
+            return EXIT_FAILURE;
+        }
+        phf_compact(&phf);
+        t_phf = (now() - start) * 1e3;
+
+        start = now();
+        for (long i = 0; i < lookups; i++) {
+            size_t k = (size_t)i % n;
+            sink += eval_hash_func(func, ptrs[k], lens[k]);
+        }
+        l_func = (now() - start) / lookups * 1e9;
+
+        start = now();
+        for (long i = 0; i < lookups; i++)
+            sink += phf_lookup(&phf, (size_t)i % n);
+        l_phf = (now() - start) / lookups * 1e9;
+
+        printf("%8zu %12.2f %12.2f %12.2f %12.2f\n",
+               n, t_func, l_func, t_phf, l_phf);
+        phf_destroy(&phf);
+    }
+    return 0;
+}
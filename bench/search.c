@@ -0,0 +1,164 @@
+/*
+ * Enum lookup benchmark: schema_rt_search8/16/32 (linear scan, scalar
+ * and SIMD) vs. the perfect hash function, across table sizes.
+ *
+ * Usage: bench_search [iterations]
+ *
+ * Keys are looked up in a random order. For every key width, the last
+ * size where the best search still beats PHF is reported: that is the
+ * phf_threshold for the width (see phf_thresholds in
+ * avro_schema/backend.lua).
+ */
+#define _POSIX_C_SOURCE 199309L /* clock_gettime */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../lib/phf/phf.h"
+
+uint32_t schema_rt_search8(const uint8_t *tab, uint32_t k, size_t n);
+uint32_t schema_rt_search16(const uint16_t *tab, uint32_t k, size_t n);
+uint32_t schema_rt_search32(const uint32_t *tab, uint32_t k, size_t n);
+phf_hash_t phf_hash_uint32_band_raw8(const void *g, uint32_t k,
+                                     uint32_t seed, size_t r, size_t m);
+phf_hash_t phf_hash_uint32_band_raw16(const void *g, uint32_t k,
+                                      uint32_t seed, size_t r, size_t m);
+phf_hash_t phf_hash_uint32_band_raw32(const void *g, uint32_t k,
+                                      uint32_t seed, size_t r, size_t m);
+int schema_rt_set_simd(int level);
+
+#define NMAX 256
+#define NLOOKUPS 4096
+
+static uint32_t keys[NMAX];
+static uint32_t lookups[NLOOKUPS];
+static union {
+    uint8_t  u8[NMAX];
+    uint16_t u16[NMAX];
+    uint32_t u32[NMAX];
+} tab;
+static struct phf phf;
+static int        bits;
+static uint32_t   sink;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint32_t xorshift(void)
+{
+    static uint32_t x = 2463534242u;
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    return x;
+}
+
+/* n distinct keys of the width, lookups of keys in the table */
+static void gen_keys(size_t n)
+{
+    uint32_t mask = bits == 32 ? UINT32_MAX : (1u << bits) - 1;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t k;
+        size_t   j;
+        do {
+            k = xorshift() & mask;
+            for (j = 0; j < i && keys[j] != k; j++);
+        } while (j != i);
+        keys[i] = k;
+        switch (bits) {
+        case 8:  tab.u8[i] = (uint8_t)k; break;
+        case 16: tab.u16[i] = (uint16_t)k; break;
+        default: tab.u32[i] = k; break;
+        }
+    }
+    for (size_t i = 0; i < NLOOKUPS; i++)
+        lookups[i] = keys[xorshift() % n];
+}
+
+static uint32_t search(uint32_t k, size_t n)
+{
+    switch (bits) {
+    case 8:  return schema_rt_search8(tab.u8, k, n);
+    case 16: return schema_rt_search16(tab.u16, k, n);
+    default: return schema_rt_search32(tab.u32, k, n);
+    }
+}
+
+static uint32_t phf_lookup(uint32_t k)
+{
+    switch (phf.g_op) {
+    case PHF_G_UINT8_BAND_R:
+        return phf_hash_uint32_band_raw8(phf.g, k, phf.seed, phf.r, phf.m);
+    case PHF_G_UINT16_BAND_R:
+        return phf_hash_uint32_band_raw16(phf.g, k, phf.seed, phf.r, phf.m);
+    default:
+        return phf_hash_uint32_band_raw32(phf.g, k, phf.seed, phf.r, phf.m);
+    }
+}
+
+static double bench(size_t n, bool use_phf, long iterations)
+{
+    double best = 0;
+    for (int run = 0; run < 5; run++) {
+        double start = now();
+        for (long i = 0; i < iterations; i++)
+            for (size_t j = 0; j < NLOOKUPS; j++)
+                sink += use_phf ? phf_lookup(lookups[j])
+                                : search(lookups[j], n);
+        double t = (now() - start) / iterations / NLOOKUPS * 1e9;
+        if (run == 0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t sizes[] = {
+        4, 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, 256
+    };
+    static const int widths[] = { 8, 16, 32 };
+    long iterations = (argc > 1 ? atol(argv[1]) : 4000000) / NLOOKUPS;
+
+    printf("%6s %6s %12s %12s %12s\n",
+           "bits", "n", "scalar ns", "simd ns", "phf ns");
+    for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+        size_t threshold = 0;
+        bits = widths[w];
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            size_t n = sizes[s];
+            gen_keys(n);
+            for (size_t i = 0; i < n; i++) {
+                if (search(keys[i], n) != i) {
+                    fprintf(stderr, "%d/%zu: search failed\n", bits, n);
+                    return EXIT_FAILURE;
+                }
+            }
+            if (phf_init_uint32(&phf, keys, n, 4, 90, 0x5a137721, true)) {
+                fprintf(stderr, "%d/%zu: phf_init failed\n", bits, n);
+                return EXIT_FAILURE;
+            }
+            phf_compact(&phf);
+
+            schema_rt_set_simd(0);
+            double t_scalar = bench(n, false, iterations);
+            schema_rt_set_simd(-1);
+            double t_simd = bench(n, false, iterations);
+            double t_phf = bench(n, true, iterations);
+            /* a tie favours search, the aux table is smaller (n < m) */
+            if ((t_simd < t_scalar ? t_simd : t_scalar) < t_phf * 1.1)
+                threshold = n;
+            printf("%6d %6zu %12.2f %12.2f %12.2f\n",
+                   bits, n, t_scalar, t_simd, t_phf);
+            phf_destroy(&phf);
+        }
+        printf("%6d phf_threshold %zu\n", bits, threshold);
+    }
+    return 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * unparse_msgpack benchmark: checked vs. exact-size encoding, then
+ * large numeric arrays on every SIMD level.
+ *
+ * Usage: bench_unparse_msgpack [iterations]
+ *
+ * Tuples of various size made of small scalars (ints, booleans, nulls,
+ * doubles and short strings). Both modes must produce the same output.
+ * Warm: the result buffer is reused. Cold: it is freed before every
+ * call, as after a buffer policy shrink.
+ * Numeric arrays (long of mixed widths, float, double) must produce the
+ * same output on every level.
+ */
+#define _POSIX_C_SOURCE 199309L /* clock_gettime */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../runtime/pipeline.h"
+
+int unparse_msgpack(struct State *state, size_t nitems);
+int schema_rt_set_simd(int level);
+size_t schema_rt_set_unparse_exact_min(size_t n);
+
+static const char strings[] = "lorem ipsum dolor sit amet";
+
+static void gen_tuple(struct State *state, size_t nitems)
+{
+    state->ot = malloc(nitems);
+    state->ov = malloc(nitems * sizeof(state->ov[0]));
+    if (state->ot == NULL || state->ov == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    /* strings are taken from bank2, relative to its end */
+    state->b2 = (const uint8_t *)strings + sizeof(strings) - 1;
+    state->ot[0] = ArrayValue;
+    state->ov[0].xlen = (uint32_t)(nitems - 1);
+    for (size_t i = 1; i < nitems; i++) {
+        switch (i % 8) {
+        case 0: case 1: case 2:
+            state->ot[i] = LongValue;
+            state->ov[i].ival = (int64_t)(i % 300) - 20;
+            break;
+        case 3:
+            state->ot[i] = i % 16 == 3 ? TrueValue : NilValue;
+            break;
+        case 4:
+            state->ot[i] = DoubleValue;
+            state->ov[i].dval = i * 0.25;
+            break;
+        default:
+            state->ot[i] = CStringValue;
+            state->ov[i].xlen = 3 + i % 10;
+            state->ov[i].xoff = sizeof(strings) - 1 - i % 7;
+            break;
+        }
+    }
+}
+
+static void gen_numeric(struct State *state, size_t nitems, uint8_t type)
+{
+    state->ot = malloc(nitems);
+    state->ov = malloc(nitems * sizeof(state->ov[0]));
+    if (state->ot == NULL || state->ov == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    state->ot[0] = ArrayValue;
+    state->ov[0].xlen = (uint32_t)(nitems - 1);
+    for (size_t i = 1; i < nitems; i++) {
+        state->ot[i] = type;
+        if (type != LongValue) {
+            state->ov[i].dval = i * 0.37 - 1000;
+            continue;
+        }
+        /* mostly small, some of every width */
+        switch (i % 16) {
+        case 0:  state->ov[i].ival = (int64_t)i * 100003; break;
+        case 1:  state->ov[i].ival = -(int64_t)i * 1009; break;
+        case 2:  state->ov[i].ival = (int64_t)i << 32; break;
+        case 3:  state->ov[i].ival = 200 + i % 50; break;
+        default: state->ov[i].ival = (int64_t)(i % 150) - 30; break;
+        }
+    }
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* best of 5 runs, ns per item */
+static double bench(struct State *state, size_t nitems, long iterations,
+                    int cold)
+{
+    double best = 0;
+    for (int run = 0; run < 5; run++) {
+        double start = now();
+        for (long i = 0; i < iterations; i++) {
+            if (cold) {
+                free(state->res);
+                state->res = NULL;
+                state->res_capacity = 0;
+            }
+            unparse_msgpack(state, nitems);
+        }
+        double t = (now() - start) / iterations / nitems * 1e9;
+        if (run == 0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t sizes[] = { 8, 16, 32, 64, 128, 256, 1024, 10000 };
+    long total = argc > 1 ? atol(argv[1]) : 4000000;
+
+    printf("%8s %14s %14s %14s %14s\n", "items", "checked ns/it",
+           "exact ns/it", "cold checked", "cold exact");
+    for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+        size_t nitems = sizes[k];
+        long iterations = total / nitems;
+        struct State checked, exact;
+        memset(&checked, 0, sizeof(checked));
+        memset(&exact, 0, sizeof(exact));
+        gen_tuple(&checked, nitems);
+        gen_tuple(&exact, nitems);
+
+        schema_rt_set_unparse_exact_min(SIZE_MAX);
+        unparse_msgpack(&checked, nitems);
+        double t_checked = bench(&checked, nitems, iterations, 0);
+        double t_checked_cold = bench(&checked, nitems, iterations, 1);
+
+        schema_rt_set_unparse_exact_min(0);
+        unparse_msgpack(&exact, nitems);
+        double t_exact = bench(&exact, nitems, iterations, 0);
+        double t_exact_cold = bench(&exact, nitems, iterations, 1);
+
+        if (checked.res_size != exact.res_size ||
+            memcmp(checked.res, exact.res, exact.res_size) != 0) {
+            fprintf(stderr, "%zu items: output mismatch\n", nitems);
+            return EXIT_FAILURE;
+        }
+        printf("%8zu %14.2f %14.2f %14.2f %14.2f\n", nitems, t_checked,
+               t_exact, t_checked_cold, t_exact_cold);
+
+        free(checked.ot); free(checked.ov); free(checked.res);
+        free(exact.ot); free(exact.ov); free(exact.res);
+    }
+
+    static const char *level_names[] = { "scalar", "sse4.2", "avx2" };
+    static const struct {
+        const char *name;
+        uint8_t     type;
+    } arrays[] = {
+        { "long", LongValue }, { "float", FloatValue },
+        { "double", DoubleValue }
+    };
+    const size_t nitems = 10001;
+    long iterations = total / nitems;
+
+    printf("\n%8s %8s %14s %14s\n", "array", "level", "checked ns/it",
+           "exact ns/it");
+    for (size_t k = 0; k < sizeof(arrays) / sizeof(arrays[0]); k++) {
+        struct State ref;
+        memset(&ref, 0, sizeof(ref));
+        gen_numeric(&ref, nitems, arrays[k].type);
+        schema_rt_set_simd(0);
+        schema_rt_set_unparse_exact_min(SIZE_MAX);
+        unparse_msgpack(&ref, nitems);
+        for (int level = 0; level <= 2; level++) {
+            struct State state;
+            if (schema_rt_set_simd(level) != level)
+                continue;
+            double t[2];
+            memset(&state, 0, sizeof(state));
+            gen_numeric(&state, nitems, arrays[k].type);
+            for (int exact = 0; exact <= 1; exact++) {
+                schema_rt_set_unparse_exact_min(exact ? 0 : SIZE_MAX);
+                unparse_msgpack(&state, nitems);
+                if (state.res_size != ref.res_size ||
+                    memcmp(state.res, ref.res, ref.res_size) != 0) {
+                    fprintf(stderr, "%s/%s: output mismatch\n",
+                            arrays[k].name, level_names[level]);
+                    return EXIT_FAILURE;
+                }
+                t[exact] = bench(&state, nitems, iterations, 0);
+            }
+            printf("%8s %8s %14.2f %14.2f\n", arrays[k].name,
+                   level_names[level], t[0], t[1]);
+            free(state.ot); free(state.ov); free(state.res);
+        }
+        free(ref.ot); free(ref.ov); free(ref.res);
+    }
+    schema_rt_set_simd(-1);
+    schema_rt_set_unparse_exact_min(SIZE_MAX);
+    return 0;
+}
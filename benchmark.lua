@@ -48,6 +48,10 @@ if not ok then error(person) end
 local ok, person_c = avro.compile{person, dump_il='person.il'}
 local ok, person_c_debug = avro.compile{person, dump_il='person.il', debug=true}
 if not ok then error(person_c) end
+local ok, person_c_vm = avro.compile{person, engine='vm'}
+if not ok then error(person_c_vm) end
+local ok, person_c_native = avro.compile{person, engine='c'}
+if not ok then error(person_c_native) end
 
 
 local data = {
@@ -74,14 +78,124 @@ local data = {
         'You feel thirsty!'
     }
 }
+-- fixed layout: flatten_msgpack / unflatten_msgpack are fused
+local ok, account = avro.create({
+    type = 'record',
+    name = 'Account',
+    fields = {
+        { name = 'Id',      type = 'long'    },
+        { name = 'Login',   type = 'string'  },
+        { name = 'Email',   type = 'string'  },
+        { name = 'Active',  type = 'boolean' },
+        { name = 'Balance', type = 'double'  },
+        { name = 'Rating',  type = 'float'   },
+        {
+            name = 'Limits',
+            type = {
+                type = 'record',
+                name = 'Limits',
+                fields = {
+                    { name = 'Daily',   type = 'long' },
+                    { name = 'Monthly', type = 'long' }
+                }
+            }
+        }
+    }
+})
+if not ok then error(account) end
+local ok, account_c = avro.compile(account)
+if not ok then error(account_c) end
+local ok, account_c_unfused = avro.compile{account, fuse=false}
+if not ok then error(account_c_unfused) end
+
+local account_data = {
+    Id      = 1234567,
+    Login   = 'jdoe',
+    Email   = 'john.doe@example.com',
+    Active  = true,
+    Balance = 1024.5,
+    Rating  = 4.25,
+    Limits  = { Daily = 500, Monthly = 10000 }
+}
+
+-- record keys: in schema order, shuffled and sparse (defaults missing)
+local order_fields, order_data, order_names = {}, {}, {}
+for i = 1, 24 do
+    local name = string.format('field_%02d', i)
+    table.insert(order_fields, { name = name, type = 'long',
+                                 default = i > 12 and 0 or nil })
+    order_data[name] = i
+    order_names[i] = name
+end
+local ok, order = avro.create({
+    type = 'record', name = 'Order', fields = order_fields
+})
+if not ok then error(order) end
+local order_c = {}
+for _, engine in ipairs({ 'lua', 'vm', 'c' }) do
+    local ok, m = avro.compile{order, engine=engine}
+    if not ok then error(m) end
+    order_c[engine] = m
+end
+-- a msgpack map with the keys in the given order
+local function order_mp(keys)
+    local encode = require('msgpack').encode
+    local res = { string.char(0xde, 0, #keys) }
+    for _, k in ipairs(keys) do
+        table.insert(res, encode(k) .. encode(order_data[k]))
+    end
+    return table.concat(res)
+end
+local shuffled, sparse = {}, {}
+for i, k in ipairs(order_names) do
+    table.insert(shuffled, math.random(#shuffled + 1), k)
+    if i <= 12 or i % 3 == 0 then
+        table.insert(sparse, k)
+    end
+end
+local order_in_order_mp = order_mp(order_names)
+-- a new order every call
+local order_shuffled_mp = {}
+for i = 1, 16 do
+    local keys = {}
+    for _, k in ipairs(order_names) do
+        table.insert(keys, math.random(#keys + 1), k)
+    end
+    order_shuffled_mp[i] = order_mp(keys)
+end
+local order_sparse_mp = order_mp(sparse)
+local shuffled_i = 0
+local function flatten_shuffled()
+    shuffled_i = shuffled_i % 16 + 1
+    return order_c.lua.flatten_msgpack(order_shuffled_mp[shuffled_i])
+end
+
 local msgpack  = require('msgpack')
 local c = person_c
 local d = person_c_debug
+local vm = person_c_vm
+local native = person_c_native
 local data_mp = msgpack.encode(data)
 local _, data_fl = c.flatten(data)
 local _, data_fl_mp = c.flatten_msgpack(data)
+local account_mp = msgpack.encode(account_data)
+local _, account_fl_mp = account_c.flatten_msgpack(account_mp)
+local json = require('json')
+local data_json = json.encode(data)
+local function flatten_mp_via_lua(s)
+    return c.flatten_msgpack(json.decode(s))
+end
+local function unflatten_via_lua(s)
+    return json.encode(select(2, c.unflatten(s)))
+end
+local batch = 1000
+local batch_mp, batch_fl_mp = {}, {}
+for i = 1, batch do
+    batch_mp[i] = data_mp
+    batch_fl_mp[i] = data_fl_mp
+end
 local testcases = {
- -- { name                  , func                , arg1         , arg2}
+ -- { name                  , func                , arg1         , arg2, items per call}
     { "msgpack(lua t)"      , msgpack.encode      , data }       ,
     { "msgpackdecode(mp)"   , msgpack.decode      , data_mp }    ,
     { "validate(lua t)"     , avro.validate       , person       , data } ,
@@ -89,12 +203,48 @@ local testcases = {
     { "flatten(mp)"         , c.flatten           , data_mp }    ,
     { "unflatten(lua t)"    , c.unflatten         , data_fl }    ,
     { "unflatten(mp)"       , c.unflatten         , data_fl_mp } ,
+    { "unflatten(mp) dest"  , c.unflatten         , data_fl_mp   , {} } ,
     { "flatten_mp(lua t)"   , c.flatten_msgpack   , data }       ,
     { "flatten_mp(mp)"      , c.flatten_msgpack   , data_mp }    ,
     { "unflatten_mp(lua t)" , c.unflatten_msgpack , data_fl }    ,
     { "unflatten_mp(mp)"    , c.unflatten_msgpack , data_fl_mp } ,
     { "flatten_mp(mp)   optimizations off" ,d.flatten_msgpack  , data_mp }   ,
     { "unflatten_mp(mp) optimizations off" ,d.unflatten_msgpack, data_fl_mp },
+    { "flatten_mp(mp)   engine=vm"  , vm.flatten_msgpack      , data_mp }    ,
+    { "unflatten_mp(mp) engine=vm"  , vm.unflatten_msgpack    , data_fl_mp } ,
+    { "flatten_mp(mp)   engine=c"   , native.flatten_msgpack  , data_mp }    ,
+    { "unflatten_mp(mp) engine=c"   , native.unflatten_msgpack, data_fl_mp } ,
+    { "flatten_mp(mp)   flat"       , account_c.flatten_msgpack  , account_mp },
+    { "unflatten_mp(mp) flat"       , account_c.unflatten_msgpack, account_fl_mp },
+    { "flatten_mp(mp)   flat, fuse=false", account_c_unfused.flatten_msgpack,
+      account_mp },
+    { "unflatten_mp(mp) flat, fuse=false", account_c_unfused.unflatten_msgpack,
+      account_fl_mp },
+    { "flatten_mp(mp)   keys in order"  , order_c.lua.flatten_msgpack,
+      order_in_order_mp },
+    { "flatten_mp(mp)   keys shuffled"  , order_c.lua.flatten_msgpack,
+      order_mp(shuffled) },
+    { "flatten_mp(mp)   keys shuffled, every call", flatten_shuffled },
+    { "flatten_mp(mp)   keys sparse"    , order_c.lua.flatten_msgpack,
+      order_sparse_mp },
+    { "flatten_mp(mp)   keys in order, engine=vm", order_c.vm.flatten_msgpack,
+      order_in_order_mp },
+    { "flatten_mp(mp)   keys shuffled, engine=vm", order_c.vm.flatten_msgpack,
+      order_mp(shuffled) },
+    { "flatten_mp(mp)   keys sparse, engine=vm"  , order_c.vm.flatten_msgpack,
+      order_sparse_mp },
+    { "flatten_mp(mp)   keys in order, engine=c" , order_c.c.flatten_msgpack,
+      order_in_order_mp },
+    { "flatten_mp(mp)   keys shuffled, engine=c" , order_c.c.flatten_msgpack,
+      order_mp(shuffled) },
+    { "flatten_mp(mp)   keys sparse, engine=c"   , order_c.c.flatten_msgpack,
+      order_sparse_mp },
+    { "flatten_mp(json) json.decode"   , flatten_mp_via_lua , data_json } ,
+    { "flatten_json(json)"             , c.flatten_json     , data_json } ,
+    { "unflatten(mp) json.encode"      , unflatten_via_lua  , data_fl_mp } ,
+    { "unflatten_json(mp)"             , c.unflatten_json   , data_fl_mp } ,
+    { "flatten_mp_batch(mp)"   , c.flatten_msgpack_batch   , batch_mp   , nil, batch },
+    { "unflatten_mp_batch(mp)" , c.unflatten_msgpack_batch , batch_fl_mp, nil, batch },
 }
 
 print('benchmark started...')
@@ -105,6 +255,8 @@ for _, testcase in pairs(testcases) do
     local xfunc = testcase[2]
     local arg1 = testcase[3]
     local arg2 = testcase[4]
+    local per_call = testcase[5] or 1
+    local n = n / per_call
     local t = clock.bench(function()
         -- This crutch is required, because we cannot just pass
         -- a nil arg to some functions implemented in C and expect the
@@ -119,5 +271,37 @@ for _, testcase in pairs(testcases) do
             end
         end
     end)[1]
-    print(string.format('%f M RPS %s', n/1000000.0/t, name))
+    print(string.format('%f M RPS %s', n*per_call/1000000.0/t, name))
+end
+
+-- object container files: a local file, written and read back
+for _, codec in ipairs({ 'null', 'deflate' }) do
+    local path = os.tmpname()
+    local file = io.open(path, 'wb')
+    local ok, writer = avro.ocf_writer(person, file, { codec = codec })
+    if not ok then error(writer) end
+    local records = n / 10
+    local t = clock.bench(function()
+        for i = 1, records / batch do
+            writer:write(batch_fl_mp)
+        end
+        writer:close()
+    end)[1]
+    file:close()
+    print(string.format('%f M RPS ocf_writer codec=%s',
+                        records/1000000.0/t, codec))
+    file = io.open(path, 'rb')
+    local ok, reader = avro.ocf_reader(file)
+    if not ok then error(reader) end
+    t = clock.bench(function()
+        local ok, data
+        repeat
+            ok, data = reader:read_msgpack()
+            if not ok then error(data) end
+        until data == nil
+    end)[1]
+    file:close()
+    os.remove(path)
+    print(string.format('%f M RPS ocf_reader codec=%s',
+                        records/1000000.0/t, codec))
 end
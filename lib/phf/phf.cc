@@ -830,6 +830,21 @@ PHF_PUBLIC phf_hash_t phf_hash_uint32_mod_raw32(uint32_t *map, uint32_t k, uint3
     return phf_hash_<false>(map, k, seed, r, m);
 } /* phf_hash_uint32_mod_raw32 */
 
+PHF_PUBLIC phf_hash_t phf_hash_string_band_raw8(uint8_t *map, const void *p, size_t n, uint32_t seed, size_t r, size_t m) {
+    phf_string_t k = { const_cast<void *>(p), n };
+    return phf_hash_<true>(map, k, seed, r, m);
+} /* phf_hash_string_band_raw8 */
+
+PHF_PUBLIC phf_hash_t phf_hash_string_band_raw16(uint16_t *map, const void *p, size_t n, uint32_t seed, size_t r, size_t m) {
+    phf_string_t k = { const_cast<void *>(p), n };
+    return phf_hash_<true>(map, k, seed, r, m);
+} /* phf_hash_string_band_raw16 */
+
+PHF_PUBLIC phf_hash_t phf_hash_string_band_raw32(uint32_t *map, const void *p, size_t n, uint32_t seed, size_t r, size_t m) {
+    phf_string_t k = { const_cast<void *>(p), n };
+    return phf_hash_<true>(map, k, seed, r, m);
+} /* phf_hash_string_band_raw32 */
+
 } /* extern "C" */
 
 
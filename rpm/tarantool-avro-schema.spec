@@ -9,6 +9,7 @@ Source0: https://github.com/tarantool/%{name}/archive/%{version}/%{name}-%{versi
 BuildRequires: cmake >= 2.8
 BuildRequires: gcc >= 4.5
 BuildRequires: tarantool-devel >= 1.6.8.0
+BuildRequires: zlib-devel
 Requires: tarantool >= 1.6.8.0
 
 %description
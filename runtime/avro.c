@@ -0,0 +1,963 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pipeline.h"
+
+/*
+ * Avro binary encoding (flatten_avro / unflatten_avro).
+ *
+ * Avro binary isn't self-describing, the schema drives both
+ * directions (a plan made by emit_avro_plan in compiler.lua). Avro
+ * is transcoded to and from msgpack, hence the rest of the pipeline
+ * is the same for either format:
+ *
+ *   schema_rt_parse_avro   - render the input as msgpack in xbuf and
+ *                            run parse_msgpack on it; record keys and
+ *                            enum symbols come from the plan, byte
+ *                            ranges of raw arrays are valid msgpack;
+ *   schema_rt_unparse_avro - run unparse_msgpack, convert the result
+ *                            (res) to Avro binary, swap res and xbuf.
+ *
+ * The _next / _batch_append variants serve object container files
+ * (ocf.lua): records are read back to back from a block, and the
+ * results of a batch are concatenated.
+ *
+ * Nullable types (an extension) are encoded as ["null", T] unions.
+ *
+ * Must be kept in sync with emit_avro_plan.
+ */
+
+enum AvroOp {
+    AvroNull         = 1,
+    AvroBoolean      = 2,
+    AvroInt          = 3,
+    AvroLong         = 4,
+    AvroFloat        = 5,
+    AvroDouble       = 6,
+    AvroBytes        = 7,
+    AvroString       = 8,
+    AvroFixed        = 9,
+    AvroEnum         = 10,
+    AvroArray        = 11,
+    AvroMap          = 12,
+    AvroRecord       = 13,
+    AvroUnion        = 14
+};
+
+/*
+ * A type or an entry (enum symbol, record field, union branch).
+ * Enum, Record and Union have n entries starting with node[arg].
+ */
+struct AvroNode {
+    uint16_t           op;
+    uint16_t           nullable;
+    uint32_t           n;      // Fixed: size
+    uint32_t           arg;    // Array, Map: item type
+    uint32_t           key;    // entry: name (offset in bank)
+    uint32_t           klen;
+    uint32_t           type;   // field or branch: the type
+};
+
+struct AvroPlan {
+    const struct AvroNode *node;
+    const uint8_t     *bank;
+};
+
+/* Records back to back (an object container file block). */
+struct AvroCursor {
+    const uint8_t     *data;
+    size_t             size;
+    size_t             pos;
+    int                failed; // the data is damaged, stop
+};
+
+int parse_msgpack_begun(struct State *state, const uint8_t *mi, size_t ms);
+int unparse_msgpack(struct State *state, size_t nitems);
+void schema_rt_parse_begin(struct State *state);
+
+/* Recursive types only, hence generous. */
+#define AVRO_DEPTH_MAX 1024
+
+/*
+ * Items of an array taking no input bytes (null, empty records) are
+ * still rendered and parsed, the count is capped.
+ */
+#define AVRO_EMPTY_ITEMS_MAX (1u << 20)
+
+struct AvroCtx {
+    struct State      *state;
+    const struct AvroPlan *plan;
+    const uint8_t     *mi;
+    const uint8_t     *me;
+    uint8_t           *out;
+    uint8_t           *out_max;
+    const char        *error;
+    int                depth;
+};
+
+static int avro_set_error(struct State *state, const char *msg)
+{
+    size_t len = strlen(msg);
+    if (state->res_capacity < len) {
+        uint8_t *res = realloc(state->res, len);
+        if (res == NULL) {
+            state->res_size = 0;
+            return -1;
+        }
+        state->res = res;
+        state->res_capacity = len;
+    }
+    state->res_size = len;
+    memcpy(state->res, msg, len);
+    return -1;
+}
+
+static int avro_fail(struct AvroCtx *ctx, const char *msg)
+{
+    if (ctx->error == NULL)
+        ctx->error = msg;
+    return -1;
+}
+
+/* Ensure n bytes in xbuf at ctx->out. */
+static int avro_reserve(struct AvroCtx *ctx, size_t n)
+{
+    struct State *state = ctx->state;
+    size_t        used, capacity;
+    uint8_t      *xbuf;
+
+    if (__builtin_expect((size_t)(ctx->out_max - ctx->out) >= n, 1))
+        return 0;
+    used = ctx->out - state->xbuf;
+    capacity = state->xbuf_capacity ? state->xbuf_capacity : 256;
+    while (capacity < used + n)
+        capacity = capacity + capacity / 2;
+    state->stats[BufX].grows++;
+    xbuf = realloc(state->xbuf, capacity);
+    if (xbuf == NULL)
+        return avro_fail(ctx, "Out of memory");
+    state->xbuf = xbuf;
+    state->xbuf_capacity = capacity;
+    ctx->out = xbuf + used;
+    ctx->out_max = xbuf + capacity;
+    return 0;
+}
+
+static inline int avro_key_eq(const struct AvroPlan *plan,
+                              const struct AvroNode *entry,
+                              const uint8_t         *key,
+                              uint32_t               len)
+{
+    return entry->klen == len &&
+           memcmp(plan->bank + entry->key, key, len) == 0;
+}
+
+/* msgpack ------------------------------------------------------------ */
+
+static inline uint8_t *put_header(uint8_t *out, uint8_t fix,
+                                  uint8_t code16, uint32_t n)
+{
+    if (n <= 15) {
+        *out++ = fix + (uint8_t)n;
+    } else if (n <= UINT16_MAX) {
+        out[0] = code16;
+        unaligned(out + 1)->u16 = host2net16((uint16_t)n);
+        out += 3;
+    } else {
+        out[0] = code16 + 1;
+        unaligned(out + 1)->u32 = host2net32(n);
+        out += 5;
+    }
+    return out;
+}
+
+static inline size_t header_size(uint32_t n)
+{
+    return n <= 15 ? 1 : n <= UINT16_MAX ? 3 : 5;
+}
+
+static inline uint8_t *put_str(uint8_t *out, int bin,
+                               const uint8_t *data, uint32_t len)
+{
+    if (!bin && len <= 31) {
+        *out++ = 0xa0 + (uint8_t)len;
+    } else if (len <= UINT8_MAX) {
+        out[0] = bin ? 0xc4 : 0xd9;
+        out[1] = (uint8_t)len;
+        out += 2;
+    } else if (len <= UINT16_MAX) {
+        out[0] = bin ? 0xc5 : 0xda;
+        unaligned(out + 1)->u16 = host2net16((uint16_t)len);
+        out += 3;
+    } else {
+        out[0] = bin ? 0xc6 : 0xdb;
+        unaligned(out + 1)->u32 = host2net32(len);
+        out += 5;
+    }
+    memcpy(out, data, len);
+    return out + len;
+}
+
+static inline uint8_t *put_long(uint8_t *out, int64_t v)
+{
+    uint64_t u = (uint64_t)v;
+
+    if (v < 0) {
+        if (v >= -0x20) {
+            *out++ = (uint8_t)u;
+        } else if (v >= INT8_MIN) {
+            out[0] = 0xd0;
+            out[1] = (uint8_t)u;
+            out += 2;
+        } else if (v >= INT16_MIN) {
+            out[0] = 0xd1;
+            unaligned(out + 1)->u16 = host2net16((uint16_t)u);
+            out += 3;
+        } else if (v >= INT32_MIN) {
+            out[0] = 0xd2;
+            unaligned(out + 1)->u32 = host2net32((uint32_t)u);
+            out += 5;
+        } else {
+            out[0] = 0xd3;
+            unaligned(out + 1)->u64 = host2net64(u);
+            out += 9;
+        }
+    } else if (u <= 0x7f) {
+        *out++ = (uint8_t)u;
+    } else if (u <= UINT8_MAX) {
+        out[0] = 0xcc;
+        out[1] = (uint8_t)u;
+        out += 2;
+    } else if (u <= UINT16_MAX) {
+        out[0] = 0xcd;
+        unaligned(out + 1)->u16 = host2net16((uint16_t)u);
+        out += 3;
+    } else if (u <= UINT32_MAX) {
+        out[0] = 0xce;
+        unaligned(out + 1)->u32 = host2net32((uint32_t)u);
+        out += 5;
+    } else {
+        out[0] = 0xcf;
+        unaligned(out + 1)->u64 = host2net64(u);
+        out += 9;
+    }
+    return out;
+}
+
+/* Parse an array or a map header (fix is 0x90 or 0x80). */
+static inline const uint8_t *get_header(const uint8_t *mi,
+                                        const uint8_t *me,
+                                        uint8_t        fix,
+                                        uint8_t        code16,
+                                        uint32_t      *n)
+{
+    size_t avail = me - mi;
+
+    if (avail == 0)
+        return NULL;
+    if ((*mi & 0xf0) == fix) {
+        *n = *mi & 0x0f;
+        return mi + 1;
+    }
+    if (*mi == code16 && avail >= 3) {
+        *n = net2host16(unaligned(mi + 1)->u16);
+        return mi + 3;
+    }
+    if (*mi == code16 + 1 && avail >= 5) {
+        *n = net2host32(unaligned(mi + 1)->u32);
+        return mi + 5;
+    }
+    return NULL;
+}
+
+/* Skip a msgpack item, NULL if invalid or truncated. */
+static const uint8_t *skip_item(const uint8_t *mi, const uint8_t *me,
+                                int depth)
+{
+    uint32_t     type, n;
+    struct Value value;
+    const uint8_t *end = msgpack_scalar(mi, me, &type, &value);
+
+    if (end == NULL || type != 0)
+        return end;
+    if (depth > AVRO_DEPTH_MAX)
+        return NULL;
+    if ((end = get_header(mi, me, 0x90, 0xdc, &n)) != NULL) {
+        while (end != NULL && n--)
+            end = skip_item(end, me, depth + 1);
+        return end;
+    }
+    if ((end = get_header(mi, me, 0x80, 0xde, &n)) != NULL) {
+        while (end != NULL && n--) {
+            end = skip_item(end, me, depth + 1);
+            if (end != NULL)
+                end = skip_item(end, me, depth + 1);
+        }
+        return end;
+    }
+    return NULL; /* ext */
+}
+
+/* Avro binary -------------------------------------------------------- */
+
+/* Zigzag varint (int and long). */
+static inline int get_varint(struct AvroCtx *ctx, int64_t *v)
+{
+    const uint8_t *mi = ctx->mi, *me = ctx->me;
+    uint64_t       u = 0;
+    int            shift = 0;
+
+    do {
+        if (mi == me)
+            return avro_fail(ctx, "Truncated data");
+        if (shift > 63)
+            return avro_fail(ctx, "Invalid data");
+        u |= (uint64_t)(*mi & 0x7f) << shift;
+        shift += 7;
+    } while (*mi++ & 0x80);
+    ctx->mi = mi;
+    *v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+    return 0;
+}
+
+static inline uint8_t *put_varint(uint8_t *out, int64_t v)
+{
+    uint64_t u = ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+
+    while (u > 0x7f) {
+        *out++ = (uint8_t)(u | 0x80);
+        u >>= 7;
+    }
+    *out++ = (uint8_t)u;
+    return out;
+}
+
+/* Length prefixed data (bytes, string). */
+static inline int get_data(struct AvroCtx *ctx, const uint8_t **data,
+                           uint32_t *len)
+{
+    int64_t n;
+
+    if (get_varint(ctx, &n) != 0)
+        return -1;
+    if (n < 0 || n > UINT32_MAX)
+        return avro_fail(ctx, "Invalid data");
+    if ((uint64_t)n > (uint64_t)(ctx->me - ctx->mi))
+        return avro_fail(ctx, "Truncated data");
+    *data = ctx->mi;
+    *len = (uint32_t)n;
+    ctx->mi += n;
+    return 0;
+}
+
+/* Block count; a negative count is followed by the block size. */
+static int get_block(struct AvroCtx *ctx, uint64_t *count)
+{
+    int64_t n, size;
+
+    if (get_varint(ctx, &n) != 0)
+        return -1;
+    if (n < 0) {
+        if (n == INT64_MIN || get_varint(ctx, &size) != 0)
+            return avro_fail(ctx, "Invalid data");
+        n = -n;
+    }
+    *count = (uint64_t)n;
+    return 0;
+}
+
+static int decode(struct AvroCtx *ctx, uint32_t id);
+
+/*
+ * Whether a value of the type node[id] may take no input bytes:
+ * null, fixed of size 0 and records of such fields. Every other
+ * type starts with a varint. Too deep (a recursive record) counts
+ * as empty.
+ */
+static int is_empty_type(const struct AvroPlan *plan, uint32_t id,
+                         int depth)
+{
+    const struct AvroNode *node = plan->node + id, *entry;
+
+    if (node->nullable)
+        return 0;
+    switch (node->op) {
+    case AvroNull:
+        return 1;
+    case AvroFixed:
+        return node->n == 0;
+    case AvroRecord:
+        if (depth > AVRO_DEPTH_MAX)
+            return 1;
+        for (entry = plan->node + node->arg;
+             entry != plan->node + node->arg + node->n; entry++) {
+            if (!is_empty_type(plan, entry->type, depth + 1))
+                return 0;
+        }
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Array or map: a sequence of blocks. The header is rendered for the
+ * first block; if more blocks follow, it is patched and the items
+ * are moved when the header size changes.
+ */
+static int decode_blocks(struct AvroCtx *ctx, const struct AvroNode *node,
+                         int map)
+{
+    uint8_t   fix = map ? 0x80 : 0x90, code16 = map ? 0xde : 0xdc;
+    uint64_t  count, total = 0, max;
+    size_t    start = ctx->out - ctx->state->xbuf, hsize;
+
+    /* map items have keys, at least a byte each */
+    max = !map && is_empty_type(ctx->plan, node->arg, 0) ?
+          AVRO_EMPTY_ITEMS_MAX : UINT32_MAX;
+    if (get_block(ctx, &count) != 0)
+        return -1;
+    /* a byte of input per item at least, unless empty */
+    if (count > max || (max == UINT32_MAX &&
+                        count > (uint64_t)(ctx->me - ctx->mi)))
+        return avro_fail(ctx, "Invalid data");
+    hsize = header_size((uint32_t)count);
+    if (avro_reserve(ctx, hsize) != 0)
+        return -1;
+    ctx->out = put_header(ctx->out, fix, code16, (uint32_t)count);
+    while (count != 0) {
+        total += count;
+        if (total > max)
+            return avro_fail(ctx, "Invalid data");
+        for (; count != 0; count--) {
+            if (map) {
+                const uint8_t *key;
+                uint32_t       len;
+                if (get_data(ctx, &key, &len) != 0 ||
+                    avro_reserve(ctx, len + 5) != 0)
+                    return -1;
+                ctx->out = put_str(ctx->out, 0, key, len);
+            }
+            if (decode(ctx, node->arg) != 0)
+                return -1;
+        }
+        if (get_block(ctx, &count) != 0)
+            return -1;
+        if (max == UINT32_MAX && count > (uint64_t)(ctx->me - ctx->mi))
+            return avro_fail(ctx, "Invalid data");
+    }
+    if (hsize != header_size((uint32_t)total)) {
+        size_t   new_hsize = header_size((uint32_t)total);
+        uint8_t *base;
+        if (avro_reserve(ctx, new_hsize - hsize) != 0)
+            return -1;
+        base = ctx->state->xbuf + start;
+        memmove(base + new_hsize, base + hsize,
+                ctx->out - (base + hsize));
+        ctx->out += new_hsize - hsize;
+    }
+    put_header(ctx->state->xbuf + start, fix, code16, (uint32_t)total);
+    return 0;
+}
+
+/* Render Avro value of the type node[id] as msgpack. */
+static int decode(struct AvroCtx *ctx, uint32_t id)
+{
+    const struct AvroPlan *plan = ctx->plan;
+    const struct AvroNode *node = plan->node + id, *entry;
+    const uint8_t         *data;
+    struct unaligned_storage ux;
+    uint32_t               len;
+    int64_t                v;
+    int                    rc;
+
+    if (avro_reserve(ctx, 10) != 0)
+        return -1;
+    if (node->nullable) {
+        if (get_varint(ctx, &v) != 0)
+            return -1;
+        if (v == 0) {
+            *ctx->out++ = 0xc0;
+            return 0;
+        }
+        if (v != 1)
+            return avro_fail(ctx, "Invalid data");
+    }
+    switch (node->op) {
+    case AvroNull:
+        *ctx->out++ = 0xc0;
+        return 0;
+    case AvroBoolean:
+        if (ctx->mi == ctx->me)
+            return avro_fail(ctx, "Truncated data");
+        if (*ctx->mi > 1)
+            return avro_fail(ctx, "Invalid data");
+        *ctx->out++ = 0xc2 + *ctx->mi++;
+        return 0;
+    case AvroInt:
+    case AvroLong:
+        if (get_varint(ctx, &v) != 0)
+            return -1;
+        ctx->out = put_long(ctx->out, v);
+        return 0;
+    case AvroFloat:
+        if (ctx->me - ctx->mi < 4)
+            return avro_fail(ctx, "Truncated data");
+        memcpy(&ux.u32, ctx->mi, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        ux.u32 = __builtin_bswap32(ux.u32);
+#endif
+        ctx->mi += 4;
+        ctx->out[0] = 0xca;
+        unaligned(ctx->out + 1)->u32 = host2net32(ux.u32);
+        ctx->out += 5;
+        return 0;
+    case AvroDouble:
+        if (ctx->me - ctx->mi < 8)
+            return avro_fail(ctx, "Truncated data");
+        memcpy(&ux.u64, ctx->mi, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        ux.u64 = __builtin_bswap64(ux.u64);
+#endif
+        ctx->mi += 8;
+        ctx->out[0] = 0xcb;
+        unaligned(ctx->out + 1)->u64 = host2net64(ux.u64);
+        ctx->out += 9;
+        return 0;
+    case AvroBytes:
+    case AvroString:
+        if (get_data(ctx, &data, &len) != 0 ||
+            avro_reserve(ctx, len + 5) != 0)
+            return -1;
+        ctx->out = put_str(ctx->out, node->op == AvroBytes, data, len);
+        return 0;
+    case AvroFixed:
+        len = node->n;
+        if ((size_t)(ctx->me - ctx->mi) < len)
+            return avro_fail(ctx, "Truncated data");
+        if (avro_reserve(ctx, len + 5) != 0)
+            return -1;
+        ctx->out = put_str(ctx->out, 1, ctx->mi, len);
+        ctx->mi += len;
+        return 0;
+    case AvroEnum:
+        if (get_varint(ctx, &v) != 0)
+            return -1;
+        if (v < 0 || v >= node->n)
+            return avro_fail(ctx, "Invalid data");
+        entry = plan->node + node->arg + v;
+        if (avro_reserve(ctx, entry->klen + 5) != 0)
+            return -1;
+        ctx->out = put_str(ctx->out, 0, plan->bank + entry->key,
+                           entry->klen);
+        return 0;
+    case AvroArray:
+    case AvroMap:
+        if (++ctx->depth > AVRO_DEPTH_MAX)
+            return avro_fail(ctx, "Nesting too deep");
+        rc = decode_blocks(ctx, node, node->op == AvroMap);
+        ctx->depth--;
+        return rc;
+    case AvroRecord:
+        if (++ctx->depth > AVRO_DEPTH_MAX)
+            return avro_fail(ctx, "Nesting too deep");
+        ctx->out = put_header(ctx->out, 0x80, 0xde, node->n);
+        for (entry = plan->node + node->arg;
+             entry != plan->node + node->arg + node->n; entry++) {
+            if (avro_reserve(ctx, entry->klen + 5) != 0)
+                return -1;
+            ctx->out = put_str(ctx->out, 0, plan->bank + entry->key,
+                               entry->klen);
+            if (decode(ctx, entry->type) != 0)
+                return -1;
+        }
+        ctx->depth--;
+        return 0;
+    case AvroUnion:
+        if (get_varint(ctx, &v) != 0)
+            return -1;
+        if (v < 0 || v >= node->n)
+            return avro_fail(ctx, "Invalid data");
+        entry = plan->node + node->arg + v;
+        if (plan->node[entry->type].op == AvroNull &&
+            !plan->node[entry->type].nullable) {
+            *ctx->out++ = 0xc0;
+            return 0;
+        }
+        /* {tag: value} */
+        if (avro_reserve(ctx, entry->klen + 6) != 0)
+            return -1;
+        *ctx->out++ = 0x81;
+        ctx->out = put_str(ctx->out, 0, plan->bank + entry->key,
+                           entry->klen);
+        return decode(ctx, entry->type);
+    default:
+        return avro_fail(ctx, "Internal error: unknown code");
+    }
+}
+
+/*
+ * Decode Avro binary, the result is in t/v (as with parse_msgpack).
+ */
+int schema_rt_parse_avro(struct State          *state,
+                         const struct AvroPlan *plan,
+                         const uint8_t         *mi,
+                         size_t                 ms)
+{
+    struct AvroCtx ctx = {
+        .state = state, .plan = plan, .mi = mi, .me = mi + ms
+    };
+
+    /* the buffer policy applies before xbuf is filled */
+    schema_rt_parse_begin(state);
+    ctx.out = state->xbuf;
+    ctx.out_max = state->xbuf + state->xbuf_capacity;
+    if (decode(&ctx, 0) != 0)
+        return avro_set_error(state, ctx.error);
+    buf_used(state, BufX, ctx.out - state->xbuf);
+    return parse_msgpack_begun(state, state->xbuf, ctx.out - state->xbuf);
+}
+
+/*
+ * Decode the record at cursor->pos, advance the cursor. Record
+ * boundaries are lost after a failure, so is the rest of the data.
+ */
+int schema_rt_parse_avro_next(struct State          *state,
+                              const struct AvroPlan *plan,
+                              struct AvroCursor     *cursor)
+{
+    struct AvroCtx ctx = {
+        .state = state, .plan = plan,
+        .mi = cursor->data + cursor->pos,
+        .me = cursor->data + cursor->size
+    };
+
+    if (cursor->failed)
+        return avro_set_error(state, "Invalid data");
+    schema_rt_parse_begin(state);
+    ctx.out = state->xbuf;
+    ctx.out_max = state->xbuf + state->xbuf_capacity;
+    if (decode(&ctx, 0) != 0) {
+        cursor->failed = 1;
+        return avro_set_error(state, ctx.error);
+    }
+    cursor->pos = ctx.mi - cursor->data;
+    buf_used(state, BufX, ctx.out - state->xbuf);
+    return parse_msgpack_begun(state, state->xbuf, ctx.out - state->xbuf);
+}
+
+static int encode(struct AvroCtx *ctx, uint32_t id);
+
+/* Encode the value of a union branch / a nullable type. */
+static int encode_index(struct AvroCtx *ctx, int64_t index)
+{
+    if (avro_reserve(ctx, 10) != 0)
+        return -1;
+    ctx->out = put_varint(ctx->out, index);
+    return 0;
+}
+
+static int encode_blocks(struct AvroCtx *ctx, const struct AvroNode *node,
+                         int map)
+{
+    uint32_t n;
+
+    ctx->mi = get_header(ctx->mi, ctx->me, map ? 0x80 : 0x90,
+                         map ? 0xde : 0xdc, &n);
+    if (ctx->mi == NULL)
+        return avro_fail(ctx, "Invalid data");
+    if (n != 0 && encode_index(ctx, n) != 0)
+        return -1;
+    for (uint32_t i = 0; i < n; i++) {
+        if (map) {
+            uint32_t     type;
+            struct Value value;
+            const uint8_t *end = msgpack_scalar(ctx->mi, ctx->me,
+                                                &type, &value);
+            if (end == NULL || type != StringValue)
+                return avro_fail(ctx, "Invalid data");
+            if (avro_reserve(ctx, value.xlen + 10) != 0)
+                return -1;
+            ctx->out = put_varint(ctx->out, value.xlen);
+            memcpy(ctx->out, end - value.xlen, value.xlen);
+            ctx->out += value.xlen;
+            ctx->mi = end;
+        }
+        if (encode(ctx, node->arg) != 0)
+            return -1;
+    }
+    return encode_index(ctx, 0);
+}
+
+/* Find the value of the field in the map, NULL if missing. */
+static const uint8_t *find_field(struct AvroCtx        *ctx,
+                                 const uint8_t         *map,
+                                 uint32_t               n,
+                                 const struct AvroNode *entry)
+{
+    uint32_t     type;
+    struct Value value;
+
+    for (; n != 0 && map != NULL; n--) {
+        const uint8_t *end = msgpack_scalar(map, ctx->me, &type, &value);
+        if (end == NULL)
+            return NULL;
+        if (type == StringValue &&
+            avro_key_eq(ctx->plan, entry, end - value.xlen, value.xlen))
+            return end;
+        if (type == 0)
+            end = skip_item(map, ctx->me, ctx->depth);
+        map = end ? skip_item(end, ctx->me, ctx->depth) : NULL;
+    }
+    return NULL;
+}
+
+/*
+ * Record: fields are encoded in the schema order. They are likely
+ * in that order in the map already, otherwise the map is searched.
+ */
+static int encode_record(struct AvroCtx *ctx, const struct AvroNode *node)
+{
+    const struct AvroPlan *plan = ctx->plan;
+    const struct AvroNode *entry = plan->node + node->arg;
+    const struct AvroNode *entry_max = entry + node->n;
+    const uint8_t         *map, *next;
+    uint32_t               n, i = 0, type;
+    struct Value           value;
+    int                    in_order = 1;
+
+    map = get_header(ctx->mi, ctx->me, 0x80, 0xde, &n);
+    if (map == NULL)
+        return avro_fail(ctx, "Invalid data");
+    next = map;
+    for (; entry != entry_max; entry++, i++) {
+        const uint8_t *key_end = NULL;
+        if (in_order && i < n)
+            key_end = msgpack_scalar(next, ctx->me, &type, &value);
+        if (key_end == NULL || type != StringValue ||
+            !avro_key_eq(plan, entry, key_end - value.xlen, value.xlen)) {
+            in_order = 0;
+            key_end = find_field(ctx, map, n, entry);
+            if (key_end == NULL)
+                return avro_fail(ctx, "Key missing");
+        }
+        ctx->mi = key_end;
+        if (encode(ctx, entry->type) != 0)
+            return -1;
+        next = ctx->mi;
+    }
+    if (!in_order || n != node->n) {
+        /* find the end of the map */
+        next = map;
+        for (i = 0; i < 2 * n && next != NULL; i++)
+            next = skip_item(next, ctx->me, ctx->depth);
+        if (next == NULL)
+            return avro_fail(ctx, "Invalid data");
+    }
+    ctx->mi = next;
+    return 0;
+}
+
+/* Render msgpack value as Avro value of the type node[id]. */
+static int encode(struct AvroCtx *ctx, uint32_t id)
+{
+    const struct AvroPlan *plan = ctx->plan;
+    const struct AvroNode *node = plan->node + id, *entry;
+    const uint8_t         *end;
+    struct unaligned_storage ux;
+    struct Value           value;
+    uint32_t               type, n;
+    int                    rc;
+
+    /* the union index of a nullable type, then a varint (10 at most) */
+    if (avro_reserve(ctx, node->nullable ? 11 : 10) != 0)
+        return -1;
+    end = msgpack_scalar(ctx->mi, ctx->me, &type, &value);
+    if (end == NULL)
+        return avro_fail(ctx, "Invalid data");
+    if (node->nullable) {
+        ctx->out = put_varint(ctx->out, type != NilValue);
+        if (type == NilValue) {
+            ctx->mi = end;
+            return 0;
+        }
+    }
+    switch (node->op) {
+    case AvroNull:
+        if (type != NilValue)
+            break;
+        ctx->mi = end;
+        return 0;
+    case AvroBoolean:
+        if (type != FalseValue && type != TrueValue)
+            break;
+        *ctx->out++ = type == TrueValue;
+        ctx->mi = end;
+        return 0;
+    case AvroInt:
+    case AvroLong:
+        if (type != LongValue)
+            break;
+        ctx->out = put_varint(ctx->out, value.ival);
+        ctx->mi = end;
+        return 0;
+    case AvroFloat:
+    case AvroDouble:
+        if (type == LongValue)
+            value.dval = (double)value.ival;
+        else if (type != FloatValue && type != DoubleValue)
+            break;
+        if (node->op == AvroFloat) {
+            ux.f32 = (float)value.dval;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            ux.u32 = __builtin_bswap32(ux.u32);
+#endif
+            memcpy(ctx->out, &ux.u32, 4);
+            ctx->out += 4;
+        } else {
+            ux.f64 = value.dval;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            ux.u64 = __builtin_bswap64(ux.u64);
+#endif
+            memcpy(ctx->out, &ux.u64, 8);
+            ctx->out += 8;
+        }
+        ctx->mi = end;
+        return 0;
+    case AvroBytes:
+    case AvroString:
+    case AvroFixed:
+        if (type != StringValue && type != BinValue)
+            break;
+        if (node->op == AvroFixed && value.xlen != node->n)
+            break;
+        if (avro_reserve(ctx, value.xlen + 10) != 0)
+            return -1;
+        if (node->op != AvroFixed)
+            ctx->out = put_varint(ctx->out, value.xlen);
+        memcpy(ctx->out, end - value.xlen, value.xlen);
+        ctx->out += value.xlen;
+        ctx->mi = end;
+        return 0;
+    case AvroEnum:
+        if (type != StringValue)
+            break;
+        entry = plan->node + node->arg;
+        for (n = 0; n < node->n; n++, entry++) {
+            if (avro_key_eq(plan, entry, end - value.xlen, value.xlen))
+                break;
+        }
+        if (n == node->n)
+            break;
+        ctx->out = put_varint(ctx->out, n);
+        ctx->mi = end;
+        return 0;
+    case AvroArray:
+    case AvroMap:
+    case AvroRecord:
+        if (++ctx->depth > AVRO_DEPTH_MAX)
+            return avro_fail(ctx, "Nesting too deep");
+        rc = node->op == AvroRecord ?
+             encode_record(ctx, node) :
+             encode_blocks(ctx, node, node->op == AvroMap);
+        ctx->depth--;
+        return rc;
+    case AvroUnion:
+        entry = plan->node + node->arg;
+        if (type == NilValue) {
+            for (n = 0; n < node->n; n++, entry++) {
+                if (plan->node[entry->type].op == AvroNull)
+                    break;
+            }
+            if (n == node->n)
+                break;
+            ctx->out = put_varint(ctx->out, n);
+            ctx->mi = end;
+            return 0;
+        }
+        /* {tag: value} */
+        end = get_header(ctx->mi, ctx->me, 0x80, 0xde, &n);
+        if (end == NULL || n != 1)
+            break;
+        end = msgpack_scalar(end, ctx->me, &type, &value);
+        if (end == NULL || type != StringValue)
+            break;
+        for (n = 0; n < node->n; n++, entry++) {
+            if (avro_key_eq(plan, entry, end - value.xlen, value.xlen))
+                break;
+        }
+        if (n == node->n)
+            break;
+        ctx->out = put_varint(ctx->out, n);
+        ctx->mi = end;
+        return encode(ctx, entry->type);
+    default:
+        return avro_fail(ctx, "Internal error: unknown code");
+    }
+    return avro_fail(ctx, "Invalid data");
+}
+
+/*
+ * Encode nitems of ot/ov (as with unparse_msgpack) as Avro binary,
+ * the result is in res.
+ */
+int schema_rt_unparse_avro(struct State          *state,
+                           const struct AvroPlan *plan,
+                           size_t                 nitems)
+{
+    struct AvroCtx ctx;
+    uint8_t       *buf;
+    size_t         capacity;
+
+    if (unparse_msgpack(state, nitems) != 0)
+        return -1;
+    ctx = (struct AvroCtx) {
+        .state = state, .plan = plan,
+        .mi = state->res, .me = state->res + state->res_size,
+        .out = state->xbuf, .out_max = state->xbuf + state->xbuf_capacity
+    };
+    if (encode(&ctx, 0) != 0)
+        return avro_set_error(state, ctx.error);
+    buf = state->res;
+    capacity = state->res_capacity;
+    state->res_size = ctx.out - state->xbuf;
+    state->res = state->xbuf;
+    state->res_capacity = state->xbuf_capacity;
+    state->xbuf = buf;
+    state->xbuf_capacity = capacity;
+    /* the buffers swapped: res is the Avro output, xbuf the msgpack */
+    buf_used(state, BufX, ctx.me - state->xbuf);
+    buf_used(state, BufRes, state->res_size);
+    return 0;
+}
+
+/* Same as schema_rt_unparse_avro, the result is appended to batch. */
+int schema_rt_batch_append_avro(struct State          *state,
+                                const struct AvroPlan *plan,
+                                size_t                 nitems)
+{
+    struct Batch *batch = &state->batch;
+    size_t        size, capacity;
+    uint8_t      *buf;
+
+    if (schema_rt_unparse_avro(state, plan, nitems) != 0)
+        return -1;
+    size = batch->size + state->res_size;
+    buf_used(state, BufBatch, size);
+    if (size > batch->capacity) {
+        state->stats[BufBatch].grows++;
+        capacity = batch->capacity ? batch->capacity : 256;
+        while (capacity < size)
+            capacity = capacity + capacity / 2;
+        buf = realloc(batch->buf, capacity);
+        if (buf == NULL)
+            return avro_set_error(state, "Out of memory");
+        batch->buf = buf;
+        batch->capacity = capacity;
+    }
+    memcpy(batch->buf + batch->size, state->res, state->res_size);
+    batch->size = size;
+    return 0;
+}
@@ -4,17 +4,30 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* Same condition as HAVE_X86_SIMD in pipeline.c */
+#if defined(__x86_64__) && (defined(__clang__) || __GNUC__ >= 5)
+#define HAVE_CRC32C_HW 1
+#else
+#define HAVE_CRC32C_HW 0
+#endif
+
 uint32_t
 eval_fnv1a_func(uint32_t seed, const char *str, size_t len);
 
+uint32_t
+eval_crc32c_func(uint32_t seed, const char *str, size_t len);
+
+/* pipeline.c; SSE4.2 and up (> 0) have the CRC32 instruction */
+int schema_rt_get_simd(void);
+
 static int
 collisions_found(uint32_t func, int n, const char *strings[],
                  void *mem);
 
 static uint32_t
-create_fnv_func(int n, const char *strings[],
-                const char *random, size_t size_random,
-                void *mem);
+create_wide_func(int n, const char *strings[],
+                 const char *random, size_t size_random,
+                 void *mem);
 
 /*
  * create_hash_func - creates a function mapping a string to
@@ -23,7 +36,8 @@ create_fnv_func(int n, const char *strings[],
  * @returns
  *
  * 0          - failed to create a perfect hash func
- * 0x???????? - FNV1A + a 4 byte random prefix (MSB > 0xf)
+ * 0x10ssssss - CRC32C of 8 byte words, seeded (see eval_crc32c_func())
+ * 0x???????? - FNV1A + a 4 byte random prefix (MSB > 0x10)
  *
  * 0x01p1     - sample specified positions, combine with '+'
  * 0x02p1p2     positions must not exceed the length of the shortest
@@ -66,12 +80,13 @@ uint32_t create_hash_func(int n, const char *strings[],
     };
 
     void *mem;
+    unsigned char *cols;
     int use_len = 0, sample_count = 0, sample_pos[4] = {256, 256, 256, 256};
     uint32_t gen;
     int best_pos, collisions_min;
     int n_active, i, pos, o, max_len = 256;
 
-    if (n == 0) return 0;
+    if (n <= 0) return 0;
 
     /*
      * mem: int32_t probes[128] | int32_t slots[n*2] (sel. sampling pos-s)
@@ -90,15 +105,36 @@ uint32_t create_hash_func(int n, const char *strings[],
     uint32_t * const slots   = probes + 128;
     uint32_t *       indices = slots;
 
-    /* semi-arbitrary limit, hard max is MAX_INT32 / 257
-     * (larger size causes generation counter to wrap)
-     * Note: it's highly unlikely we'll ever get a huge string set;
-     *       if we do, it makes sense to have character *COLUMNS*
-     *       in continuous memory (aka transpose) for improved memory
-     *       access pattern, not implemented.
-     * */
-    if (n > 1000)
-        return create_fnv_func(n, strings, random, size_random, mem);
+    /* hard max, larger size causes generation counter to wrap */
+    if (n > INT32_MAX / 257)
+        return create_wide_func(n, strings, random, size_random, mem);
+
+    /*
+     * Character *COLUMNS* in continuous memory (aka transpose): the
+     * samples at a position are scanned for every string in the set.
+     * Column 0 is the length, column pos + 1 is the char at pos, up to
+     * the length of the shortest string. Probes are 7 bit: strings
+     * differing in the MSB only are counted as colliding, the final
+     * check is exact.
+     */
+    for (i = 0; i < n; i++) {
+        size_t len = strlen(strings[i]);
+        if (len < (size_t)max_len)
+            max_len = (int)len;
+    }
+    cols = malloc((size_t)(max_len + 1) * (size_t)n);
+    if (cols == NULL) {
+        free(mem);
+        return 0;
+    }
+    for (i = 0; i < n; i++) {
+        const char *str = strings[i];
+        cols[i] = 0x7f & strlen(str);
+        for (pos = 0; pos < max_len; pos++)
+            cols[(size_t)(pos + 1) * n + i] = 0x7f & str[pos];
+    }
+#define PROBE(pos, idx) \
+    (cols[(size_t)((pos) + 1) * n + ((idx) & IDX_MASK)])
 
     for (i = 0; i < n; i++)
         indices[i] = i;
@@ -113,20 +149,8 @@ pick_next_sample:
     for (pos = use_len - 1; pos < max_len; pos++) {
         int collisions = 0;
         for (i = 0; i < n_active; i++) {
-            uint32_t  idx = indices[i];
-            const char *str = strings[idx & IDX_MASK];
-            unsigned probe;
-
-            if (pos == -1) {
-                probe = 0x7f & strlen(str);
-            } else {
-                probe = str[pos];
-                if (str[pos] == 0) {
-                    /* we may drop the string when splitting domains */
-                    max_len = pos;
-                    goto save_best_pos;
-                }
-            }
+            uint32_t idx = indices[i];
+            unsigned probe = PROBE(pos, idx);
 
             if (probes[probe] == gen)
                 collisions++;
@@ -143,7 +167,6 @@ pick_next_sample:
         }
     }
 
-save_best_pos:
     /* save the best pos */
     if (best_pos == -1)
         use_len = 1;
@@ -179,13 +202,15 @@ sort_sample_pos:
         if (collisions_found(func, n, strings, mem))
             func |= 0x08000000;
 
+        free(cols);
         free(mem);
         return func;
     }
 
-    if (sample_count == 4) {
-        /* too many samples, yet no solution */
-        return create_fnv_func(n, strings, random, size_random, mem);
+    if (sample_count == 3) {
+        /* too many samples, yet no solution (3 positions max) */
+        free(cols);
+        return create_wide_func(n, strings, random, size_random, mem);
     }
 
     /* rebuild collision domains...
@@ -204,9 +229,7 @@ sort_sample_pos:
         map = 0;
         for (j = i; ; j++) {
             const uint32_t idx = indices[j];
-            const char * const str = strings[idx & IDX_MASK];
-            unsigned probe = (best_pos == -1 ?
-                              (0x7f & strlen(str)) : (unsigned)str[best_pos]);
+            unsigned probe = PROBE(best_pos, idx);
             map |= (uint64_t)1 << (probe / 2);
             probes[probe]++;
             if (idx & DOMAIN_END_BIT) {
@@ -235,10 +258,7 @@ sort_sample_pos:
         /* copy */
         for (j = i; j != end; j++) {
             const uint32_t idx = indices[j];
-            const char * const str = strings[idx & IDX_MASK];
-            unsigned probe = (best_pos == -1 ?
-                              (0x7f & strlen(str)) : (unsigned)str[best_pos]);
-            next_indices[--probes[probe]] = idx;
+            next_indices[--probes[PROBE(best_pos, idx)]] = idx;
         }
         i = end;
         /* zero out entries we touched */
@@ -251,22 +271,58 @@ sort_sample_pos:
     indices = next_indices;
     n_active = o;
     goto pick_next_sample;
+#undef PROBE
 }
 
-static uint32_t create_fnv_func(int n, const char *strings[],
-                                const char *random, size_t size_random,
-                                void *mem)
+/*
+ * A 32 bit hash of this many strings has collisions with any seed,
+ * most likely (the birthday bound: about n * n / 2^33 of them); the
+ * caller makes a string phf instead.
+ */
+#define WIDE_FUNC_MAX_N 150000
+#define WIDE_FUNC_TRIALS 128
+
+/*
+ * Trial seeds: 4 byte windows of the random chunk, then FNV1A of the
+ * chunk seeded with the trial number.
+ */
+static uint32_t
+trial_seed(const char *random, size_t size_random, int trial)
+{
+    uint32_t v;
+    if ((size_t)trial + sizeof(v) <= size_random) {
+        memcpy(&v, random + trial, sizeof(v));
+        return v;
+    }
+    return eval_fnv1a_func((uint32_t)trial, random, size_random);
+}
+
+/*
+ * No cheap sampling function: hash the whole string. CRC32C is tried
+ * first if there is an instruction for it (a word at a time), FNV1A
+ * next; the table driven CRC is slower than FNV1A. CRC is linear, a
+ * seed doesn't separate strings of the same length; it is rarely
+ * needed though, CRC has no collisions on short strings.
+ */
+static uint32_t create_wide_func(int n, const char *strings[],
+                                 const char *random, size_t size_random,
+                                 void *mem)
 {
-    const char *last_random;
     uint32_t func = 0;
-    if (size_random < sizeof(uint32_t)) goto done;
-    for (last_random = random + size_random - sizeof(uint32_t);
-         random <= last_random;
-         random++) {
-
-        uint32_t v;
-        memcpy(&v, random, sizeof(v));
-        if (v > 0xf000000 && !collisions_found(v, n, strings, mem)) {
+    int trial;
+    if (size_random < sizeof(uint32_t) || n > WIDE_FUNC_MAX_N) goto done;
+    for (trial = 0; HAVE_CRC32C_HW && schema_rt_get_simd() > 0 &&
+                    trial < WIDE_FUNC_TRIALS; trial++) {
+        uint32_t v = trial_seed(random, size_random, trial);
+        v = 0x10000000 | (v & 0xffffff);
+        if (!collisions_found(v, n, strings, mem)) {
+            func = v;
+            goto done;
+        }
+    }
+    for (trial = 0; trial < WIDE_FUNC_TRIALS; trial++) {
+        uint32_t v = trial_seed(random, size_random, trial);
+        if (v >= 0x11000000 && !collisions_found(v, n, strings, mem)) {
             func = v;
             goto done;
         }
@@ -280,7 +336,9 @@ uint32_t
 eval_hash_func(uint32_t func, const char *str, size_t len)
 {
     int family = func >> 24, a, b, c;
-    if (family > 0xf) {
+    if (family == 0x10)
+        return eval_crc32c_func(func & 0xffffff, str, len);
+    if (family > 0x10) {
         uint32_t prefix = func;
         uint32_t seed = eval_fnv1a_func(0x811c9dc5,
                                         (const char *)&prefix,
@@ -338,6 +396,66 @@ eval_fnv1a_func(uint32_t seed, const char *str, size_t len)
     return res;
 }
 
+/* CRC32C (Castagnoli), reflected, no pre/post inversion */
+static uint32_t crc32c_table[256];
+
+__attribute__((constructor))
+static void crc32c_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+        crc32c_table[i] = crc;
+    }
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        crc = crc32c_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if HAVE_CRC32C_HW
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t c = crc, w;
+    size_t   i;
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&w, p + i, sizeof(w));
+        c = __builtin_ia32_crc32di(c, w);
+    }
+    if (i != len) {
+        w = 0;
+        memcpy(&w, p + i, len - i);
+        c = __builtin_ia32_crc32di(c, w);
+    }
+    return (uint32_t)c;
+}
+#endif
+
+/*
+ * CRC32C of the string padded with zeroes to a multiple of 8 bytes,
+ * the initial value is seed ^ len. Same result with and without
+ * the instruction.
+ */
+uint32_t
+eval_crc32c_func(uint32_t seed, const char *str, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)str;
+    const unsigned char  zeroes[8] = {0};
+    uint32_t             crc = seed ^ (uint32_t)len;
+
+#if HAVE_CRC32C_HW
+    if (schema_rt_get_simd() > 0)
+        return crc32c_hw(crc, p, len);
+#endif
+    crc = crc32c_sw(crc, p, len);
+    return crc32c_sw(crc, zeroes, -len & 7);
+}
+
 static int
 collisions_found(uint32_t func, int n, const char *strings[],
                  void *mem)
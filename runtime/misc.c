@@ -1,25 +1,167 @@
 #include <stdint.h>
 #include <string.h>
 
+/* Same condition as HAVE_X86_SIMD in pipeline.c */
+#if defined(__x86_64__) && (defined(__clang__) || __GNUC__ >= 5)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_SIMD 0
+#endif
+
+/* pipeline.c; SimdNone, SimdSSE42, SimdAVX2 */
+int schema_rt_get_simd(void);
+
 int
 schema_rt_key_eq(const char *key, const char *str, size_t klen, size_t len)
 {
     return klen == 0 || klen != len ? -1 : memcmp(key, str, klen);
 }
 
-uint32_t
-schema_rt_search8(const uint8_t *tab, uint32_t k, size_t n)
+/*
+ * schema_rt_search8/16/32 - find k in tab (n entries, no duplicates)
+ *
+ * Returns the index of k, or n - 1 if not found (the caller checks the
+ * key anyway). Tables of 16 bytes and up are scanned with SIMD
+ * compares, a vector at a time; the last vector overlaps the previous
+ * one if n isn't a multiple of the vector width, tab is never read
+ * past n. Keys too wide for the table are not found.
+ */
 #define SCHEMA_RT_SEARCH_BODY \
     uint32_t i = 0; \
     while (i != n - 1 && tab[i] != k) i++; \
     return i;
-{ SCHEMA_RT_SEARCH_BODY }
+
+#if HAVE_X86_SIMD
+
+#define SCHEMA_RT_SEARCH_SIMD(name, T, isa, V, loadu, set1, cmpeq, \
+                              movemask) \
+__attribute__((target(isa))) \
+static uint32_t name(const T *tab, uint32_t k, size_t n) \
+{ \
+    const size_t w = sizeof(V) / sizeof(T); \
+    const V      key = set1(k); \
+    size_t       i = 0; \
+    for (;;) { \
+        unsigned m = (unsigned)movemask( \
+            cmpeq(loadu((const V *)(tab + i)), key)); \
+        if (m != 0) \
+            return (uint32_t)(i + __builtin_ctz(m) / sizeof(T)); \
+        if (i + w == n) \
+            return (uint32_t)(n - 1); \
+        i = i + 2 * w <= n ? i + w : n - w; \
+    } \
+}
+
+SCHEMA_RT_SEARCH_SIMD(search8_sse, uint8_t, "sse4.2", __m128i,
+                      _mm_loadu_si128, _mm_set1_epi8, _mm_cmpeq_epi8,
+                      _mm_movemask_epi8)
+SCHEMA_RT_SEARCH_SIMD(search16_sse, uint16_t, "sse4.2", __m128i,
+                      _mm_loadu_si128, _mm_set1_epi16, _mm_cmpeq_epi16,
+                      _mm_movemask_epi8)
+SCHEMA_RT_SEARCH_SIMD(search32_sse, uint32_t, "sse4.2", __m128i,
+                      _mm_loadu_si128, _mm_set1_epi32, _mm_cmpeq_epi32,
+                      _mm_movemask_epi8)
+SCHEMA_RT_SEARCH_SIMD(search8_avx2, uint8_t, "avx2", __m256i,
+                      _mm256_loadu_si256, _mm256_set1_epi8,
+                      _mm256_cmpeq_epi8, _mm256_movemask_epi8)
+SCHEMA_RT_SEARCH_SIMD(search16_avx2, uint16_t, "avx2", __m256i,
+                      _mm256_loadu_si256, _mm256_set1_epi16,
+                      _mm256_cmpeq_epi16, _mm256_movemask_epi8)
+SCHEMA_RT_SEARCH_SIMD(search32_avx2, uint32_t, "avx2", __m256i,
+                      _mm256_loadu_si256, _mm256_set1_epi32,
+                      _mm256_cmpeq_epi32, _mm256_movemask_epi8)
+
+#define SCHEMA_RT_SEARCH_DISPATCH(T, sse, avx2) \
+    if (n * sizeof(T) >= 16 && k <= (T)-1) { \
+        int simd = schema_rt_get_simd(); \
+        if (simd >= 2 && n * sizeof(T) >= 32) \
+            return avx2(tab, k, n); \
+        if (simd >= 1) \
+            return sse(tab, k, n); \
+    }
+
+#else
+
+#define SCHEMA_RT_SEARCH_DISPATCH(T, sse, avx2)
+
+#endif /* HAVE_X86_SIMD */
+
+uint32_t
+schema_rt_search8(const uint8_t *tab, uint32_t k, size_t n)
+{
+    SCHEMA_RT_SEARCH_DISPATCH(uint8_t, search8_sse, search8_avx2)
+    SCHEMA_RT_SEARCH_BODY
+}
 
 uint32_t
 schema_rt_search16(const uint16_t *tab, uint32_t k, size_t n)
-{ SCHEMA_RT_SEARCH_BODY }
+{
+    SCHEMA_RT_SEARCH_DISPATCH(uint16_t, search16_sse, search16_avx2)
+    SCHEMA_RT_SEARCH_BODY
+}
 
 uint32_t
 schema_rt_search32(const uint32_t *tab, uint32_t k, size_t n)
-{ SCHEMA_RT_SEARCH_BODY }
+{
+    SCHEMA_RT_SEARCH_DISPATCH(uint32_t, search32_sse, search32_avx2)
+    SCHEMA_RT_SEARCH_BODY
+}
+
+/*
+ * schema_rt_strsearch - find str in a string switch table
+ *
+ * tab holds n triples of uint32: key length, key cpos (b2 - cpos is the
+ * key, see cpool in backend.lua) and the branch, ordered by length,
+ * then by contents. Returns the branch, or -1 if str is not in tab.
+ * For string switches with no hash function (enable_fast_strings off):
+ * O(log n) compares and no Lua strings interned.
+ */
+int32_t
+schema_rt_strsearch(const uint8_t *b2, const uint32_t *tab, uint32_t n,
+                    const char *str, size_t len)
+{
+    uint32_t lo = 0, hi = n;
+    while (lo < hi) {
+        uint32_t        mid = lo + (hi - lo) / 2;
+        const uint32_t *e = tab + 3 * (size_t)mid;
+        int             c = e[0] != len ? (e[0] < len ? -1 : 1) :
+                            memcmp(b2 - e[1], str, len);
+        if (c == 0)
+            return (int32_t)e[2];
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -1;
+}
 
+/*
+ * schema_rt_guess_key, schema_rt_learn_key - record keys in the order
+ * seen before
+ *
+ * Producers nearly always encode record keys in the same order. A
+ * string switch keeps hints: the branch taken last (hints[0]) and, for
+ * every branch b, the one taken after it the last time (hints[1 + b]).
+ * keys holds the (length, cpos) pairs of the branches. guess_key
+ * returns the guessed branch if str is its key, or -1; the caller then
+ * dispatches on the hash and reports the branch taken to learn_key.
+ */
+int32_t
+schema_rt_guess_key(const uint8_t *b2, const uint32_t *keys,
+                    uint32_t *hints, const char *str, size_t len)
+{
+    uint32_t g = hints[1 + hints[0]];
+    if (keys[2 * g] != len || memcmp(b2 - keys[2 * g + 1], str, len) != 0)
+        return -1;
+    hints[0] = g;
+    return (int32_t)g;
+}
+
+void
+schema_rt_learn_key(uint32_t *hints, uint32_t b)
+{
+    hints[1 + hints[0]] = b;
+    hints[0] = b;
+}
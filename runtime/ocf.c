@@ -0,0 +1,125 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+/*
+ * Object container file block codecs (ocf.lua).
+ *
+ * Avro "deflate" codec is the raw deflate stream (RFC 1951, no zlib
+ * header or checksum). A codec either compresses or decompresses; the
+ * z_stream is reset and reused for every block, the output goes to
+ * buf (grows as needed and is kept for the next block).
+ */
+
+struct OcfCodec {
+    void              *zs;
+    int                deflate;
+    uint8_t           *buf;
+    size_t             size;
+    size_t             capacity;
+};
+
+enum {
+    OcfOk              = 0,
+    OcfInvalidData     = -1,
+    OcfOutOfMemory     = -2
+};
+
+static int ocf_grow(struct OcfCodec *codec, size_t min_capacity)
+{
+    size_t   capacity = codec->capacity ? codec->capacity : 4096;
+    uint8_t *buf;
+
+    while (capacity < min_capacity)
+        capacity = capacity + capacity / 2;
+    buf = realloc(codec->buf, capacity);
+    if (buf == NULL)
+        return OcfOutOfMemory;
+    codec->buf = buf;
+    codec->capacity = capacity;
+    return OcfOk;
+}
+
+int schema_rt_ocf_init(struct OcfCodec *codec, int compress, int level)
+{
+    z_stream *zs = calloc(1, sizeof(*zs));
+    int       rc;
+
+    memset(codec, 0, sizeof(*codec));
+    if (zs == NULL)
+        return OcfOutOfMemory;
+    rc = compress ?
+        deflateInit2(zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) :
+        inflateInit2(zs, -15);
+    if (rc != Z_OK) {
+        free(zs);
+        return rc == Z_MEM_ERROR ? OcfOutOfMemory : OcfInvalidData;
+    }
+    codec->zs = zs;
+    codec->deflate = compress;
+    return OcfOk;
+}
+
+void schema_rt_ocf_destroy(struct OcfCodec *codec)
+{
+    if (codec->zs) {
+        if (codec->deflate)
+            deflateEnd(codec->zs);
+        else
+            inflateEnd(codec->zs);
+        free(codec->zs);
+    }
+    free(codec->buf);
+    memset(codec, 0, sizeof(*codec));
+}
+
+/* Compress or decompress a block, the result is in buf/size. */
+int schema_rt_ocf_run(struct OcfCodec *codec,
+                      const uint8_t   *in,
+                      size_t           size)
+{
+    z_stream *zs = codec->zs;
+    int       rc;
+
+    if (size > UINT32_MAX)
+        return OcfInvalidData;
+    zs->next_in = (Bytef *)in;
+    zs->avail_in = (uInt)size;
+    codec->size = 0;
+    if (codec->deflate) {
+        size_t bound = deflateBound(zs, size);
+        if (bound > codec->capacity && ocf_grow(codec, bound) != OcfOk)
+            return OcfOutOfMemory;
+        zs->next_out = codec->buf;
+        zs->avail_out = (uInt)codec->capacity;
+        rc = deflate(zs, Z_FINISH);
+        codec->size = zs->total_out;
+        deflateReset(zs);
+        return rc == Z_STREAM_END ? OcfOk : OcfInvalidData;
+    }
+    if (codec->capacity < size * 2 && ocf_grow(codec, size * 2) != OcfOk)
+        return OcfOutOfMemory;
+    for (;;) {
+        size_t avail = codec->capacity - zs->total_out;
+        zs->next_out = codec->buf + zs->total_out;
+        zs->avail_out = avail > UINT32_MAX ? UINT32_MAX : (uInt)avail;
+        rc = inflate(zs, Z_FINISH);
+        if (rc == Z_STREAM_END)
+            break;
+        if ((rc != Z_BUF_ERROR && rc != Z_OK) || zs->avail_out != 0) {
+            /* damaged or truncated */
+            inflateReset(zs);
+            return rc == Z_MEM_ERROR ? OcfOutOfMemory : OcfInvalidData;
+        }
+        /* out of space */
+        if (ocf_grow(codec, codec->capacity + 1) != OcfOk) {
+            inflateReset(zs);
+            return OcfOutOfMemory;
+        }
+    }
+    codec->size = zs->total_out;
+    inflateReset(zs);
+    return OcfOk;
+}
@@ -4,113 +4,9 @@
 #include <string.h>
 #include <inttypes.h>
 #include <stdio.h>
+#include <math.h>
 
-enum TypeId {
-    NilValue         = 1,
-    FalseValue       = 2,
-    TrueValue        = 3,
-    LongValue        = 4,
-    UlongValue       = 5, /* parser prefers LongValue */
-    FloatValue       = 6,
-    DoubleValue      = 7,
-    StringValue      = 8,
-    BinValue         = 9,
-    ExtValue         = 10,
-
-    ArrayValue       = 11,
-    MapValue         = 12,
-
-    CDummyValue      = 17, /* skipped */
-    CStringValue     = 18,
-    CBinValue        = 19,
-    CopyCommand      = 20 /* Copy N bytes verbatim from data bank.
-                           * Provides complex default values. Also
-                           * strings during unflatten.
-                           */
-};
-
-struct Value {
-    union {
-        void          *p;
-        int64_t        ival;
-        uint64_t       uval;
-        double         dval;
-        struct {
-            uint32_t   xlen;
-            uint32_t   xoff;
-        };
-    };
-};
-
-/*
- * TypeId-s and Value-s live in two parallel arrays.
- *
- * NilValue         - (value allocated but unused)
- * FalseValue       - (value allocated but unused)
- * TrueValue        - (value allocated but unused)
- * LongValue        - ival
- * UlongValue       - uval
- * FloatValue       - dval
- * DoubleValue      - dval
- * StringValue      - xlen, xoff
- * BinValue         - xlen, xoff
- * ExtValue         - xlen, xoff
- * ArrayValue       - xlen, xoff
- * MapValue         - xlen, xoff
- */
-
-struct State {
-    size_t             t_capacity;   // capacity of t/v   bufs (items)
-    size_t             ot_capacity;  // capacity of ot/ov bufs (items)
-    size_t             res_capacity; // capacity of res   buf
-    size_t             res_size;
-    uint8_t           *res;      // filled by unparse_msgpack, others
-    const uint8_t     *b1;       // bank1: input data
-    const uint8_t     *b2;       // bank2: program constants
-    uint8_t           *t;        // filled by parse_msgpack
-    struct Value      *v;        // .......................
-    uint8_t           *ot;       // consumed by unparse_msgpack
-    struct Value      *ov;       // ...........................
-};
-
-#if !(C_HAVE_BSWAP16)
-static inline uint16_t __builtin_bswap16(uint16_t a)
-{
-    return (a << 8) | ( a >> 8);
-}
-#endif
-
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-#define net2host16(v) __builtin_bswap16(v)
-#define net2host32(v) __builtin_bswap32(v)
-#define net2host64(v) __builtin_bswap64(v)
-#define host2net16(v) __builtin_bswap16(v)
-#define host2net32(v) __builtin_bswap32(v)
-#define host2net64(v) __builtin_bswap64(v)
-#elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
-#define net2host16(v) (v)
-#define net2host32(v) (v)
-#define net2host64(v) (v)
-#define host2net16(v) (v)
-#define host2net32(v) (v)
-#define host2net64(v) (v)
-#else
-#error Unsupported __BYTE_ORDER__
-#endif
-
-#define unaligned(p) ((struct unaligned_storage *)(p))
-
-struct unaligned_storage
-{
-    union {
-        uint16_t u16;
-        uint32_t u32;
-        uint64_t u64;
-        float    f32;
-        double   f64;
-    };
-}
-__attribute__((__packed__));
+#include "pipeline.h"
 
 static inline size_t next_capacity(size_t min_capacity)
 {
@@ -135,6 +31,21 @@ static int buf_grow(uint8_t **t,
     return 0;
 }
 
+static int buf_grow_v(struct Value **v,
+                      size_t *capacity,
+                      size_t new_capacity)
+{
+    struct Value *new_v;
+
+    new_v = realloc(*v, new_capacity * sizeof(new_v[0]));
+    if (new_v == NULL)
+        return -1;
+
+    *v = new_v;
+    *capacity = new_capacity;
+    return 0;
+}
+
 static int buf_grow_tv(uint8_t **t,
                        struct Value **v,
                        size_t *capacity,
@@ -150,12 +61,199 @@ static int buf_grow_tv(uint8_t **t,
     return buf_grow(t, capacity, new_capacity);
 }
 
+/*
+ * State buffers grow on demand. Subject to the policy below, they
+ * shrink back to the baseline at the beginning of a call (parse_msgpack),
+ * once the previous call is over:
+ *
+ * - a buffer larger than high_water bytes is shrunk right away;
+ * - a buffer larger than the baseline is shrunk after decay calls
+ *   in a row used no more than the baseline (0 - never).
+ *
+ * The defaults retain the memory forever. The policy is process-wide,
+ * set it before conversions start. It applies to every buffer in
+ * enum StateBuf; batch.buf is left alone while a batch is in progress.
+ * Stream buffers aren't state buffers, see stream_decay().
+ */
+static size_t   buf_high_water = SIZE_MAX;
+static size_t   buf_baseline   = 0;
+static uint32_t buf_decay_calls = 0;
+
+#define TV_ITEM_SIZE (sizeof(uint8_t) + sizeof(struct Value))
+
+static int tv_grow(struct State *state, size_t new_capacity)
+{
+    state->stats[BufTV].grows++;
+    return buf_grow_tv(&state->t, &state->v, &state->t_capacity,
+                       new_capacity);
+}
+
+static int ot_grow(struct State *state, size_t new_capacity)
+{
+    state->stats[BufOT].grows++;
+    return buf_grow_tv(&state->ot, &state->ov, &state->ot_capacity,
+                       new_capacity);
+}
+
+static int res_grow(struct State *state, size_t new_capacity)
+{
+    state->stats[BufRes].grows++;
+    return buf_grow(&state->res, &state->res_capacity, new_capacity);
+}
+
+static size_t buf_size(const struct State *state,
+                       enum StateBuf buf)
+{
+    switch (buf) {
+    case BufTV:
+        return state->t_capacity * TV_ITEM_SIZE +
+               state->rv_capacity * sizeof(struct Value);
+    case BufOT:
+        return state->ot_capacity * TV_ITEM_SIZE;
+    case BufX:
+        return state->xbuf_capacity;
+    case BufBatch:
+        return state->batch.capacity;
+    case BufVM:
+        return state->vm_capacity * sizeof(state->vm_stack[0]);
+    default:
+        return state->res_capacity;
+    }
+}
+
+/*
+ * Realloc to a smaller capacity. If the second realloc fails
+ * the buffer is merely larger than necessary.
+ */
+static int buf_shrink_tv(uint8_t **t,
+                         struct Value **v,
+                         size_t *capacity,
+                         size_t new_capacity)
+{
+    struct Value *new_v;
+    uint8_t      *new_t;
+
+    if (new_capacity >= *capacity)
+        return 0;
+    new_v = realloc(*v, new_capacity * sizeof(new_v[0]));
+    if (new_v == NULL)
+        return 0;
+    *v = new_v;
+    new_t = realloc(*t, new_capacity * sizeof(new_t[0]));
+    if (new_t != NULL)
+        *t = new_t;
+    *capacity = new_capacity;
+    return 1;
+}
+
+/* Shrink to the baseline; returns 1 if shrunk. */
+static int buf_shrink(struct State *state,
+                      enum StateBuf buf)
+{
+    size_t capacity;
+
+    switch (buf) {
+    case BufTV:
+        capacity = next_capacity(buf_baseline / TV_ITEM_SIZE);
+        if (state->rv_capacity > capacity &&
+            buf_grow_v(&state->rv, &state->rv_capacity, capacity) != 0)
+            return 0;
+        return buf_shrink_tv(&state->t, &state->v, &state->t_capacity,
+                             capacity);
+    case BufOT:
+        capacity = next_capacity(buf_baseline / TV_ITEM_SIZE);
+        return buf_shrink_tv(&state->ot, &state->ov, &state->ot_capacity,
+                             capacity);
+    case BufX:
+        capacity = next_capacity(buf_baseline);
+        if (capacity >= state->xbuf_capacity)
+            return 0;
+        return buf_grow(&state->xbuf, &state->xbuf_capacity,
+                        capacity) == 0;
+    case BufBatch:
+        capacity = next_capacity(buf_baseline);
+        if (capacity >= state->batch.capacity)
+            return 0;
+        return buf_grow(&state->batch.buf, &state->batch.capacity,
+                        capacity) == 0;
+    case BufVM: {
+        int64_t *stack;
+        /* vm.c grows it from 256 entries */
+        capacity = buf_baseline / sizeof(stack[0]);
+        if (capacity >= state->vm_capacity)
+            return 0;
+        if (capacity == 0) {
+            free(state->vm_stack);
+            state->vm_stack = NULL;
+            state->vm_capacity = 0;
+            return 1;
+        }
+        stack = realloc(state->vm_stack, capacity * sizeof(stack[0]));
+        if (stack == NULL)
+            return 0;
+        state->vm_stack = stack;
+        state->vm_capacity = capacity;
+        return 1;
+    }
+    default:
+        capacity = next_capacity(buf_baseline);
+        if (capacity >= state->res_capacity)
+            return 0;
+        return buf_grow(&state->res, &state->res_capacity, capacity) == 0;
+    }
+}
+
+/* Apply the policy; called when a new call starts. */
+static void buf_decay(struct State *state)
+{
+    for (int buf = 0; buf < BufCount; buf++) {
+        struct BufStats *stats = &state->stats[buf];
+        size_t           size = buf_size(state, buf);
+
+        /* a batch spans many calls, its results are in the buffer */
+        if (buf == BufBatch && state->batch_mode)
+            continue;
+        if (stats->used > buf_baseline)
+            stats->idle = 0;
+        else
+            stats->idle++;
+        stats->used = 0;
+        if (size <= buf_baseline)
+            continue;
+        if (size > buf_high_water ||
+            (buf_decay_calls != 0 && stats->idle >= buf_decay_calls)) {
+            stats->shrinks += buf_shrink(state, buf);
+            stats->idle = 0;
+        }
+    }
+}
+
+/*
+ * Set the buffer policy: high_water and baseline are in bytes, decay
+ * is the number of calls. SIZE_MAX, 0, 0 - never shrink.
+ */
+void schema_rt_buf_policy(size_t   high_water,
+                          size_t   baseline,
+                          uint32_t decay)
+{
+    buf_high_water  = high_water;
+    buf_baseline    = baseline;
+    buf_decay_calls = decay;
+}
+
+/* Current capacity (bytes) of a buffer, see enum StateBuf. */
+size_t schema_rt_buf_size(const struct State *state,
+                          int                 buf)
+{
+    return buf_size(state, buf);
+}
+
 static int set_error(struct State *state,
                      const char *msg)
 {
     size_t len = strlen(msg);
     if (state->res_capacity < len &&
-        buf_grow(&state->res, &state->res_capacity, next_capacity(len)) != 0) {
+        res_grow(state, next_capacity(len)) != 0) {
 
         state->res_size = 0;
         return -1;
@@ -165,21 +263,216 @@ static int set_error(struct State *state,
     return -1; /* always returns -1, see invocation */
 }
 
-int parse_msgpack(struct State *state,
-                  const uint8_t * restrict mi,
-                  size_t        ms)
+/*
+ * SIMD fast path for parse_msgpack.
+ *
+ * A fixint is a single header byte which becomes a LongValue by
+ * sign extension (0x00-0x7f positive, 0xe0-0xff negative). Arrays of
+ * small numbers are mostly made of fixint runs, hence the vector
+ * kernels classify a block of header bytes at once and convert the
+ * entire run in one go. Str/bin payloads are never scanned - skipping
+ * one is already a single pointer increment.
+ *
+ * The kernel is picked at runtime; the scalar path remains the reference
+ * implementation. The output is exactly the same regardless of the path.
+ */
+#if defined(__x86_64__) && (defined(__clang__) || __GNUC__ >= 5)
+#define HAVE_X86_SIMD 1
+#include <cpuid.h>
+#include <immintrin.h>
+#else
+#define HAVE_X86_SIMD 0
+#endif
+
+enum SimdLevel {
+    SimdNone         = 0,
+    SimdSSE42        = 1,
+    SimdAVX2         = 2
+};
+
+/* Runs shorter than that are not worth a kernel call. */
+#define FIXINT_RUN_MIN 16
+
+/*
+ * Written once, the same value from every thread (or overriden
+ * explicitly with schema_rt_set_simd()), hence no locking.
+ */
+static int simd_level = -1;
+
+static int simd_detect(void)
 {
-    const uint8_t *me = mi + ms;
+#if HAVE_X86_SIMD
+    unsigned eax, ebx, ecx, edx, xcr0_lo, xcr0_hi;
+    int level = SimdNone;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return SimdNone;
+    if (ecx & bit_SSE4_2)
+        level = SimdSSE42;
+    /* AVX2 also requires OS support for the YMM state (XCR0) */
+    if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+        return level;
+    __asm__ ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 6) != 6 || __get_cpuid_max(0, NULL) < 7)
+        return level;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    if (ebx & bit_AVX2)
+        level = SimdAVX2;
+    return level;
+#else
+    return SimdNone;
+#endif
+}
+
+/*
+ * Force the parser and encoder path (SimdNone, SimdSSE42, SimdAVX2);
+ * negative level picks the best one available. Levels unsupported by
+ * the CPU are clamped. Returns the effective level.
+ */
+int schema_rt_set_simd(int level)
+{
+    int max_level = simd_detect();
+    if (level < 0 || level > max_level)
+        level = max_level;
+    simd_level = level;
+    return level;
+}
+
+static inline int simd_get_level(void)
+{
+    int level = simd_level;
+    if (__builtin_expect(level < 0, 0))
+        level = schema_rt_set_simd(-1);
+    return level;
+}
+
+/* The effective level, for the other units (hash.c) */
+int schema_rt_get_simd(void)
+{
+    return simd_get_level();
+}
+
+#if HAVE_X86_SIMD
+
+/*
+ * Convert up to n fixints starting at mi. Stops at the first non-fixint.
+ * Vector stores may touch up to a block of typeid/value slots beyond
+ * the run (never beyond n); those are overwritten by subsequent items.
+ * Returns the number of items converted.
+ */
+__attribute__((target("avx2")))
+static size_t fixint_run_avx2(const uint8_t * restrict mi, size_t n,
+                              uint8_t * restrict typeid,
+                              struct Value * restrict value)
+{
+    const __m256i min_fixint = _mm256_set1_epi8(-33);
+    const __m256i long_value = _mm256_set1_epi8(LongValue);
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i  x = _mm256_loadu_si256((const __m256i *)(mi + i));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+                            _mm256_cmpgt_epi8(x, min_fixint));
+        _mm256_storeu_si256((__m256i *)(typeid + i), long_value);
+        for (size_t j = 0; j < 32; j += 4) {
+            __m128i b = _mm_cvtsi32_si128((int)unaligned(mi + i + j)->u32);
+            _mm256_storeu_si256((__m256i *)(value + i + j),
+                                _mm256_cvtepi8_epi64(b));
+        }
+        if (mask != UINT32_MAX)
+            return i + __builtin_ctz(~mask);
+    }
+    for (; i < n && (int8_t)mi[i] >= -32; i++) {
+        typeid[i] = LongValue;
+        value[i].ival = (int8_t)mi[i];
+    }
+    return i;
+}
+
+__attribute__((target("sse4.2")))
+static size_t fixint_run_sse42(const uint8_t * restrict mi, size_t n,
+                               uint8_t * restrict typeid,
+                               struct Value * restrict value)
+{
+    const __m128i min_fixint = _mm_set1_epi8(-33);
+    const __m128i long_value = _mm_set1_epi8(LongValue);
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i  x = _mm_loadu_si128((const __m128i *)(mi + i));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(
+                            _mm_cmpgt_epi8(x, min_fixint));
+        _mm_storeu_si128((__m128i *)(typeid + i), long_value);
+        for (size_t j = 0; j < 16; j += 2) {
+            __m128i b = _mm_cvtsi32_si128(unaligned(mi + i + j)->u16);
+            _mm_storeu_si128((__m128i *)(value + i + j),
+                             _mm_cvtepi8_epi64(b));
+        }
+        if (mask != 0xffff)
+            return i + __builtin_ctz(~mask);
+    }
+    for (; i < n && (int8_t)mi[i] >= -32; i++) {
+        typeid[i] = LongValue;
+        value[i].ival = (int8_t)mi[i];
+    }
+    return i;
+}
+
+#endif /* HAVE_X86_SIMD */
+
+static inline size_t fixint_run(int level,
+                                const uint8_t * restrict mi, size_t n,
+                                uint8_t * restrict typeid,
+                                struct Value * restrict value)
+{
+#if HAVE_X86_SIMD
+    if (level == SimdAVX2)
+        return fixint_run_avx2(mi, n, typeid, value);
+    return fixint_run_sse42(mi, n, typeid, value);
+#else
+    (void)level; (void)mi; (void)n; (void)typeid; (void)value;
+    return 0;
+#endif
+}
+
+/*
+ * Parser state saved between calls in resumable mode (see Stream).
+ */
+struct ParseCtx {
+    size_t             nitems;   // items in t/v so far
+    size_t             depth;    // nesting stack depth
+    uint32_t           todo;
+    uint32_t           patch;
+    const uint8_t     *mi;       // where to resume / where the data ended
+};
+
+/*
+ * Strings are referenced with offsets relative to *ref*, i.e. b1.
+ * One-shot mode (ctx == NULL) passes ref = me. In resumable mode
+ * ref is fixed beyond the buffer end, hence the offsets remain valid
+ * when more data is appended. On underflow, the partial item is rolled
+ * back and 1 returned ("need more") instead of failing.
+ */
+static inline __attribute__((always_inline))
+int parse_msgpack_impl(struct State *state,
+                       const uint8_t * restrict mi,
+                       const uint8_t *me,
+                       const uint8_t *ref,
+                       struct ParseCtx *ctx)
+{
+    const uint8_t *item_start;
     uint8_t       * restrict typeid;
     struct Value  * restrict value, *value_max, *value_buf;
     uint32_t       todo = 1, patch = -1;
     uint32_t      * restrict stack, *stack_max, *stack_buf;
     uint32_t       len;
+    int            simd = simd_get_level();
+    int            raw = state->raw;
 
 #if 0
     /* Debug  */
     fprintf(stderr, "parse_msgpack; s: ");
-    for (int i = 0; i < ms; ++i)
+    for (int i = 0; i < me - mi; ++i)
         fprintf(stderr, "%02X ", mi[i]);
     fprintf(stderr, "\b\n");
 #endif
@@ -197,6 +490,14 @@ int parse_msgpack(struct State *state,
     stack_max = (void *)(state->ov + state->ot_capacity);
     stack_buf = (void *)(state->ov);
 
+    if (ctx) {
+        typeid += ctx->nitems;
+        value  += ctx->nitems;
+        stack  += ctx->depth;
+        todo    = ctx->todo;
+        patch   = ctx->patch;
+    }
+
     if (0) {
 repeat:
         value++; typeid++;
@@ -210,10 +511,16 @@ repeat:
 
         todo = *--stack;
         fixit = value_buf + patch;
+        if (raw) {
+            /* the container is complete, record its size */
+            struct Value *range = state->rv + patch;
+            range->xlen = range->xoff - (uint32_t)(ref - mi);
+        }
         patch = fixit->xoff;
         fixit->xoff = value - fixit;
     }
 
+    item_start = mi;
     if (mi == me)
         goto error_underflow;
 
@@ -222,8 +529,7 @@ repeat:
 
         size_t old_capacity = state->t_capacity;
 
-        if (buf_grow_tv(&state->t, &state->v, &state->t_capacity,
-                        next_capacity(old_capacity + 1)) != 0)
+        if (tv_grow(state, next_capacity(old_capacity + 1)) != 0)
             goto error_alloc;
 
         typeid    = state->t + old_capacity;
@@ -237,7 +543,7 @@ repeat:
         /* positive fixint */
         *typeid = LongValue;
         value->ival = *mi++;
-        goto repeat;
+        goto more_fixints;
     case 0x80 ... 0x8f:
         /* fixmap */
         len = *mi++ - 0x80;
@@ -253,12 +559,18 @@ repeat:
 setup_nested:
         value->xoff = patch;
         patch = value - value_buf;
+        if (raw) {
+            if (__builtin_expect(patch >= state->rv_capacity, 0) &&
+                buf_grow_v(&state->rv, &state->rv_capacity,
+                           state->t_capacity) != 0)
+                goto error_alloc;
+            state->rv[patch].xoff = (uint32_t)(ref - item_start);
+        }
         if (__builtin_expect(stack == stack_max, 0)) {
 
             size_t old_capacity = state->ot_capacity;
 
-            if (buf_grow_tv(&state->ot, &state->ov, &state->ot_capacity,
-                            next_capacity(old_capacity + 1)) != 0)
+            if (ot_grow(state, next_capacity(old_capacity + 1)) != 0)
                 goto error_alloc;
 
             /* reusing ov for the stack */
@@ -279,7 +591,7 @@ do_xdata:
             goto error_underflow;
         value->xlen = len;
         /* offset relative to blob end! (saves a reg) */
-        value->xoff = (me - mi - 1);
+        value->xoff = (ref - mi - 1);
         mi += len + 1;
         goto repeat;
     case 0xc0:
@@ -526,15 +838,39 @@ do_xdata:
         /* negative fixint */
         *typeid = LongValue;
         value->ival = (int8_t)*mi++;
+more_fixints:
+        /* more siblings follow, likely fixints as well */
+        if (todo >= FIXINT_RUN_MIN && simd != SimdNone) {
+            size_t n = todo;
+            if (n > (size_t)(me - mi))
+                n = me - mi;
+            if (n > (size_t)(value_max - value - 1))
+                n = value_max - value - 1;
+            n = fixint_run(simd, mi, n, typeid + 1, value + 1);
+            mi += n; typeid += n; value += n;
+            todo -= (uint32_t)n;
+        }
         goto repeat;
     }
 
 done:
     state->res_size = value - state->v;
-    state->b1 = me;
+    buf_used(state, BufTV, state->res_size * TV_ITEM_SIZE);
+    state->b1 = ref;
+    if (ctx)
+        ctx->mi = mi;
     return 0;
 
 error_underflow:
+    if (ctx) {
+        /* roll back the partial item, resume from its start */
+        ctx->nitems = value - state->v;
+        ctx->depth  = stack - stack_buf;
+        ctx->todo   = todo + 1;
+        ctx->patch  = patch;
+        ctx->mi     = item_start;
+        return 1;
+    }
     return set_error(state, "Truncated data");
 error_c1:
     return set_error(state, "Invalid data");
@@ -542,62 +878,1323 @@ error_alloc:
     return set_error(state, "Out of memory");
 }
 
-int unparse_msgpack(struct State *state,
-                    size_t        nitems)
+int parse_msgpack(struct State *state,
+                  const uint8_t *mi,
+                  size_t        ms)
 {
-    //nitems--;
-    const uint8_t      * restrict typeid = state->ot - 1;
-    const struct Value * restrict value = state->ov - 1;
-    const uint8_t      * restrict bank1 = state->b1;
-    const uint8_t      * restrict bank2 = state->b2;
-    const uint8_t      * typeid_max = state->ot + nitems;
-    uint8_t            * restrict out, *out_max;
-    const uint8_t      * restrict copy_from = bank1;
+    buf_decay(state);
+    return parse_msgpack_impl(state, mi, mi + ms, mi + ms, NULL);
+}
 
-    out = state->res;
-    out_max = state->res + state->res_capacity;
+/*
+ * Same, once the call began (schema_rt_parse_begin): the input is
+ * in a state buffer (xbuf, see avro.c), it must not shrink.
+ */
+int parse_msgpack_begun(struct State  *state,
+                        const uint8_t *mi,
+                        size_t         ms)
+{
+    return parse_msgpack_impl(state, mi, mi + ms, mi + ms, NULL);
+}
 
-    const uint8_t * typeid2 = typeid;
-    const struct Value * value2 = value;
-#if 0
-    /* Debug  */
-    for (; typeid2 != typeid_max; typeid2++, value2++) {
-        const uint8_t *cmdname =
-            (*typeid2 == 18) ? "PUTSTRC" :
-            (*typeid2 == 12) ? "PUTMAP" :
-            (*typeid2 == 11) ? "PUTARRAYC" :
-            (*typeid2 == 4) ? "PUTINT / PUTLONG" :
-            (*typeid2 == 8) ? "PUTSTR" :
-            (*typeid2 == 7) ? "PUTDOUBLE" :
-            (*typeid2 == 0) ? "(zero)" : "unknown";
-	if (*typeid2 == 7)
-		fprintf(stderr, "unparse_msgpack; *typeid: 0x%02X (%d) -- %s; value: %llx\n", *typeid2, *typeid2, cmdname, *value2);
-	else
-		fprintf(stderr, "unparse_msgpack; *typeid: 0x%02X (%d) -- %s; value: %d\n", *typeid2, *typeid2, cmdname, *value2);
+/*
+ * Resumable parser: a document is fed chunk by chunk.
+ *
+ * The chunks are appended to the stream-owned buffer (all strings
+ * must live in a single bank since t/v reference them with 32 bit
+ * offsets). The parser picks up where it left, i.e. the data is
+ * parsed only once, as it arrives.
+ *
+ * Once complete, items are in state->t/v and b1 points beyond
+ * the buffer end (offsets are relative to the virtual end fixed at
+ * STREAM_REF, so they survive buffer growth). Bytes past the end of
+ * the document are retained; parsing of the next document starts
+ * with them.
+ */
+enum StreamStatus {
+    StreamActive     = 0,
+    StreamComplete   = 1,
+    StreamError      = 2
+};
+
+#define STREAM_REF ((size_t)UINT32_MAX)
+
+struct Stream {
+    struct State      *state;    // t/v hold the result, ov - the stack
+    uint8_t           *buf;
+    size_t             size;
+    size_t             capacity;
+    size_t             pos;      // data before pos is parsed
+    struct ParseCtx    ctx;
+    int                status;
+};
+
+/*
+ * The previous document is consumed: its state follows the buffer
+ * policy, so does the stream buffer (high_water only, a stream isn't
+ * a state, hence no stats).
+ */
+static void stream_decay(struct Stream *s)
+{
+    size_t capacity = next_capacity(s->size > buf_baseline ?
+                                    s->size : buf_baseline);
+
+    buf_decay(s->state);
+    if (s->capacity > buf_high_water && capacity < s->capacity)
+        buf_grow(&s->buf, &s->capacity, capacity);
+}
+
+static void stream_restart(struct Stream *s)
+{
+    s->ctx.nitems = 0;
+    s->ctx.depth  = 0;
+    s->ctx.todo   = 1;
+    s->ctx.patch  = -1;
+    s->status     = StreamActive;
+}
+
+/*
+ * Returns 0 if the document is complete, 1 if more data is needed,
+ * -1 on error (message in state->res).
+ */
+int schema_rt_stream_feed(struct Stream *s,
+                          const uint8_t *chunk,
+                          size_t        len)
+{
+    struct State *state = s->state;
+    int rc;
+
+    if (s->status == StreamError)
+        return -1;
+    if (s->status == StreamComplete) {
+        /* start the next document, keep the data past the end */
+        memmove(s->buf, s->buf + s->pos, s->size - s->pos);
+        s->size -= s->pos;
+        s->pos = 0;
+        stream_restart(s);
+        stream_decay(s);
     }
-#endif
-    int i = 0;
 
-    goto check_buf;
+    if (s->size + len >= STREAM_REF) {
+        s->status = StreamError;
+        return set_error(state, "Document too large");
+    }
+    if (s->size + len > s->capacity &&
+        buf_grow(&s->buf, &s->capacity, next_capacity(s->size + len)) != 0) {
+        s->status = StreamError;
+        return set_error(state, "Out of memory");
+    }
+    if (len != 0)
+        memcpy(s->buf + s->size, chunk, len);
+    s->size += len;
 
-    for (; typeid != typeid_max; typeid++, value++) {
-        /* precondition: at least 10 bytes avail in out */
+    rc = parse_msgpack_impl(state, s->buf + s->pos, s->buf + s->size,
+                            s->buf + STREAM_REF, &s->ctx);
+    if (rc < 0) {
+        s->status = StreamError;
+        return -1;
+    }
+    s->pos = s->ctx.mi - s->buf;
+    if (rc == 0)
+        s->status = StreamComplete;
+    return rc;
+}
 
-#if 0
-	    /* Debug  */
-	const uint8_t *cmdname =
-            (*typeid == 18) ? "PUTSTRC" :
-            (*typeid == 12) ? "PUTMAP" :
-            (*typeid == 11) ? "PUTARRAYC" :
-            (*typeid == 4) ? "PUTINT / PUTLONG" :
-            (*typeid == 8) ? "PUTSTR" :
-            (*typeid == 7) ? "PUTDOUBLE" :
-            (*typeid == 0) ? "(zero)" : "unknown";
-        fprintf(stderr, "%02d; unparse_msgpack; in for; *typeid: 0x%02X (%d) -- %s; value: %d\n", i, *typeid, *typeid, cmdname, *value);
-#endif
-        ++i;
+int schema_rt_stream_init(struct Stream *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->state = calloc(1, sizeof(*s->state));
+    if (s->state == NULL)
+        return -1;
+    stream_restart(s);
+    return 0;
+}
 
-        switch (*typeid) {
+/* Discard everything, including the buffered data. */
+void schema_rt_stream_reset(struct Stream *s)
+{
+    s->size = 0;
+    s->pos = 0;
+    stream_restart(s);
+}
+
+/* Release the buffers, the state itself is owned by the caller. */
+void schema_rt_state_destroy(struct State *state)
+{
+    free(state->res);
+    free(state->t);
+    free(state->v);
+    free(state->ot);
+    free(state->ov);
+    free(state->rv);
+    free(state->batch.buf);
+    free(state->vm_stack);
+    free(state->xbuf);
+    memset(state, 0, sizeof(*state));
+}
+
+void schema_rt_stream_destroy(struct Stream *s)
+{
+    if (s->state != NULL) {
+        schema_rt_state_destroy(s->state);
+        free(s->state);
+    }
+    free(s->buf);
+    memset(s, 0, sizeof(*s));
+}
+
+/*
+ * JSON parser, fills t/v as parse_msgpack does.
+ *
+ * Open containers are chained through xoff (as in parse_msgpack);
+ * element counts are unknown upfront, hence xlen is bumped as
+ * elements arrive.
+ *
+ * Strings are referenced in place (b1 is the input end). The first
+ * string with escapes moves the bank to xbuf: [decoded | input copy],
+ * each half sized as the input. A decoded string is never longer than
+ * its source, hence the lower half is enough. Since the copy is at the
+ * bank end, offsets of the strings referenced so far remain valid.
+ *
+ * Numbers become LongValue (UlongValue above INT64_MAX); with a
+ * fraction, an exponent or out of 64 bit range - DoubleValue.
+ *
+ * Raw ranges (rv) must be msgpack, see render_raw.
+ */
+struct JsonBank {
+    const uint8_t     *ms;       // input start
+    const uint8_t     *me;       // input end
+    size_t             size;     // bank size, 0 - still in place
+    size_t             used;     // decoded strings in xbuf
+};
+
+static inline const uint8_t *json_skip_ws(const uint8_t *mi,
+                                          const uint8_t *me)
+{
+    while (mi != me &&
+           (*mi == ' ' || *mi == '\n' || *mi == '\r' || *mi == '\t'))
+        mi++;
+    return mi;
+}
+
+static int xbuf_reserve(struct State *state, size_t size)
+{
+    uint8_t *xbuf;
+
+    buf_used(state, BufX, size);
+    if (state->xbuf_capacity >= size)
+        return 0;
+    state->stats[BufX].grows++;
+    xbuf = realloc(state->xbuf, size);
+    if (xbuf == NULL)
+        return -1;
+    state->xbuf = xbuf;
+    state->xbuf_capacity = size;
+    return 0;
+}
+
+static int json_bank_init(struct State *state, struct JsonBank *bank)
+{
+    size_t size = bank->me - bank->ms;
+
+    if (size > UINT32_MAX / 2 ||
+        xbuf_reserve(state, size * 2) != 0)
+        return -1;
+    memcpy(state->xbuf + size, bank->ms, size);
+    bank->size = size * 2;
+    bank->used = 0;
+    return 0;
+}
+
+static inline int json_hex4(const uint8_t *mi, uint32_t *res)
+{
+    uint32_t v = 0;
+
+    for (int i = 0; i < 4; i++) {
+        uint8_t c = mi[i];
+        v <<= 4;
+        if (c >= '0' && c <= '9')
+            v |= c - '0';
+        else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+            v |= (c | 0x20) - 'a' + 10;
+        else
+            return -1;
+    }
+    *res = v;
+    return 0;
+}
+
+static inline uint8_t *json_put_utf8(uint8_t *out, uint32_t c)
+{
+    if (c < 0x80) {
+        *out++ = (uint8_t)c;
+    } else if (c < 0x800) {
+        *out++ = 0xc0 | (c >> 6);
+        *out++ = 0x80 | (c & 0x3f);
+    } else if (c < 0x10000) {
+        *out++ = 0xe0 | (c >> 12);
+        *out++ = 0x80 | ((c >> 6) & 0x3f);
+        *out++ = 0x80 | (c & 0x3f);
+    } else {
+        *out++ = 0xf0 | (c >> 18);
+        *out++ = 0x80 | ((c >> 12) & 0x3f);
+        *out++ = 0x80 | ((c >> 6) & 0x3f);
+        *out++ = 0x80 | (c & 0x3f);
+    }
+    return out;
+}
+
+/*
+ * Decode a string with escapes into out; mi is the first escape.
+ * Returns the position after the closing quote, NULL if invalid
+ * (*truncated is set if the input ended).
+ */
+static const uint8_t *json_unescape(const uint8_t *mi,
+                                    const uint8_t *me,
+                                    uint8_t      **out,
+                                    int           *truncated)
+{
+    uint8_t  *o = *out;
+    uint32_t  c, c2;
+
+    while (mi != me) {
+        if (*mi == '"') {
+            *out = o;
+            return mi + 1;
+        }
+        if (*mi < 0x20)
+            return NULL;
+        if (*mi != '\\') {
+            *o++ = *mi++;
+            continue;
+        }
+        if (me - mi < 2)
+            break;
+        switch (mi[1]) {
+        case '"': case '\\': case '/':
+            *o++ = mi[1];
+            break;
+        case 'b': *o++ = '\b'; break;
+        case 'f': *o++ = '\f'; break;
+        case 'n': *o++ = '\n'; break;
+        case 'r': *o++ = '\r'; break;
+        case 't': *o++ = '\t'; break;
+        case 'u':
+            if (me - mi < 6)
+                goto underflow;
+            if (json_hex4(mi + 2, &c) != 0)
+                return NULL;
+            mi += 6;
+            if (c >= 0xd800 && c < 0xdc00) {
+                /* a surrogate pair */
+                if (me - mi < 6)
+                    goto underflow;
+                if (mi[0] != '\\' || mi[1] != 'u' ||
+                    json_hex4(mi + 2, &c2) != 0 ||
+                    c2 < 0xdc00 || c2 >= 0xe000)
+                    return NULL;
+                c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+                mi += 6;
+            } else if (c >= 0xdc00 && c < 0xe000) {
+                return NULL;
+            }
+            o = json_put_utf8(o, c);
+            continue;
+        default:
+            return NULL;
+        }
+        mi += 2;
+    }
+underflow:
+    *truncated = 1;
+    return NULL;
+}
+
+/*
+ * A string at mi (the opening quote); the result is StringValue.
+ * Returns the position after the closing quote, NULL on error
+ * (message in *error).
+ */
+static inline const uint8_t *json_string(struct State    *state,
+                                         struct JsonBank *bank,
+                                         const uint8_t   *mi,
+                                         struct Value    *value,
+                                         const char     **error)
+{
+    const uint8_t *me = bank->me, *start = ++mi;
+    uint8_t       *out;
+    int            truncated = 0;
+
+    while (mi != me && *mi != '"' && *mi != '\\' && *mi >= 0x20)
+        mi++;
+    if (mi == me) {
+        *error = "Truncated data";
+        return NULL;
+    }
+    if (*mi == '"') {
+        value->xlen = (uint32_t)(mi - start);
+        value->xoff = (uint32_t)(me - start);
+        return mi + 1;
+    }
+    if (*mi < 0x20) {
+        *error = "Invalid data";
+        return NULL;
+    }
+    if (bank->size == 0 && json_bank_init(state, bank) != 0) {
+        *error = "Out of memory";
+        return NULL;
+    }
+    out = state->xbuf + bank->used;
+    memcpy(out, start, mi - start);
+    out += mi - start;
+    mi = json_unescape(mi, me, &out, &truncated);
+    if (mi == NULL) {
+        *error = truncated ? "Truncated data" : "Invalid data";
+        return NULL;
+    }
+    value->xlen = (uint32_t)(out - (state->xbuf + bank->used));
+    value->xoff = (uint32_t)(bank->size - bank->used);
+    bank->used = out - state->xbuf;
+    return mi;
+}
+
+static inline int json_digit(const uint8_t *mi, const uint8_t *me)
+{
+    return mi != me && *mi >= '0' && *mi <= '9';
+}
+
+/* A number at mi; returns the position after it, NULL if invalid. */
+static const uint8_t *json_number(const uint8_t *mi,
+                                  const uint8_t *me,
+                                  uint8_t       *typeid,
+                                  struct Value  *value)
+{
+    const uint8_t *start = mi;
+    uint64_t       u = 0;
+    int            neg = 0, fp = 0;
+    char           buf[64], *copy;
+    size_t         len;
+
+    if (*mi == '-') {
+        neg = 1;
+        mi++;
+    }
+    if (!json_digit(mi, me))
+        return NULL;
+    if (*mi == '0') {
+        mi++;
+    } else {
+        do {
+            uint32_t d = *mi++ - '0';
+            if (u > (UINT64_MAX - d) / 10)
+                fp = 1; /* out of range */
+            u = u * 10 + d;
+        } while (json_digit(mi, me));
+    }
+    if (mi != me && *mi == '.') {
+        fp = 1;
+        if (!json_digit(++mi, me))
+            return NULL;
+        while (json_digit(mi, me))
+            mi++;
+    }
+    if (mi != me && (*mi | 0x20) == 'e') {
+        fp = 1;
+        mi++;
+        if (mi != me && (*mi == '+' || *mi == '-'))
+            mi++;
+        if (!json_digit(mi, me))
+            return NULL;
+        while (json_digit(mi, me))
+            mi++;
+    }
+    if (!fp) {
+        if (!neg) {
+            *typeid = u > (uint64_t)INT64_MAX ? UlongValue : LongValue;
+            value->uval = u;
+            return mi;
+        }
+        if (u <= (uint64_t)INT64_MAX + 1) {
+            *typeid = LongValue;
+            value->uval = 0 - u;
+            return mi;
+        }
+    }
+    /* strtod needs a terminated string */
+    len = mi - start;
+    copy = len < sizeof(buf) ? buf : malloc(len + 1);
+    if (copy == NULL)
+        return NULL;
+    memcpy(copy, start, len);
+    copy[len] = 0;
+    *typeid = DoubleValue;
+    value->dval = strtod(copy, NULL);
+    if (copy != buf)
+        free(copy);
+    return mi;
+}
+
+static inline const uint8_t *json_literal(const uint8_t *mi,
+                                          const uint8_t *me,
+                                          const char    *lit,
+                                          size_t         len)
+{
+    if ((size_t)(me - mi) < len || memcmp(mi, lit, len) != 0)
+        return NULL;
+    return mi + len;
+}
+
+/* Msgpack size of an item (containers: the header only). */
+static inline size_t msgpack_item_size(uint8_t             typeid,
+                                       const struct Value *value)
+{
+    switch (typeid) {
+    case LongValue:
+        if (value->ival >= -0x20 && value->ival <= 0x7f)
+            return 1;
+        if (value->ival >= INT8_MIN && value->ival <= UINT8_MAX)
+            return 2;
+        if (value->ival >= INT16_MIN && value->ival <= UINT16_MAX)
+            return 3;
+        if (value->ival >= INT32_MIN && value->ival <= UINT32_MAX)
+            return 5;
+        return 9;
+    case UlongValue:
+    case DoubleValue:
+        return 9;
+    case StringValue:
+        return value->xlen + (value->xlen < 32 ? 1 :
+                              value->xlen <= UINT8_MAX ? 2 :
+                              value->xlen <= UINT16_MAX ? 3 : 5);
+    case ArrayValue:
+    case MapValue:
+        return value->xlen < 16 ? 1 : value->xlen <= UINT16_MAX ? 3 : 5;
+    default:
+        return 1;
+    }
+}
+
+static uint8_t *msgpack_put_item(uint8_t            *out,
+                                 uint8_t             typeid,
+                                 const struct Value *value,
+                                 const uint8_t      *b1)
+{
+    uint32_t len = value->xlen;
+    int64_t  v = value->ival;
+
+    switch (typeid) {
+    case NilValue:   *out++ = 0xc0; return out;
+    case FalseValue: *out++ = 0xc2; return out;
+    case TrueValue:  *out++ = 0xc3; return out;
+    case LongValue:
+        if (v >= -0x20 && v <= 0x7f) {
+            *out++ = (uint8_t)v;
+        } else if (v >= INT8_MIN && v <= UINT8_MAX) {
+            *out++ = v < 0 ? 0xd0 : 0xcc;
+            *out++ = (uint8_t)v;
+        } else if (v >= INT16_MIN && v <= UINT16_MAX) {
+            *out++ = v < 0 ? 0xd1 : 0xcd;
+            unaligned(out)->u16 = host2net16((uint16_t)v);
+            out += 2;
+        } else if (v >= INT32_MIN && v <= UINT32_MAX) {
+            *out++ = v < 0 ? 0xd2 : 0xce;
+            unaligned(out)->u32 = host2net32((uint32_t)v);
+            out += 4;
+        } else {
+            *out++ = v < 0 ? 0xd3 : 0xcf;
+            unaligned(out)->u64 = host2net64(value->uval);
+            out += 8;
+        }
+        return out;
+    case UlongValue:
+        *out++ = 0xcf;
+        unaligned(out)->u64 = host2net64(value->uval);
+        return out + 8;
+    case DoubleValue:
+        *out++ = 0xcb;
+        unaligned(out)->u64 = host2net64(value->uval);
+        return out + 8;
+    case StringValue:
+        if (len < 32) {
+            *out++ = 0xa0 | len;
+        } else if (len <= UINT8_MAX) {
+            *out++ = 0xd9;
+            *out++ = (uint8_t)len;
+        } else if (len <= UINT16_MAX) {
+            *out++ = 0xda;
+            unaligned(out)->u16 = host2net16((uint16_t)len);
+            out += 2;
+        } else {
+            *out++ = 0xdb;
+            unaligned(out)->u32 = host2net32(len);
+            out += 4;
+        }
+        memcpy(out, b1 - value->xoff, len);
+        return out + len;
+    default: /* ArrayValue, MapValue */
+        if (len < 16) {
+            *out++ = (typeid == ArrayValue ? 0x90 : 0x80) | len;
+        } else if (len <= UINT16_MAX) {
+            *out++ = typeid == ArrayValue ? 0xdc : 0xde;
+            unaligned(out)->u16 = host2net16((uint16_t)len);
+            out += 2;
+        } else {
+            *out++ = typeid == ArrayValue ? 0xdd : 0xdf;
+            unaligned(out)->u32 = host2net32(len);
+            out += 4;
+        }
+        return out;
+    }
+}
+
+/*
+ * Raw ranges must be valid msgpack. Parsers of other formats (JSON,
+ * Lua objects) render the document as msgpack in front of the bank
+ * (bank_size bytes, moved to xbuf unless there already), i.e. the bank
+ * is at the end again and the string offsets are unchanged. Item start
+ * positions are in rv temporarily.
+ */
+static int render_raw(struct State  *state,
+                      size_t         nitems,
+                      const uint8_t *bank,
+                      size_t         bank_size)
+{
+    const uint8_t *t = state->t;
+    struct Value  *v = state->v, *rv;
+    uint8_t       *base;
+    size_t         pos = 0, size;
+    int            in_xbuf = bank == state->xbuf;
+
+    if (state->rv_capacity < nitems &&
+        buf_grow_v(&state->rv, &state->rv_capacity,
+                   next_capacity(nitems)) != 0)
+        return -1;
+    rv = state->rv;
+    for (size_t i = 0; i < nitems; i++) {
+        rv[i].uval = pos;
+        pos += msgpack_item_size(t[i], v + i);
+    }
+    size = pos;
+    if (size + bank_size > UINT32_MAX ||
+        xbuf_reserve(state, size + bank_size) != 0)
+        return -1;
+    base = state->xbuf;
+    if (in_xbuf)
+        memmove(base + size, base, bank_size);
+    else if (bank_size != 0)
+        memcpy(base + size, bank, bank_size);
+    state->b1 = base + size + bank_size;
+    for (size_t i = 0; i < nitems; i++) {
+        size_t start = rv[i].uval, end;
+
+        msgpack_put_item(base + start, t[i], v + i, state->b1);
+        if (t[i] != ArrayValue && t[i] != MapValue)
+            continue;
+        /* rv of the items that follow are intact */
+        end = i + v[i].xoff < nitems ? rv[i + v[i].xoff].uval : size;
+        rv[i].xlen = (uint32_t)(end - start);
+        rv[i].xoff = (uint32_t)(size + bank_size - start);
+    }
+    return 0;
+}
+
+int parse_json(struct State  *state,
+               const uint8_t *mi,
+               size_t         ms)
+{
+    struct JsonBank bank = { .ms = mi, .me = mi + ms };
+    const uint8_t  *me = mi + ms;
+    uint8_t        *typeid;
+    struct Value   *value, *value_max, *value_buf, *fixit;
+    uint32_t        patch = -1;
+    const char     *error = "Invalid data";
+
+    buf_decay(state);
+    typeid    = state->t;
+    value     = state->v;
+    value_max = state->v + state->t_capacity;
+    value_buf = state->v;
+
+parse_value:
+    mi = json_skip_ws(mi, me);
+    if (mi == me)
+        goto error_underflow;
+    if (__builtin_expect(value == value_max, 0)) {
+        size_t nitems = value - value_buf;
+        if (tv_grow(state, next_capacity(nitems + 1)) != 0)
+            goto error_alloc;
+        typeid    = state->t + nitems;
+        value     = state->v + nitems;
+        value_max = state->v + state->t_capacity;
+        value_buf = state->v;
+    }
+    switch (*mi) {
+    case '{':
+        *typeid = MapValue;
+        goto open_container;
+    case '[':
+        *typeid = ArrayValue;
+open_container:
+        value->xlen = 0;
+        value->xoff = patch;
+        patch = value - value_buf;
+        value++; typeid++;
+        mi = json_skip_ws(mi + 1, me);
+        if (mi == me)
+            goto error_underflow;
+        if (*mi == (typeid[-1] == MapValue ? '}' : ']')) {
+            mi++;
+            goto close_container;
+        }
+        value_buf[patch].xlen = 1;
+        if (typeid[-1] == MapValue)
+            goto parse_key;
+        goto parse_value;
+    case '"':
+        *typeid = StringValue;
+        mi = json_string(state, &bank, mi, value, &error);
+        if (mi == NULL)
+            goto error;
+        break;
+    case 't':
+        *typeid = TrueValue;
+        mi = json_literal(mi, me, "true", 4);
+        goto check_literal;
+    case 'f':
+        *typeid = FalseValue;
+        mi = json_literal(mi, me, "false", 5);
+        goto check_literal;
+    case 'n':
+        *typeid = NilValue;
+        mi = json_literal(mi, me, "null", 4);
+check_literal:
+        if (mi == NULL)
+            goto error;
+        break;
+    case '-':
+    case '0' ... '9':
+        mi = json_number(mi, me, typeid, value);
+        if (mi == NULL)
+            goto error;
+        break;
+    default:
+        goto error;
+    }
+    value++; typeid++;
+
+next:
+    if (patch == (uint32_t)-1)
+        goto done;
+    mi = json_skip_ws(mi, me);
+    if (mi == me)
+        goto error_underflow;
+    fixit = value_buf + patch;
+    if (state->t[patch] == MapValue) {
+        if (*mi == '}') {
+            mi++;
+            goto close_container;
+        }
+        if (*mi != ',')
+            goto error;
+        mi++;
+        fixit->xlen++;
+parse_key:
+        mi = json_skip_ws(mi, me);
+        if (mi == me)
+            goto error_underflow;
+        if (*mi != '"')
+            goto error;
+        if (__builtin_expect(value == value_max, 0)) {
+            size_t nitems = value - value_buf;
+            if (tv_grow(state, next_capacity(nitems + 1)) != 0)
+                goto error_alloc;
+            typeid    = state->t + nitems;
+            value     = state->v + nitems;
+            value_max = state->v + state->t_capacity;
+            value_buf = state->v;
+        }
+        *typeid = StringValue;
+        mi = json_string(state, &bank, mi, value, &error);
+        if (mi == NULL)
+            goto error;
+        value++; typeid++;
+        mi = json_skip_ws(mi, me);
+        if (mi == me)
+            goto error_underflow;
+        if (*mi != ':')
+            goto error;
+        mi++;
+        goto parse_value;
+    }
+    if (*mi == ']') {
+        mi++;
+        goto close_container;
+    }
+    if (*mi != ',')
+        goto error;
+    mi++;
+    fixit->xlen++;
+    goto parse_value;
+
+close_container:
+    fixit = value_buf + patch;
+    patch = fixit->xoff;
+    fixit->xoff = (uint32_t)(value - fixit);
+    goto next;
+
+done:
+    if (json_skip_ws(mi, me) != me)
+        goto error;
+    state->res_size = value - value_buf;
+    buf_used(state, BufTV, state->res_size * TV_ITEM_SIZE);
+    state->b1 = bank.size ? state->xbuf + bank.size : me;
+    if (state->raw &&
+        (bank.size ? render_raw(state, state->res_size, state->xbuf,
+                                bank.size) :
+                     render_raw(state, state->res_size, bank.ms, ms)) != 0)
+        goto error_alloc;
+    return 0;
+
+error_underflow:
+    return set_error(state, "Truncated data");
+error:
+    return set_error(state, error);
+error_alloc:
+    return set_error(state, "Out of memory");
+}
+
+/*
+ * Parsers outside of this file (Lua objects, table.c) fill t/v
+ * themselves, these take care of the rest.
+ */
+void schema_rt_parse_begin(struct State *state)
+{
+    buf_decay(state);
+}
+
+int schema_rt_tv_reserve(struct State *state,
+                         size_t        nitems)
+{
+    if (nitems <= state->t_capacity)
+        return 0;
+    return tv_grow(state, next_capacity(nitems));
+}
+
+/* Strings are relative to bank + bank_size. */
+int schema_rt_parse_end(struct State  *state,
+                        size_t         nitems,
+                        const uint8_t *bank,
+                        size_t         bank_size)
+{
+    state->res_size = nitems;
+    buf_used(state, BufTV, nitems * TV_ITEM_SIZE);
+    state->b1 = bank + bank_size;
+    if (state->raw && render_raw(state, nitems, bank, bank_size) != 0)
+        return -1;
+    return 0;
+}
+
+/* Same for emitters outside of this file. */
+void schema_rt_unparse_begin(struct State *state,
+                             size_t        nitems)
+{
+    buf_used(state, BufOT, nitems * TV_ITEM_SIZE);
+}
+
+/*
+ * SIMD fast path for unparse_msgpack.
+ *
+ * Numeric arrays and records come as long runs of LongValue,
+ * FloatValue or DoubleValue items (arrays of long and double are mostly
+ * copied verbatim, see RawCommand; not float arrays, the values are
+ * narrowed). A run is found comparing a block of typeids at once and
+ * encoded in a tight loop, with a single buffer check. Doubles are
+ * byte-swapped a vector at a time, floats are narrowed and byte-swapped
+ * a vector at a time. Integer widths are picked for a vector of values at
+ * once: the range checks are nested, hence the width class is the
+ * number of checks failed; blocks of fixints are packed with a shuffle.
+ *
+ * A value is always stored as 8 bytes following the header, the output
+ * advances by the actual size. Up to 8 bytes past the end of the run
+ * are clobbered, the headroom covers that (UNPARSE_SLACK in exact-size
+ * mode).
+ *
+ * As with the parser, the level is set with schema_rt_set_simd(),
+ * SimdNone keeps the reference path. The output is exactly the same
+ * regardless of the path.
+ */
+
+/* Runs shorter than that take the regular path. */
+#define NUMERIC_RUN_MIN 16
+
+#if HAVE_X86_SIMD
+
+/* Integers by width class: fixint, 8, 16, 32 and 64 bit. */
+static const uint8_t long_header[2][5] = {
+    { 0x00, 0xcc, 0xcd, 0xce, 0xcf },   /* non-negative */
+    { 0x00, 0xd0, 0xd1, 0xd2, 0xd3 }    /* negative */
+};
+static const uint8_t long_size[5]  = { 1, 2, 3, 5, 9 };
+static const uint8_t long_shift[5] = { 0, 56, 48, 32, 0 };
+
+static inline uint8_t *put_long_class(uint8_t *out, int64_t v, unsigned k)
+{
+    out[0] = k == 0 ? (uint8_t)v : long_header[v < 0][k];
+    unaligned(out + 1)->u64 = host2net64((uint64_t)v << long_shift[k]);
+    return out + long_size[k];
+}
+
+__attribute__((target("avx2")))
+static size_t type_run_avx2(const uint8_t *typeid, size_t n, uint8_t t)
+{
+    const __m256i x = _mm256_set1_epi8((char)t);
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                            _mm256_loadu_si256((const __m256i *)(typeid + i)),
+                            x));
+        if (mask != UINT32_MAX)
+            return i + __builtin_ctz(~mask);
+    }
+    while (i < n && typeid[i] == t)
+        i++;
+    return i;
+}
+
+__attribute__((target("sse4.2")))
+static size_t type_run_sse42(const uint8_t *typeid, size_t n, uint8_t t)
+{
+    const __m128i x = _mm_set1_epi8((char)t);
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(
+                            _mm_loadu_si128((const __m128i *)(typeid + i)),
+                            x));
+        if (mask != 0xffff)
+            return i + __builtin_ctz(~mask);
+    }
+    while (i < n && typeid[i] == t)
+        i++;
+    return i;
+}
+
+__attribute__((target("avx2")))
+static uint8_t *double_run_avx2(uint8_t * restrict out,
+                                const struct Value * restrict value,
+                                size_t n)
+{
+    const __m256i bswap = _mm256_set_epi8(
+        8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7,
+        8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_shuffle_epi8(
+                        _mm256_loadu_si256((const __m256i *)(value + i)),
+                        bswap);
+        __m128i lo = _mm256_castsi256_si128(x);
+        __m128i hi = _mm256_extracti128_si256(x, 1);
+        out[0] = out[9] = out[18] = out[27] = 0xcb;
+        _mm_storel_epi64((__m128i *)(out + 1), lo);
+        _mm_storel_epi64((__m128i *)(out + 10), _mm_unpackhi_epi64(lo, lo));
+        _mm_storel_epi64((__m128i *)(out + 19), hi);
+        _mm_storel_epi64((__m128i *)(out + 28), _mm_unpackhi_epi64(hi, hi));
+        out += 36;
+    }
+    for (; i < n; i++) {
+        out[0] = 0xcb;
+        unaligned(out + 1)->u64 = host2net64(value[i].uval);
+        out += 9;
+    }
+    return out;
+}
+
+__attribute__((target("sse4.2")))
+static uint8_t *double_run_sse42(uint8_t * restrict out,
+                                 const struct Value * restrict value,
+                                 size_t n)
+{
+    const __m128i bswap = _mm_set_epi8(8, 9, 10, 11, 12, 13, 14, 15,
+                                       0, 1, 2, 3, 4, 5, 6, 7);
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2) {
+        __m128i x = _mm_shuffle_epi8(
+                        _mm_loadu_si128((const __m128i *)(value + i)),
+                        bswap);
+        out[0] = out[9] = 0xcb;
+        _mm_storel_epi64((__m128i *)(out + 1), x);
+        _mm_storel_epi64((__m128i *)(out + 10), _mm_unpackhi_epi64(x, x));
+        out += 18;
+    }
+    for (; i < n; i++) {
+        out[0] = 0xcb;
+        unaligned(out + 1)->u64 = host2net64(value[i].uval);
+        out += 9;
+    }
+    return out;
+}
+
+__attribute__((target("avx2")))
+static uint8_t *float_run_avx2(uint8_t * restrict out,
+                               const struct Value * restrict value,
+                               size_t n)
+{
+    const __m128i bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+                                       4, 5, 6, 7, 0, 1, 2, 3);
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = _mm_shuffle_epi8(_mm_castps_si128(_mm256_cvtpd_ps(
+                        _mm256_loadu_pd((const double *)(value + i)))),
+                        bswap);
+        out[0] = out[5] = out[10] = out[15] = 0xca;
+        unaligned(out + 1)->u32 = (uint32_t)_mm_extract_epi32(x, 0);
+        unaligned(out + 6)->u32 = (uint32_t)_mm_extract_epi32(x, 1);
+        unaligned(out + 11)->u32 = (uint32_t)_mm_extract_epi32(x, 2);
+        unaligned(out + 16)->u32 = (uint32_t)_mm_extract_epi32(x, 3);
+        out += 20;
+    }
+    for (; i < n; i++) {
+        struct unaligned_storage ux;
+        ux.f32 = (float)value[i].dval;
+        out[0] = 0xca;
+        unaligned(out + 1)->u32 = host2net32(ux.u32);
+        out += 5;
+    }
+    return out;
+}
+
+__attribute__((target("sse4.2")))
+static uint8_t *float_run_sse42(uint8_t * restrict out,
+                                const struct Value * restrict value,
+                                size_t n)
+{
+    const __m128i bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+                                       4, 5, 6, 7, 0, 1, 2, 3);
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2) {
+        __m128i x = _mm_shuffle_epi8(_mm_castps_si128(_mm_cvtpd_ps(
+                        _mm_loadu_pd((const double *)(value + i)))),
+                        bswap);
+        out[0] = out[5] = 0xca;
+        unaligned(out + 1)->u32 = (uint32_t)_mm_extract_epi32(x, 0);
+        unaligned(out + 6)->u32 = (uint32_t)_mm_extract_epi32(x, 1);
+        out += 10;
+    }
+    for (; i < n; i++) {
+        struct unaligned_storage ux;
+        ux.f32 = (float)value[i].dval;
+        out[0] = 0xca;
+        unaligned(out + 1)->u32 = host2net32(ux.u32);
+        out += 5;
+    }
+    return out;
+}
+
+/* Nonzero lanes: v out of [lo, hi]. */
+#define LONG_OUT_OF_RANGE_AVX2(v, lo, hi) \
+    _mm256_or_si256(_mm256_cmpgt_epi64(_mm256_set1_epi64x(lo), (v)), \
+                    _mm256_cmpgt_epi64((v), _mm256_set1_epi64x(hi)))
+#define LONG_OUT_OF_RANGE_SSE42(v, lo, hi) \
+    _mm_or_si128(_mm_cmpgt_epi64(_mm_set1_epi64x(lo), (v)), \
+                 _mm_cmpgt_epi64((v), _mm_set1_epi64x(hi)))
+
+__attribute__((target("avx2")))
+static uint8_t *long_run_avx2(uint8_t * restrict out,
+                              const struct Value * restrict value,
+                              size_t n)
+{
+    /* the low byte of every lane to the bottom of the vector */
+    const __m256i low_bytes = _mm256_set_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 8, 0,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 8, 0);
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(value + i));
+        __m256i f0 = LONG_OUT_OF_RANGE_AVX2(v, -32, 127);
+        int64_t k[4];
+
+        if (_mm256_testz_si256(f0, f0)) {
+            /* fixints */
+            __m256i b = _mm256_shuffle_epi8(v, low_bytes);
+            uint32_t lo = (uint32_t)_mm256_extract_epi16(b, 0);
+            uint32_t hi = (uint32_t)_mm256_extract_epi16(b, 8);
+            unaligned(out)->u32 = lo | hi << 16;
+            out += 4;
+            continue;
+        }
+        _mm256_storeu_si256((__m256i *)k, _mm256_sub_epi64(
+            _mm256_setzero_si256(),
+            _mm256_add_epi64(
+                _mm256_add_epi64(f0,
+                                 LONG_OUT_OF_RANGE_AVX2(v, INT8_MIN,
+                                                        UINT8_MAX)),
+                _mm256_add_epi64(LONG_OUT_OF_RANGE_AVX2(v, INT16_MIN,
+                                                        UINT16_MAX),
+                                 LONG_OUT_OF_RANGE_AVX2(v, INT32_MIN,
+                                                        UINT32_MAX)))));
+        for (int j = 0; j < 4; j++)
+            out = put_long_class(out, value[i + j].ival, (unsigned)k[j]);
+    }
+    for (; i < n; i++) {
+        int64_t v = value[i].ival;
+        out = put_long_class(out, v,
+                             (v < -32 || v > 127) +
+                             (v < INT8_MIN || v > UINT8_MAX) +
+                             (v < INT16_MIN || v > UINT16_MAX) +
+                             (v < INT32_MIN || v > UINT32_MAX));
+    }
+    return out;
+}
+
+__attribute__((target("sse4.2")))
+static uint8_t *long_run_sse42(uint8_t * restrict out,
+                               const struct Value * restrict value,
+                               size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(value + i));
+        __m128i f0 = LONG_OUT_OF_RANGE_SSE42(v, -32, 127);
+        int64_t k[2];
+
+        if (_mm_testz_si128(f0, f0)) {
+            /* fixints */
+            out[0] = (uint8_t)_mm_extract_epi8(v, 0);
+            out[1] = (uint8_t)_mm_extract_epi8(v, 8);
+            out += 2;
+            continue;
+        }
+        _mm_storeu_si128((__m128i *)k, _mm_sub_epi64(
+            _mm_setzero_si128(),
+            _mm_add_epi64(
+                _mm_add_epi64(f0,
+                              LONG_OUT_OF_RANGE_SSE42(v, INT8_MIN,
+                                                      UINT8_MAX)),
+                _mm_add_epi64(LONG_OUT_OF_RANGE_SSE42(v, INT16_MIN,
+                                                      UINT16_MAX),
+                              LONG_OUT_OF_RANGE_SSE42(v, INT32_MIN,
+                                                      UINT32_MAX)))));
+        out = put_long_class(out, value[i].ival, (unsigned)k[0]);
+        out = put_long_class(out, value[i + 1].ival, (unsigned)k[1]);
+    }
+    for (; i < n; i++) {
+        int64_t v = value[i].ival;
+        out = put_long_class(out, v,
+                             (v < -32 || v > 127) +
+                             (v < INT8_MIN || v > UINT8_MAX) +
+                             (v < INT16_MIN || v > UINT16_MAX) +
+                             (v < INT32_MIN || v > UINT32_MAX));
+    }
+    return out;
+}
+
+#endif /* HAVE_X86_SIMD */
+
+/* Length of the run of typeid t at typeid (n at most). */
+static inline size_t type_run(int level, const uint8_t *typeid, size_t n,
+                              uint8_t t)
+{
+#if HAVE_X86_SIMD
+    if (level == SimdAVX2)
+        return type_run_avx2(typeid, n, t);
+    return type_run_sse42(typeid, n, t);
+#else
+    (void)level; (void)typeid; (void)n; (void)t;
+    return 0;
+#endif
+}
+
+/* Encode a run of n LongValue-s, FloatValue-s or DoubleValue-s. */
+static inline uint8_t *numeric_run(int level, uint8_t *out,
+                                   const struct Value *value, size_t n,
+                                   uint8_t type)
+{
+#if HAVE_X86_SIMD
+    if (type == DoubleValue)
+        return level == SimdAVX2 ? double_run_avx2(out, value, n) :
+                                   double_run_sse42(out, value, n);
+    if (type == FloatValue)
+        return level == SimdAVX2 ? float_run_avx2(out, value, n) :
+                                   float_run_sse42(out, value, n);
+    return level == SimdAVX2 ? long_run_avx2(out, value, n) :
+                               long_run_sse42(out, value, n);
+#else
+    (void)level; (void)value; (void)n; (void)type;
+    return out;
+#endif
+}
+
+/*
+ * Exact size of unparse_msgpack output, the switch mirrors the one in
+ * unparse_msgpack_impl. Stops at an unknown code, the encoder fails
+ * there before writing anything for it.
+ */
+static size_t unparse_msgpack_size(const struct State *state,
+                                   size_t        nitems)
+{
+    const uint8_t      *typeid = state->ot;
+    const uint8_t      *typeid_max = state->ot + nitems;
+    const struct Value *value = state->ov;
+    size_t              size = 0;
+    int                 simd = simd_get_level();
+    size_t              run;
+    uint64_t            v;
+    uint32_t            xlen;
+
+    for (; typeid < typeid_max; typeid++, value++) {
+        switch (*typeid) {
+        default:
+            return size;
+        case CDummyValue:
+            continue;
+        case NilValue:
+        case FalseValue:
+        case TrueValue:
+            size += 1;
+            continue;
+        case LongValue:
+            v = value->uval;
+            if (v > (uint64_t)INT64_MAX /* negative val */) {
+                size += v >= (uint64_t)-0x20 ? 1 :
+                        v >= (uint64_t)INT8_MIN ? 2 :
+                        v >= (uint64_t)INT16_MIN ? 3 :
+                        v >= (uint64_t)INT32_MIN ? 5 : 9;
+                continue;
+            }
+            /* fallthrough */
+        case UlongValue:
+            v = value->uval;
+            size += v <= 0x7f ? 1 : v <= UINT8_MAX ? 2 :
+                    v <= UINT16_MAX ? 3 : v <= UINT32_MAX ? 5 : 9;
+            continue;
+        case FloatValue:
+        case DoubleValue:
+            /* a run of fixed size items, as in numeric_run */
+            run = 1;
+            if (simd != SimdNone &&
+                typeid_max - typeid >= NUMERIC_RUN_MIN &&
+                typeid[NUMERIC_RUN_MIN - 1] == *typeid)
+                run = type_run(simd, typeid, typeid_max - typeid, *typeid);
+            size += (*typeid == FloatValue ? 5 : 9) * run;
+            typeid += run - 1;
+            value += run - 1;
+            continue;
+        case StringValue:
+        case CStringValue:
+            xlen = value->xlen;
+            size += xlen <= 31 ? 1 : xlen <= UINT8_MAX ? 2 :
+                    xlen <= UINT16_MAX ? 3 : 5;
+            break;
+        case BinValue:
+        case CBinValue:
+            xlen = value->xlen;
+            size += xlen <= UINT8_MAX ? 2 : xlen <= UINT16_MAX ? 3 : 5;
+            break;
+        case ExtValue:
+            xlen = value->xlen;
+            if (xlen == 2 || xlen == 3 || xlen == 5 || xlen == 9) {
+                /* fixext 1 to 8, copied inline */
+                size += 1 + xlen;
+                continue;
+            }
+            size += xlen == 17 ? 1 : xlen - 1 <= UINT8_MAX ? 2 :
+                    xlen - 1 <= UINT16_MAX ? 3 : 5;
+            break;
+        case ArrayValue:
+        case MapValue:
+            xlen = value->xlen;
+            size += xlen <= 15 ? 1 : xlen <= UINT16_MAX ? 3 : 5;
+            continue;
+        case CopyCommand:
+        case RawCommand:
+            break;
+        }
+        /* out of line data */
+        size += value->xlen;
+        if (__builtin_expect(value->xoff == UINT32_MAX, 0)) {
+            /* next item contains explicit ptr */
+            typeid++;
+            value++;
+        }
+    }
+    return size;
+}
+
+/*
+ * Checked mode maintains the headroom invariant in the output buffer
+ * while encoding. Unchecked mode relies on the buffer being large
+ * enough for the entire output (see unparse_msgpack_size), plus
+ * UNPARSE_SLACK bytes clobbered by numeric runs.
+ */
+#define UNPARSE_SLACK 8
+
+static inline __attribute__((always_inline))
+int unparse_msgpack_impl(struct State *state,
+                         size_t        nitems,
+                         int           checked)
+{
+    //nitems--;
+    const uint8_t      * restrict typeid = state->ot - 1;
+    const struct Value * restrict value = state->ov - 1;
+    const uint8_t      * restrict bank1 = state->b1;
+    const uint8_t      * restrict bank2 = state->b2;
+    const uint8_t      * typeid_max = state->ot + nitems;
+    uint8_t            * restrict out, *out_max;
+    const uint8_t      * restrict copy_from = bank1;
+    int                  simd = simd_get_level();
+    size_t               run;
+
+    out = state->res;
+    out_max = state->res + state->res_capacity;
+
+    const uint8_t * typeid2 = typeid;
+    const struct Value * value2 = value;
+#if 0
+    /* Debug  */
+    for (; typeid2 != typeid_max; typeid2++, value2++) {
+        const uint8_t *cmdname =
+            (*typeid2 == 18) ? "PUTSTRC" :
+            (*typeid2 == 12) ? "PUTMAP" :
+            (*typeid2 == 11) ? "PUTARRAYC" :
+            (*typeid2 == 4) ? "PUTINT / PUTLONG" :
+            (*typeid2 == 8) ? "PUTSTR" :
+            (*typeid2 == 7) ? "PUTDOUBLE" :
+            (*typeid2 == 0) ? "(zero)" : "unknown";
+	if (*typeid2 == 7)
+		fprintf(stderr, "unparse_msgpack; *typeid: 0x%02X (%d) -- %s; value: %llx\n", *typeid2, *typeid2, cmdname, *value2);
+	else
+		fprintf(stderr, "unparse_msgpack; *typeid: 0x%02X (%d) -- %s; value: %d\n", *typeid2, *typeid2, cmdname, *value2);
+    }
+#endif
+    int i = 0;
+
+    goto check_buf;
+
+    for (; typeid != typeid_max; typeid++, value++) {
+        /* precondition: at least 10 bytes avail in out */
+
+#if 0
+	    /* Debug  */
+	const uint8_t *cmdname =
+            (*typeid == 18) ? "PUTSTRC" :
+            (*typeid == 12) ? "PUTMAP" :
+            (*typeid == 11) ? "PUTARRAYC" :
+            (*typeid == 4) ? "PUTINT / PUTLONG" :
+            (*typeid == 8) ? "PUTSTR" :
+            (*typeid == 7) ? "PUTDOUBLE" :
+            (*typeid == 0) ? "(zero)" : "unknown";
+        fprintf(stderr, "%02d; unparse_msgpack; in for; *typeid: 0x%02X (%d) -- %s; value: %d\n", i, *typeid, *typeid, cmdname, *value);
+#endif
+        ++i;
+
+        switch (*typeid) {
         default:
             goto error_badcode;
         case CDummyValue:
@@ -612,6 +2209,10 @@ int unparse_msgpack(struct State *state,
             *out ++ = 0xc3;
             goto check_buf;
         case LongValue:
+            if (simd != SimdNone &&
+                typeid_max - typeid >= NUMERIC_RUN_MIN &&
+                typeid[NUMERIC_RUN_MIN - 1] == LongValue)
+                goto numeric_run;
             /*
              * Note: according to the MsgPack spec, signed and unsigned
              * integer families are different 'presentations' of
@@ -680,6 +2281,10 @@ int unparse_msgpack(struct State *state,
             goto check_buf;
         case FloatValue: {
             struct unaligned_storage ux;
+            if (simd != SimdNone &&
+                typeid_max - typeid >= NUMERIC_RUN_MIN &&
+                typeid[NUMERIC_RUN_MIN - 1] == FloatValue)
+                goto numeric_run;
             ux.f32 = (float)value->dval;
             out[0] = 0xca;
             unaligned(out + 1)->u32 = host2net32(ux.u32);
@@ -688,6 +2293,10 @@ int unparse_msgpack(struct State *state,
         }
         case DoubleValue: {
             struct unaligned_storage ux;
+            if (simd != SimdNone &&
+                typeid_max - typeid >= NUMERIC_RUN_MIN &&
+                typeid[NUMERIC_RUN_MIN - 1] == DoubleValue)
+                goto numeric_run;
             ux.f64 = value->dval;
             out[0] = 0xcb;
             unaligned(out + 1)->u64 = host2net64(ux.u64);
@@ -821,6 +2430,9 @@ int unparse_msgpack(struct State *state,
         case CopyCommand:
             copy_from = bank2;
             goto copy_data;
+        case RawCommand:
+            /* bank1 */
+            goto copy_data;
         }
 
 check_buf:
@@ -828,29 +2440,51 @@ check_buf:
          * Restore invariant: at least 10 bytes available in out_buf.
          * Almost every switch branch ends up jumping here.
          */
-        if (__builtin_expect(out + 10 > out_max, 0)) {
-            uint8_t *old_res = state->res;
-            if (buf_grow(&state->res, &state->res_capacity,
-                         next_capacity(state->res_capacity + 10)) != 0)
+        if (checked && __builtin_expect(out + 10 > out_max, 0)) {
+            size_t used = out - state->res;
+            if (res_grow(state, next_capacity(state->res_capacity + 10)) != 0)
                 goto error_alloc;
-            out = state->res + (out - old_res);
+            out = state->res + used;
             out_max = state->res + state->res_capacity;
         }
         continue;
 
+numeric_run:
+        /*
+         * A run of numbers of the same type (possibly shorter than
+         * NUMERIC_RUN_MIN, the kernel copes), 9 bytes per item at most,
+         * plus 10 more bytes for the next iteration.
+         */
+        run = type_run(simd, typeid, typeid_max - typeid, *typeid);
+        if (checked &&
+            __builtin_expect(out + run * 9 + 10 > out_max, 0)) {
+            size_t used = out - state->res;
+            size_t old_capacity = state->res_capacity;
+            if (res_grow(state,
+                         next_capacity(old_capacity + run * 9 + 10)) != 0)
+                goto error_alloc;
+            out = state->res + used;
+            out_max = state->res + state->res_capacity;
+        }
+        out = numeric_run(simd, out, value, run, *typeid);
+        typeid += run - 1;
+        value += run - 1;
+        goto check_buf;
+
 copy_data:
         /*
          * Ensure we have a room fom value->xlen bytes in out_buf, plus
          * 10 more bytes for the next iteration.
          * Some switch branches end up jumping here.
          */
-        if (__builtin_expect(out + value->xlen + 10 > out_max, 0)) {
-            uint8_t *old_res = state->res;
+        if (checked &&
+            __builtin_expect(out + value->xlen + 10 > out_max, 0)) {
+            size_t used = out - state->res;
             size_t old_capacity = state->res_capacity;
-            if (buf_grow(&state->res, &state->res_capacity,
+            if (res_grow(state,
                          next_capacity(old_capacity + value->xlen + 10)) != 0)
                 goto error_alloc;
-            out = state->res + (out - old_res);
+            out = state->res + used;
             out_max = state->res + state->res_capacity;
         }
         if (__builtin_expect(value->xoff == UINT32_MAX, 0)) {
@@ -883,13 +2517,863 @@ error_badcode:
     return set_error(state, "Internal error: unknown code");
 }
 
+/*
+ * Exact-size mode: compute the output size first, reserve the buffer
+ * once and encode with no buffer checks. See bench/unparse_msgpack.c
+ * for the numbers, schema_rt_set_unparse_exact_min() sets the
+ * threshold.
+ */
+static size_t unparse_exact_min = SIZE_MAX;
+
+int unparse_msgpack(struct State *state,
+                    size_t        nitems)
+{
+    int rc;
+
+    buf_used(state, BufOT, nitems * TV_ITEM_SIZE);
+    if (nitems >= unparse_exact_min) {
+        size_t size = unparse_msgpack_size(state, nitems) + UNPARSE_SLACK;
+        if (size > state->res_capacity &&
+            res_grow(state, next_capacity(size)) != 0)
+            return set_error(state, "Out of memory");
+        rc = unparse_msgpack_impl(state, nitems, 0);
+    } else {
+        rc = unparse_msgpack_impl(state, nitems, 1);
+    }
+    buf_used(state, BufRes, state->res_size);
+    return rc;
+}
+
+/*
+ * Use exact-size mode for outputs of at least n items
+ * (0 - always, SIZE_MAX - never). Returns the previous value.
+ */
+size_t schema_rt_set_unparse_exact_min(size_t n)
+{
+    size_t prev = unparse_exact_min;
+    unparse_exact_min = n;
+    return prev;
+}
+
+/* Same as unparse_msgpack, but the result is appended to state->batch. */
+int schema_rt_batch_append(struct State *state,
+                           size_t        nitems)
+{
+    struct Batch *batch = &state->batch;
+    size_t        size;
+
+    if (unparse_msgpack(state, nitems) != 0)
+        return -1;
+    size = batch->size + state->res_size;
+    buf_used(state, BufBatch, size);
+    if (size > batch->capacity) {
+        state->stats[BufBatch].grows++;
+        if (buf_grow(&batch->buf, &batch->capacity,
+                     next_capacity(size)) != 0)
+            return set_error(state, "Out of memory");
+    }
+    memcpy(batch->buf + batch->size, state->res, state->res_size);
+    batch->size = size;
+    return 0;
+}
+
+/*
+ * JSON emitter (unflatten_json), the counterpart of unparse_msgpack:
+ * the output (res) is JSON text made straight from ot/ov.
+ *
+ * Unflatten output already has the Avro JSON shape: a record is an
+ * object, a union value other than null is {"branch": value}. Bytes and
+ * fixed are strings of code points 0-255, as in the Avro JSON encoding.
+ * Arrays and maps copied verbatim (RawCommand) and complex defaults
+ * (CopyCommand) are msgpack, those are converted as well. Infinities
+ * and NaNs have no JSON representation and become null.
+ *
+ * Msgpack items come with the element count, JSON needs the closing
+ * bracket; open containers are on a stack.
+ */
+struct JsonFrame {
+    uint32_t           n;        // items so far (map: keys and values)
+    uint32_t           count;
+    uint32_t           map;
+};
+
+#define JSON_STACK_LOCAL 32
+#define JSON_HEADROOM    64
+
+struct JsonOut {
+    struct State      *state;
+    uint8_t           *out;
+    uint8_t           *out_max;
+    struct JsonFrame  *stack;
+    size_t             depth;
+    size_t             capacity;
+    const char        *error;
+    struct JsonFrame   local[JSON_STACK_LOCAL];
+};
+
+/* Ensure n bytes at o->out, plus a separator and the closing brackets. */
+static inline int json_reserve(struct JsonOut *o, size_t n)
+{
+    struct State *state = o->state;
+    size_t        used;
+
+    n += o->depth + 1;
+    if (__builtin_expect((size_t)(o->out_max - o->out) >= n, 1))
+        return 0;
+    used = o->out - state->res;
+    if (res_grow(state, next_capacity(used + n)) != 0) {
+        o->error = "Out of memory";
+        return -1;
+    }
+    o->out = state->res + used;
+    o->out_max = state->res + state->res_capacity;
+    return 0;
+}
+
+/* A separator before an item; map keys must be strings. */
+static inline int json_begin(struct JsonOut *o, int is_string)
+{
+    struct JsonFrame *f;
+
+    if (o->depth == 0)
+        return 0;
+    f = o->stack + o->depth - 1;
+    if (!f->map) {
+        if (f->n != 0)
+            *o->out++ = ',';
+        return 0;
+    }
+    if (f->n & 1) {
+        *o->out++ = ':';
+        return 0;
+    }
+    if (!is_string) {
+        o->error = "Map keys must be strings";
+        return -1;
+    }
+    if (f->n != 0)
+        *o->out++ = ',';
+    return 0;
+}
+
+/* An item is complete, close the containers that are complete too. */
+static inline void json_end(struct JsonOut *o)
+{
+    while (o->depth != 0) {
+        struct JsonFrame *f = o->stack + o->depth - 1;
+        if (++f->n < f->count)
+            return;
+        *o->out++ = f->map ? '}' : ']';
+        o->depth--;
+    }
+}
+
+static int json_open(struct JsonOut *o, int map, uint32_t count)
+{
+    struct JsonFrame *f;
+
+    if (json_begin(o, 0) != 0)
+        return -1;
+    *o->out++ = map ? '{' : '[';
+    if (count == 0) {
+        *o->out++ = map ? '}' : ']';
+        json_end(o);
+        return 0;
+    }
+    if (o->depth == o->capacity) {
+        size_t capacity = o->capacity * 2;
+        f = o->stack == o->local ? NULL : o->stack;
+        f = realloc(f, capacity * sizeof(f[0]));
+        if (f == NULL) {
+            o->error = "Out of memory";
+            return -1;
+        }
+        if (o->stack == o->local)
+            memcpy(f, o->local, sizeof(o->local));
+        o->stack = f;
+        o->capacity = capacity;
+    }
+    f = o->stack + o->depth++;
+    f->n = 0;
+    f->count = map ? count * 2 : count;
+    f->map = map;
+    return 0;
+}
+
+/* Escapes: 0 - verbatim, 'u' - \u00XX, other - \<char> */
+static const uint8_t json_escape[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\'
+};
+
+/*
+ * Bin: bytes 0x80-0xff are code points, not UTF-8 (\u00XX).
+ * Needs 6 * len + 2 bytes.
+ */
+static uint8_t *json_put_string(uint8_t       *out,
+                                const uint8_t *s,
+                                uint32_t       len,
+                                int            bin)
+{
+    static const char hex[] = "0123456789abcdef";
+    const uint8_t    *se = s + len, *run;
+
+    *out++ = '"';
+    while (s != se) {
+        run = s;
+        while (s != se && json_escape[*s] == 0 && (*s < 0x80 || !bin))
+            s++;
+        memcpy(out, run, s - run);
+        out += s - run;
+        if (s == se)
+            break;
+        if (json_escape[*s] != 'u' && *s < 0x80) {
+            out[0] = '\\';
+            out[1] = json_escape[*s];
+            out += 2;
+        } else {
+            memcpy(out, "\\u00", 4);
+            out[4] = hex[*s >> 4];
+            out[5] = hex[*s & 0xf];
+            out += 6;
+        }
+        s++;
+    }
+    *out++ = '"';
+    return out;
+}
+
+static inline uint8_t *json_put_uint(uint8_t *out, uint64_t v)
+{
+    uint8_t buf[20];
+    int     n = 0;
+
+    do {
+        buf[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v != 0);
+    while (n != 0)
+        *out++ = buf[--n];
+    return out;
+}
+
+/* The shortest of %.15g, %.16g, %.17g that reads back the same. */
+static uint8_t *json_put_double(uint8_t *out, double v, int single)
+{
+    char *s = (char *)out;
+    int   len;
+
+    if (!isfinite(v)) {
+        memcpy(out, "null", 4);
+        return out + 4;
+    }
+    if (single) {
+        len = snprintf(s, JSON_HEADROOM, "%.7g", v);
+        if ((float)strtod(s, NULL) != (float)v)
+            len = snprintf(s, JSON_HEADROOM, "%.9g", v);
+        return out + len;
+    }
+    for (int prec = 15; prec < 17; prec++) {
+        len = snprintf(s, JSON_HEADROOM, "%.*g", prec, v);
+        if (strtod(s, NULL) == v)
+            return out + len;
+    }
+    return out + snprintf(s, JSON_HEADROOM, "%.17g", v);
+}
+
+/* A scalar; data is the string / bin payload. */
+static int json_put_scalar(struct JsonOut     *o,
+                           uint32_t            type,
+                           const struct Value *value,
+                           const uint8_t      *data)
+{
+    if (type == StringValue || type == BinValue) {
+        if (json_reserve(o, (size_t)value->xlen * 6 + JSON_HEADROOM) != 0 ||
+            json_begin(o, type == StringValue) != 0)
+            return -1;
+        o->out = json_put_string(o->out, data, value->xlen,
+                                 type == BinValue);
+        json_end(o);
+        return 0;
+    }
+    if (json_reserve(o, JSON_HEADROOM) != 0 || json_begin(o, 0) != 0)
+        return -1;
+    switch (type) {
+    case NilValue:
+        memcpy(o->out, "null", 4);
+        o->out += 4;
+        break;
+    case FalseValue:
+        memcpy(o->out, "false", 5);
+        o->out += 5;
+        break;
+    case TrueValue:
+        memcpy(o->out, "true", 4);
+        o->out += 4;
+        break;
+    case LongValue:
+        if (value->ival < 0) {
+            *o->out++ = '-';
+            o->out = json_put_uint(o->out, 0 - value->uval);
+            break;
+        }
+        /* fallthrough */
+    case UlongValue:
+        o->out = json_put_uint(o->out, value->uval);
+        break;
+    case FloatValue:
+    case DoubleValue:
+        o->out = json_put_double(o->out, value->dval, type == FloatValue);
+        break;
+    default:
+        o->error = "Ext values are not supported";
+        return -1;
+    }
+    json_end(o);
+    return 0;
+}
+
+/* Msgpack values (RawCommand, CopyCommand). */
+static int json_put_msgpack_data(struct JsonOut *o,
+                                 const uint8_t  *mi,
+                                 uint32_t        len)
+{
+    const uint8_t *me = mi + len, *end;
+    struct Value   value;
+    uint32_t       type, count;
+    uint8_t        code;
+
+    while (mi != me) {
+        end = msgpack_scalar(mi, me, &type, &value);
+        if (end == NULL)
+            goto error_data;
+        if (type != 0) {
+            if (json_put_scalar(o, type, &value, end - value.xlen) != 0)
+                return -1;
+            mi = end;
+            continue;
+        }
+        code = *mi;
+        switch (code) {
+        case 0x80 ... 0x8f:
+        case 0x90 ... 0x9f:
+            count = *mi & 0x0f;
+            mi += 1;
+            break;
+        case 0xdc:
+        case 0xde:
+            if (me - mi < 3)
+                goto error_data;
+            count = net2host16(unaligned(mi + 1)->u16);
+            mi += 3;
+            break;
+        case 0xdd:
+        case 0xdf:
+            if (me - mi < 5)
+                goto error_data;
+            count = net2host32(unaligned(mi + 1)->u32);
+            mi += 5;
+            break;
+        default:
+            o->error = "Ext values are not supported";
+            return -1;
+        }
+        if (json_reserve(o, JSON_HEADROOM) != 0 ||
+            json_open(o, code <= 0x8f || code >= 0xde, count) != 0)
+            return -1;
+    }
+    return 0;
+error_data:
+    o->error = "Invalid data";
+    return -1;
+}
+
+int unparse_json(struct State *state,
+                 size_t        nitems)
+{
+    const uint8_t      *typeid = state->ot;
+    const struct Value *value = state->ov, *item;
+    const uint8_t      *typeid_max = state->ot + nitems;
+    const uint8_t      *bank, *data;
+    uint32_t            type;
+    struct JsonOut      o = {
+        .state = state, .out = state->res,
+        .out_max = state->res + state->res_capacity,
+        .capacity = JSON_STACK_LOCAL
+    };
+    int                 rc = -1;
+
+    o.stack = o.local;
+    buf_used(state, BufOT, nitems * TV_ITEM_SIZE);
+    for (; typeid != typeid_max; typeid++, value++) {
+        switch (*typeid) {
+        case CDummyValue:
+            continue;
+        case ArrayValue:
+        case MapValue:
+            if (json_reserve(&o, JSON_HEADROOM) != 0 ||
+                json_open(&o, *typeid == MapValue, value->xlen) != 0)
+                goto out;
+            continue;
+        case CStringValue:
+        case CBinValue:
+        case CopyCommand:
+            bank = state->b2;
+            break;
+        case StringValue:
+        case BinValue:
+        case ExtValue:
+        case RawCommand:
+            bank = state->b1;
+            break;
+        default:
+            if (*typeid > ExtValue) {
+                o.error = "Internal error: unknown code";
+                goto out;
+            }
+            if (json_put_scalar(&o, *typeid, value, NULL) != 0)
+                goto out;
+            continue;
+        }
+        item = value;
+        type = *typeid;
+        data = bank - item->xoff;
+        if (__builtin_expect(item->xoff == UINT32_MAX, 0)) {
+            /* Offset is too big; next item contains explicit ptr. */
+            data = value[1].p;
+            typeid++;
+            value++;
+        }
+        if (type == CopyCommand || type == RawCommand) {
+            if (json_put_msgpack_data(&o, data, item->xlen) != 0)
+                goto out;
+            continue;
+        }
+        if (json_put_scalar(&o, type == CStringValue ? StringValue :
+                                type == CBinValue ? BinValue : type,
+                            item, data) != 0)
+            goto out;
+    }
+    if (o.depth != 0) {
+        o.error = "Internal error: incomplete container";
+        goto out;
+    }
+    state->res_size = o.out - state->res;
+    buf_used(state, BufRes, state->res_size);
+    rc = 0;
+out:
+    if (o.stack != o.local)
+        free(o.stack);
+    return rc == 0 ? 0 : set_error(state, o.error);
+}
+
+/*
+ * Fused transcoder.
+ *
+ * In a schema of a fixed layout (a record of records and scalars, see
+ * emit_fuse_plan in compiler.lua) the position of every value in a
+ * flattened tuple is known in advance. Flatten and unflatten of such
+ * schemas convert msgpack to msgpack in a single pass, bypassing
+ * t/v and ot/ov entirely. Flatten records where each value starts,
+ * since map keys may come in any order; unflatten is purely streaming.
+ *
+ * Only the common case is handled. A missing, an unknown or a duplicate
+ * key, or a value of an unexpected type make the transcoder bail out
+ * (-1); the caller then runs the generated code, which either converts
+ * the data (e.g. substitutes a default value) or reports the error.
+ * Hence the output is exactly the same in either case.
+ */
+enum FuseOp {
+    FuseNull         = 1,
+    FuseBoolean      = 2,
+    FuseInt          = 3,
+    FuseLong         = 4,
+    FuseFloat        = 5,
+    FuseDouble       = 6,
+    FuseString       = 7,
+    FuseBytes        = 8,
+    FuseRecord       = 9
+};
+
+struct FuseNode {
+    uint16_t           op;
+    uint16_t           n;      // FuseRecord: number of fields
+    uint32_t           arg;    // FuseRecord: first field node,
+                               // scalar: position in a tuple
+    uint32_t           key;    // field name, offset in bank
+    uint32_t           klen;
+};
+
+struct FusePlan {
+    const struct FuseNode *node;
+    const uint8_t     *bank;
+    uint32_t           width;  // number of scalars
+    uint32_t           keys;   // map headers and keys size (unflatten)
+};
+
+#define FUSE_WIDTH_MAX 256
+
+/* Render a scalar of the given FuseOp, the same way unparse_msgpack does. */
+static inline uint8_t *fuse_put(uint8_t            *out,
+                                uint32_t            op,
+                                uint32_t            type,
+                                const struct Value *value,
+                                const uint8_t      *end)
+{
+    struct unaligned_storage ux;
+    uint64_t u = value->uval;
+    uint32_t len = value->xlen;
+
+    switch (op) {
+    case FuseNull:
+        if (type != NilValue)
+            return NULL;
+        *out++ = 0xc0;
+        return out;
+    case FuseBoolean:
+        if (type != FalseValue && type != TrueValue)
+            return NULL;
+        *out++ = type == TrueValue ? 0xc3 : 0xc2;
+        return out;
+    case FuseInt:
+        if (type != LongValue || u + 0x80000000u > 0xffffffffu)
+            return NULL;
+        goto put_long;
+    case FuseLong:
+        if (type != LongValue)
+            return NULL;
+        goto put_long;
+    case FuseFloat:
+        if (type == LongValue)
+            ux.f32 = (float)(double)value->ival;
+        else if (type == FloatValue || type == DoubleValue)
+            ux.f32 = (float)value->dval;
+        else
+            return NULL;
+        out[0] = 0xca;
+        unaligned(out + 1)->u32 = host2net32(ux.u32);
+        return out + 5;
+    case FuseDouble:
+        if (type == LongValue)
+            ux.f64 = (double)value->ival;
+        else if (type == FloatValue || type == DoubleValue)
+            ux.f64 = value->dval;
+        else
+            return NULL;
+        out[0] = 0xcb;
+        unaligned(out + 1)->u64 = host2net64(ux.u64);
+        return out + 9;
+    case FuseString:
+        if (type != StringValue)
+            return NULL;
+        if (len <= 31) {
+            *out++ = 0xa0 + (uint8_t)len;
+        } else if (len <= UINT8_MAX) {
+            out[0] = 0xd9;
+            out[1] = (uint8_t)len;
+            out += 2;
+        } else if (len <= UINT16_MAX) {
+            out[0] = 0xda;
+            unaligned(out + 1)->u16 = host2net16((uint16_t)len);
+            out += 3;
+        } else {
+            out[0] = 0xdb;
+            unaligned(out + 1)->u32 = host2net32(len);
+            out += 5;
+        }
+        goto put_data;
+    case FuseBytes:
+        if (type != BinValue)
+            return NULL;
+        if (len <= UINT8_MAX) {
+            out[0] = 0xc4;
+            out[1] = (uint8_t)len;
+            out += 2;
+        } else if (len <= UINT16_MAX) {
+            out[0] = 0xc5;
+            unaligned(out + 1)->u16 = host2net16((uint16_t)len);
+            out += 3;
+        } else {
+            out[0] = 0xc6;
+            unaligned(out + 1)->u32 = host2net32(len);
+            out += 5;
+        }
+        goto put_data;
+    default:
+        return NULL;
+    }
+put_long:
+    if (u > (uint64_t)INT64_MAX) {
+        if (u >= (uint64_t)-0x20) {
+            *out++ = (uint8_t)u;
+        } else if (u >= (uint64_t)INT8_MIN) {
+            out[0] = 0xd0;
+            out[1] = (uint8_t)u;
+            out += 2;
+        } else if (u >= (uint64_t)INT16_MIN) {
+            out[0] = 0xd1;
+            unaligned(out + 1)->u16 = host2net16((uint16_t)u);
+            out += 3;
+        } else if (u >= (uint64_t)INT32_MIN) {
+            out[0] = 0xd2;
+            unaligned(out + 1)->u32 = host2net32((uint32_t)u);
+            out += 5;
+        } else {
+            out[0] = 0xd3;
+            unaligned(out + 1)->u64 = host2net64(u);
+            out += 9;
+        }
+    } else if (u <= 0x7f) {
+        *out++ = (uint8_t)u;
+    } else if (u <= UINT8_MAX) {
+        out[0] = 0xcc;
+        out[1] = (uint8_t)u;
+        out += 2;
+    } else if (u <= UINT16_MAX) {
+        out[0] = 0xcd;
+        unaligned(out + 1)->u16 = host2net16((uint16_t)u);
+        out += 3;
+    } else if (u <= UINT32_MAX) {
+        out[0] = 0xce;
+        unaligned(out + 1)->u32 = host2net32((uint32_t)u);
+        out += 5;
+    } else {
+        out[0] = 0xcf;
+        unaligned(out + 1)->u64 = host2net64(u);
+        out += 9;
+    }
+    return out;
+put_data:
+    memcpy(out, end - len, len);
+    return out + len;
+}
+
+static inline uint8_t *fuse_put_header(uint8_t *out,
+                                       uint8_t  fix,
+                                       uint8_t  code16,
+                                       uint32_t n)
+{
+    if (n <= 15) {
+        *out++ = fix + (uint8_t)n;
+    } else if (n <= UINT16_MAX) {
+        out[0] = code16;
+        unaligned(out + 1)->u16 = host2net16((uint16_t)n);
+        out += 3;
+    } else {
+        out[0] = code16 + 1;
+        unaligned(out + 1)->u32 = host2net32(n);
+        out += 5;
+    }
+    return out;
+}
+
+/* Parse an array (fix == 0x90) or a map (fix == 0x80) header. */
+static inline const uint8_t *fuse_header(const uint8_t *mi,
+                                         const uint8_t *me,
+                                         uint8_t        fix,
+                                         uint8_t        code16,
+                                         uint32_t      *n)
+{
+    size_t avail = me - mi;
+
+    if (avail == 0)
+        return NULL;
+    if ((*mi & 0xf0) == fix) {
+        *n = *mi & 0x0f;
+        return mi + 1;
+    }
+    if (*mi == code16 && avail >= 3) {
+        *n = net2host16(unaligned(mi + 1)->u16);
+        return mi + 3;
+    }
+    if (*mi == code16 + 1 && avail >= 5) {
+        *n = net2host32(unaligned(mi + 1)->u32);
+        return mi + 5;
+    }
+    return NULL;
+}
+
+/*
+ * Flatten, pass 1: find out where values of scalar fields start
+ * (slot is indexed by the position in a tuple).
+ */
+static const uint8_t *fuse_scan_record(const struct FusePlan *plan,
+                                       const struct FuseNode *record,
+                                       const uint8_t         *mi,
+                                       const uint8_t         *me,
+                                       const uint8_t        **slot)
+{
+    const struct FuseNode *field = plan->node + record->arg;
+    const struct FuseNode *field_max = field + record->n, *next = field;
+    uint32_t               n, type;
+    struct Value           value;
+
+    mi = fuse_header(mi, me, 0x80, 0xde, &n);
+    if (mi == NULL || n != record->n)
+        return NULL;
+    for (; n != 0; n--) {
+        const struct FuseNode *f;
+        const uint8_t         *key;
+
+        mi = msgpack_scalar(mi, me, &type, &value);
+        if (mi == NULL || type != StringValue)
+            return NULL;
+        key = mi - value.xlen;
+        /* fields are likely in the schema order */
+        f = next;
+        if (f == field_max || f->klen != value.xlen ||
+            memcmp(plan->bank + f->key, key, value.xlen) != 0) {
+            for (f = field; f != field_max; f++) {
+                if (f->klen == value.xlen &&
+                    memcmp(plan->bank + f->key, key, value.xlen) == 0)
+                    break;
+            }
+            if (f == field_max)
+                return NULL;
+        }
+        next = f + 1;
+        if (f->op == FuseRecord) {
+            mi = fuse_scan_record(plan, f, mi, me, slot);
+            if (mi == NULL)
+                return NULL;
+            continue;
+        }
+        if (slot[f->arg] != NULL)
+            return NULL;
+        slot[f->arg] = mi;
+        mi = msgpack_scalar(mi, me, &type, &value);
+        if (mi == NULL || type == 0)
+            return NULL;
+    }
+    return mi;
+}
+
+/*
+ * Render the record. Flatten takes values from slots, unflatten
+ * (slot == NULL) consumes them from *pmi in order and emits maps.
+ */
+static uint8_t *fuse_put_record(const struct FusePlan *plan,
+                                const struct FuseNode *record,
+                                uint8_t               *out,
+                                const uint8_t        **pmi,
+                                const uint8_t         *me,
+                                const uint8_t        **slot)
+{
+    const struct FuseNode *f = plan->node + record->arg;
+    const struct FuseNode *field_max = f + record->n;
+    uint32_t               type;
+    struct Value           value;
+
+    if (slot == NULL)
+        out = fuse_put_header(out, 0x80, 0xde, record->n);
+    for (; f != field_max; f++) {
+        const uint8_t *mi, *end;
+
+        if (slot == NULL) {
+            value.xlen = f->klen;
+            out = fuse_put(out, FuseString, StringValue, &value,
+                           plan->bank + f->key + f->klen);
+        }
+        if (f->op == FuseRecord) {
+            out = fuse_put_record(plan, f, out, pmi, me, slot);
+            if (out == NULL)
+                return NULL;
+            continue;
+        }
+        mi = slot == NULL ? *pmi : slot[f->arg];
+        if (mi == NULL)
+            return NULL;
+        end = msgpack_scalar(mi, me, &type, &value);
+        if (end == NULL)
+            return NULL;
+        out = fuse_put(out, f->op, type, &value, end);
+        if (out == NULL)
+            return NULL;
+        if (slot == NULL)
+            *pmi = end;
+    }
+    return out;
+}
+
+/*
+ * Reserve the output buffer. A value grows by at most 8 bytes
+ * (a fixint becoming a double), keys of input maps are dropped.
+ */
+static int fuse_reserve(struct State *state, size_t size)
+{
+    if (size > state->res_capacity &&
+        res_grow(state, next_capacity(size)) != 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * Flatten msgpack (a map) into msgpack (an array). Returns 0 and the
+ * result in res on success, -1 if the generated code should run instead.
+ */
+int schema_rt_fuse_flatten(struct State          *state,
+                           const struct FusePlan *plan,
+                           const uint8_t         *mi,
+                           size_t                 ms)
+{
+    const uint8_t *slot[FUSE_WIDTH_MAX];
+    const uint8_t *me = mi + ms;
+    uint8_t       *out;
+
+    if (plan->width > FUSE_WIDTH_MAX)
+        return -1;
+    memset(slot, 0, plan->width * sizeof(slot[0]));
+    if (fuse_scan_record(plan, plan->node, mi, me, slot) == NULL)
+        return -1;
+    buf_decay(state);
+    if (fuse_reserve(state, 5 + ms + (size_t)plan->width * 8) != 0)
+        return -1;
+    out = fuse_put_header(state->res, 0x90, 0xdc, plan->width);
+    out = fuse_put_record(plan, plan->node, out, &mi, me, slot);
+    if (out == NULL)
+        return -1;
+    state->res_size = out - state->res;
+    buf_used(state, BufRes, state->res_size);
+    return 0;
+}
+
+/* Unflatten msgpack (an array) into msgpack (a map), see above. */
+int schema_rt_fuse_unflatten(struct State          *state,
+                             const struct FusePlan *plan,
+                             const uint8_t         *mi,
+                             size_t                 ms)
+{
+    const uint8_t *me = mi + ms;
+    uint8_t       *out;
+    uint32_t       n;
+
+    mi = fuse_header(mi, me, 0x90, 0xdc, &n);
+    if (mi == NULL || n != plan->width)
+        return -1;
+    buf_decay(state);
+    if (fuse_reserve(state,
+                     ms + plan->keys + (size_t)plan->width * 8) != 0)
+        return -1;
+    out = fuse_put_record(plan, plan->node, state->res, &mi, me, NULL);
+    if (out == NULL)
+        return -1;
+    state->res_size = out - state->res;
+    buf_used(state, BufRes, state->res_size);
+    return 0;
+}
+
 int schema_rt_buf_grow(struct State *state,
                        size_t min_capacity)
 {
     if (min_capacity <= state->ot_capacity)
         return 0;
-    return buf_grow_tv(&state->ot, &state->ov, &state->ot_capacity,
-                       next_capacity(min_capacity));
+    return ot_grow(state, next_capacity(min_capacity));
 }
 
 /*
@@ -942,7 +3426,7 @@ int schema_rt_extract_location(struct State *state,
         }
         /* maintain invariant: there's space for sep in buf */
         if (state->res_capacity < state->res_size + item_size + 2 &&
-            buf_grow(&state->res, &state->res_capacity,
+            res_grow(state,
                      next_capacity(state->res_size + item_size + 2)) != 0) {
 
             /* allocation failure (unlikely); discard incomplete message */
@@ -0,0 +1,338 @@
+#ifndef AVRO_SCHEMA_RT_PIPELINE_H
+#define AVRO_SCHEMA_RT_PIPELINE_H
+
+/*
+ * Data layout shared by the runtime C sources (and the C benchmarks).
+ * Must be kept in sync with the schema_rt_State cdef in runtime.lua.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum TypeId {
+    NilValue         = 1,
+    FalseValue       = 2,
+    TrueValue        = 3,
+    LongValue        = 4,
+    UlongValue       = 5, /* parser prefers LongValue */
+    FloatValue       = 6,
+    DoubleValue      = 7,
+    StringValue      = 8,
+    BinValue         = 9,
+    ExtValue         = 10,
+
+    ArrayValue       = 11,
+    MapValue         = 12,
+
+    CDummyValue      = 17, /* skipped */
+    CStringValue     = 18,
+    CBinValue        = 19,
+    CopyCommand      = 20, /* Copy N bytes verbatim from data bank.
+                            * Provides complex default values. Also
+                            * strings during unflatten.
+                            */
+    RawCommand       = 21  /* Copy N bytes verbatim from input data.
+                            * Passes an array or a map through
+                            * unchanged (byte range from State.rv).
+                            */
+};
+
+struct Value {
+    union {
+        void          *p;
+        int64_t        ival;
+        uint64_t       uval;
+        double         dval;
+        struct {
+            uint32_t   xlen;
+            uint32_t   xoff;
+        };
+    };
+};
+
+/*
+ * TypeId-s and Value-s live in two parallel arrays.
+ *
+ * NilValue         - (value allocated but unused)
+ * FalseValue       - (value allocated but unused)
+ * TrueValue        - (value allocated but unused)
+ * LongValue        - ival
+ * UlongValue       - uval
+ * FloatValue       - dval
+ * DoubleValue      - dval
+ * StringValue      - xlen, xoff
+ * BinValue         - xlen, xoff
+ * ExtValue         - xlen, xoff
+ * ArrayValue       - xlen, xoff
+ * MapValue         - xlen, xoff
+ *
+ * When raw is set, parse_msgpack also records the byte range of each
+ * array and map in rv (xlen - size in bytes, xoff - offset relative
+ * to b1, as in StringValue); rv entries of other items are undefined.
+ */
+
+/*
+ * Buffer usage stats (bytes), see buf_decay() in pipeline.c.
+ */
+enum StateBuf {
+    BufTV            = 0, /* t/v (and rv) */
+    BufOT            = 1, /* ot/ov */
+    BufRes           = 2,
+    BufX             = 3, /* xbuf */
+    BufBatch         = 4, /* batch.buf, kept while batch_mode is on */
+    BufVM            = 5, /* vm_stack */
+    BufCount         = 6
+};
+
+struct BufStats {
+    size_t             used;     // by the current call
+    size_t             peak;
+    uint32_t           grows;
+    uint32_t           shrinks;
+    uint32_t           idle;     // calls in a row within the baseline
+};
+
+/*
+ * Batch conversions collect results in a single buffer.
+ */
+struct Batch {
+    uint8_t           *buf;
+    size_t             size;
+    size_t             capacity;
+};
+
+/*
+ * A conversion error of the generated code, the IL interpreter or the
+ * native code; Lua renders the message (kinds are listed in vm.c).
+ */
+struct VmError {
+    int32_t            kind;
+    int32_t            arg;
+    uint32_t           str;  // cpool offset
+    uint32_t           len;
+    int64_t            pos;  // offending item
+};
+
+/*
+ * The runtime keeps no per-conversion data outside of State (the few
+ * globals in pipeline.c are settings), hence conversions with distinct
+ * states may run concurrently.
+ */
+struct State {
+    size_t             t_capacity;   // capacity of t/v   bufs (items)
+    size_t             ot_capacity;  // capacity of ot/ov bufs (items)
+    size_t             res_capacity; // capacity of res   buf
+    size_t             res_size;
+    uint8_t           *res;      // filled by unparse_msgpack, others
+    const uint8_t     *b1;       // bank1: input data
+    const uint8_t     *b2;       // bank2: program constants
+    uint8_t           *t;        // filled by parse_msgpack
+    struct Value      *v;        // .......................
+    uint8_t           *ot;       // consumed by unparse_msgpack
+    struct Value      *ov;       // ...........................
+    int32_t            k;        // used by generated code (xflatten)
+    int32_t            raw;      // parse_msgpack fills rv if set
+    size_t             rv_capacity;
+    struct Value      *rv;       // byte ranges of arrays and maps
+    struct BufStats    stats[BufCount];
+    int32_t            batch_mode; // results are appended to batch
+    struct Batch       batch;
+    size_t             vm_capacity;
+    int64_t           *vm_stack; // registers and frames of vm.c
+    size_t             xbuf_capacity;
+    uint8_t           *xbuf;     // Avro binary transcoded (avro.c)
+    struct VmError     err;      // the last error (lazy_errors)
+};
+
+/* Record the usage of a buffer by the current call. */
+static inline void buf_used(struct State *state,
+                            enum StateBuf buf,
+                            size_t        size)
+{
+    struct BufStats *stats = &state->stats[buf];
+    if (stats->used < size)
+        stats->used = size;
+    if (stats->peak < size)
+        stats->peak = size;
+}
+
+#if !(C_HAVE_BSWAP16)
+static inline uint16_t __builtin_bswap16(uint16_t a)
+{
+    return (a << 8) | ( a >> 8);
+}
+#endif
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define net2host16(v) __builtin_bswap16(v)
+#define net2host32(v) __builtin_bswap32(v)
+#define net2host64(v) __builtin_bswap64(v)
+#define host2net16(v) __builtin_bswap16(v)
+#define host2net32(v) __builtin_bswap32(v)
+#define host2net64(v) __builtin_bswap64(v)
+#elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define net2host16(v) (v)
+#define net2host32(v) (v)
+#define net2host64(v) (v)
+#define host2net16(v) (v)
+#define host2net32(v) (v)
+#define host2net64(v) (v)
+#else
+#error Unsupported __BYTE_ORDER__
+#endif
+
+#define unaligned(p) ((struct unaligned_storage *)(p))
+
+struct unaligned_storage
+{
+    union {
+        uint16_t u16;
+        uint32_t u32;
+        uint64_t u64;
+        float    f32;
+        double   f64;
+    };
+}
+__attribute__((__packed__));
+
+/*
+ * Decode a msgpack scalar, type is a TypeId (0 - not a scalar).
+ * Returns the end of the item (string data precedes it), NULL if
+ * truncated. Str/bin set xlen only.
+ */
+static inline const uint8_t *msgpack_scalar(const uint8_t *mi,
+                                            const uint8_t *me,
+                                            uint32_t      *type,
+                                            struct Value  *value)
+{
+    size_t   avail = me - mi;
+    uint32_t len;
+
+    if (avail == 0)
+        return NULL;
+    switch (*mi) {
+    case 0x00 ... 0x7f:
+        *type = LongValue;
+        value->ival = *mi;
+        return mi + 1;
+    case 0xe0 ... 0xff:
+        *type = LongValue;
+        value->ival = (int8_t)*mi;
+        return mi + 1;
+    case 0xa0 ... 0xbf:
+        *type = StringValue;
+        len = *mi & 0x1f;
+        mi += 1;
+        goto payload;
+    case 0xc0:
+        *type = NilValue;
+        return mi + 1;
+    case 0xc2:
+        *type = FalseValue;
+        return mi + 1;
+    case 0xc3:
+        *type = TrueValue;
+        return mi + 1;
+    case 0xc4:
+    case 0xd9:
+        if (avail < 2)
+            return NULL;
+        *type = *mi == 0xc4 ? BinValue : StringValue;
+        len = mi[1];
+        mi += 2;
+        goto payload;
+    case 0xc5:
+    case 0xda:
+        if (avail < 3)
+            return NULL;
+        *type = *mi == 0xc5 ? BinValue : StringValue;
+        len = net2host16(unaligned(mi + 1)->u16);
+        mi += 3;
+        goto payload;
+    case 0xc6:
+    case 0xdb:
+        if (avail < 5)
+            return NULL;
+        *type = *mi == 0xc6 ? BinValue : StringValue;
+        len = net2host32(unaligned(mi + 1)->u32);
+        mi += 5;
+        goto payload;
+    case 0xca: {
+        struct unaligned_storage ux;
+        if (avail < 5)
+            return NULL;
+        ux.u32 = net2host32(unaligned(mi + 1)->u32);
+        *type = FloatValue;
+        value->dval = ux.f32;
+        return mi + 5;
+    }
+    case 0xcb: {
+        struct unaligned_storage ux;
+        if (avail < 9)
+            return NULL;
+        ux.u64 = net2host64(unaligned(mi + 1)->u64);
+        *type = DoubleValue;
+        value->dval = ux.f64;
+        return mi + 9;
+    }
+    case 0xcc:
+        if (avail < 2)
+            return NULL;
+        *type = LongValue;
+        value->ival = mi[1];
+        return mi + 2;
+    case 0xcd:
+        if (avail < 3)
+            return NULL;
+        *type = LongValue;
+        value->ival = net2host16(unaligned(mi + 1)->u16);
+        return mi + 3;
+    case 0xce:
+        if (avail < 5)
+            return NULL;
+        *type = LongValue;
+        value->ival = net2host32(unaligned(mi + 1)->u32);
+        return mi + 5;
+    case 0xcf:
+        if (avail < 9)
+            return NULL;
+        value->uval = net2host64(unaligned(mi + 1)->u64);
+        *type = value->uval > (uint64_t)INT64_MAX ? UlongValue : LongValue;
+        return mi + 9;
+    case 0xd0:
+        if (avail < 2)
+            return NULL;
+        *type = LongValue;
+        value->ival = (int8_t)mi[1];
+        return mi + 2;
+    case 0xd1:
+        if (avail < 3)
+            return NULL;
+        *type = LongValue;
+        value->ival = (int16_t)net2host16(unaligned(mi + 1)->u16);
+        return mi + 3;
+    case 0xd2:
+        if (avail < 5)
+            return NULL;
+        *type = LongValue;
+        value->ival = (int32_t)net2host32(unaligned(mi + 1)->u32);
+        return mi + 5;
+    case 0xd3:
+        if (avail < 9)
+            return NULL;
+        *type = LongValue;
+        value->ival = (int64_t)net2host64(unaligned(mi + 1)->u64);
+        return mi + 9;
+    default:
+        /* arrays, maps, ext */
+        *type = 0;
+        return mi;
+    }
+payload:
+    if ((size_t)(me - mi) < len)
+        return NULL;
+    value->xlen = len;
+    return mi + len;
+}
+
+#endif /* AVRO_SCHEMA_RT_PIPELINE_H */
@@ -0,0 +1,561 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "pipeline.h"
+
+/*
+ * Lua object input (flatten of a Lua table).
+ *
+ * The object is walked with the Lua C API and t/v are filled directly,
+ * instead of encoding the object with msgpack.encode and parsing the
+ * result. The rules are the ones of the msgpack encoder:
+ *
+ * - an integral number is an integer, otherwise a double;
+ * - a table with positive integer keys is an array (holes are nils),
+ *   unless it is excessively sparse; other tables are maps;
+ * - __serialize = 'seq' / 'map' (and aliases) in a metatable forces
+ *   an array / a map.
+ *
+ * Everything else (cdata other than NULL, userdata, excessively sparse
+ * arrays, __serialize functions, deep nesting) makes the walker give up,
+ * the caller falls back to msgpack.encode. Hence the result is the same
+ * either way.
+ *
+ * Strings are referenced in place, the object (hence every string in
+ * it) is alive during the conversion. Offsets are 32 bit: if the strings
+ * are too far apart, or raw ranges are needed (those must be msgpack,
+ * see schema_rt_parse_end), the strings are copied to xbuf instead.
+ * String pointers are kept in ov while walking (not in use during parse).
+ */
+
+int  schema_rt_buf_grow(struct State *state, size_t min_capacity);
+void schema_rt_parse_begin(struct State *state);
+int  schema_rt_tv_reserve(struct State *state, size_t nitems);
+int  schema_rt_parse_end(struct State *state, size_t nitems,
+                         const uint8_t *bank, size_t bank_size);
+void schema_rt_unparse_begin(struct State *state, size_t nitems);
+
+/* msgpack.encode defaults: encode_max_depth, encode_sparse_* */
+#define TABLE_DEPTH_MAX    128
+#define TABLE_SPARSE_RATIO 2
+#define TABLE_SPARSE_SAFE  10
+
+enum {
+    TableOk            = 0,
+    TableUnsupported   = 1,   // fall back to msgpack
+    TableOutOfMemory   = -1
+};
+
+struct TableCtx {
+    lua_State         *L;
+    struct State      *state;
+    size_t             nitems;
+    int                null_idx; // msgpack.NULL
+    int                depth;
+};
+
+static int walk(struct TableCtx *ctx, int idx);
+
+static inline void put_number(uint8_t *typeid, struct Value *value,
+                              double d)
+{
+    if (d >= 0 && d < 18446744073709551616.0) {
+        uint64_t u = (uint64_t)d;
+        if ((double)u == d) {
+            *typeid = u > (uint64_t)INT64_MAX ? UlongValue : LongValue;
+            value->uval = u;
+            return;
+        }
+    } else if (d < 0 && d >= -9223372036854775808.0) {
+        int64_t i = (int64_t)d;
+        if ((double)i == d) {
+            *typeid = LongValue;
+            value->ival = i;
+            return;
+        }
+    }
+    *typeid = DoubleValue;
+    value->dval = d;
+}
+
+/* -1 - by contents, 0 - a map, 1 - an array, 2 - unsupported */
+static int table_serialize(lua_State *L, int idx)
+{
+    const char *s;
+    int         res = -1;
+
+    if (!lua_getmetatable(L, idx))
+        return -1;
+    lua_pushliteral(L, "__serialize");
+    lua_rawget(L, -2);
+    if (lua_type(L, -1) == LUA_TSTRING) {
+        s = lua_tostring(L, -1);
+        if (strcmp(s, "seq") == 0 || strcmp(s, "sequence") == 0 ||
+            strcmp(s, "array") == 0)
+            res = 1;
+        else if (strcmp(s, "map") == 0 || strcmp(s, "mapping") == 0)
+            res = 0;
+        else
+            res = 2;
+    } else if (!lua_isnil(L, -1)) {
+        res = 2;
+    }
+    lua_pop(L, 2);
+    return res;
+}
+
+static int walk_table(struct TableCtx *ctx, int idx, size_t item)
+{
+    lua_State    *L = ctx->L;
+    struct State *state = ctx->state;
+    size_t        count = 0, max = 0;
+    int           array = 1, serialize, rc;
+
+    serialize = table_serialize(L, idx);
+    if (serialize == 2 || ctx->depth == TABLE_DEPTH_MAX ||
+        !lua_checkstack(L, 4))
+        return TableUnsupported;
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0) {
+        count++;
+        if (array) {
+            double d;
+            if (lua_type(L, -2) == LUA_TNUMBER &&
+                (d = lua_tonumber(L, -2)) >= 1 && d <= INT32_MAX &&
+                d == (double)(int32_t)d) {
+                if (d > max)
+                    max = (size_t)d;
+            } else {
+                array = 0;
+            }
+        }
+        lua_pop(L, 1);
+    }
+    if (serialize == 1 && !array)
+        return TableUnsupported;
+    if (serialize == 0)
+        array = 0;
+    else if (array && serialize == -1 && max > TABLE_SPARSE_SAFE &&
+             max > count * TABLE_SPARSE_RATIO)
+        return TableUnsupported;
+    ctx->depth++;
+    if (array) {
+        state->t[item] = ArrayValue;
+        state->v[item].xlen = (uint32_t)max;
+        for (size_t i = 1; i <= max; i++) {
+            lua_rawgeti(L, idx, (int)i);
+            rc = walk(ctx, lua_gettop(L));
+            lua_pop(L, 1);
+            if (rc != TableOk)
+                return rc;
+        }
+    } else {
+        if (count > UINT32_MAX)
+            return TableUnsupported;
+        state->t[item] = MapValue;
+        state->v[item].xlen = (uint32_t)count;
+        lua_pushnil(L);
+        while (lua_next(L, idx) != 0) {
+            int top = lua_gettop(L);
+            if ((rc = walk(ctx, top - 1)) != TableOk ||
+                (rc = walk(ctx, top)) != TableOk) {
+                lua_pop(L, 2);
+                return rc;
+            }
+            lua_pop(L, 1);
+        }
+    }
+    ctx->depth--;
+    state->v[item].xoff = (uint32_t)(ctx->nitems - item);
+    return TableOk;
+}
+
+static int walk(struct TableCtx *ctx, int idx)
+{
+    lua_State    *L = ctx->L;
+    struct State *state = ctx->state;
+    size_t        item = ctx->nitems, len;
+    const char   *s;
+
+    if (__builtin_expect(item == state->t_capacity ||
+                         item == state->ot_capacity, 0) &&
+        (schema_rt_tv_reserve(state, item + 1) != 0 ||
+         schema_rt_buf_grow(state, item + 1) != 0))
+        return TableOutOfMemory;
+    ctx->nitems++;
+    switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+        state->t[item] = NilValue;
+        return TableOk;
+    case LUA_TBOOLEAN:
+        state->t[item] = lua_toboolean(L, idx) ? TrueValue : FalseValue;
+        return TableOk;
+    case LUA_TNUMBER:
+        put_number(state->t + item, state->v + item, lua_tonumber(L, idx));
+        return TableOk;
+    case LUA_TSTRING:
+        s = lua_tolstring(L, idx, &len);
+        if (len > UINT32_MAX)
+            return TableUnsupported;
+        state->t[item] = StringValue;
+        state->v[item].xlen = (uint32_t)len;
+        state->ov[item].p = (void *)s;
+        return TableOk;
+    case LUA_TTABLE:
+        return walk_table(ctx, idx, item);
+    default:
+        if (lua_rawequal(L, idx, ctx->null_idx)) {
+            state->t[item] = NilValue;
+            return TableOk;
+        }
+        return TableUnsupported;
+    }
+}
+
+/* Point string offsets to the strings, copy them if necessary. */
+static int table_strings(struct TableCtx *ctx)
+{
+    struct State  *state = ctx->state;
+    const uint8_t *lo = (const uint8_t *)UINTPTR_MAX, *hi = NULL, *p;
+    size_t         total = 0, pos = 0;
+
+    for (size_t i = 0; i < ctx->nitems; i++) {
+        if (state->t[i] != StringValue)
+            continue;
+        p = state->ov[i].p;
+        if (p < lo)
+            lo = p;
+        if (p + state->v[i].xlen > hi)
+            hi = p + state->v[i].xlen;
+        total += state->v[i].xlen;
+    }
+    if (total == 0)
+        return schema_rt_parse_end(state, ctx->nitems,
+                                   (const uint8_t *)"", 0);
+    if (!state->raw && (size_t)(hi - lo) <= UINT32_MAX) {
+        for (size_t i = 0; i < ctx->nitems; i++) {
+            if (state->t[i] == StringValue)
+                state->v[i].xoff =
+                    (uint32_t)(hi - (const uint8_t *)state->ov[i].p);
+        }
+        return schema_rt_parse_end(state, ctx->nitems, lo, hi - lo);
+    }
+    if (total > UINT32_MAX)
+        return -1;
+    buf_used(state, BufX, total);
+    if (state->xbuf_capacity < total) {
+        uint8_t *xbuf;
+        state->stats[BufX].grows++;
+        xbuf = realloc(state->xbuf, total);
+        if (xbuf == NULL)
+            return -1;
+        state->xbuf = xbuf;
+        state->xbuf_capacity = total;
+    }
+    for (size_t i = 0; i < ctx->nitems; i++) {
+        if (state->t[i] != StringValue)
+            continue;
+        memcpy(state->xbuf + pos, state->ov[i].p, state->v[i].xlen);
+        state->v[i].xoff = (uint32_t)(total - pos);
+        pos += state->v[i].xlen;
+    }
+    return schema_rt_parse_end(state, ctx->nitems, state->xbuf, total);
+}
+
+/*
+ * parse_table(state, object, null) -> true: the result is in t/v;
+ * false: unsupported, use msgpack.encode; nil, error.
+ */
+static int parse_table(lua_State *L)
+{
+    struct TableCtx ctx = {
+        .L = L, .state = (struct State *)lua_topointer(L, 1),
+        .null_idx = 3
+    };
+    int             rc;
+
+    lua_settop(L, 3);
+    schema_rt_parse_begin(ctx.state);
+    rc = walk(&ctx, 2);
+    if (rc == TableOk && table_strings(&ctx) != 0)
+        rc = TableOutOfMemory;
+    if (rc == TableOutOfMemory) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "Out of memory");
+        return 2;
+    }
+    lua_pushboolean(L, rc == TableOk);
+    return 1;
+}
+
+/*
+ * Lua object output (unflatten to a Lua table).
+ *
+ * Lua values are made straight from ot/ov, as msgpack.decode would make
+ * them from the unparse_msgpack result: nil is msgpack.NULL, bin is a
+ * string, arrays and maps get the metatables msgpack.decode sets (if
+ * any). Tables are pre-sized from the element counts. Msgpack data in
+ * ot/ov (RawCommand, CopyCommand) is decoded as well.
+ *
+ * Integers that msgpack.decode would turn into int64 / uint64 cdata and
+ * ext values make the builder give up, the caller falls back to
+ * msgpack.decode.
+ */
+
+/* msgpack.decode yields a number below that */
+#define BUILD_NUMBER_MAX   4503599627370496LL  /* 2^52 */
+
+struct BuildCtx {
+    lua_State          *L;
+    struct State       *state;
+    const uint8_t      *typeid;
+    const uint8_t      *typeid_max;
+    const struct Value *value;
+    const uint8_t      *mi;       // msgpack data (RawCommand, CopyCommand)
+    const uint8_t      *me;
+    int                 null_idx; // msgpack.NULL
+    int                 array_mt; // metatables of msgpack.decode results
+    int                 map_mt;
+    int                 depth;
+};
+
+/* An item of msgpack data; containers yield the element count. */
+static int build_next_msgpack(struct BuildCtx *ctx, uint32_t *type,
+                              struct Value *value, const uint8_t **data)
+{
+    const uint8_t *mi = ctx->mi, *me = ctx->me, *end;
+    uint8_t        code = *mi;
+
+    end = msgpack_scalar(mi, me, type, value);
+    if (end == NULL)
+        return TableUnsupported;
+    if (*type != 0) {
+        *data = end - value->xlen;
+        ctx->mi = end;
+        return TableOk;
+    }
+    switch (code) {
+    case 0x80 ... 0x8f:
+    case 0x90 ... 0x9f:
+        value->xlen = code & 0x0f;
+        mi += 1;
+        break;
+    case 0xdc:
+    case 0xde:
+        if (me - mi < 3)
+            return TableUnsupported;
+        value->xlen = net2host16(unaligned(mi + 1)->u16);
+        mi += 3;
+        break;
+    case 0xdd:
+    case 0xdf:
+        if (me - mi < 5)
+            return TableUnsupported;
+        value->xlen = net2host32(unaligned(mi + 1)->u32);
+        mi += 5;
+        break;
+    default:
+        /* ext */
+        return TableUnsupported;
+    }
+    *type = code <= 0x8f || code >= 0xde ? MapValue : ArrayValue;
+    ctx->mi = mi;
+    return TableOk;
+}
+
+/* The next item, either from ot/ov or from msgpack data. */
+static int build_next(struct BuildCtx *ctx, uint32_t *type,
+                      struct Value *value, const uint8_t **data)
+{
+    struct State       *state = ctx->state;
+    const struct Value *item;
+    const uint8_t      *bank, *p;
+    uint32_t            t;
+
+    for (;;) {
+        if (ctx->mi != ctx->me)
+            return build_next_msgpack(ctx, type, value, data);
+        if (ctx->typeid == ctx->typeid_max)
+            return TableUnsupported;
+        t = *ctx->typeid++;
+        item = ctx->value++;
+        switch (t) {
+        case CDummyValue:
+            continue;
+        case CStringValue:
+        case CBinValue:
+        case CopyCommand:
+            bank = state->b2;
+            break;
+        case StringValue:
+        case BinValue:
+        case RawCommand:
+            bank = state->b1;
+            break;
+        default:
+            if (t == ExtValue || t > MapValue)
+                return TableUnsupported;
+            *type = t;
+            *value = *item;
+            return TableOk;
+        }
+        p = bank - item->xoff;
+        if (__builtin_expect(item->xoff == UINT32_MAX, 0)) {
+            /* Offset is too big; next item contains explicit ptr. */
+            if (ctx->typeid == ctx->typeid_max)
+                return TableUnsupported;
+            p = ctx->value->p;
+            ctx->typeid++;
+            ctx->value++;
+        }
+        if (t == CopyCommand || t == RawCommand) {
+            ctx->mi = p;
+            ctx->me = p + item->xlen;
+            continue;
+        }
+        *type = t == CStringValue ? StringValue :
+                t == CBinValue ? BinValue : t;
+        value->xlen = item->xlen;
+        *data = p;
+        return TableOk;
+    }
+}
+
+/* Push the next value; a container goes to dest_idx if nonzero. */
+static int build(struct BuildCtx *ctx, int dest_idx)
+{
+    lua_State     *L = ctx->L;
+    struct Value   value;
+    const uint8_t *data = NULL;
+    uint32_t       type;
+    size_t         count, hint;
+    int            rc;
+
+    if ((rc = build_next(ctx, &type, &value, &data)) != TableOk)
+        return rc;
+    switch (type) {
+    case NilValue:
+        lua_pushvalue(L, ctx->null_idx);
+        return TableOk;
+    case FalseValue:
+    case TrueValue:
+        lua_pushboolean(L, type == TrueValue);
+        return TableOk;
+    case LongValue:
+        if (value.ival <= -BUILD_NUMBER_MAX ||
+            value.ival >= BUILD_NUMBER_MAX)
+            return TableUnsupported;
+        lua_pushnumber(L, (lua_Number)value.ival);
+        return TableOk;
+    case FloatValue:
+    case DoubleValue:
+        lua_pushnumber(L, value.dval);
+        return TableOk;
+    case StringValue:
+    case BinValue:
+        lua_pushlstring(L, (const char *)data, value.xlen);
+        return TableOk;
+    case ArrayValue:
+    case MapValue:
+        break;
+    default:
+        return TableUnsupported;
+    }
+    if (ctx->depth == TABLE_DEPTH_MAX || !lua_checkstack(L, 4))
+        return TableUnsupported;
+    count = value.xlen;
+    /* every element takes an item or a byte at least */
+    hint = (size_t)(ctx->typeid_max - ctx->typeid) +
+           (size_t)(ctx->me - ctx->mi);
+    if (hint > count)
+        hint = count;
+    if (hint > INT32_MAX)
+        hint = INT32_MAX;
+    if (dest_idx != 0)
+        lua_pushvalue(L, dest_idx);
+    else if (type == ArrayValue)
+        lua_createtable(L, (int)hint, 0);
+    else
+        lua_createtable(L, 0, (int)hint);
+    ctx->depth++;
+    if (type == ArrayValue) {
+        if (count > INT32_MAX)
+            return TableUnsupported;
+        for (size_t i = 1; i <= count; i++) {
+            if ((rc = build(ctx, 0)) != TableOk)
+                return rc;
+            lua_rawseti(L, -2, (int)i);
+        }
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            if ((rc = build(ctx, 0)) != TableOk)
+                return rc;
+            /* table index is NaN */
+            if (lua_type(L, -1) == LUA_TNUMBER &&
+                lua_tonumber(L, -1) != lua_tonumber(L, -1))
+                return TableUnsupported;
+            if ((rc = build(ctx, 0)) != TableOk)
+                return rc;
+            lua_rawset(L, -3);
+        }
+    }
+    ctx->depth--;
+    if (dest_idx == 0) {
+        int mt = type == ArrayValue ? ctx->array_mt : ctx->map_mt;
+        if (!lua_isnil(L, mt)) {
+            lua_pushvalue(L, mt);
+            lua_setmetatable(L, -2);
+        }
+    }
+    return TableOk;
+}
+
+/*
+ * unparse_table(state, nitems, dest, null, array_mt, map_mt)
+ * -> true, value; false: unsupported, use msgpack.decode.
+ * A table result is stored in dest (if given): the elements are set,
+ * other keys are left as is.
+ */
+static int unparse_table(lua_State *L)
+{
+    struct BuildCtx ctx = {
+        .L = L, .state = (struct State *)lua_topointer(L, 1),
+        .null_idx = 4, .array_mt = 5, .map_mt = 6
+    };
+    size_t          nitems = (size_t)lua_tonumber(L, 2);
+    int             rc;
+
+    lua_settop(L, 6);
+    schema_rt_unparse_begin(ctx.state, nitems);
+    ctx.typeid = ctx.state->ot;
+    ctx.typeid_max = ctx.state->ot + nitems;
+    ctx.value = ctx.state->ov;
+    rc = build(&ctx, lua_istable(L, 3) ? 3 : 0);
+    if (rc != TableOk) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    lua_pushboolean(L, 1);
+    lua_insert(L, -2);
+    return 2;
+}
+
+int luaopen_avro_schema_rt_c(lua_State *L)
+{
+    static const luaL_Reg lib[] = {
+        { "parse_table", parse_table },
+        { "unparse_table", unparse_table },
+        { NULL, NULL }
+    };
+
+    lua_newtable(L);
+    for (const luaL_Reg *reg = lib; reg->name != NULL; reg++) {
+        lua_pushcfunction(L, reg->func);
+        lua_setfield(L, -2, reg->name);
+    }
+    return 1;
+}
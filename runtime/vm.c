@@ -0,0 +1,1069 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pipeline.h"
+
+/*
+ * IL interpreter (compile option engine = 'vm').
+ *
+ * Backend_vm.lua lowers the optimized IL into a flat array of
+ * instructions. An instruction has the layout of schema_il_Opcode
+ * (il.lua) and IL opcodes keep their meaning, except that IL variables
+ * become registers and nested blocks become jumps:
+ *
+ *   pos = reg[ipv] + ipo   - input item
+ *   out = reg[0] + a       - output item (a is the IL offset)
+ *
+ * Operands not fitting in a single instruction follow it in VmExt
+ * words. Registers and call frames live in State.vm_stack; the stack
+ * is explicit, the interpreter doesn't recurse.
+ *
+ * Must be kept in sync with backend_vm.lua.
+ */
+
+struct VmInsn {
+    uint16_t           op;
+    uint16_t           k;
+    uint32_t           a;
+    union {
+        struct {
+            uint32_t   ipv;
+            int32_t    ipo;
+        };
+        int32_t        ci;
+        int64_t        cl;
+        double         cd;
+    };
+};
+
+enum VmOp {
+    VmJump        = 0x01, /* goto a */
+    VmLoop        = 0x02, /* if reg[ipv] >= reg[ipo] goto a */
+    VmNext        = 0x03, /* reg[ipv] += ipo; goto a */
+    VmReturn      = 0x04,
+    VmExt         = 0x05, /* operands of the preceding instruction */
+
+    IlCheckItems  = 0xbe, /* k: item opcode | ItemsNullable | ItemsMap */
+    IlPutItems    = 0xbf, /* a: offset, k: as above; reg[0] moves past
+                           * the items */
+
+    IlCallFunc    = 0xc0, /* a: result reg, k: r.k increment,
+                           * ext a: callee */
+    IlDeclFunc    = 0xc1, /* function header, k: nregs, ipv: param reg */
+    IlIfSet       = 0xc4, /* unless (reg[ipv] != 0) == k goto a */
+    IlIfNul       = 0xc5, /* unless (t[pos] == Nil) == k goto a */
+    IlIntSwitch   = 0xc6, /* k: n, n x ext (a: target, ci: value) */
+    IlStrSwitch   = 0xc7, /* k: n, a: hint, ext ci: hash func or
+                           * (k: bits, a: cpos, ipv: r, ipo: m) string
+                           * phf or (ci: 0, a: cpos) strsearch table,
+                           * n x (ext a: target, ipv: len, ipo: cpos;
+                           *      ext a: hint, ci: hash) */
+    IlObjForeach  = 0xc8, /* a: iter reg, k: end reg */
+    IlMove        = 0xc9,
+    IlSkip        = 0xca,
+    IlPSkip       = 0xcb,
+
+    IlPutBoolC    = 0xcc,
+    IlPutIntC     = 0xcd,
+    IlPutLongC    = 0xce,
+    IlPutFloatC   = 0xcf,
+    IlPutDoubleC  = 0xd0,
+    IlPutStrC     = 0xd1, /* ipv: len, ipo: cpos */
+    IlPutBinC     = 0xd2, /* ........... */
+    IlPutArrayC   = 0xd3,
+    IlPutMapC     = 0xd4,
+    IlPutXC       = 0xd5, /* ipv: len, ipo: cpos */
+    IlPutIntKC    = 0xd6,
+    IlPutDummyC   = 0xd7,
+    IlPutNulC     = 0xd8,
+
+    IlPutBool     = 0xd9,
+    IlPutInt      = 0xda,
+    IlPutLong     = 0xdb,
+    IlPutFloat    = 0xdc,
+    IlPutDouble   = 0xdd,
+    IlPutStr      = 0xde,
+    IlPutBin      = 0xdf,
+    IlPutArray    = 0xe0,
+    IlPutMap      = 0xe1,
+    IlPutInt2Long = 0xe2,
+    IlPutInt2Flt  = 0xe3,
+    IlPutInt2Dbl  = 0xe4,
+    IlPutLong2Flt = 0xe5,
+    IlPutLong2Dbl = 0xe6,
+    IlPutFlt2Dbl  = 0xe7,
+    IlPutStr2Bin  = 0xe8,
+    IlPutBin2Str  = 0xe9,
+
+    IlPutEnumI2S  = 0xea, /* ext a: cpos, k: bits, ipv: n, ipo: sparse */
+    IlPutEnumS2I  = 0xeb, /* ext a: seed, k: phf (2: string phf),
+                           *     ci: hash func;
+                           * ext a: cpos, k: bits, ipv: r or n, ipo: m;
+                           * ext a: aux cpos, k: aux bits, ci: v_max */
+
+    IlIsBool      = 0xec,
+    IlIsInt       = 0xed,
+    IlIsFloat     = 0xee,
+    IlIsDouble    = 0xef,
+    IlIsLong      = 0xf0,
+    IlIsStr       = 0xf1,
+    IlIsBin       = 0xf2,
+    IlIsArray     = 0xf3,
+    IlIsMap       = 0xf4,
+    IlIsNul       = 0xf5,
+    IlIsNulOrMap  = 0xf6,
+
+    IlLenIs       = 0xf7, /* a: len */
+
+    IlIsSet       = 0xf8, /* a: reg, ext ipv: len, ipo: cpos (name) */
+    IlIsNotSet    = 0xf9,
+    IlBeginVar    = 0xfa,
+
+    IlCheckObuf   = 0xfc, /* a: offset, k: scale */
+    IlErrValueV   = 0xfd,
+    IlError       = 0xfe, /* ipv: len, ipo: cpos */
+    IlPutRaw      = 0xff
+};
+
+#define NilReg 0xffffffffu
+
+/* IlCheckItems / IlPutItems kind flags */
+enum {
+    ItemsNullable  = 0x100,
+    ItemsMap       = 0x200
+};
+
+/* VmError kinds (pipeline.h); Lua renders the message, see vm_raise(). */
+enum VmErrorKind {
+    VmErrType      = 1, /* arg: IL opcode */
+    VmErrLength    = 2, /* arg: expected length */
+    VmErrMissing   = 3, /* str, len: key */
+    VmErrDuplicate = 4,
+    VmErrValue     = 5, /* arg: schema versioning error */
+    VmErrMessage   = 6, /* str, len: message */
+    VmErrNoMem     = 7,
+    VmErrBadCode   = 8
+};
+
+/*
+ * A frame: control slots followed by the registers.
+ *
+ *   regs[-5] return pc (-1 in the entry frame)
+ *   regs[-4] caller frame (vm_stack offset of regs)
+ *   regs[-3] caller function (code offset of DECLFUNC)
+ *   regs[-2] caller register receiving the callee param
+ *   regs[-1] r.k increment
+ */
+enum {
+    FrameRet       = 5,
+    FrameBase      = 4,
+    FrameFunc      = 3,
+    FrameResult    = 2,
+    FrameK         = 1,
+    FrameSize      = 5
+};
+
+uint32_t
+eval_hash_func(uint32_t func, const char *str, size_t len);
+
+uint32_t
+phf_hash_uint32_band_raw8(const uint8_t *g, uint32_t k, uint32_t seed,
+                          size_t r, size_t m);
+
+uint32_t
+phf_hash_uint32_band_raw16(const uint16_t *g, uint32_t k, uint32_t seed,
+                           size_t r, size_t m);
+
+uint32_t
+phf_hash_uint32_band_raw32(const uint32_t *g, uint32_t k, uint32_t seed,
+                           size_t r, size_t m);
+
+uint32_t
+phf_hash_string_band_raw8(const uint8_t *g, const void *p, size_t n,
+                          uint32_t seed, size_t r, size_t m);
+
+uint32_t
+phf_hash_string_band_raw16(const uint16_t *g, const void *p, size_t n,
+                           uint32_t seed, size_t r, size_t m);
+
+uint32_t
+phf_hash_string_band_raw32(const uint32_t *g, const void *p, size_t n,
+                           uint32_t seed, size_t r, size_t m);
+
+int
+schema_rt_key_eq(const char *key, const char *str, size_t klen, size_t len);
+
+uint32_t
+schema_rt_search8(const uint8_t *tab, uint32_t k, size_t n);
+
+uint32_t
+schema_rt_search16(const uint16_t *tab, uint32_t k, size_t n);
+
+uint32_t
+schema_rt_search32(const uint32_t *tab, uint32_t k, size_t n);
+
+int32_t
+schema_rt_strsearch(const uint8_t *b2, const uint32_t *tab, uint32_t n,
+                    const char *str, size_t len);
+
+int schema_rt_buf_grow(struct State *state, size_t min_capacity);
+
+static int vm_reserve(struct State *state, size_t size)
+{
+    size_t     capacity;
+    int64_t   *stack;
+
+    buf_used(state, BufVM, size * sizeof(stack[0]));
+    if (size <= state->vm_capacity)
+        return 0;
+    state->stats[BufVM].grows++;
+    capacity = state->vm_capacity ? state->vm_capacity : 256;
+    while (capacity < size)
+        capacity *= 2;
+    stack = realloc(state->vm_stack, capacity * sizeof(stack[0]));
+    if (stack == NULL)
+        return -1;
+    state->vm_stack = stack;
+    state->vm_capacity = capacity;
+    return 0;
+}
+
+static inline uint32_t uint_at(const uint8_t *tab, int bits, size_t i)
+{
+    switch (bits) {
+    case 8:
+        return tab[i];
+    case 16:
+        return ((const uint16_t *)tab)[i];
+    default:
+        return ((const uint32_t *)tab)[i];
+    }
+}
+
+/*
+ * Hash a string with a func made by create_hash_func. Funcs sampling
+ * chars at fixed positions don't apply to shorter strings (no match).
+ */
+static inline int vm_hash(uint32_t func, const char *str, uint32_t len,
+                          uint32_t *hash)
+{
+    uint32_t family = func >> 24;
+    if ((func & 0xf0000000) == 0 && (family & 3) != 0 &&
+        len <= (0xff & (func >> (8 * (3 - (family & 3))))))
+        return -1;
+    *hash = eval_hash_func(func, str, len);
+    return 0;
+}
+
+/*
+ * Hash a string with a string phf (huge sets, no func): x is the ext
+ * with the displacement map (a: cpos, k: bits, ipv: r, ipo: m).
+ */
+static inline uint32_t vm_hash_phf(const uint8_t *b2, const struct VmInsn *x,
+                                   uint32_t seed, const char *str,
+                                   uint32_t len)
+{
+    const uint8_t *g = b2 - x->a;
+    switch (x->k) {
+    case 8:
+        return phf_hash_string_band_raw8(g, str, len, seed, x->ipv, x->ipo);
+    case 16:
+        return phf_hash_string_band_raw16((const uint16_t *)g, str, len,
+                                          seed, x->ipv, x->ipo);
+    default:
+        return phf_hash_string_band_raw32((const uint32_t *)g, str, len,
+                                          seed, x->ipv, x->ipo);
+    }
+}
+
+/*
+ * CHECKITEMS / PUTITEMS: all items of an array or a map of primitives
+ * in a single call, instead of a loop running a check (and a put) per
+ * item. Shared by the backends, the generated Lua code included.
+ *
+ * Kind is the item's opcode, IlIsXxx (check only) or IlPutXxx (check
+ * and store) | ItemsNullable | ItemsMap. Map keys must be strings and
+ * are stored as such.
+ */
+
+/* The check preceding a put. */
+static inline uint32_t items_check_op(uint32_t op)
+{
+    switch (op) {
+    case IlPutNulC:
+        return IlIsNul;
+    case IlPutBool:
+        return IlIsBool;
+    case IlPutInt:
+    case IlPutInt2Long:
+    case IlPutInt2Flt:
+    case IlPutInt2Dbl:
+        return IlIsInt;
+    case IlPutLong:
+    case IlPutLong2Flt:
+    case IlPutLong2Dbl:
+        return IlIsLong;
+    case IlPutFloat:
+    case IlPutFlt2Dbl:
+        return IlIsFloat;
+    case IlPutDouble:
+        return IlIsDouble;
+    case IlPutStr:
+    case IlPutStr2Bin:
+        return IlIsStr;
+    case IlPutBin:
+    case IlPutBin2Str:
+        return IlIsBin;
+    default:
+        return op;
+    }
+}
+
+static inline __attribute__((always_inline)) int
+item_check(struct State *state, int64_t i, uint32_t check)
+{
+    uint8_t t = state->t[i];
+    switch (check) {
+    case IlIsNul:
+        return t == NilValue;
+    case IlIsBool:
+        return t == FalseValue || t == TrueValue;
+    case IlIsInt:
+        return t == LongValue &&
+               state->v[i].uval + 0x80000000 <= 0xffffffff;
+    case IlIsLong:
+        return t == LongValue;
+    case IlIsFloat:
+    case IlIsDouble:
+        if (t == LongValue) {
+            /* promote, as err_type() in runtime.lua does */
+            state->t[i] = DoubleValue;
+            state->v[i].dval = state->v[i].ival;
+            return 1;
+        }
+        return t == FloatValue || t == DoubleValue;
+    case IlIsStr:
+        return t == StringValue;
+    case IlIsBin:
+        return t == BinValue;
+    default:
+        return 0;
+    }
+}
+
+static inline __attribute__((always_inline)) void
+item_put(struct State *state, int64_t o, int64_t i, uint32_t put)
+{
+    const struct Value *v = &state->v[i];
+    struct Value       *ov = &state->ov[o];
+    switch (put) {
+    case IlPutNulC:
+        state->ot[o] = NilValue;
+        break;
+    case IlPutBool:
+        state->ot[o] = state->t[i];
+        break;
+    case IlPutInt:
+    case IlPutLong:
+    case IlPutInt2Long:
+        state->ot[o] = LongValue;
+        ov->ival = v->ival;
+        break;
+    case IlPutFloat:
+        state->ot[o] = FloatValue;
+        ov->dval = v->dval;
+        break;
+    case IlPutDouble:
+    case IlPutFlt2Dbl:
+        state->ot[o] = DoubleValue;
+        ov->dval = v->dval;
+        break;
+    case IlPutInt2Flt:
+    case IlPutLong2Flt:
+        state->ot[o] = FloatValue;
+        ov->dval = v->ival;
+        break;
+    case IlPutInt2Dbl:
+    case IlPutLong2Dbl:
+        state->ot[o] = DoubleValue;
+        ov->dval = v->ival;
+        break;
+    case IlPutStr:
+    case IlPutBin2Str:
+        state->ot[o] = StringValue;
+        ov->uval = v->uval;
+        break;
+    case IlPutBin:
+    case IlPutStr2Bin:
+        state->ot[o] = BinValue;
+        ov->uval = v->uval;
+        break;
+    }
+}
+
+/* Leading bytes equal to type, 8 at a time. */
+static inline size_t type_run(const uint8_t *t, size_t n, uint8_t type)
+{
+    uint64_t pattern = 0x0101010101010101ull * type, x;
+    size_t   i = 0;
+    for (; i + 8 <= n; i += 8) {
+        memcpy(&x, t + i, 8);
+        if (x != pattern)
+            break;
+    }
+    return i;
+}
+
+/*
+ * Op is a constant once inlined, the loop is specialized for it.
+ * Out is NULL unless storing the items (then it is the output
+ * position, updated).
+ */
+static inline __attribute__((always_inline)) int
+items_run(struct State *state, int64_t pos, int64_t *out, uint32_t kind,
+          uint32_t op, struct VmError *err)
+{
+    uint32_t check = items_check_op(op);
+    int      map = (kind & ItemsMap) != 0;
+    int      nullable = (kind & ItemsNullable) != 0;
+    int64_t  i = pos + 1, end = pos + state->v[pos].xoff;
+    int64_t  o = out ? *out : 0;
+
+    if (!out && !map && !nullable) {
+        /* check only: skip a run of a single type */
+        switch (check) {
+        case IlIsNul:
+            i += type_run(state->t + i, end - i, NilValue);
+            break;
+        case IlIsLong:
+            i += type_run(state->t + i, end - i, LongValue);
+            break;
+        case IlIsStr:
+            i += type_run(state->t + i, end - i, StringValue);
+            break;
+        case IlIsBin:
+            i += type_run(state->t + i, end - i, BinValue);
+            break;
+        }
+    }
+    for (; i < end; i++) {
+        if (map) {
+            if (state->t[i] != StringValue) {
+                check = IlIsStr;
+                goto bad;
+            }
+            if (out) {
+                state->ot[o] = StringValue;
+                state->ov[o++].uval = state->v[i].uval;
+            }
+            i++;
+        }
+        if (nullable && state->t[i] == NilValue) {
+            if (out)
+                state->ot[o++] = NilValue;
+            continue;
+        }
+        if (!item_check(state, i, check))
+            goto bad;
+        if (out)
+            item_put(state, o++, i, op);
+    }
+    if (out)
+        *out = o;
+    return 0;
+bad:
+    err->kind = VmErrType;
+    err->arg = check;
+    err->pos = i;
+    return -1;
+}
+
+int schema_rt_check_items(struct State *state, int64_t pos, uint32_t kind,
+                          struct VmError *err)
+{
+#define CASE(op) \
+    case op: return items_run(state, pos, NULL, kind, op, err)
+    switch (kind & 0xff) {
+    CASE(IlIsNul);
+    CASE(IlIsBool);
+    CASE(IlIsInt);
+    CASE(IlIsLong);
+    CASE(IlIsFloat);
+    CASE(IlIsDouble);
+    CASE(IlIsStr);
+    CASE(IlIsBin);
+    }
+#undef CASE
+    err->kind = VmErrBadCode;
+    err->pos = 0;
+    return -1;
+}
+
+/* Returns the output position following the items, -1 on error. */
+int64_t schema_rt_put_items(struct State *state, int64_t pos, int64_t opos,
+                            uint32_t kind, struct VmError *err)
+{
+    int rc;
+#define CASE(op) \
+    case op: rc = items_run(state, pos, &opos, kind, op, err); break
+    switch (kind & 0xff) {
+    CASE(IlPutNulC);
+    CASE(IlPutBool);
+    CASE(IlPutInt);
+    CASE(IlPutLong);
+    CASE(IlPutFloat);
+    CASE(IlPutDouble);
+    CASE(IlPutStr);
+    CASE(IlPutBin);
+    CASE(IlPutInt2Long);
+    CASE(IlPutInt2Flt);
+    CASE(IlPutInt2Dbl);
+    CASE(IlPutLong2Flt);
+    CASE(IlPutLong2Dbl);
+    CASE(IlPutFlt2Dbl);
+    CASE(IlPutStr2Bin);
+    CASE(IlPutBin2Str);
+    default:
+        err->kind = VmErrBadCode;
+        err->pos = 0;
+        return -1;
+    }
+#undef CASE
+    return rc == 0 ? opos : -1;
+}
+
+ptrdiff_t schema_rt_vm_run(struct State *state,
+                           const struct VmInsn *code,
+                           uint32_t entry,
+                           struct VmError *err)
+{
+#define OP(name) [name] = &&do_##name
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+    static const void *const dispatch[256] = {
+        [0 ... 255] = &&do_bad,
+        OP(VmJump), OP(VmLoop), OP(VmNext), OP(VmReturn),
+        OP(IlCallFunc), OP(IlIfSet), OP(IlIfNul),
+        OP(IlIntSwitch), OP(IlStrSwitch), OP(IlObjForeach),
+        OP(IlMove), OP(IlSkip), OP(IlPSkip),
+        OP(IlPutBoolC), OP(IlPutIntC), OP(IlPutLongC),
+        OP(IlPutFloatC), OP(IlPutDoubleC), OP(IlPutStrC),
+        OP(IlPutBinC), OP(IlPutArrayC), OP(IlPutMapC),
+        OP(IlPutXC), OP(IlPutIntKC), OP(IlPutDummyC), OP(IlPutNulC),
+        OP(IlPutBool), OP(IlPutInt), OP(IlPutLong), OP(IlPutFloat),
+        OP(IlPutDouble), OP(IlPutStr), OP(IlPutBin), OP(IlPutArray),
+        OP(IlPutMap), OP(IlPutInt2Long), OP(IlPutInt2Flt),
+        OP(IlPutInt2Dbl), OP(IlPutLong2Flt), OP(IlPutLong2Dbl),
+        OP(IlPutFlt2Dbl), OP(IlPutStr2Bin), OP(IlPutBin2Str),
+        OP(IlPutEnumI2S), OP(IlPutEnumS2I),
+        OP(IlIsBool), OP(IlIsInt), OP(IlIsFloat), OP(IlIsDouble),
+        OP(IlIsLong), OP(IlIsStr), OP(IlIsBin), OP(IlIsArray),
+        OP(IlIsMap), OP(IlIsNul), OP(IlIsNulOrMap), OP(IlLenIs),
+        OP(IlIsSet), OP(IlIsNotSet), OP(IlBeginVar), OP(IlCheckObuf),
+        OP(IlErrValueV), OP(IlError), OP(IlPutRaw),
+        OP(IlCheckItems), OP(IlPutItems)
+    };
+#pragma GCC diagnostic pop
+#undef OP
+
+#define DISPATCH()    goto *dispatch[pc->op]
+#define HINT_LOAD(x)     __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define HINT_STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define NEXT(n)       do { pc += (n); DISPATCH(); } while (0)
+#define POS           (regs[pc->ipv] + pc->ipo)
+#define OUT           (regs[0] + (int32_t)pc->a)
+#define PUT(type, field, value) \
+    do { \
+        int64_t o = OUT; \
+        state->ot[o] = (type); state->ov[o].field = (value); \
+        NEXT(1); \
+    } while (0)
+#define CHECK(cond, etype) \
+    do { \
+        if (!(cond)) { pos = POS; arg = (etype); goto err_type; } \
+        NEXT(1); \
+    } while (0)
+
+    const struct VmInsn *fn = code + entry, *pc;
+    const uint8_t       *b2 = state->b2;
+    size_t               base = FrameSize;
+    int64_t             *regs;
+    int64_t              pos;
+    int32_t              arg;
+
+    if (fn->op != IlDeclFunc)
+        goto bad_code;
+    if (vm_reserve(state, base + fn->k) != 0)
+        goto nomem;
+    regs = state->vm_stack + base;
+    memset(regs - FrameSize, 0, (FrameSize + fn->k) * sizeof(regs[0]));
+    regs[-FrameRet] = -1;
+    pc = fn + 1;
+    DISPATCH();
+
+do_VmJump:
+    pc = code + pc->a;
+    DISPATCH();
+
+do_VmLoop:
+    if (regs[pc->ipv] >= regs[pc->ipo]) {
+        pc = code + pc->a;
+        DISPATCH();
+    }
+    NEXT(1);
+
+do_VmNext:
+    regs[pc->ipv] += pc->ipo;
+    pc = code + pc->a;
+    DISPATCH();
+
+do_VmReturn: {
+    int64_t v0 = regs[0], param = regs[fn->ipv];
+    int64_t ret = regs[-FrameRet];
+    int64_t result = regs[-FrameResult];
+    if (ret < 0)
+        return v0;
+    state->k -= (int32_t)regs[-FrameK];
+    base = regs[-FrameBase];
+    fn = code + regs[-FrameFunc];
+    regs = state->vm_stack + base;
+    regs[0] = v0;
+    if (result != NilReg)
+        regs[result] = param;
+    pc = code + ret;
+    DISPATCH();
+}
+
+do_IlCallFunc: {
+    const struct VmInsn *callee = code + pc[1].a;
+    size_t   callee_base = base + fn->k + FrameSize;
+    int64_t  v0 = regs[0], param = POS;
+    if (vm_reserve(state, callee_base + callee->k) != 0)
+        goto nomem;
+    regs = state->vm_stack + callee_base;
+    memset(regs, 0, callee->k * sizeof(regs[0]));
+    regs[-FrameRet] = pc + 2 - code;
+    regs[-FrameBase] = base;
+    regs[-FrameFunc] = fn - code;
+    regs[-FrameResult] = pc->a;
+    regs[-FrameK] = pc->k;
+    regs[0] = v0;
+    regs[callee->ipv] = param;
+    state->k += pc->k;
+    base = callee_base;
+    fn = callee;
+    pc = callee + 1;
+    DISPATCH();
+}
+
+do_IlIfSet:
+    if ((regs[pc->ipv] != 0) != pc->k) {
+        pc = code + pc->a;
+        DISPATCH();
+    }
+    NEXT(1);
+
+do_IlIfNul:
+    if ((state->t[POS] == NilValue) != pc->k) {
+        pc = code + pc->a;
+        DISPATCH();
+    }
+    NEXT(1);
+
+do_IlIntSwitch: {
+    const struct VmInsn *c = pc + 1, *e = c + pc->k;
+    int64_t val;
+    pos = POS;
+    val = state->v[pos].ival;
+    while (c != e && c->ci != val)
+        c++;
+    if (c == e) {
+        arg = 0;
+        goto err_value;
+    }
+    pc = code + c->a;
+    DISPATCH();
+}
+
+do_IlStrSwitch: {
+    /*
+     * Hints, see schema_rt_guess_key(): the branch taken last in pc->a,
+     * the one taken after branch b in the a field of its second ext.
+     * The program is updated in place; concurrent runs on other states
+     * may only spoil a guess.
+     */
+    struct VmInsn *hints = (struct VmInsn *)pc;
+    const struct VmInsn *c = pc + 2, *e = c + 2 * pc->k;
+    const char *str;
+    uint32_t len, func = pc[1].ci, hash, prev, b;
+    pos = POS;
+    str = (const char *)state->b1 - state->v[pos].xoff;
+    len = state->v[pos].xlen;
+    arg = 0;
+    prev = HINT_LOAD(hints->a);
+    b = HINT_LOAD(hints[3 + 2 * prev].a);
+    if (c[2 * b].ipv == len &&
+        memcmp(b2 - c[2 * b].ipo, str, len) == 0) {
+        HINT_STORE(hints->a, b);
+        pc = code + c[2 * b].a;
+        DISPATCH();
+    }
+    if (pc[1].k != 0 || func != 0) {
+        if (pc[1].k != 0)
+            hash = vm_hash_phf(b2, pc + 1, 0, str, len);
+        else if (vm_hash(func, str, len, &hash) != 0)
+            goto err_value;
+        while (c != e && (uint32_t)c[1].ci != hash)
+            c += 2;
+        if (c == e || schema_rt_key_eq((const char *)b2 - c->ipo, str,
+                                       c->ipv, len) != 0)
+            goto err_value;
+    } else {
+        int32_t i = schema_rt_strsearch(b2, (const uint32_t *)(b2 - pc[1].a),
+                                        pc->k, str, len);
+        if (i < 0)
+            goto err_value;
+        c += 2 * i;
+    }
+    b = (uint32_t)(c - (pc + 2)) / 2;
+    HINT_STORE(hints[3 + 2 * prev].a, b);
+    HINT_STORE(hints->a, b);
+    pc = code + c->a;
+    DISPATCH();
+}
+
+do_IlObjForeach:
+    pos = POS;
+    regs[pc->a] = pos + 1;
+    regs[pc->k] = pos + state->v[pos].xoff;
+    NEXT(1);
+
+do_IlMove:
+    regs[pc->a] = POS;
+    NEXT(1);
+
+do_IlSkip:
+    pos = POS;
+    regs[pc->a] = pos + state->v[pos].xoff;
+    NEXT(1);
+
+do_IlPSkip: {
+    uint8_t t;
+    pos = POS;
+    t = state->t[pos];
+    regs[pc->a] = t == ArrayValue || t == MapValue ?
+                  pos + state->v[pos].xoff : pos + 1;
+    NEXT(1);
+}
+
+do_IlPutBoolC:
+    state->ot[OUT] = pc->ci ? TrueValue : FalseValue;
+    NEXT(1);
+
+do_IlPutIntC:
+    PUT(LongValue, ival, pc->ci);
+
+do_IlPutLongC:
+    PUT(LongValue, ival, pc->cl);
+
+do_IlPutFloatC:
+    PUT(FloatValue, dval, pc->cd);
+
+do_IlPutDoubleC:
+    PUT(DoubleValue, dval, pc->cd);
+
+do_IlPutStrC:
+do_IlPutBinC:
+do_IlPutXC: {
+    int64_t o = OUT;
+    state->ot[o] = pc->op == IlPutStrC ? CStringValue :
+                   pc->op == IlPutBinC ? CBinValue : CopyCommand;
+    state->ov[o].xlen = pc->ipv;
+    state->ov[o].xoff = pc->ipo;
+    NEXT(1);
+}
+
+do_IlPutArrayC:
+    PUT(ArrayValue, xlen, pc->ci);
+
+do_IlPutMapC:
+    PUT(MapValue, xlen, pc->ci);
+
+do_IlPutIntKC:
+    PUT(LongValue, ival, state->k + pc->ci);
+
+do_IlPutDummyC:
+    state->ot[OUT] = CDummyValue;
+    NEXT(1);
+
+do_IlPutNulC:
+    state->ot[OUT] = NilValue;
+    NEXT(1);
+
+do_IlPutBool:
+    state->ot[OUT] = state->t[POS];
+    NEXT(1);
+
+do_IlPutInt:
+do_IlPutLong:
+do_IlPutInt2Long:
+    PUT(LongValue, ival, state->v[POS].ival);
+
+do_IlPutFloat:
+    PUT(FloatValue, dval, state->v[POS].dval);
+
+do_IlPutDouble:
+    PUT(DoubleValue, dval, state->v[POS].dval);
+
+do_IlPutStr:
+do_IlPutBin2Str:
+    PUT(StringValue, uval, state->v[POS].uval);
+
+do_IlPutBin:
+do_IlPutStr2Bin:
+    PUT(BinValue, uval, state->v[POS].uval);
+
+do_IlPutArray:
+    PUT(ArrayValue, xlen, state->v[POS].xlen);
+
+do_IlPutMap:
+    PUT(MapValue, xlen, state->v[POS].xlen);
+
+do_IlPutInt2Flt:
+do_IlPutLong2Flt:
+    PUT(FloatValue, dval, state->v[POS].ival);
+
+do_IlPutInt2Dbl:
+do_IlPutLong2Dbl:
+    PUT(DoubleValue, dval, state->v[POS].ival);
+
+do_IlPutFlt2Dbl:
+    PUT(DoubleValue, dval, state->v[POS].dval);
+
+do_IlPutRaw:
+    PUT(RawCommand, uval, state->rv[POS].uval);
+
+do_IlCheckItems:
+    if (schema_rt_check_items(state, POS, pc->k, err) != 0)
+        return -1;
+    NEXT(1);
+
+do_IlPutItems: {
+    int64_t o = schema_rt_put_items(state, POS, OUT, pc->k, err);
+    if (o < 0)
+        return -1;
+    regs[0] = o;
+    NEXT(1);
+}
+
+do_IlPutEnumI2S: {
+    const struct VmInsn *x = pc + 1;
+    const uint8_t *tab = b2 - x->a;
+    uint64_t i;
+    uint32_t len;
+    int64_t o;
+    pos = POS;
+    i = state->v[pos].uval;
+    arg = 0;
+    if (i >= x->ipv)
+        goto err_value;
+    len = uint_at(tab, x->k, i * 2);
+    arg = 1;
+    if (x->ipo && len == 0)
+        goto err_value;
+    o = OUT;
+    state->ot[o] = CStringValue;
+    state->ov[o].xlen = len;
+    state->ov[o].xoff = uint_at(tab, x->k, i * 2 + 1);
+    NEXT(2);
+}
+
+do_IlPutEnumS2I: {
+    const struct VmInsn *x = pc + 1;
+    const uint8_t *tab = b2 - x[1].a, *aux = b2 - x[2].a;
+    const char *str;
+    uint32_t len, hash, klen, kpos, val;
+    int32_t idx;
+    int64_t o;
+    pos = POS;
+    str = (const char *)state->b1 - state->v[pos].xoff;
+    len = state->v[pos].xlen;
+    arg = 0;
+    if (x->k == 2) {
+        idx = vm_hash_phf(b2, x + 1, x->a, str, len);
+    } else if (vm_hash(x->ci, str, len, &hash) != 0) {
+        goto err_value;
+    } else if (x->k) {
+        switch (x[1].k) {
+        case 8:
+            idx = phf_hash_uint32_band_raw8(tab, hash, x->a,
+                                            x[1].ipv, x[1].ipo);
+            break;
+        case 16:
+            idx = phf_hash_uint32_band_raw16((const uint16_t *)tab, hash, x->a,
+                                             x[1].ipv, x[1].ipo);
+            break;
+        default:
+            idx = phf_hash_uint32_band_raw32((const uint32_t *)tab, hash, x->a,
+                                             x[1].ipv, x[1].ipo);
+        }
+    } else {
+        switch (x[1].k) {
+        case 8:
+            idx = schema_rt_search8(tab, hash, x[1].ipv);
+            break;
+        case 16:
+            idx = schema_rt_search16((const uint16_t *)tab, hash, x[1].ipv);
+            break;
+        default:
+            idx = schema_rt_search32((const uint32_t *)tab, hash, x[1].ipv);
+        }
+    }
+    klen = uint_at(aux, x[2].k, idx * 3);
+    kpos = uint_at(aux, x[2].k, idx * 3 + 1);
+    val  = uint_at(aux, x[2].k, idx * 3 + 2);
+    if (schema_rt_key_eq((const char *)b2 - kpos, str, klen, len) != 0)
+        goto err_value;
+    arg = 1;
+    if (x[2].ci >= 0 && val > (uint32_t)x[2].ci)
+        goto err_value;
+    o = OUT;
+    state->ot[o] = LongValue;
+    state->ov[o].ival = val;
+    NEXT(4);
+}
+
+do_IlIsBool: {
+    uint8_t t = state->t[POS];
+    CHECK(t == FalseValue || t == TrueValue, IlIsBool);
+}
+
+do_IlIsInt:
+    CHECK(state->t[POS] == LongValue &&
+          state->v[POS].uval + 0x80000000 <= 0xffffffff, IlIsInt);
+
+do_IlIsFloat:
+do_IlIsDouble: {
+    uint8_t t;
+    pos = POS;
+    t = state->t[pos];
+    if (t == LongValue) {
+        /* promote, as err_type() in runtime.lua does */
+        state->t[pos] = DoubleValue;
+        state->v[pos].dval = state->v[pos].ival;
+        NEXT(1);
+    }
+    CHECK(t == FloatValue || t == DoubleValue, pc->op);
+}
+
+do_IlIsLong:
+    CHECK(state->t[POS] == LongValue, IlIsLong);
+
+do_IlIsStr:
+    CHECK(state->t[POS] == StringValue, IlIsStr);
+
+do_IlIsBin:
+    CHECK(state->t[POS] == BinValue, IlIsBin);
+
+do_IlIsArray:
+    CHECK(state->t[POS] == ArrayValue, IlIsArray);
+
+do_IlIsMap:
+    CHECK(state->t[POS] == MapValue, IlIsMap);
+
+do_IlIsNul:
+    CHECK(state->t[POS] == NilValue, IlIsNul);
+
+do_IlIsNulOrMap: {
+    uint8_t t = state->t[POS];
+    CHECK(t == NilValue || t == MapValue, IlIsNulOrMap);
+}
+
+do_IlLenIs:
+    pos = POS;
+    if (state->v[pos].xlen != pc->a) {
+        err->kind = VmErrLength;
+        err->arg = pc->a;
+        goto error;
+    }
+    NEXT(1);
+
+do_IlIsSet:
+    if (regs[pc->a] == 0) {
+        pos = POS;
+        err->kind = VmErrMissing;
+        err->len = pc[1].ipv;
+        err->str = pc[1].ipo;
+        goto error;
+    }
+    NEXT(2);
+
+do_IlIsNotSet:
+    pos = POS;
+    if (pos != 0) {
+        err->kind = VmErrDuplicate;
+        goto error;
+    }
+    NEXT(1);
+
+do_IlBeginVar:
+    regs[pc->ipv] = 0;
+    NEXT(1);
+
+do_IlCheckObuf: {
+    int64_t size = OUT;
+    if (pc->ipv != NilReg)
+        size += (int64_t)state->v[POS].xlen * pc->k;
+    if ((size_t)size > state->ot_capacity &&
+        schema_rt_buf_grow(state, size) != 0)
+        goto nomem;
+    NEXT(1);
+}
+
+do_IlErrValueV:
+    pos = POS;
+    arg = 1;
+    goto err_value;
+
+do_IlError:
+    pos = 0;
+    err->kind = VmErrMessage;
+    err->len = pc->ipv;
+    err->str = pc->ipo;
+    goto error;
+
+do_bad:
+bad_code:
+    pos = 0;
+    err->kind = VmErrBadCode;
+    goto error;
+
+nomem:
+    pos = 0;
+    err->kind = VmErrNoMem;
+    goto error;
+
+err_type:
+    err->kind = VmErrType;
+    err->arg = arg;
+    goto error;
+
+err_value:
+    err->kind = VmErrValue;
+    err->arg = arg;
+
+error:
+    err->pos = pos;
+    return -1;
+
+#undef DISPATCH
+#undef HINT_LOAD
+#undef HINT_STORE
+#undef NEXT
+#undef POS
+#undef OUT
+#undef PUT
+#undef CHECK
+}
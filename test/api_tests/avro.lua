@@ -0,0 +1,241 @@
+local ffi = require('ffi')
+local msgpack = require('msgpack')
+local tap = require('tap')
+local schema = require('avro_schema')
+local test = tap.test('Avro binary')
+
+test:plan(8)
+
+local _, s = schema.create({
+    type = 'record', name = 'Doc', fields = {
+        {name = 'id', type = 'long'},
+        {name = 'name', type = 'string'},
+        {name = 'blob', type = 'bytes'},
+        {name = 'flag', type = 'boolean'},
+        {name = 'ratio', type = 'float'},
+        {name = 'score', type = 'double'},
+        {name = 'small', type = 'int'},
+        {name = 'nothing', type = 'null'},
+        {name = 'color', type = {
+            type = 'enum', name = 'Color', symbols = {'RED', 'GREEN'}}},
+        {name = 'hash', type = {type = 'fixed', name = 'Hash', size = 4}},
+        {name = 'nums', type = {type = 'array', items = 'long'}},
+        {name = 'attrs', type = {type = 'map', values = 'string'}},
+        {name = 'pos', type = {
+            type = 'record', name = 'Pos', fields = {
+                {name = 'x', type = 'long'},
+                {name = 'y', type = 'long'}
+            }
+        }},
+        {name = 'opt', type = 'long*'},
+        {name = 'choice', type = {'null', 'string', 'Pos'}}
+    }
+})
+local ok, m = schema.compile(s)
+assert(ok, m)
+
+-- Avro binary encoding helpers
+local function varint(n)
+    local u = n >= 0 and 2 * n or -2 * n - 1
+    local res = {}
+    repeat
+        local b = u % 128
+        u = (u - b) / 128
+        table.insert(res, string.char(u > 0 and b + 128 or b))
+    until u == 0
+    return table.concat(res)
+end
+
+local function str(v)
+    return varint(#v) .. v
+end
+
+local function float(v)
+    return ffi.string(ffi.new('float[1]', v), 4)
+end
+
+local function double(v)
+    return ffi.string(ffi.new('double[1]', v), 8)
+end
+
+local doc = {
+    id = -1234567, name = 'John', blob = '\0\1', flag = true, ratio = 0.5,
+    score = 1.25, small = 42, nothing = msgpack.NULL, color = 'GREEN',
+    hash = 'abcd', nums = {1, 2, 3}, attrs = {k = 'v'}, pos = {x = 1, y = -2},
+    opt = 7, choice = {Pos = {x = 3, y = 4}}
+}
+
+-- everything before opt and choice
+local head = table.concat({
+    varint(-1234567), str('John'), str('\0\1'), '\1', float(0.5),
+    double(1.25), varint(42), --[[ null ]] varint(1), 'abcd',
+    varint(3), varint(1), varint(2), varint(3), varint(0),
+    varint(1), str('k'), str('v'), varint(0),
+    varint(1), varint(-2)
+})
+local avro = head .. varint(1) .. varint(7) .. varint(2) .. varint(3) ..
+             varint(4)
+
+-- flatten_avro, then unflatten the tuple back to a Lua object
+local function decode(data)
+    local ok, tuple = m.flatten_avro(data)
+    if not ok then return ok, tuple end
+    return m.unflatten(tuple)
+end
+
+test:test('flatten_avro', function(test)
+    test:plan(2)
+    test:is_deeply({decode(avro)}, {true, doc}, 'flatten_avro')
+    local _, tuple = m.flatten_avro(avro)
+    test:is_deeply({m.flatten_msgpack(select(2, m.unflatten_msgpack(tuple)))},
+                   {true, tuple}, 'flatten_msgpack agrees')
+end)
+
+test:test('unflatten_avro', function(test)
+    test:plan(2)
+    local _, tuple = m.flatten_avro(avro)
+    test:is_deeply({m.unflatten_avro(tuple)}, {true, avro}, 'unflatten_avro')
+    local _, msgpack_tuple = m.flatten_msgpack(
+        select(2, m.unflatten_msgpack(tuple)))
+    test:is_deeply({m.unflatten_avro(msgpack_tuple)}, {true, avro},
+                   'same tuple from flatten_msgpack')
+end)
+
+test:test('unions and nullable', function(test)
+    test:plan(4)
+    local function variant(opt, choice, tail)
+        local d = table.copy(doc)
+        d.opt, d.choice = opt, choice
+        return d, head .. tail
+    end
+    local d, a = variant(msgpack.NULL, msgpack.NULL, varint(0) .. varint(0))
+    test:is_deeply({decode(a)}, {true, d}, 'nulls')
+    test:is(select(2, m.unflatten_avro(select(2, m.flatten_avro(a)))), a,
+            'nulls encoded')
+    d, a = variant(msgpack.NULL, {string = 'x'},
+                   varint(0) .. varint(1) .. str('x'))
+    test:is_deeply({decode(a)}, {true, d}, 'string branch')
+    test:is(select(2, m.unflatten_avro(select(2, m.flatten_avro(a)))), a,
+            'string branch encoded')
+end)
+
+test:test('blocks', function(test)
+    test:plan(2)
+    local nums = {}
+    for i = 1, 20 do nums[i] = i end
+    local d = table.copy(doc)
+    d.nums = nums
+    -- 2 blocks: 10 items, then -10 items with the block size
+    local items = {}
+    for i = 1, 10 do items[i] = varint(i) end
+    local block1 = varint(10) .. table.concat(items)
+    for i = 1, 10 do items[i] = varint(10 + i) end
+    local body = table.concat(items)
+    local block2 = varint(-10) .. varint(#body) .. body
+    local nums_avro = varint(3) .. varint(1) .. varint(2) .. varint(3) ..
+                      varint(0)
+    local pos = avro:find(nums_avro, 1, true)
+    local a = avro:sub(1, pos - 1) .. block1 .. block2 .. varint(0) ..
+              avro:sub(pos + #nums_avro)
+    test:is_deeply({decode(a)}, {true, d}, 'multiple blocks')
+    local _, tuple = m.flatten_avro(a)
+    test:is_deeply({m.flatten_avro(select(2, m.unflatten_avro(tuple)))},
+                   {true, tuple}, 'round trip')
+end)
+
+test:test('errors', function(test)
+    test:plan(4)
+    test:is_deeply({m.flatten_avro(avro:sub(1, -2))},
+                   {false, 'Truncated data'}, 'truncated')
+    local bad_enum = avro:gsub(varint(42) .. varint(1), varint(42) ..
+                               varint(5), 1)
+    test:is_deeply({m.flatten_avro(bad_enum)}, {false, 'Invalid data'},
+                   'enum index')
+    local bad_int = avro:gsub(varint(42), varint(2^31), 1)
+    test:is_deeply({m.flatten_avro(bad_int)},
+                   {false, 'small: Value exceeds INT range: 2147483648LL'},
+                   'int range')
+    test:is_deeply({m.flatten_avro({})}, {false, 'Expecting a string'},
+                   'not a string')
+end)
+
+test:test('huge block count', function(test)
+    test:plan(5)
+    local _, s3 = schema.create({
+        type = 'record', name = 'Counts', fields = {
+            {name = 'nulls', type = {type = 'array', items = 'null'}},
+            {name = 'empty', type = {type = 'array', items = {
+                type = 'record', name = 'Empty', fields = {
+                    {name = 'n', type = 'null'}}}}},
+            {name = 'nums', type = {type = 'array', items = 'long'}}
+        }
+    })
+    local _, m3 = schema.compile(s3)
+    local e = varint(0)
+    test:is_deeply({m3.flatten_avro(varint(2^32 - 1) .. e .. e .. e)},
+                   {false, 'Invalid data'}, 'nulls')
+    test:is_deeply({m3.flatten_avro(e .. varint(-2^31) .. varint(0) .. e ..
+                                    e)},
+                   {false, 'Invalid data'}, 'empty records')
+    test:is_deeply({m3.flatten_avro(e .. e .. varint(2^20) .. e)},
+                   {false, 'Invalid data'}, 'more items than bytes')
+    local ok, tuple = m3.flatten_avro(varint(1000) .. e .. varint(3) ..
+                                      e .. varint(2) .. varint(7) ..
+                                      varint(8) .. e)
+    tuple = msgpack.decode(tuple)
+    test:is_deeply({ok, #tuple[1], #tuple[2], tuple[3]},
+                   {true, 1000, 3, {7, 8}}, 'within limits')
+    -- the limit applies to the total, not to a block
+    local blocks = {}
+    for i = 1, 2^20 / 2^16 + 1 do
+        blocks[i] = varint(2^16)
+    end
+    test:is_deeply({m3.flatten_avro(table.concat(blocks) .. e .. e .. e)},
+                   {false, 'Invalid data'}, 'blocks')
+end)
+
+test:test('long* at the buffer end', function(test)
+    test:plan(2)
+    local _, s2 = schema.create({
+        type = 'record', name = 'Tail', fields = {
+            {name = 's', type = 'string'},
+            {name = 'v', type = 'long*'}
+        }
+    })
+    local _, m2 = schema.compile(s2)
+    -- the union index and a 10 byte varint, right where xbuf grows
+    local limits = {
+        {0x7fffffffffffffffLL, '\xfe' .. string.rep('\xff', 8) .. '\x01'},
+        {-0x7fffffffffffffffLL - 1, string.rep('\xff', 9) .. '\x01'}
+    }
+    for _, limit in ipairs(limits) do
+        local ok = true
+        for len = 200, 600 do
+            local bound = m2.bind(schema.new_state())
+            local v = string.rep('x', len)
+            local _, tuple = bound.flatten({s = v, v = limit[1]})
+            local _, a = bound.unflatten_avro(tuple)
+            ok = ok and a == str(v) .. varint(1) .. limit[2]
+        end
+        test:ok(ok, tostring(limit[1]))
+    end
+end)
+
+test:test('evolution', function(test)
+    test:plan(1)
+    local _, s2 = schema.create({
+        type = 'record', name = 'Doc', fields = {
+            {name = 'id', type = 'long'},
+            {name = 'name', type = 'string'},
+            {name = 'extra', type = 'int', default = 5}
+        }
+    })
+    local _, m12 = schema.compile({s, s2})
+    local _, m2 = schema.compile(s2)
+    local _, tuple = m12.flatten_avro(avro)
+    test:is_deeply({m2.unflatten(tuple)},
+                   {true, {id = -1234567, name = 'John', extra = 5}},
+                   'flatten_avro')
+end)
+
+os.exit(test:check() and 0 or 1)
@@ -0,0 +1,91 @@
+local tap = require('tap')
+local msgpack = require('msgpack')
+local schema = require('avro_schema')
+local test = tap.test('batch')
+
+test:plan(4)
+
+local _, s = schema.create({
+    type = 'record', name = 'Frob', fields = {
+        {name = 'foo', type = 'int', default = 42},
+        {name = 'bar', type = 'string'},
+        {name = 'baz', type = {type = 'array', items = 'double'}}
+    }
+})
+local _, m = schema.compile(s)
+
+local items = {
+    {foo = 1, bar = 'a', baz = {}},
+    {bar = 'b', baz = {1.5, 2.5}},
+    {foo = 'bad', bar = 'c', baz = {}},
+    {foo = 4, bar = 'd', baz = {0.5}},
+    {foo = 5},
+    {foo = 6, bar = string.rep('e', 1000), baz = {}},
+}
+
+-- reference results and errors obtained one by one
+local expected, expected_errors = {}, {}
+for i, item in ipairs(items) do
+    local ok, res = m.flatten(item)
+    if ok then expected[i] = res else expected_errors[i] = res end
+end
+
+test:test('flatten_batch', function(test)
+    test:plan(3)
+    local ok, results, errors = m.flatten_batch(items)
+    test:ok(ok, 'ok')
+    test:is_deeply(results, expected, 'results')
+    test:is_deeply(errors, expected_errors, 'errors')
+end)
+
+test:test('flatten_msgpack_batch', function(test)
+    test:plan(4)
+    local ok, data, offsets, errors = m.flatten_msgpack_batch(items)
+    test:ok(ok, 'ok')
+    test:is(#offsets, #items + 1, 'offsets')
+    local results = {}
+    for i = 1, #items do
+        if offsets[i] ~= offsets[i + 1] then
+            results[i] = msgpack.decode(data:sub(offsets[i] + 1,
+                                                 offsets[i + 1]))
+        end
+    end
+    test:is_deeply(results, expected, 'results')
+    test:is_deeply(errors, expected_errors, 'errors')
+end)
+
+test:test('unflatten_batch', function(test)
+    test:plan(3)
+    local tuples = {}
+    for i = 1, #items do tuples[i] = expected[i] or {1, 2} end
+    local ok, results, errors = m.unflatten_batch(tuples)
+    test:ok(ok, 'ok')
+    local expected_u, expected_e = {}, {}
+    for i, tuple in ipairs(tuples) do
+        local ok, res = m.unflatten(tuple)
+        if ok then expected_u[i] = res else expected_e[i] = res end
+    end
+    test:is_deeply(results, expected_u, 'results')
+    test:is_deeply(errors, expected_e, 'errors')
+end)
+
+test:test('service fields', function(test)
+    test:plan(4)
+    local _, m = schema.compile({s, service_fields = {'int', 'string'}})
+    local ok, results, errors = m.flatten_batch(
+        {items[1], items[3], items[4]}, {{1, 'x'}, {2, 'y'}, {3, 'z'}})
+    test:ok(ok, 'ok')
+    test:is_deeply({results, errors}, {
+        {[1] = {1, 'x', 1, 'a', {}}, [3] = {3, 'z', 4, 'd', {0.5}}},
+        {[2] = expected_errors[3]}
+    }, 'flatten')
+    local ok, results, errors, service = m.unflatten_batch(
+        {results[1], results[3]})
+    test:ok(ok, 'ok')
+    test:is_deeply({results, errors, service}, {
+        {{foo = 1, bar = 'a', baz = {}}, {foo = 4, bar = 'd', baz = {0.5}}},
+        {}, {{1, 'x'}, {3, 'z'}}
+    }, 'unflatten')
+end)
+
+os.exit(test:check() and 0 or 1)
@@ -0,0 +1,120 @@
+local tap = require('tap')
+local schema = require('avro_schema')
+local test = tap.test('buffers')
+
+test:plan(6)
+
+local _, s = schema.create({type = 'array', items = 'float'})
+local _, m = schema.compile(s)
+
+local function items(n)
+    local res = {}
+    for i = 1, n do res[i] = i + 0.5 end
+    return res
+end
+local small, large = items(10), items(100000)
+
+test:test('stats', function(test)
+    test:plan(4)
+    m.flatten(small)
+    local before = schema.buffer_stats()
+    -- flatten doesn't need res (the result is made straight from ot/ov)
+    m.flatten_msgpack(large)
+    local after = schema.buffer_stats()
+    test:ok(after.tv.grows > before.tv.grows, 'tv grows')
+    test:ok(after.ot.grows > before.ot.grows, 'ot grows')
+    test:ok(after.res.grows > before.res.grows, 'res grows')
+    test:ok(after.tv.peak >= 100001 * 9 and
+            after.tv.capacity >= after.tv.peak, 'tv peak')
+end)
+
+test:test('high water', function(test)
+    test:plan(4)
+    schema.buffer_policy({high_water = 256 * 1024, baseline = 4096})
+    m.flatten(large)
+    local stats = schema.buffer_stats()
+    test:ok(stats.tv.capacity > 256 * 1024, 'large call')
+    local ok, res = m.flatten(small)
+    test:is_deeply({ok, res}, {true, {small}}, 'next call')
+    local next = schema.buffer_stats()
+    test:is(next.tv.shrinks, stats.tv.shrinks + 1, 'shrunk')
+    test:ok(next.tv.capacity < 16 * 1024 and next.res.capacity < 16 * 1024,
+            'capacity')
+end)
+
+test:test('decay', function(test)
+    test:plan(3)
+    schema.buffer_policy({baseline = 4096, decay = 3})
+    m.flatten(large)
+    local stats = schema.buffer_stats()
+    -- usage is checked when the next call starts
+    for _ = 1, 3 do m.flatten(small) end
+    test:is(schema.buffer_stats().tv.shrinks, stats.tv.shrinks, 'kept')
+    m.flatten(small)
+    local next = schema.buffer_stats()
+    test:is(next.tv.shrinks, stats.tv.shrinks + 1, 'shrunk')
+    test:ok(next.tv.capacity < 16 * 1024, 'capacity')
+    schema.buffer_policy()
+end)
+
+test:test('xbuf', function(test)
+    test:plan(4)
+    local _, a = schema.create({type = 'array', items = 'string'})
+    local _, ma = schema.compile(a)
+    local strings = {}
+    for i = 1, 20000 do strings[i] = 'string ' .. i end
+    local _, tuple = ma.flatten(strings)
+    local ok, avro = ma.unflatten_avro(tuple)
+    local before = schema.buffer_stats()
+    ma.flatten_avro(avro)
+    local stats = schema.buffer_stats()
+    -- unparse_avro swaps res and xbuf, the capacity may be below the peak
+    test:ok(ok and stats.xbuf.peak > 200000 and
+            stats.xbuf.capacity > 200000, 'xbuf peak')
+    schema.buffer_policy({high_water = 64 * 1024, baseline = 4096})
+    ok, tuple = ma.flatten_avro(select(2, ma.unflatten_avro({{'x'}})))
+    local next = schema.buffer_stats()
+    test:is_deeply({ok, tuple}, {true, '\145\145\161x'}, 'next call')
+    test:is(next.xbuf.shrinks, before.xbuf.shrinks + 1, 'shrunk')
+    test:ok(next.xbuf.capacity < 16 * 1024, 'capacity')
+    schema.buffer_policy()
+end)
+
+test:test('batch', function(test)
+    test:plan(4)
+    local _, ref = m.flatten_msgpack_batch({large, small, small})
+    local ok, data = m.flatten_msgpack_batch({large, large})
+    local stats = schema.buffer_stats()
+    test:ok(ok and #data > 1000000 and stats.batch.peak >= #data and
+            stats.batch.capacity >= #data, 'batch peak')
+    schema.buffer_policy({high_water = 256 * 1024, baseline = 4096})
+    -- not shrunk within a batch: the results of every item are kept
+    ok, data = m.flatten_msgpack_batch({large, small, small})
+    test:ok(ok and data == ref, 'next batch')
+    m.flatten(small)
+    local next = schema.buffer_stats()
+    test:is(next.batch.shrinks, stats.batch.shrinks + 1, 'shrunk')
+    test:ok(next.batch.capacity < 16 * 1024, 'capacity')
+    schema.buffer_policy()
+end)
+
+test:test('vm stack', function(test)
+    test:plan(3)
+    local _, list = schema.create({type = 'record', name = 'node', fields = {
+        {name = 'v', type = 'long'}, {name = 'next', type = 'node*'}}})
+    local _, mv = schema.compile({list, engine = 'vm'})
+    local deep = {v = 0}
+    for i = 1, 1000 do deep = {v = i, next = deep} end
+    local ok = mv.flatten(deep)
+    local stats = schema.buffer_stats()
+    test:ok(ok and stats.vm.peak > 16 * 1024 and
+            stats.vm.capacity >= stats.vm.peak, 'vm peak')
+    schema.buffer_policy({high_water = 16 * 1024, baseline = 1024})
+    mv.flatten({v = 1})
+    local next = schema.buffer_stats()
+    test:is(next.vm.shrinks, stats.vm.shrinks + 1, 'shrunk')
+    test:ok(next.vm.capacity <= 1024, 'capacity')
+    schema.buffer_policy()
+end)
+
+os.exit(test:check() and 0 or 1)
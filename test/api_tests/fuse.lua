@@ -0,0 +1,138 @@
+local tap = require('tap')
+local msgpack = require('msgpack')
+local schema = require('avro_schema')
+local test = tap.test('fused transcoder')
+
+test:plan(5)
+
+local _, s = schema.create({
+    type = 'record', name = 'Flat', fields = {
+        {name = 'id', type = 'long'},
+        {name = 'name', type = 'string'},
+        {name = 'tag', type = 'bytes'},
+        {name = 'ok', type = 'boolean'},
+        {name = 'ratio', type = 'float'},
+        {name = 'score', type = 'double'},
+        {name = 'small', type = 'int', default = 7},
+        {name = 'nothing', type = 'null'},
+        {name = 'pos', type = {
+            type = 'record', name = 'Pos', fields = {
+                {name = 'x', type = 'long'},
+                {name = 'y', type = 'long'}
+            }
+        }}
+    }
+})
+local _, fused = schema.compile(s)
+local _, plain = schema.compile({s, fuse = false})
+
+-- msgpack map, keys in the given order
+local function map(...)
+    local n = select('#', ...) / 2
+    local res = { string.char(0x80 + n) }
+    for i = 1, n do
+        local k, v = select(2 * i - 1, ...)
+        table.insert(res, msgpack.encode(k))
+        table.insert(res, v)
+    end
+    return table.concat(res)
+end
+
+local e = msgpack.encode
+local pos = map('x', e(1), 'y', e(-2))
+local bin = '\196\3bin'
+
+local function record(overrides)
+    local fields = {
+        {'id', e(42)}, {'name', e('John')}, {'tag', bin}, {'ok', e(true)},
+        {'ratio', e(0.5)}, {'score', e(1.25)}, {'small', e(-3)},
+        {'nothing', '\192'}, {'pos', pos}
+    }
+    local res = {}
+    for _, f in ipairs(fields) do
+        local v = overrides[f[1]]
+        if v ~= false then
+            table.insert(res, f[1])
+            table.insert(res, v or f[2])
+        end
+    end
+    return map(unpack(res))
+end
+
+local function same(test, method, data, name)
+    test:is_deeply({fused[method](data)}, {plain[method](data)}, name)
+end
+
+test:test('flatten', function(test)
+    test:plan(6)
+    same(test, 'flatten_msgpack', record({}), 'schema order')
+    local data = map('pos', pos, 'nothing', '\192', 'small', e(-3),
+                     'score', e(1.25), 'ratio', e(0.5), 'ok', e(true),
+                     'tag', bin, 'name', e('John'), 'id', e(42))
+    same(test, 'flatten_msgpack', data, 'reverse order')
+    same(test, 'flatten_msgpack', record({
+        id = '\211\0\0\0\0\0\0\0\5', -- int64 5
+        name = '\217\4John',         -- str8
+        ratio = e(3),                -- long to float
+        score = '\202\63\192\0\0',   -- float 1.5
+        small = '\208\127'           -- int8 127
+    }), 'non-canonical encodings, promotions')
+    same(test, 'flatten_msgpack', record({
+        id = '\207\127\255\255\255\255\255\255\255',
+        ratio = e(1.1),
+        small = '\210\128\0\0\0'
+    }), 'limits')
+    same(test, 'flatten_msgpack', record({name = e(string.rep('x', 300))}),
+         'long string')
+    same(test, 'flatten_msgpack', record({}) .. '\192', 'trailing data')
+end)
+
+test:test('unflatten', function(test)
+    test:plan(4)
+    local _, tuple = plain.flatten_msgpack(record({}))
+    same(test, 'unflatten_msgpack', tuple, 'unflatten')
+    local _, data = plain.unflatten_msgpack(tuple)
+    test:is(select(2, fused.flatten_msgpack(data)), tuple, 'round trip')
+    same(test, 'unflatten_msgpack',
+         '\154\42\164John\196\3bin\195\1\202\63\192\0\0\5\192\1\2',
+         'promotions')
+    local long_tuple = select(2, plain.flatten_msgpack(
+        record({name = e(string.rep('x', 70000))})))
+    same(test, 'unflatten_msgpack', long_tuple, 'long string')
+end)
+
+test:test('fallback', function(test)
+    test:plan(6)
+    same(test, 'flatten_msgpack', record({small = false}), 'default value')
+    same(test, 'flatten_msgpack', record({id = e('42')}), 'type mismatch')
+    same(test, 'flatten_msgpack', record({small = e(2^31)}),
+         'int range')
+    same(test, 'flatten_msgpack', record({nothing = false}), 'missing key')
+    same(test, 'flatten_msgpack', record({}):sub(1, -2), 'truncated')
+    same(test, 'unflatten_msgpack', '\154\42\164John\196\3bin',
+         'short tuple')
+end)
+
+test:test('keys', function(test)
+    test:plan(3)
+    local data = record({})
+    same(test, 'flatten_msgpack', '\138' .. data:sub(2) .. '\161z\1',
+         'unknown key')
+    same(test, 'flatten_msgpack', '\138' .. data:sub(2) .. '\162id\1',
+         'duplicate key')
+    same(test, 'flatten_msgpack', '\138' .. data:sub(2) .. '\1\1',
+         'non-string key')
+end)
+
+test:test('bypasses t/v', function(test)
+    test:plan(3)
+    local state = schema.new_state()
+    local bound = fused.bind(state)
+    local ok, tuple = bound.flatten_msgpack(record({}))
+    test:ok(ok, 'flatten_msgpack')
+    ok = bound.unflatten_msgpack(tuple)
+    test:ok(ok, 'unflatten_msgpack')
+    test:is(schema.buffer_stats(state).tv.peak, 0, 'nothing parsed')
+end)
+
+os.exit(test:check() and 0 or 1)
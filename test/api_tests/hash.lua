@@ -0,0 +1,283 @@
+local ffi = require('ffi')
+local msgpack = require('msgpack')
+local tap = require('tap')
+local schema = require('avro_schema')
+local runtime = require('avro_schema.runtime')
+local test = tap.test('hash')
+
+test:plan(7)
+
+local rt_C = ffi.load(runtime.C_path)
+local random = string.rep('\90\19\119\33\144\171\205\239', 8)
+
+-- a func made by create_hash_func: nil if none, else the collisions
+local function create(strings)
+    local s = ffi.new('const char *[?]', #strings)
+    for i = 1, #strings do
+        s[i - 1] = strings[i]
+    end
+    local func = rt_C.create_hash_func(#strings, s, random, #random)
+    if func == 0 then
+        return nil
+    end
+    local seen, collisions = {}, 0
+    for _, str in ipairs(strings) do
+        local h = rt_C.eval_hash_func(func, str, #str)
+        collisions = collisions + (seen[h] and 1 or 0)
+        seen[h] = true
+    end
+    return collisions, func
+end
+
+local engines = {'lua', 'vm', 'c'}
+
+test:test('create_hash_func', function(test)
+    test:plan(5)
+    -- solved by the 4th sampled position (3 are encoded at most)
+    local four = {}
+    for i = 0, 15 do
+        local s = 'f'
+        for b = 3, 0, -1 do
+            s = s .. (bit.band(i, bit.lshift(1, b)) == 0 and 'x' or 'y')
+        end
+        table.insert(four, s)
+    end
+    test:is(create(four), 0, '4 positions')
+    local names = {}
+    for i = 1, 5000 do
+        names[i] = string.format('customer_%d_shipping_address', i)
+    end
+    test:is(create(names), 0, '5000 names')
+    local utf8 = {}
+    for i = 1, 300 do
+        utf8[i] = 'поле_' .. string.char(0xd0, 0x80 + i % 64) .. i
+    end
+    test:is(create(utf8), 0, 'UTF-8, bytes over 0x7f')
+    for i = 5001, 150001 do
+        names[i] = 'x' .. i
+    end
+    test:isnil(create(names), 'none for a huge set')
+    test:isnil(create({}), 'none for an empty set')
+end)
+
+test:test('string phf', function(test)
+    test:plan(#engines * 2)
+    local symbols = {}
+    for i = 1, 40 do
+        symbols[i] = 'symbol_' .. i
+    end
+    local _, s = schema.create({type = 'enum', name = 'e', symbols = symbols})
+    for _, engine in ipairs(engines) do
+        -- no hash func without fast strings, a string phf instead
+        local _, m = schema.compile({s, engine = engine,
+                                     enable_fast_strings = false})
+        local res = {}
+        for i = 1, #symbols do
+            local _, tuple = m.flatten(msgpack.encode(symbols[i]))
+            res[i] = tuple[1]
+        end
+        local expected = {}
+        for i = 1, #symbols do
+            expected[i] = i - 1
+        end
+        test:is_deeply(res, expected, engine .. ': all symbols')
+        test:is_deeply({m.flatten(msgpack.encode('symbol_41'))},
+                       {false, 'Bad value: "symbol_41"'}, engine .. ': bad')
+    end
+end)
+
+test:test('4 positions', function(test)
+    test:plan(#engines)
+    local fields, obj, expected = {}, {}, {}
+    for i = 0, 15 do
+        local name = 'f'
+        for b = 3, 0, -1 do
+            name = name .. (bit.band(i, bit.lshift(1, b)) == 0 and 'x' or 'y')
+        end
+        table.insert(fields, {name = name, type = 'int'})
+        obj[name] = i
+        expected[i + 1] = i
+    end
+    local _, s = schema.create({type = 'record', name = 'r', fields = fields})
+    for _, engine in ipairs(engines) do
+        local _, m = schema.compile({s, engine = engine})
+        test:is_deeply({m.flatten(obj)}, {true, expected}, engine)
+    end
+end)
+
+test:test('wide record', function(test)
+    test:plan(2)
+    local fields, obj = {}, {}
+    for i = 1, 3000 do
+        local name = string.format('customer_shipping_address_%d', i)
+        table.insert(fields, {name = name, type = 'int'})
+        obj[name] = i
+    end
+    local _, s = schema.create({type = 'record', name = 'r', fields = fields})
+    -- a local variable per field in the generated Lua code, too many
+    local _, m = schema.compile({s, engine = 'vm'})
+    local _, tuple = m.flatten(obj)
+    test:is_deeply({#tuple, tuple[1], tuple[3000]}, {3000, 1, 3000}, 'flatten')
+    obj.customer_shipping_address_3001 = 1
+    test:ok(not m.flatten(obj), 'unknown field')
+end)
+
+test:test('string switch without a hash func', function(test)
+    test:plan(#engines * 3)
+    -- lengths and contents differ, prefixes are shared
+    local names = {'a', 'b', 'ab', 'ba', 'aa', 'abc', 'bc', 'field',
+                   'field_1', 'field_10', 'field_2', 'f'}
+    local fields, obj, expected = {}, {}, {}
+    for i, name in ipairs(names) do
+        table.insert(fields, {name = name, type = 'int'})
+        obj[name] = i
+        expected[i] = i
+    end
+    local _, s = schema.create({type = 'record', name = 'r', fields = fields})
+    for _, engine in ipairs(engines) do
+        local _, m = schema.compile({s, engine = engine,
+                                     enable_fast_strings = false})
+        test:is_deeply({m.flatten(obj)}, {true, expected}, engine)
+        obj.field_3 = 0
+        test:is_deeply({m.flatten(obj)}, {false, 'Unknown key: "field_3"'},
+                       engine .. ': unknown key')
+        obj.field_3, obj.fiel = nil, 0
+        test:is_deeply({m.flatten(obj)}, {false, 'Unknown key: "fiel"'},
+                       engine .. ': a prefix')
+        obj.fiel = nil
+    end
+end)
+
+-- a msgpack map with the keys in the given order
+local function map(keys, obj)
+    local res = {string.char(0x80 + #keys)}
+    for _, k in ipairs(keys) do
+        table.insert(res, msgpack.encode(k) .. msgpack.encode(obj[k]))
+    end
+    return table.concat(res)
+end
+
+test:test('key order', function(test)
+    test:plan(#engines * 6)
+    local names = {'id', 'name', 'email', 'emails', 'age', 'city', 'zip',
+                   'country'}
+    local fields, obj, expected = {}, {}, {}
+    for i, name in ipairs(names) do
+        -- the last 3 may be missing
+        table.insert(fields, {name = name, type = 'int',
+                              default = i > 5 and 0 or nil})
+        obj[name] = i
+        expected[i] = i
+    end
+    local reversed, sparse, sparse_expected = {}, {}, {}
+    for i = #names, 1, -1 do
+        table.insert(reversed, names[i])
+    end
+    for i = 1, #names do
+        if i % 2 == 1 or i < 5 then
+            table.insert(sparse, names[i])
+        end
+        sparse_expected[i] = (i % 2 == 1 or i < 5) and i or 0
+    end
+    local _, s = schema.create({type = 'record', name = 'r', fields = fields})
+    for _, engine in ipairs(engines) do
+        local _, m = schema.compile({s, engine = engine})
+        local function flatten_n(keys, exp, n)
+            local data = map(keys, obj)
+            for _ = 1, n do
+                local ok, tuple = m.flatten(data)
+                if not ok or #tuple ~= #exp then
+                    return false
+                end
+                for i = 1, #exp do
+                    if tuple[i] ~= exp[i] then
+                        return false
+                    end
+                end
+            end
+            return true
+        end
+        test:ok(flatten_n(names, expected, 3), engine .. ': in order')
+        test:ok(flatten_n(reversed, expected, 3), engine .. ': reversed')
+        local alternating = true
+        for _ = 1, 3 do
+            alternating = alternating and flatten_n(names, expected, 1) and
+                          flatten_n(reversed, expected, 1)
+        end
+        test:ok(alternating, engine .. ': alternating')
+        test:ok(flatten_n(sparse, sparse_expected, 3), engine .. ': sparse')
+        -- an unknown key where the next one is expected
+        flatten_n(names, expected, 2)
+        local bad = {unpack(names)}
+        bad[3] = 'mail'
+        obj.mail = 3
+        test:is_deeply({m.flatten(map(bad, obj))},
+                       {false, 'Unknown key: "mail"'}, engine .. ': unknown')
+        -- a prefix of the expected one
+        bad[3] = 'emai'
+        obj.emai = 3
+        test:is_deeply({m.flatten(map(bad, obj))},
+                       {false, 'Unknown key: "emai"'}, engine .. ': a prefix')
+        obj.mail, obj.emai = nil, nil
+    end
+end)
+
+test:test('cache', function(test)
+    test:plan(10)
+    local symbols = {}
+    for i = 1, 500 do
+        symbols[i] = 'symbol_' .. i
+    end
+    local enum = {type = 'enum', name = 'e', symbols = symbols}
+    local function compile(name)
+        local _, s = schema.create({type = 'record', name = name, fields = {
+            {name = 'a', type = enum}, {name = 'b', type = 'int'}}})
+        local _, m = schema.compile(s)
+        return m
+    end
+    local function flatten_all(m)
+        for i = 1, #symbols do
+            local ok, tuple = m.flatten({a = symbols[i], b = i})
+            if not ok or tuple[1] ~= i - 1 then
+                return false
+            end
+        end
+        return true
+    end
+    local function stats()
+        local s = schema.compile_stats()
+        return {s.hash_hits, s.hash_misses}
+    end
+    schema.hash_cache_clear()
+    local base = stats()
+    compile('r1')
+    local s1 = stats()
+    test:ok(s1[2] > base[2], 'misses')
+    test:ok(flatten_all(compile('r2')), 'hit: flatten')
+    local s2 = stats()
+    test:is_deeply({s2[1] > s1[1], s2[2]}, {true, s1[2]}, 'hit: no misses')
+    local data = schema.hash_cache_dump()
+    schema.hash_cache_clear()
+    test:is(schema.compile_stats().hash_entries, 0, 'clear')
+    test:ok(schema.hash_cache_load(data), 'load')
+    test:ok(flatten_all(compile('r1')), 'loaded: flatten')
+    test:is(stats()[2], s2[2], 'loaded: no misses')
+    -- a bad entry is rebuilt
+    local t = msgpack.decode(data)
+    for k, v in pairs(t[2]) do
+        if type(v) == 'table' then
+            t[2][k].g = string.rep('\0', #v.g)
+        else
+            t[2][k] = 1
+        end
+    end
+    schema.hash_cache_clear()
+    schema.hash_cache_load(msgpack.encode(t))
+    test:ok(flatten_all(compile('r1')), 'bad entries: flatten')
+    test:is_deeply({schema.hash_cache_load('\1')},
+                   {false, 'hash cache: malformed data'}, 'malformed')
+    test:is_deeply({schema.hash_cache_load(msgpack.encode({0, {}}))},
+                   {false, 'hash cache: version mismatch'}, 'version')
+end)
+
+os.exit(test:check() and 0 or 1)
@@ -0,0 +1,248 @@
+local ffi = require('ffi')
+local json = require('json')
+local msgpack = require('msgpack')
+local tap = require('tap')
+local schema = require('avro_schema')
+local test = tap.test('JSON')
+
+test:plan(9)
+
+local _, s = schema.create({
+    type = 'record', name = 'Doc', fields = {
+        {name = 'id', type = 'long'},
+        {name = 'name', type = 'string'},
+        {name = 'flag', type = 'boolean'},
+        {name = 'score', type = 'double'},
+        {name = 'nothing', type = 'null'},
+        {name = 'color', type = {
+            type = 'enum', name = 'Color', symbols = {'RED', 'GREEN'}}},
+        {name = 'tags', type = {type = 'array', items = 'string'}},
+        {name = 'attrs', type = {type = 'map', values = 'long'}},
+        {name = 'pos', type = {
+            type = 'record', name = 'Pos', fields = {
+                {name = 'x', type = 'long'},
+                {name = 'y', type = 'long'}
+            }
+        }},
+        {name = 'opt', type = 'long*'},
+        {name = 'choice', type = {'null', 'string', 'Pos'}}
+    }
+})
+local ok, m = schema.compile(s)
+assert(ok, m)
+
+local doc = [[
+{
+    "id": -1234567, "name": "John", "flag": true, "score": 1.25,
+    "nothing": null, "color": "GREEN", "tags": ["a", "b", "c"],
+    "attrs": {"k": 1, "l": 2}, "pos": {"x": 1, "y": -2}, "opt": 7,
+    "choice": {"Pos": {"x": 3, "y": 4}}
+}
+]]
+
+-- flatten_json must agree with the Lua path
+local function expected(text)
+    return {m.flatten_msgpack(msgpack.encode(json.decode(text)))}
+end
+
+test:test('flatten_json', function(test)
+    test:plan(3)
+    test:is_deeply({m.flatten_json(doc)}, expected(doc), 'flatten_json')
+    local compact = json.encode(json.decode(doc))
+    test:is_deeply({m.flatten_json(compact)}, expected(doc), 'compact')
+    local _, tuple = m.flatten_json(doc)
+    local _, res = m.unflatten(tuple)
+    test:is_deeply({res.name, res.tags, res.choice.Pos},
+                   {'John', {'a', 'b', 'c'}, {x = 3, y = 4}}, 'unflatten')
+end)
+
+test:test('strings', function(test)
+    test:plan(4)
+    local function name(text)
+        local ok, tuple = m.flatten_json((doc:gsub('"John"', text)))
+        if not ok then return ok, tuple end
+        return ok, select(2, m.unflatten(tuple)).name
+    end
+    test:is_deeply({name([["a\"b\\c\/d\n\t"]])},
+                   {true, 'a"b\\c/d\n\t'}, 'escapes')
+    test:is_deeply({name([["Aé€😀"]])},
+                   {true, 'A\195\169\226\130\172\240\159\152\128'},
+                   'unicode escapes')
+    test:is_deeply({name('"\208\159\209\128\208\184"')},
+                   {true, '\208\159\209\128\208\184'}, 'utf-8')
+    -- escaped and verbatim strings mixed (different banks)
+    local text = doc:gsub('"a", "b"', [["a\nx", "b"]])
+    local _, tuple = m.flatten_json(text)
+    local res = select(2, m.unflatten(tuple))
+    test:is_deeply({res.tags, res.name}, {{'a\nx', 'b', 'c'}, 'John'},
+                   'mixed')
+end)
+
+test:test('numbers', function(test)
+    test:plan(4)
+    local function field(name, text)
+        local ok, tuple = m.flatten_json((doc:gsub('"' .. name ..
+                                                  '": [^,]+', '"' .. name ..
+                                                  '": ' .. text, 1)))
+        if not ok then return ok, tuple end
+        return ok, select(2, m.unflatten(tuple))[name]
+    end
+    test:is_deeply({field('score', '-2.5e-3')}, {true, -2.5e-3}, 'double')
+    test:is_deeply({field('score', '3')}, {true, 3}, 'integer to double')
+    test:is_deeply({field('id', '-9223372036854775808')},
+                   {true, -9223372036854775808LL}, 'INT64_MIN')
+    test:is_deeply({field('id', '01')}, {false, 'Invalid data'},
+                   'leading zero')
+end)
+
+test:test('nesting', function(test)
+    test:plan(2)
+    local tags, attrs = {}, {}
+    for i = 1, 1000 do
+        tags[i] = 'tag' .. i
+        attrs['k' .. i] = i
+    end
+    local text = json.encode({
+        id = 1, name = 'x', flag = false, score = 0, nothing = json.NULL,
+        color = 'RED', tags = tags, attrs = attrs, pos = {x = 0, y = 0},
+        opt = json.NULL, choice = {string = 'y'}
+    })
+    test:is_deeply({m.flatten_json(text)}, expected(text), 'large')
+    text = doc:gsub('%["a", "b", "c"%]', '[]'):gsub('{"k": 1, "l": 2}',
+                                                    '{ }')
+    -- json.decode can't tell an empty object from an empty array
+    local _, tuple = m.flatten_json(text)
+    local res = select(2, m.unflatten(tuple))
+    test:is_deeply({res.tags, res.attrs}, {{}, {}}, 'empty')
+end)
+
+test:test('raw', function(test)
+    test:plan(2)
+    local _, s2 = schema.create({
+        type = 'record', name = 'Doc', fields = {
+            {name = 'id', type = 'long'},
+            {name = 'nums', type = {type = 'array', items = 'long'}}
+        }
+    })
+    local _, m2 = schema.compile(s2)
+    local text = '{"nums": [1, -2, 300, 70000, 5000000000], "id": 1}'
+    local _, res = m2.flatten_json(text)
+    test:is(res, msgpack.encode({1, {1, -2, 300, 70000, 5000000000}}),
+            'array copied')
+    -- escapes move the bank
+    text = '{"name": "\\n", "id": 2, "nums": []}'
+    local _, s3 = schema.create({
+        type = 'record', name = 'Doc', fields = {
+            {name = 'id', type = 'long'},
+            {name = 'name', type = 'string'},
+            {name = 'nums', type = {type = 'array', items = 'long'}}
+        }
+    })
+    local _, m3 = schema.compile(s3)
+    test:is_deeply({m3.flatten_json(text)},
+                   {true, msgpack.encode({2, '\n', {}})}, 'escapes')
+end)
+
+test:test('errors', function(test)
+    test:plan(6)
+    test:is_deeply({m.flatten_json(doc:sub(1, -4))},
+                   {false, 'Truncated data'}, 'truncated')
+    test:is_deeply({m.flatten_json(doc .. ' x')}, {false, 'Invalid data'},
+                   'trailing data')
+    test:is_deeply({m.flatten_json((doc:gsub('true', 'tru')))},
+                   {false, 'Invalid data'}, 'literal')
+    test:is_deeply({m.flatten_json((doc:gsub('"John"', '"\\x"')))},
+                   {false, 'Invalid data'}, 'escape')
+    test:is_deeply({m.flatten_json((doc:gsub('"GREEN"', '"BLUE"')))},
+                   {false, 'color: Bad value: "BLUE"'}, 'schema error')
+    test:is_deeply({m.flatten_json({})}, {false, 'Expecting a string'},
+                   'not a string')
+end)
+
+test:test('unflatten_json', function(test)
+    test:plan(3)
+    local _, tuple = m.flatten_json(doc)
+    local ok, text = m.unflatten_json(tuple)
+    test:ok(ok, 'unflatten_json')
+    test:is_deeply(json.decode(text), json.decode(doc), 'same document')
+    test:is_deeply({m.flatten_json(text)}, {true, tuple}, 'round trip')
+end)
+
+-- big endian bytes of a number
+local function net(p, size)
+    local s = ffi.string(p, size)
+    return ffi.abi('le') and s:reverse() or s
+end
+
+test:test('JSON output values', function(test)
+    test:plan(5)
+    local _, s2 = schema.create({
+        type = 'record', name = 'Values', fields = {
+            {name = 's', type = 'string'},
+            {name = 'b', type = 'bytes'},
+            {name = 'f', type = 'float'},
+            {name = 'd', type = 'double'},
+            {name = 'l', type = 'long'},
+            {name = 'u', type = {'null', 'string'}}
+        }
+    })
+    local _, m2 = schema.compile(s2)
+    -- a tuple; b is a msgpack binary, the union takes two fields:
+    -- the branch and the value
+    local function out(s, b, f, d, l, u)
+        local tuple = {'\151', msgpack.encode(s),
+                       '\196' .. string.char(#b) .. b,
+                       '\202' .. net(ffi.new('float[1]', f), 4),
+                       '\203' .. net(ffi.new('double[1]', d), 8)}
+        for _, v in ipairs({l, u == nil and 0 or 1, u or msgpack.NULL}) do
+            table.insert(tuple, msgpack.encode(v))
+        end
+        return select(2, m2.unflatten_json(table.concat(tuple)))
+    end
+    local text = out('a"\\\n\1\208\159', '\0\255', 0.5, 0.1, -2^53)
+    test:is(text, '{"s":"a\\"\\\\\\n\\u0001\208\159",' ..
+                  '"b":"\\u0000\\u00ff","f":0.5,"d":0.1,' ..
+                  '"l":-9007199254740992,"u":null}', 'values')
+    text = out('', '', 1 / 3, 1 / 3, 9223372036854775807LL, 'x')
+    test:is_deeply(json.decode(text),
+                   {s = '', b = '', f = json.decode('0.333333343'),
+                    d = 1 / 3, l = json.decode('9223372036854775807'),
+                    u = {string = 'x'}}, 'numbers, union')
+    test:ok(text:find('"l":9223372036854775807', 1, true), 'int64')
+    text = out('', '', 0, 1 / 0, 0)
+    test:ok(text:find('"d":null', 1, true), 'infinity')
+    text = out('', '', 0, 0 / 0, 0)
+    test:ok(text:find('"d":null', 1, true), 'nan')
+end)
+
+test:test('JSON output nesting', function(test)
+    test:plan(3)
+    -- arrays and maps of primitives are copied (RawCommand)
+    local _, s2 = schema.create({
+        type = 'record', name = 'Doc', fields = {
+            {name = 'nums', type = {type = 'array', items = 'long'}},
+            {name = 'attrs', type = {type = 'map', values = {
+                type = 'array', items = 'string'}}},
+            {name = 'deep', type = {type = 'array', items = {
+                type = 'array', items = {type = 'map', values = 'long'}}}}
+        }
+    })
+    local _, m2 = schema.compile(s2)
+    local text = '{"nums":[1,-2,300],"attrs":{"k":["a","b"],"l":[]},' ..
+                 '"deep":[[{"x":1},{}],[]]}'
+    local _, tuple = m2.flatten_json(text)
+    test:is_deeply(json.decode(select(2, m2.unflatten_json(tuple))),
+                   json.decode(text), 'raw and nested')
+    local _, empty = m2.flatten_json('{"nums":[],"attrs":{},"deep":[]}')
+    test:is(select(2, m2.unflatten_json(empty)),
+            '{"nums":[],"attrs":{},"deep":[]}', 'empty')
+    local nums = {}
+    for i = 1, 10000 do nums[i] = i end
+    text = '{"nums":[' .. table.concat(nums, ',') ..
+           '],"attrs":{},"deep":[]}'
+    _, tuple = m2.flatten_json(text)
+    test:is_deeply(json.decode(select(2, m2.unflatten_json(tuple))).nums,
+                   nums, 'large')
+end)
+
+os.exit(test:check() and 0 or 1)
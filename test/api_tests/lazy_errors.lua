@@ -0,0 +1,125 @@
+local msgpack = require('msgpack')
+local tap = require('tap')
+local schema = require('avro_schema')
+local test = tap.test('lazy_errors')
+
+test:plan(6)
+
+local _, s = schema.create({
+    type = 'record', name = 'Doc', fields = {
+        {name = 'id', type = 'int'},
+        {name = 'color', type = {
+            type = 'enum', name = 'Color', symbols = {'RED', 'GREEN'}}},
+        {name = 'nums', type = {type = 'array', items = 'float'}},
+        {name = 'pos', type = {
+            type = 'record', name = 'Pos', fields = {
+                {name = 'x', type = 'long'}
+            }
+        }}
+    }
+})
+
+local function doc()
+    return {id = 1, color = 'RED', nums = {0.5, 1}, pos = {x = 2}}
+end
+
+local engines = {'lua', 'vm', 'c'}
+
+test:test('error codes', function(test)
+    test:plan(#engines * 4)
+    for _, engine in ipairs(engines) do
+        local _, m = schema.compile({s, engine = engine, lazy_errors = true})
+        local _, plain = schema.compile({s, engine = engine})
+        test:is_deeply({m.flatten(doc())}, {plain.flatten(doc())},
+                       engine .. ': ok')
+        local d = doc()
+        d.color = 'BLUE'
+        test:is_deeply({m.flatten(d)}, {false, 5}, engine .. ': bad value')
+        d = doc()
+        d.pos = setmetatable({}, {__serialize = 'map'})
+        test:is_deeply({m.flatten(d)}, {false, 3}, engine .. ': missing')
+        d = doc()
+        d.nums = {1, 'x'}
+        test:is_deeply({m.flatten(d)}, {false, 1}, engine .. ': type')
+    end
+end)
+
+test:test('error_message', function(test)
+    test:plan(#engines * 5)
+    for _, engine in ipairs(engines) do
+        local _, m = schema.compile({s, engine = engine, lazy_errors = true})
+        local _, plain = schema.compile({s, engine = engine})
+        for _, patch in ipairs({
+            {'color', 'BLUE'}, {'pos', {y = 1}}, {'nums', {1, 'x'}},
+            {'pos', setmetatable({}, {__serialize = 'map'})}
+        }) do
+            local d = doc()
+            d[patch[1]] = patch[2]
+            m.flatten(d)
+            test:is(m.error_message(), select(2, plain.flatten(d)),
+                    engine .. ': ' .. patch[1])
+        end
+        m.flatten(doc())
+        test:isnil(m.error_message(), engine .. ': cleared')
+    end
+end)
+
+test:test('input', function(test)
+    test:plan(3)
+    local _, m = schema.compile({s, lazy_errors = true})
+    local d = doc()
+    d.color = 'BLUE'
+    -- the input is kept until the message is rendered
+    m.flatten_msgpack(msgpack.encode(d))
+    collectgarbage()
+    test:is(m.error_message(), 'color: Bad value: "BLUE"', 'kept alive')
+    test:is_deeply({m.flatten_msgpack('\144')}, {false, 1}, 'not a map')
+    -- not a schema error
+    test:is_deeply({m.flatten_msgpack('\193')}, {false, 'Invalid data'},
+                   'bad data')
+end)
+
+test:test('states', function(test)
+    test:plan(3)
+    local _, m = schema.compile({s, lazy_errors = true})
+    local bound = m.bind()
+    local d = doc()
+    d.color = 'BLUE'
+    bound.flatten(d)
+    m.flatten(doc())
+    test:isnil(m.error_message(), 'default state')
+    test:is(bound.error_message(), 'color: Bad value: "BLUE"', 'bound')
+    local _, plain = schema.compile(s)
+    test:isnil(plain.error_message(), 'raising methods')
+end)
+
+test:test('batch', function(test)
+    test:plan(2)
+    local _, m = schema.compile({s, lazy_errors = true})
+    local bad = doc()
+    bad.id = 'x'
+    local ok, results, errors = m.flatten_batch({doc(), bad, doc()})
+    test:is_deeply({ok, errors}, {true, {[2] = 1}}, 'error code')
+    test:is_deeply(results[3], select(2, m.flatten(doc())), 'resumed')
+end)
+
+test:test('fused', function(test)
+    test:plan(4)
+    local _, flat = schema.create({
+        type = 'record', name = 'Flat', fields = {
+            {name = 'id', type = 'long'},
+            {name = 'name', type = 'string'}
+        }
+    })
+    local _, m = schema.compile({flat, lazy_errors = true})
+    local good = {id = 1, name = 'x'}
+    test:is_deeply({m.flatten_msgpack(msgpack.encode({id = 'x', name = 'x'}))},
+                   {false, 1}, 'lazy failure')
+    test:ok(m.error_message(), 'message')
+    -- the fused transcoder succeeds, the generated code doesn't run
+    test:is(select(2, m.flatten_msgpack(msgpack.encode(good))),
+            msgpack.encode({1, 'x'}), 'fused success')
+    test:isnil(m.error_message(), 'cleared')
+end)
+
+os.exit(test:check() and 0 or 1)
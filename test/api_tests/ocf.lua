@@ -0,0 +1,199 @@
+local tap = require('tap')
+local msgpack = require('msgpack')
+local schema = require('avro_schema')
+local test = tap.test('object container files')
+
+test:plan(6)
+
+local raw_schema = {
+    type = 'record', name = 'Item', fields = {
+        {name = 'id', type = 'long'},
+        {name = 'name', type = 'string'}
+    }
+}
+local _, item = schema.create(raw_schema)
+
+local function sink()
+    local chunks = {}
+    return chunks, function(s) table.insert(chunks, s) return true end
+end
+
+-- feed the data in chunks of the given size
+local function source(data, chunk_size)
+    local pos = 1
+    return function()
+        local chunk = data:sub(pos, pos + chunk_size - 1)
+        pos = pos + chunk_size
+        return chunk
+    end
+end
+
+local function read_all(reader)
+    local res = {}
+    while true do
+        local ok, tuples, errors = reader:read()
+        if not ok then return false, tuples end
+        if not tuples then return true, res end
+        for i = 1, #tuples do
+            table.insert(res, tuples[i] or errors[i])
+        end
+    end
+end
+
+-- Avro long
+local function long(n)
+    local u = n >= 0 and 2 * n or -2 * n - 1
+    local res = {}
+    repeat
+        local b = u % 128
+        u = (u - b) / 128
+        table.insert(res, string.char(u > 0 and b + 128 or b))
+    until u == 0
+    return table.concat(res)
+end
+
+local function str(s)
+    return long(#s) .. s
+end
+
+local sync = string.rep('S', 16)
+
+-- a container file with a single block of {1, 'one'}, {2, 'two'}
+local function container(codec, block)
+    return table.concat({
+        'Obj\1', long(2),
+        str('avro.schema'), str(require('json').encode(raw_schema)),
+        str('avro.codec'), str(codec), long(0), sync,
+        long(2), long(#block), block, sync
+    })
+end
+
+local records = long(1) .. str('one') .. long(2) .. str('two')
+local deflated = '\99\98\203\207\75\101\97\43\41\207\7\0'
+
+test:test('round trip', function(test)
+    test:plan(6)
+    for _, codec in ipairs({'deflate', 'null'}) do
+        local tuples = {}
+        for i = 1, 1000 do
+            tuples[i] = {i, 'item ' .. i}
+        end
+        local chunks, write = sink()
+        local ok, writer = schema.ocf_writer(item, write, {
+            codec = codec, block_size = 1000,
+            metadata = {origin = 'test'}
+        })
+        assert(ok, writer)
+        for i = 1, 1000, 100 do
+            writer:write({unpack(tuples, i, i + 99)})
+        end
+        writer:close()
+        test:ok(#chunks > 10, codec .. ': multiple blocks')
+        local reader
+        ok, reader = schema.ocf_reader(source(table.concat(chunks), 777))
+        assert(ok, reader)
+        test:is(reader.metadata.origin, 'test', codec .. ': metadata')
+        test:is_deeply({read_all(reader)}, {true, tuples},
+                       codec .. ': records')
+    end
+end)
+
+test:test('interoperability', function(test)
+    test:plan(3)
+    local expected = {{1, 'one'}, {2, 'two'}}
+    local _, reader = schema.ocf_reader(source(container('null', records),
+                                               5))
+    test:is_deeply({read_all(reader)}, {true, expected}, 'null codec')
+    _, reader = schema.ocf_reader(source(container('deflate', deflated),
+                                         5))
+    test:is_deeply({read_all(reader)}, {true, expected}, 'deflate codec')
+    _, reader = schema.ocf_reader(source(container('null', records), 5))
+    local _, data, offsets = reader:read_msgpack()
+    local tuples = msgpack.encode(expected[1]) .. msgpack.encode(expected[2])
+    test:is_deeply({data, offsets}, {tuples, {0, 6, 12}}, 'read_msgpack')
+end)
+
+test:test('reader schema', function(test)
+    test:plan(1)
+    local _, item2 = schema.create({
+        type = 'record', name = 'Item', fields = {
+            {name = 'id', type = 'long'},
+            {name = 'name', type = 'string'},
+            {name = 'count', type = 'int', default = 0}
+        }
+    })
+    local _, reader = schema.ocf_reader(source(container('null', records),
+                                               100), {schema = item2})
+    test:is_deeply({read_all(reader)},
+                   {true, {{1, 'one', 0}, {2, 'two', 0}}}, 'converted')
+end)
+
+test:test('writer errors', function(test)
+    test:plan(3)
+    local chunks, write = sink()
+    local _, writer = schema.ocf_writer(item, write, {codec = 'null'})
+    local ok, errors = writer:write({{1, 'one'}, {'x', 'bad'}, {2, 'two'}})
+    test:is_deeply({ok, errors},
+                   {true, {[2] = '1: Expecting LONG, encountered STR'}},
+                   'per item errors')
+    writer:close()
+    local _, reader = schema.ocf_reader(source(table.concat(chunks), 100))
+    test:is_deeply({read_all(reader)}, {true, {{1, 'one'}, {2, 'two'}}},
+                   'others written')
+    test:is_deeply({schema.ocf_writer(item, write, {codec = 'snappy'})},
+                   {false, 'codec: Unsupported codec: snappy'}, 'codec')
+end)
+
+test:test('reader errors', function(test)
+    test:plan(5)
+    test:is_deeply({schema.ocf_reader(source('Obj\2', 100))},
+                   {false, 'Not an Avro object container file'}, 'magic')
+    local data = container('null', records)
+    test:is_deeply({schema.ocf_reader(source(data:sub(1, 20), 100))},
+                   {false, 'Truncated data'}, 'truncated header')
+    local _, reader = schema.ocf_reader(source(data:sub(1, -2), 100))
+    test:is_deeply({reader:read()}, {false, 'Truncated data'},
+                   'truncated block')
+    _, reader = schema.ocf_reader(source(data:sub(1, -2) .. 'X', 100))
+    test:is_deeply({reader:read()}, {false, 'Sync marker mismatch'}, 'sync')
+    -- the first record claims 3 more bytes than the block has
+    local damaged = long(1) .. long(20) .. 'one' ..
+                    long(2) .. str('two')
+    _, reader = schema.ocf_reader(source(container('null', damaged), 100))
+    test:is_deeply({reader:read()}, {false, 'Truncated data'},
+                   'damaged block')
+end)
+
+test:test('files', function(test)
+    test:plan(2)
+    local path = os.tmpname()
+    local file = io.open(path, 'wb')
+    local _, writer = schema.ocf_writer(item, file, {block_size = 4096})
+    local written = 0
+    for i = 1, 50 do
+        local batch = {}
+        for j = 1, 100 do
+            batch[j] = {i * 100 + j, string.rep('x', 100)}
+        end
+        writer:write(batch)
+        written = written + 100
+    end
+    writer:close()
+    file:close()
+    file = io.open(path, 'rb')
+    local _, reader = schema.ocf_reader(file)
+    -- the reader holds a block at a time
+    local n, max_block = 0, 0
+    while true do
+        local _, tuples = reader:read()
+        if not tuples then break end
+        n = n + #tuples
+        max_block = math.max(max_block, #tuples)
+    end
+    file:close()
+    os.remove(path)
+    test:is(n, written, 'all records')
+    test:ok(max_block < 100, 'blocks of block_size')
+end)
+
+os.exit(test:check() and 0 or 1)
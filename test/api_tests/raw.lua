@@ -0,0 +1,108 @@
+local tap = require('tap')
+local schema = require('avro_schema')
+local test = tap.test('raw passthrough')
+
+test:plan(6)
+
+local _, s = schema.create({
+    type = 'record', name = 'Doc', fields = {
+        {name = 'id', type = 'long'},
+        {name = 'nums', type = {type = 'array', items = 'long'}},
+        {name = 'attrs', type = {type = 'map', values = {
+            type = 'array', items = 'long*'}}},
+        {name = 'ratios', type = {type = 'array', items = 'float'}}
+    }
+})
+local _, m = schema.compile(s)
+
+-- non-canonical encodings: int64 5, uint16 7
+local nums = '\146\211\0\0\0\0\0\0\0\5\205\0\7'
+local attrs = '\130\161x\147\1\192\3\161y\144'
+local ratios = '\145\203\63\241\153\153\153\153\153\154' -- double 1.1
+local data = '\132\162id\42\164nums' .. nums .. '\165attrs' .. attrs ..
+             '\166ratios' .. ratios
+
+test:test('flatten', function(test)
+    test:plan(4)
+    local ok, res = m.flatten_msgpack(data)
+    test:ok(ok, 'flatten_msgpack')
+    test:ok(res:find(nums, 1, true), 'array copied verbatim')
+    test:ok(res:find(attrs, 1, true), 'map copied verbatim')
+    -- arrays of floats are converted, the double is narrowed
+    test:ok(res:find('\145\202', 1, true), 'float array converted')
+end)
+
+test:test('unflatten', function(test)
+    test:plan(2)
+    local ok, tuple = m.flatten(data)
+    test:ok(ok, 'flatten')
+    local res
+    ok, res = m.unflatten(tuple)
+    local x = res.attrs.x
+    test:is_deeply({ok, res.nums, res.attrs.y, x[1], x[2] == nil, x[3]},
+                   {true, {5, 7}, {}, 1, true, 3}, 'unflatten')
+end)
+
+test:test('xflatten', function(test)
+    test:plan(2)
+    local ok, res = m.xflatten_msgpack('\129\164nums' .. nums)
+    test:ok(ok, 'xflatten_msgpack')
+    test:ok(res:find(nums, 1, true), 'array copied verbatim')
+end)
+
+test:test('validation', function(test)
+    test:plan(3)
+    local ok, err = m.flatten({id = 1, nums = {1, 'two'}, attrs = {z = {}},
+                               ratios = {}})
+    test:is_deeply({ok, err}, {false, 'nums/2: Expecting LONG, encountered STR'},
+                   'array item')
+    ok, err = m.flatten({id = 1, nums = {}, attrs = {x = {1, 2.5}},
+                         ratios = {}})
+    test:is_deeply({ok, err},
+                   {false, 'attrs/x/2: Expecting LONG, encountered DOUBLE'},
+                   'nested array item')
+    ok, err = m.flatten({id = 1, nums = {}, attrs = {x = 1}, ratios = {}})
+    test:is_deeply({ok, err},
+                   {false, 'attrs/x: Expecting ARRAY, encountered LONG'},
+                   'map value')
+end)
+
+test:test('double items promoted', function(test)
+    test:plan(6)
+    local _, d = schema.create({
+        type = 'record', name = 'D', fields = {
+            {name = 'a', type = {type = 'array', items = 'double'}},
+            {name = 'm', type = {type = 'map', values = 'double'}}
+        }
+    })
+    -- ints and a float32 1.5, every one becomes a double
+    local a = '\147\1\205\1\0\202\63\192\0\0'
+    local mp = '\129\161x\2'
+    local a_dbl = '\147\203\63\240\0\0\0\0\0\0' ..
+                  '\203\64\112\0\0\0\0\0\0' ..
+                  '\203\63\248\0\0\0\0\0\0'
+    local mp_dbl = '\129\161x\203\64\0\0\0\0\0\0\0'
+    local tuple_dbl = '\146' .. a_dbl .. mp_dbl
+    for _, engine in ipairs({'lua', 'vm', 'c'}) do
+        local _, md = schema.compile({d, engine = engine})
+        test:is(select(2, md.flatten_msgpack('\130\161a' .. a ..
+                                             '\161m' .. mp)),
+                tuple_dbl, engine .. ': flatten')
+        test:is(select(2, md.unflatten_msgpack('\146' .. a .. mp)),
+                '\130\161a' .. a_dbl .. '\161m' .. mp_dbl,
+                engine .. ': unflatten')
+    end
+end)
+
+test:test('stream', function(test)
+    test:plan(2)
+    local stream = schema.msgpack_stream()
+    for i = 1, #data, 5 do
+        stream:feed(data:sub(i, i + 4))
+    end
+    local ok, res = m.flatten_msgpack(stream)
+    test:ok(ok, 'flatten_msgpack')
+    test:is(res, select(2, m.flatten_msgpack(data)), 'same result')
+end)
+
+os.exit(test:check() and 0 or 1)
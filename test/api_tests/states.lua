@@ -0,0 +1,67 @@
+local tap = require('tap')
+local schema = require('avro_schema')
+local test = tap.test('states')
+
+test:plan(4)
+
+local _, s = schema.create({
+    type = 'record', name = 'Frob', fields = {
+        {name = 'foo', type = 'int'},
+        {name = 'bar', type = {type = 'array', items = 'double'}}
+    }
+})
+local _, m = schema.compile(s)
+
+local function frob(n)
+    local bar = {}
+    for i = 1, n do bar[i] = i + 0.5 end
+    return {foo = n, bar = bar}
+end
+
+test:test('bind', function(test)
+    test:plan(4)
+    local expected = {m.flatten(frob(10000))}
+    local before = schema.buffer_stats()
+    local state = schema.new_state()
+    local bound = m.bind(state)
+    local ok, res = bound.flatten(frob(10000))
+    test:is_deeply({ok, res}, expected, 'same result')
+    ok, res = bound.unflatten(res)
+    test:is_deeply({ok, res}, {true, frob(10000)}, 'unflatten')
+    test:ok(schema.buffer_stats(state).tv.grows > 0, 'state buffers grow')
+    test:is_deeply(schema.buffer_stats(), before, 'default state is intact')
+end)
+
+test:test('batch', function(test)
+    test:plan(2)
+    local items = {frob(1), frob(2), {foo = 'bad'}, frob(3)}
+    local other = {frob(4), frob(5)}
+    local expected = {m.flatten_msgpack_batch(items)}
+    local bound = m.bind()
+    test:is_deeply({bound.flatten_msgpack_batch(items)}, expected,
+                   'same results')
+    test:is_deeply({m.bind().flatten_batch(other)}, {m.flatten_batch(other)},
+                   'other state')
+end)
+
+test:test('raw', function(test)
+    test:plan(2)
+    -- created before a schema passing arrays through unchanged
+    local state = schema.new_state()
+    local _, raw = schema.create({type = 'array', items = 'long'})
+    local _, rm = schema.compile(raw)
+    local data = '\146\211\0\0\0\0\0\0\0\5\205\0\7'
+    local ok, res = rm.bind(state).flatten_msgpack(data)
+    test:ok(ok, 'flatten_msgpack')
+    test:ok(res:find(data, 1, true), 'array copied verbatim')
+end)
+
+test:test('errors', function(test)
+    test:plan(2)
+    test:is_deeply({pcall(m.bind, {})}, {false, 'Expecting a state'},
+                   'not a state')
+    local ok, res = m.bind().flatten({foo = 1, bar = {}})
+    test:is_deeply({ok, res}, {m.flatten({foo = 1, bar = {}})}, 'new state')
+end)
+
+os.exit(test:check() and 0 or 1)
@@ -0,0 +1,79 @@
+local tap = require('tap')
+local msgpack = require('msgpack')
+local schema = require('avro_schema')
+local test = tap.test('msgpack stream')
+
+test:plan(4)
+
+local _, s = schema.create({
+    type = 'record', name = 'Doc', fields = {
+        {name = 'id', type = 'long'},
+        {name = 'tags', type = {type = 'array', items = 'string'}},
+        {name = 'attrs', type = {type = 'map', values = 'double'}},
+        {name = 'body', type = 'string'}
+    }
+})
+local _, m = schema.compile(s)
+
+local doc = {
+    id = 42, tags = {'a', 'bb', 'ccc', string.rep('d', 300)},
+    attrs = {x = 1.5, y = -2.25}, body = string.rep('lorem ipsum ', 100)
+}
+local data = msgpack.encode(doc)
+local _, expected = m.flatten(doc)
+
+local function feed_chunks(stream, str, chunk_size)
+    local res, err
+    for i = 1, #str, chunk_size do
+        res, err = stream:feed(str:sub(i, i + chunk_size - 1))
+        if res ~= false then break end
+    end
+    return res, err
+end
+
+test:test('chunked input', function(test)
+    test:plan(8)
+    for _, chunk_size in ipairs({1, 7, 100, #data}) do
+        local stream = schema.msgpack_stream()
+        local complete = feed_chunks(stream, data, chunk_size)
+        test:is(complete, true, 'complete, chunk size ' .. chunk_size)
+        local ok, res = m.flatten(stream)
+        test:is_deeply({ok, res}, {true, expected},
+                       'flatten, chunk size ' .. chunk_size)
+    end
+end)
+
+test:test('multiple documents', function(test)
+    test:plan(5)
+    local stream = schema.msgpack_stream()
+    local two = data .. data:sub(1, 10)
+    test:is(stream:feed(two), true, 'first complete')
+    local ok, res = m.flatten_msgpack(stream)
+    test:is_deeply({ok, (msgpack.decode(res))}, {true, expected}, 'first')
+    test:is(feed_chunks(stream, data:sub(11), 13), true, 'second complete')
+    ok, res = m.flatten(stream)
+    test:is_deeply({ok, res}, {true, expected}, 'second')
+    ok, res = m.flatten(stream)
+    test:is_deeply({ok, res}, {false, 'Incomplete data'}, 'consumed')
+end)
+
+test:test('incomplete', function(test)
+    test:plan(3)
+    local stream = schema.msgpack_stream()
+    test:is(stream:feed(data:sub(1, -2)), false, 'need more')
+    local ok, res = m.flatten(stream)
+    test:is_deeply({ok, res}, {false, 'Incomplete data'}, 'flatten')
+    stream:reset()
+    test:is(stream:feed(data), true, 'reset')
+end)
+
+test:test('invalid', function(test)
+    test:plan(2)
+    local stream = schema.msgpack_stream()
+    test:is_deeply({stream:feed('\x92\x01\xc1')}, {nil, 'Invalid data'},
+                   'error')
+    test:is_deeply({stream:feed('\x01')}, {nil, 'Invalid data'},
+                   'error is sticky')
+end)
+
+os.exit(test:check() and 0 or 1)
@@ -0,0 +1,211 @@
+local msgpack = require('msgpack')
+local tap = require('tap')
+local schema = require('avro_schema')
+local test = tap.test('Lua tables')
+
+test:plan(9)
+
+local _, s = schema.create({
+    type = 'record', name = 'Doc', fields = {
+        {name = 'id', type = 'long'},
+        {name = 'name', type = 'string'},
+        {name = 'flag', type = 'boolean'},
+        {name = 'score', type = 'double'},
+        {name = 'nothing', type = 'null'},
+        {name = 'tags', type = {type = 'array', items = 'string'}},
+        {name = 'attrs', type = {type = 'map', values = 'long'}},
+        {name = 'opt', type = {type = 'array', items = 'long*'}},
+        {name = 'choice', type = {'null', 'string', {
+            type = 'record', name = 'Pos', fields = {
+                {name = 'x', type = 'long'},
+                {name = 'y', type = 'long'}
+            }
+        }}}
+    }
+})
+local ok, m = schema.compile(s)
+assert(ok, m)
+
+local function doc()
+    return {
+        id = -1234567, name = 'John', flag = true, score = 1.25,
+        nothing = msgpack.NULL, tags = {'a', 'b', 'c'},
+        attrs = {k = 1, l = 2}, opt = {1, msgpack.NULL, 3},
+        choice = {Pos = {x = 3, y = 4}}
+    }
+end
+
+-- the table walker must agree with msgpack.encode
+local function same(test, obj, name)
+    test:is_deeply({m.flatten(obj)}, {m.flatten(msgpack.encode(obj))}, name)
+end
+
+test:test('values', function(test)
+    test:plan(5)
+    same(test, doc(), 'document')
+    local d = doc()
+    d.id, d.score = 2^53, 3
+    same(test, d, 'integral numbers')
+    d.score = -0.5
+    same(test, d, 'double')
+    d.choice = {string = ''}
+    same(test, d, 'union, empty string')
+    local _, tuple = m.flatten(doc())
+    local _, res = m.unflatten(tuple)
+    test:is_deeply({res.name, res.tags, res.choice.Pos},
+                   {'John', {'a', 'b', 'c'}, {x = 3, y = 4}}, 'round trip')
+end)
+
+test:test('arrays and maps', function(test)
+    test:plan(5)
+    local d = doc()
+    d.opt = {1, nil, 3}
+    test:is_deeply({m.flatten(d)}, {m.flatten(doc())}, 'hole')
+    d.opt = {[1] = 1, [100] = 2}
+    same(test, d, 'sparse')
+    d.attrs = setmetatable({}, {__serialize = 'map'})
+    same(test, d, '__serialize map')
+    d.tags = setmetatable({'x'}, {__serialize = 'seq'})
+    same(test, d, '__serialize seq')
+    d.attrs = {}
+    same(test, d, 'empty')
+end)
+
+test:test('fallback', function(test)
+    test:plan(3)
+    local d = doc()
+    d.id = 10LL
+    same(test, d, 'int64 cdata')
+    d.id = 1
+    d.attrs = setmetatable({k = 1}, {__serialize = function(t) return t end})
+    same(test, d, '__serialize function')
+    local deep = {}
+    for _ = 1, 200 do deep = {deep} end
+    d.opt = deep
+    same(test, d, 'deep nesting')
+end)
+
+test:test('strings', function(test)
+    test:plan(3)
+    local tags = {}
+    for i = 1, 1000 do
+        tags[i] = string.rep(string.char(i % 256), i % 100)
+    end
+    local d = doc()
+    d.tags = tags
+    same(test, d, 'many strings')
+    d.name = string.rep('x', 100000)
+    same(test, d, 'large string')
+    local attrs = {}
+    for i = 1, 1000 do attrs['k' .. i] = i end
+    d.attrs = attrs
+    same(test, d, 'map keys')
+end)
+
+test:test('raw', function(test)
+    test:plan(2)
+    local _, s2 = schema.create({
+        type = 'record', name = 'Doc', fields = {
+            {name = 'name', type = 'string'},
+            {name = 'nums', type = {type = 'array', items = 'long'}},
+            {name = 'tags', type = {type = 'array', items = 'string'}}
+        }
+    })
+    local _, m2 = schema.compile(s2)
+    local obj = {name = 'x', nums = {1, -2, 300, 70000, 5000000000},
+                 tags = {'a', 'b'}}
+    test:is_deeply({m2.flatten(obj)}, {m2.flatten(msgpack.encode(obj))},
+                   'arrays copied')
+    test:is_deeply({m2.flatten_msgpack({name = 'x', nums = {}, tags = {}})},
+                   {true, msgpack.encode({'x', {}, {}})}, 'empty')
+end)
+
+test:test('errors', function(test)
+    test:plan(3)
+    local d = doc()
+    d.id = 'x'
+    same(test, d, 'type mismatch')
+    test:is_deeply({m.flatten(42)}, {m.flatten(msgpack.encode(42))},
+                   'not a table')
+    local objs = {doc(), 1, doc()}
+    test:is_deeply({m.flatten_batch(objs)},
+                   {m.flatten_batch({doc(), msgpack.encode(1), doc()})},
+                   'batch')
+end)
+
+-- the table builder must agree with msgpack.decode
+local function same_out(test, methods, tuple, name)
+    local _, data = methods.unflatten_msgpack(tuple)
+    test:is_deeply({methods.unflatten(tuple)},
+                   {true, (msgpack.decode(data))}, name)
+end
+
+test:test('unflatten', function(test)
+    test:plan(5)
+    local _, tuple = m.flatten(doc())
+    same_out(test, m, tuple, 'document')
+    local _, res = m.unflatten(tuple)
+    local expected = (msgpack.decode(select(2, m.unflatten_msgpack(tuple))))
+    test:is(getmetatable(res.tags), getmetatable(expected.tags),
+            'array metatable')
+    test:is(getmetatable(res.attrs), getmetatable(expected.attrs),
+            'map metatable')
+    local d = doc()
+    d.id = 2^60
+    _, tuple = m.flatten(d)
+    same_out(test, m, tuple, 'int64')
+    _, res = m.unflatten(tuple)
+    test:ok(res.id == 2^60, 'int64 value')
+end)
+
+test:test('unflatten into a table', function(test)
+    test:plan(5)
+    local _, tuple = m.flatten(doc())
+    local dest = {extra = 1}
+    local ok, res = m.unflatten(tuple, dest)
+    test:ok(ok and res == dest, 'dest returned')
+    local expected = select(2, m.unflatten(tuple))
+    expected.extra = 1
+    test:is_deeply(dest, expected, 'dest filled')
+    -- reused, as on a hot path
+    local d = doc()
+    d.name, d.id = 'Jane', 2^60
+    _, tuple = m.flatten(d)
+    ok, res = m.unflatten(tuple, dest)
+    test:ok(ok and res == dest, 'fallback')
+    test:is_deeply({dest.name, dest.id == 2^60}, {'Jane', true},
+                   'dest updated')
+    test:is_deeply({m.unflatten(tuple, 'x')}, {false, 'Expecting a table'},
+                   'not a table')
+end)
+
+test:test('unflatten data', function(test)
+    test:plan(3)
+    -- arrays of primitives are msgpack in ot/ov (RawCommand)
+    local _, s1 = schema.create({
+        type = 'record', name = 'Doc', fields = {
+            {name = 'nums', type = {type = 'array', items = 'long'}},
+            {name = 's', type = 'string'}
+        }
+    })
+    local _, s2 = schema.create({
+        type = 'record', name = 'Doc', fields = {
+            {name = 'nums', type = {type = 'array', items = 'long'}},
+            {name = 's', type = 'string'},
+            {name = 'extra', type = 'string', default = 'default'},
+            {name = 'empty', type = {type = 'map', values = 'long'},
+             default = {}}
+        }
+    })
+    local _, m1 = schema.compile(s1)
+    local ok, m12 = schema.compile({s1, s2})
+    assert(ok, m12)
+    local _, tuple = m1.flatten({nums = {1, -2, 300, 2^40}, s = '\0\255'})
+    same_out(test, m1, tuple, 'raw')
+    same_out(test, m12, tuple, 'default')
+    local _, res = m12.unflatten(tuple)
+    test:is_deeply({res.nums, res.s, res.extra, res.empty},
+                   {{1, -2, 300, 2^40}, '\0\255', 'default', {}}, 'values')
+end)
+
+os.exit(test:check() and 0 or 1)
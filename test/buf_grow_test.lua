@@ -24,8 +24,9 @@ local _, s = schema.create({
             {name = 'A', type = 'long'},
             {name = 'B', type = 'long'},
             {name = 'C', type = 'long'},
+            -- not 'long': an array of longs is copied verbatim
             {name = 'D', type = {
-                type = 'array', items = 'long'
+                type = 'array', items = 'float'
             }}
         }
     }
@@ -38,7 +39,7 @@ if not _ then error(m) end
 
 
 local item = msgpack.encode({
-    A = 1, B = 2, C = 3, D = { 0, -1, -2, -3 }
+    A = 1, B = 2, C = 3, D = { 0.5, -1.5, -2.5, -3.5 }
 })
 
 m.flatten_msgpack('\220\0\20' .. string.rep(item, 20))
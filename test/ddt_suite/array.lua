@@ -346,3 +346,76 @@ t {
         {"int":7}] ]],
     output = [=[ [[[2, ["1", "2"]], [2, null], [0, null], [1, 7]]] ]=]
 }
+
+-- items converted by a single PUTITEMS (not copied verbatim)
+
+local float_array = [[{
+    "type": "array",
+    "items": "float"
+}]]
+
+local float_array_nullable_items = [[{
+    "type": "array",
+    "items": "float*"
+}]]
+
+t {
+    schema = float_array,
+    func = 'flatten',
+    input = '[]', output = '[[]]'
+}
+
+t {
+    schema = float_array,
+    func = 'flatten',
+    input = '[0.5, 1, 2.5, -3]', output = '![[0.5, 1.0, 2.5, -3.0]]'
+}
+
+t {
+    schema = float_array,
+    func = 'unflatten',
+    input = '![[0.5, 1.0, 2.5]]', output = '![0.5, 1.0, 2.5]'
+}
+
+t {
+    error  = '3: Expecting FLOAT, encountered STR',
+    schema = float_array,
+    func = 'flatten', input = '[0.5, 1, "2.5", -3]'
+}
+
+t {
+    schema1 = int_array, schema2 = [[{"type": "array", "items": "long"}]],
+    func = 'flatten',
+    input = '[1, -2, 2147483647]', output = '[[1, -2, 2147483647]]'
+}
+
+t {
+    schema1 = int_array, schema2 = [[{"type": "array", "items": "double"}]],
+    func = 'flatten',
+    input = '[1, -2, 3]', output = '[[1.0, -2.0, 3.0]]'
+}
+
+t {
+    error  = '2: Value exceeds INT range: 2147483648LL',
+    schema1 = int_array, schema2 = [[{"type": "array", "items": "long"}]],
+    func = 'flatten', input = '[1, 2147483648]'
+}
+
+t {
+    schema1 = string_array, schema2 = [[{"type": "array", "items": "bytes"}]],
+    func = 'flatten',
+    input = '["a", "b"]',
+    output = '[[{"$binary": "61"}, {"$binary": "62"}]]'
+}
+
+t {
+    schema = float_array_nullable_items,
+    func = 'flatten',
+    input = '[0.5, null, 3]', output = '![[0.5, null, 3.0]]'
+}
+
+t {
+    error  = '2: Expecting FLOAT, encountered STR',
+    schema = float_array_nullable_items,
+    func = 'flatten', input = '[null, "x"]'
+}
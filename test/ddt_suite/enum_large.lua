@@ -43,3 +43,59 @@ for i = 1,#symbols do
         func = "unflatten", output = '"'..symbols[i]..'"', input = '['..(i-1)..']'
     }
 end
+
+-- a SIMD vector of hashes, searched rather than phf
+local letters = 'abcdefghijklmnopqrstuvwx'
+local medium = '{"name": "medium", "type": "enum", "symbols": ['
+for i = 1, #letters do
+    medium = medium .. (i == 1 and '' or ', ') ..
+             '"sym_' .. letters:sub(i, i) .. '"'
+end
+medium = medium .. ']}'
+
+for i = 1, #letters do
+    _G["i"] = i
+
+    t {
+        schema = medium,
+        func = "flatten", output = '['..(i-1)..']',
+        input = '"sym_'..letters:sub(i, i)..'"'
+    }
+end
+
+t {
+    schema = medium,
+    func = "flatten", input = '"sym_y"', error = 'Bad value: "sym_y"'
+}
+
+-- over 1000 symbols, hashed as a whole
+local wide = '{"name": "wide", "type": "enum", "symbols": ['
+for i = 1, 1200 do
+    wide = wide .. (i == 1 and '' or ', ') ..
+           '"customer_shipping_address_line_' .. i .. '"'
+end
+wide = wide .. ']}'
+
+local picked = {1, 2, 9, 10, 500, 1000, 1199, 1200}
+for k = 1, #picked do
+    local i = picked[k]
+    _G["i"] = i
+
+    t {
+        schema = wide,
+        func = "flatten", output = '['..(i-1)..']',
+        input = '"customer_shipping_address_line_'..i..'"'
+    }
+
+    t {
+        schema = wide,
+        func = "unflatten", input = '['..(i-1)..']',
+        output = '"customer_shipping_address_line_'..i..'"'
+    }
+end
+
+t {
+    schema = wide,
+    func = "flatten", input = '"customer_shipping_address_line_1201"',
+    error = 'Bad value: "customer_shipping_address_line_1201"'
+}
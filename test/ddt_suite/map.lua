@@ -208,3 +208,40 @@ t {
     input = '[null]',
     output  =  'null'
 }
+
+-- values converted by a single PUTITEMS (not copied verbatim)
+
+local float_map = [[{
+    "type": "map",
+    "values": "float"
+}]]
+
+t {
+    schema = float_map,
+    func = 'flatten',
+    input = '{"a": 0.5, "b": 1}', output = '![{"a": 0.5, "b": 1.0}]'
+}
+
+t {
+    error  = 'b: Expecting FLOAT, encountered STR',
+    schema = float_map,
+    func = 'flatten', input = '{"a": 0.5, "b": "1"}'
+}
+
+t {
+    schema1 = int_map, schema2 = [[{"type": "map", "values": "long"}]],
+    func = 'flatten',
+    input = '{"a": 1, "b": -2}', output = '[{"a": 1, "b": -2}]'
+}
+
+t {
+    error  = 'b: Expecting INT, encountered STR',
+    schema1 = int_map, schema2 = [[{"type": "map", "values": "long"}]],
+    func = 'flatten', input = '{"a": 1, "b": "x"}'
+}
+
+t {
+    schema = [[{"type": "map", "values": "float*"}]],
+    func = 'flatten',
+    input = '{"a": 1, "b": null}', output = '![{"a": 1.0, "b": null}]'
+}
@@ -13,6 +13,12 @@ local format, gsub   = string.format, string.gsub
 local insert, concat = table.insert, table.concat
 local sort           = table.sort
 
+-- compile option engine ('lua', 'vm' or 'c'), the same tests run with each
+local engine         = arg[1] or 'lua'
+-- lazy_errors compile option: a failed call yields an error code, the
+-- message is fetched with error_message()
+local lazy_errors    = arg[2] == 'lazy_errors'
+
 -- order-preserving JSON<->msgpack conversion, via external tool
 local function msgpack_helper(data, opts)
     if data=='' then error('Data empty') end
@@ -146,12 +152,14 @@ local function compile_stage(test, args)
     local compile_downgrade = args.compile_downgrade or false
     local compile_error  = args.compile_error
 
-    local key = format('%s;%s;%s',
+    local key = format('%s;%s;%s;%s;%s', engine, lazy_errors,
                        compile_downgrade, concat(service_fields, ';'),
                        test.schema_key)
     local compile_opts          = test.schema
     compile_opts.service_fields = service_fields
     compile_opts.downgrade      = compile_downgrade
+    compile_opts.engine         = engine
+    compile_opts.lazy_errors    = lazy_errors
     -- would be deleted after #85
     compile_opts.alpha_nullable_record_xflatten = true
     local ok, schema_c
@@ -201,6 +209,9 @@ local function convert_stage(test, args)
     local input_1 = input[1]
     input[1] = json2msgpack(input_1)
     local ok, result = res_wrap(call_func(unpack(input)))
+    if not ok and lazy_errors and type(result[1]) == 'number' then
+        result[1] = test.schema_c.error_message()
+    end
     local status          = ok and '<OK>' or result[1]
     local expected_status = args.error or '<OK>'  
     if status ~= expected_status then
@@ -0,0 +1,243 @@
+local msgpack = require('msgpack')
+local schema  = require('avro_schema')
+local runtime = require('avro_schema.runtime')
+local tap     = require('tap')
+
+local test = tap.test('simd')
+test:plan(10)
+
+local _, s = schema.create({
+    type = 'array', items = {
+        name = 'FooBar', type = 'record', fields = {
+            {name = 'A', type = 'long'},
+            {name = 'B', type = {type = 'array', items = 'long'}},
+            {name = 'C', type = {type = 'array', items = {
+                type = 'array', items = 'double'
+            }}}
+        }
+    }
+})
+if not _ then error(s) end
+
+local _, m = schema.compile(s)
+if not _ then error(m) end
+
+-- Runs of fixints of varying length, interrupted by non-fixints,
+-- crossing the 16 and 32 byte block boundaries.
+local function gen_array(n, seed)
+    local a = {}
+    for i = 1, n do
+        local x = (i * 7 + seed * 13) % 160 - 32
+        if (i + seed) % 37 == 0 then x = x * 1000 end
+        if (i + seed) % 53 == 0 then x = -33 end
+        a[i] = x
+    end
+    return a
+end
+
+local data = {}
+for i = 1, 20 do
+    table.insert(data, {
+        A = i - 16, B = gen_array(i * 7, i),
+        C = { gen_array(i * 3, i), { 1.5, 2, 3 }, gen_array(40, i + 1) }
+    })
+end
+local input = msgpack.encode(data)
+-- the last item truncated in the middle of a fixint run
+local truncated = input:sub(1, -30)
+
+local results = {}
+local levels = {}
+for level = 0, 2 do
+    local effective = runtime.set_simd(level)
+    if not levels[effective] then
+        levels[effective] = true
+        local ok, res = m.flatten_msgpack(input)
+        local _, err = m.flatten_msgpack(truncated)
+        table.insert(results, { ok = ok, res = res, err = err })
+    end
+end
+runtime.set_simd()
+
+test:ok(results[1].ok, 'scalar path works')
+local same_res, same_err = true, true
+for i = 2, #results do
+    same_res = same_res and results[i].ok and results[i].res == results[1].res
+    same_err = same_err and results[i].err == results[1].err
+end
+test:ok(same_res, 'all paths produce the same result')
+test:ok(same_err, 'all paths report the same error')
+test:is(#results, runtime.set_simd() + 1, 'all supported paths tested')
+
+-- Encoder: runs of longs (every width class, both signs), floats and
+-- doubles; arrays of float are not copied verbatim (narrowed), records
+-- of numbers make runs as well.
+local fields = {}
+for i = 1, 40 do
+    table.insert(fields, {name = 'L' .. i, type = 'long'})
+end
+for i = 1, 20 do
+    table.insert(fields, {name = 'D' .. i, type = 'double'})
+end
+table.insert(fields, {name = 'F', type = {type = 'array', items = 'float'}})
+local _, s2 = schema.create({type = 'array', items = {
+    name = 'Numbers', type = 'record', fields = fields
+}})
+local _, m2 = schema.compile(s2)
+
+local edges = {0, 1, 127, 128, 255, 256, 65535, 65536, 4294967295,
+               4294967296, -1, -32, -33, -128, -129, -32768, -32769,
+               -2147483648, -2147483649, 2^53, -2^53}
+local numbers = {}
+for i = 1, 30 do
+    local rec = {F = {}}
+    for j = 1, 40 do
+        rec['L' .. j] = edges[(i * 7 + j) % #edges + 1]
+    end
+    for j = 1, 20 do
+        rec['D' .. j] = (i - j) * 1.125 + (j % 3 == 0 and 1e-300 or 0.0625)
+    end
+    for j = 1, i * 3 do
+        rec.F[j] = j % 5 == 0 and 1 / 3 or (i * j - 17) * 0.5 + 0.25
+    end
+    table.insert(numbers, rec)
+end
+local numbers_mp = msgpack.encode(numbers)
+
+results = {}
+for level = 0, 2 do
+    local effective = runtime.set_simd(level)
+    if effective == level then
+        local _, tuple = m2.flatten_msgpack(numbers_mp)
+        local _, res = m2.unflatten_msgpack(tuple)
+        -- exact-size mode
+        local prev = runtime.set_unparse_exact_min(0)
+        local _, tuple2 = m2.flatten_msgpack(numbers_mp)
+        runtime.set_unparse_exact_min(prev)
+        table.insert(results, { tuple = tuple, res = res, tuple2 = tuple2 })
+    end
+end
+runtime.set_simd()
+
+local same_tuple, same_unflatten = true, true
+for i = 1, #results do
+    same_tuple = same_tuple and results[i].tuple == results[1].tuple and
+                 results[i].tuple2 == results[1].tuple
+    same_unflatten = same_unflatten and results[i].res == results[1].res
+end
+test:ok(same_tuple, 'encoder: all paths produce the same tuple')
+test:ok(same_unflatten, 'encoder: all paths produce the same document')
+test:is_deeply(msgpack.decode(results[1].res)[30].L1, numbers[30].L1,
+               'encoder: reference path')
+
+-- Exact-size mode: every header width, out of line data, service
+-- fields (strings passed by pointer).
+local _, s3 = schema.create({
+    type = 'record', name = 'AllWidths', fields = {
+        {name = 'L', type = {type = 'array', items = 'long'}},
+        {name = 'S', type = {type = 'array', items = 'string'}},
+        {name = 'B', type = 'bytes'},
+        {name = 'X', type = {type = 'fixed', name = 'X', size = 3}},
+        {name = 'M', type = {type = 'map', values = 'boolean'}},
+        {name = 'U', type = {type = 'array', items = {'null', 'float'}}},
+        {name = 'E', type = {type = 'array', items = 'int'}}
+    }
+})
+-- not fused, the fused transcoder doesn't go through unparse_msgpack
+local _, m3 = schema.compile({s3, service_fields = {'string', 'string'},
+                              fuse = false})
+local widths = {0, 127, 128, 255, 256, 65535, 65536, 2^32 - 1, 2^32,
+                -1, -32, -33, -128, -129, -32768, -32769, -2^31,
+                -2^31 - 1, 2^53}
+local keys = {}
+for i = 1, 20 do keys['k' .. i] = i % 2 == 0 end
+local doc = {
+    L = widths,
+    S = {'', ('s'):rep(31), ('s'):rep(32), ('s'):rep(256),
+         ('s'):rep(70000)},
+    M = keys, U = {msgpack.NULL, {float = 1.5}, msgpack.NULL}, E = {}
+}
+-- bytes and fixed are BIN, encoded by hand
+local doc_mp = {'\135'}
+for _, k in ipairs({'L', 'S', 'M', 'U', 'E'}) do
+    table.insert(doc_mp, msgpack.encode(k) .. msgpack.encode(doc[k]))
+end
+table.insert(doc_mp, msgpack.encode('B') .. '\197\1\44' .. ('b'):rep(300))
+table.insert(doc_mp, msgpack.encode('X') .. '\196\3xyz')
+doc_mp = table.concat(doc_mp)
+local _, flat = m3.flatten_msgpack(doc_mp, 'id', 'v')
+local encoded = {}
+-- res shrinks back before every call, exact-size mode has to reserve
+schema.buffer_policy({high_water = 4096, baseline = 4096})
+for _, exact_min in ipairs({0, false}) do
+    local prev = runtime.set_unparse_exact_min(exact_min or nil)
+    table.insert(encoded, {m3.flatten_msgpack(doc_mp, 'id',
+                                              ('v'):rep(300))})
+    table.insert(encoded, {m3.unflatten_msgpack(flat)})
+    runtime.set_unparse_exact_min(prev)
+end
+schema.buffer_policy()
+test:ok(encoded[1][1] and encoded[2][1] and
+        encoded[3][2] == encoded[1][2] and encoded[4][2] == encoded[2][2],
+        'encoder: exact-size mode')
+
+-- Hashing: CRC32C (func family 0x10) of strings of every tail length,
+-- with and without the instruction, against a bitwise reference.
+local ffi = require('ffi')
+local rt_C = ffi.load(runtime.C_path)
+
+local function crc32c(seed, str)
+    local crc = bit.bxor(seed, #str)
+    str = str .. string.rep('\0', -#str % 8)
+    for i = 1, #str do
+        crc = bit.bxor(crc, str:byte(i))
+        for _ = 1, 8 do
+            crc = bit.bxor(bit.rshift(crc, 1),
+                           bit.band(0x82f63b78, -bit.band(crc, 1)))
+        end
+    end
+    return bit.tobit(crc)
+end
+
+local keys = {}
+for i = 0, 40 do
+    table.insert(keys, string.sub('customer_shipping_address_line_' ..
+                                  string.rep('x', 9), 1, i))
+end
+local same_hash = true
+for level = 0, 2 do
+    if runtime.set_simd(level) == level then
+        for _, key in ipairs(keys) do
+            local h = rt_C.eval_hash_func(0x10abcdef, key, #key)
+            same_hash = same_hash and h == crc32c(0xabcdef, key)
+        end
+    end
+end
+runtime.set_simd()
+test:ok(same_hash, 'hash: all paths match the reference CRC32C')
+
+-- Table search (enums below phf_threshold): every size up to a few
+-- vectors, every position, keys not in the table and keys too wide.
+local same_search = true
+for level = 0, 2 do
+    if runtime.set_simd(level) == level then
+        for _, bits in ipairs({8, 16, 32}) do
+            local search = rt_C['schema_rt_search' .. bits]
+            local tab = ffi.new('uint' .. bits .. '_t[?]', 80)
+            for n = 1, 80 do
+                for i = 0, n - 1 do tab[i] = (i * 37 + bits) % 251 end
+                for i = 0, n - 1 do
+                    same_search = same_search and
+                                  search(tab, tab[i], n) == i
+                end
+                same_search = same_search and
+                              search(tab, 251, n) == n - 1 and
+                              search(tab, 0x10000 + tab[0], n) == n - 1
+            end
+        end
+    end
+end
+runtime.set_simd()
+test:ok(same_search, 'search: all paths find every key')
+
+test:check()